@@ -93,8 +93,10 @@ Block Block::split( long long pos, const int hardbs )
   }
 
 
+// Builds a domain from the blocks with status 'st' in 'mapname'.
 Domain::Domain( const long long p, const long long s,
-                const char * const mapname, const bool loose )
+                const char * const mapname, const bool loose,
+                const Sblock::Status st )
   {
   reset_cached_in_size();
   const Block b( p, s );
@@ -112,7 +114,7 @@ Domain::Domain( const long long p, const long long s,
   for( long i = 0; i < mapfile.sblocks(); ++i )
     {
     const Sblock & sb = mapfile.sblock( i );
-    if( sb.status() == Sblock::finished ) block_vector.push_back( sb );
+    if( sb.status() == st ) block_vector.push_back( sb );
     }
   if( block_vector.empty() ) block_vector.push_back( Block( 0, 0 ) );
   else this->crop( b );
@@ -137,3 +139,70 @@ void Domain::crop( const Block & b )
   if( l > 0 )					// remove blocks before b
     block_vector.erase( block_vector.begin(), block_vector.begin() + l );
   }
+
+
+// Restricts the domain to the blocks in 'bv', which must be ordered and
+// must not overlap.
+void Domain::crop( const std::vector< Block > & bv )
+  {
+  reset_cached_in_size();
+  std::vector< Block > v;
+  unsigned long i = 0, j = 0;
+  while( i < block_vector.size() && j < bv.size() )
+    {
+    Block b( block_vector[i] );
+    b.crop( bv[j] );
+    if( b.size() > 0 ) v.push_back( b );
+    if( block_vector[i].end() <= bv[j].end() ) ++i; else ++j;
+    }
+  if( v.empty() ) v.push_back( Block( 0, 0 ) );
+  block_vector.swap( v );
+  }
+
+
+// Adds to the domain the blocks of 'd'.
+void Domain::join( const Domain & d )
+  {
+  reset_cached_in_size();
+  std::vector< Block > v;
+  unsigned long i = 0, j = 0;
+  while( i < block_vector.size() || j < d.block_vector.size() )
+    {
+    const Block & b = ( j >= d.block_vector.size() ||
+                        ( i < block_vector.size() &&
+                          block_vector[i].pos() <= d.block_vector[j].pos() ) ) ?
+                      block_vector[i++] : d.block_vector[j++];
+    if( b.size() <= 0 ) continue;
+    if( v.empty() || v.back().end() < b.pos() ) v.push_back( b );
+    else if( v.back().end() < b.end() )
+      v.back().size( b.end() - v.back().pos() );
+    }
+  if( v.empty() ) v.push_back( Block( 0, 0 ) );
+  block_vector.swap( v );
+  }
+
+
+// Removes from the domain the blocks of 'd'.
+void Domain::remove( const Domain & d )
+  {
+  reset_cached_in_size();
+  std::vector< Block > v;
+  unsigned long j = 0;
+  for( unsigned long i = 0; i < block_vector.size(); ++i )
+    {
+    Block b( block_vector[i] );
+    while( b.size() > 0 )
+      {
+      while( j < d.block_vector.size() && d.block_vector[j].end() <= b.pos() )
+        ++j;
+      if( j >= d.block_vector.size() || d.block_vector[j].pos() >= b.end() )
+        { v.push_back( b ); break; }
+      const Block & db = d.block_vector[j];
+      if( db.pos() > b.pos() ) v.push_back( Block( b.pos(), db.pos() - b.pos() ) );
+      if( db.end() >= b.end() ) break;
+      b.assign( db.end(), b.end() - db.end() );
+      }
+    }
+  if( v.empty() ) v.push_back( Block( 0, 0 ) );
+  block_vector.swap( v );
+  }
@@ -146,7 +146,8 @@ class Domain
 
 public:
   Domain( const long long p, const long long s,
-          const char * const mapname = 0, const bool loose = false );
+          const char * const mapname = 0, const bool loose = false,
+          const Sblock::Status st = Sblock::finished );
 
   long long pos() const { return block_vector.front().pos(); }
   long long end() const { return block_vector.back().end(); }
@@ -193,9 +194,20 @@ public:
 
   bool includes( const long long pos ) const
     {
-    for( unsigned long i = 0; i < block_vector.size(); ++i )
-      if( block_vector[i].includes( pos ) ) return true;
-    return false;
+    const long i = find_block( pos );
+    return ( i < blocks() && block_vector[i].includes( pos ) );
+    }
+
+  // Returns the index of the first block ending after pos, or blocks().
+  long find_block( const long long pos ) const
+    {
+    unsigned long l = 0, r = block_vector.size();
+    while( l < r )
+      {
+      const long m = ( l + r ) / 2;
+      if( block_vector[m].end() <= pos ) l = m + 1; else r = m;
+      }
+    return l;
     }
 
   void clear()
@@ -205,7 +217,120 @@ public:
     }
 
   void crop( const Block & b );
+  void crop( const std::vector< Block > & bv );
+  void crop( const Domain & d ) { crop( d.block_vector ); }
   void crop_by_file_size( const long long size ) { crop( Block( 0, size ) ); }
+  void join( const Domain & d );
+  void remove( const Domain & d );
+  };
+
+
+// Walks the blocks of a Domain along with a scan of sblocks, so that
+// checking whether each sblock is in the domain takes amortized constant
+// time if the sblocks are visited in order, either forwards or backwards.
+//
+class Domain_cursor
+  {
+  const Domain & domain;
+  long index;			// first domain block ending after last b.pos
+
+public:
+  explicit Domain_cursor( const Domain & d ) : domain( d ), index( -1 ) {}
+
+  bool includes( const Block & b )
+    {
+    if( index < 0 ) index = domain.find_block( b.pos() );
+    while( index > 0 && !( domain.block( index - 1 ) < b ) ) --index;
+    while( index < domain.blocks() && domain.block( index ) < b ) ++index;
+    return ( index < domain.blocks() && domain.block( index ).includes( b ) );
+    }
+  };
+
+
+// Compact storage for a sequence of consecutive Sblocks.
+// As each block begins where the previous one ends, only the position of
+// the first block is stored, followed by the end of each block and, in a
+// separate array, the status of each block; 9 bytes per block instead of
+// the 24 used by a 'std::vector< Sblock >'.
+//
+class Sblock_vector
+  {
+  long long pos_;				// pos of first block
+  std::vector< long long > end_vector;
+  std::vector< char > status_vector;
+
+public:
+  Sblock_vector() : pos_( 0 ) {}
+
+  unsigned long size() const { return end_vector.size(); }
+  bool empty() const { return end_vector.empty(); }
+  long long pos( const unsigned long i ) const
+    { return i ? end_vector[i-1] : pos_; }
+  long long end( const unsigned long i ) const { return end_vector[i]; }
+  Sblock::Status status( const unsigned long i ) const
+    { return Sblock::Status( status_vector[i] ); }
+  Sblock operator[]( const unsigned long i ) const
+    { const long long p = pos( i );
+      return Sblock( p, end_vector[i] - p, status( i ) ); }
+  Sblock front() const { return operator[]( 0 ); }
+  Sblock back() const { return operator[]( size() - 1 ); }
+
+  void first_pos( const long long p ) { pos_ = p; }
+  // moves also the beginning of the next block, if any
+  void end( const unsigned long i, const long long e ) { end_vector[i] = e; }
+  void status( const unsigned long i, const Sblock::Status st )
+    { status_vector[i] = st; }
+
+  void clear() { pos_ = 0; end_vector.clear(); status_vector.clear(); }
+  void reserve( const unsigned long n )
+    { end_vector.reserve( n ); status_vector.reserve( n ); }
+  void swap( Sblock_vector & v )
+    { std::swap( pos_, v.pos_ ); end_vector.swap( v.end_vector );
+      status_vector.swap( v.status_vector ); }
+
+  // 'sb' must begin where the last block ends
+  void push_back( const Sblock & sb )
+    { if( empty() ) pos_ = sb.pos();
+      end_vector.push_back( sb.end() ); status_vector.push_back( sb.status() ); }
+
+  // the first block of 'v' must begin where the last block ends
+  void append( const Sblock_vector & v )
+    {
+    if( empty() ) pos_ = v.pos_;
+    end_vector.insert( end_vector.end(), v.end_vector.begin(),
+                       v.end_vector.end() );
+    status_vector.insert( status_vector.end(), v.status_vector.begin(),
+                          v.status_vector.end() );
+    }
+
+  // 'sb' must end inside block 'i' (splitting it) or at its beginning.
+  // If 'i' is 0, 'sb' becomes the first block; else it must begin at pos(i).
+  void insert( const unsigned long i, const Sblock & sb )
+    {
+    end_vector.insert( end_vector.begin() + i, sb.end() );
+    status_vector.insert( status_vector.begin() + i, sb.status() );
+    if( i == 0 ) pos_ = sb.pos();
+    }
+
+  // join blocks 'i' to 'i + n' into block 'i', keeping its status
+  void join( const unsigned long i, const unsigned long n )
+    {
+    status_vector[i+n] = status_vector[i];
+    end_vector.erase( end_vector.begin() + i, end_vector.begin() + i + n );
+    status_vector.erase( status_vector.begin() + i,
+                         status_vector.begin() + i + n );
+    }
+
+  void erase_front( const unsigned long n )	// remove the first n blocks
+    {
+    if( n == 0 ) return;
+    pos_ = end_vector[n-1];
+    end_vector.erase( end_vector.begin(), end_vector.begin() + n );
+    status_vector.erase( status_vector.begin(), status_vector.begin() + n );
+    }
+
+  void truncate( const unsigned long n )	// keep only the first n blocks
+    { if( n < size() ) { end_vector.resize( n ); status_vector.resize( n ); } }
   };
 
 
@@ -224,10 +349,7 @@ private:
   int current_pass_;
   mutable long index_;			// cached index of last find or change
   bool read_only_;
-  std::vector< Sblock > sblock_vector;	// note: blocks are consecutive
-
-  void insert_sblock( const long i, const Sblock & sb )
-    { sblock_vector.insert( sblock_vector.begin() + i, sb ); }
+  Sblock_vector sblock_vector;		// note: blocks are consecutive
 
 public:
   explicit Mapfile( const char * const mapname )
@@ -240,7 +362,12 @@ public:
   void shift_blocks( const long long offset );
   bool truncate_vector( const long long end, const bool force = false );
   void set_to_status( const Sblock::Status st )
-    { sblock_vector.assign( 1, Sblock( 0, -1, st ) ); }
+    { sblock_vector.clear(); sblock_vector.push_back( Sblock( 0, -1, st ) ); }
+  // copy everything but the name, reusing the memory already allocated
+  void copy_state( const Mapfile & m )
+    { current_pos_ = m.current_pos_; current_msg = m.current_msg;
+      current_status_ = m.current_status_; current_pass_ = m.current_pass_;
+      index_ = 0; sblock_vector = m.sblock_vector; }
   bool read_mapfile( const int default_sblock_status = 0, const bool ro = true );
   bool write_mapfile( FILE * f = 0, const bool timestamp = false,
                       const bool mf_sync = false,
@@ -261,19 +388,21 @@ public:
 
   Block extent() const
     { if( sblock_vector.empty() ) return Block( 0, 0 );
-      return Block( sblock_vector.front().pos(),
-                    sblock_vector.back().end() - sblock_vector.front().pos() ); }
-  const Sblock & sblock( const long i ) const { return sblock_vector[i]; }
+      return Block( sblock_vector.pos( 0 ),
+                    sblock_vector.end( sblocks() - 1 ) - sblock_vector.pos( 0 ) ); }
+  Sblock sblock( const long i ) const { return sblock_vector[i]; }
   long sblocks() const { return sblock_vector.size(); }
   void change_sblock_status( const long i, const Sblock::Status st )
-    { sblock_vector[i].status( st ); }
+    { sblock_vector.status( i, st ); }
 
   void split_by_domain_borders( const Domain & domain );
   void split_by_mapfile_borders( const Mapfile & mapfile );
   bool try_split_sblock_by( const long long pos, const long i )
     {
-    if( sblock_vector[i].strictly_includes( pos ) )
-      { insert_sblock( i, sblock_vector[i].split( pos ) ); return true; }
+    const long long p = sblock_vector.pos( i );
+    if( p < pos && sblock_vector.end( i ) > pos )
+      { sblock_vector.insert( i, Sblock( p, pos - p, sblock_vector.status( i ) ) );
+        return true; }
     return false;
     }
 
@@ -297,6 +426,31 @@ public:
   };
 
 
+class Line_reader;			// defined in mapfile.cc
+
+// Reads the blocks of a mapfile one at a time without storing them, so
+// that mapfiles of any size can be processed in constant memory. Like
+// Mapfile::read_mapfile, exits with status 2 if the mapfile is corrupt.
+class Mapfile_reader
+  {
+  const char * const filename_;
+  FILE * f;
+  Line_reader * reader;			// reads the lines of 'f'
+  long long next_pos;			// end of last block read, or -1
+
+  Mapfile_reader( const Mapfile_reader & );	// declared as private
+  void operator=( const Mapfile_reader & );	// declared as private
+
+public:
+  explicit Mapfile_reader( const char * const mapname )
+    : filename_( mapname ), f( 0 ), reader( 0 ), next_pos( -1 ) {}
+  ~Mapfile_reader();
+
+  bool open();				// and read the status line
+  bool read_sblock( Sblock & sb );	// returns false at EOF
+  };
+
+
 // Defined in main_common.cc
 extern int verbosity;
 void show_error( const char * const msg,
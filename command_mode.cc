@@ -25,6 +25,7 @@
 #include <string>
 #include <vector>
 #include <stdint.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
@@ -34,11 +35,9 @@
 #include "rescuebook.h"
 
 
-int Rescuebook::copy_command( const char * const command )
+int Rescuebook::copy_command( long long pos, const long long size )
   {
-  long long pos, size;
-  const int n = std::sscanf( command, "%lli %lli", &pos, &size );
-  if( n != 2 || pos < 0 || size <= 0 ) return 1;
+  if( pos < 0 || size <= 0 ) return 1;
   const long long end = Block( pos, size ).end();
   while( pos < end )
     {
@@ -73,26 +72,231 @@ int Rescuebook::copy_command( const char * const command )
   }
 
 
-int Rescuebook::status_command( const char * const command ) const
+int Rescuebook::copy_command( const char * const command )
   {
   long long pos, size;
   const int n = std::sscanf( command, "%lli %lli", &pos, &size );
-  if( n != 2 || pos < 0 || size <= 0 ) return 1;
-  const Block b( pos, size );
-  const long index = find_index( pos );
+  if( n != 2 ) return 1;
+  return copy_command( pos, size );
+  }
+
+
+// Appends to 'blocks' the status of the areas included in 'b'.
+//
+int Rescuebook::status_command( const Block & b,
+                                std::vector< Sblock > & blocks ) const
+  {
+  const long index = find_index( b.pos() );
   if( index < 0 ) return 1;
+  Domain_cursor dc( domain() );
   for( long i = index; i < sblocks(); ++i )
     {
     const Sblock & sb = sblock( i );
     if( sb.pos() >= b.end() ) break;
-    if( !domain().includes( sb ) && domain() < sb ) break;
-    Block c( sb ); c.crop( b );
-    std::printf( "0x%08llX  0x%08llX  %c\n", c.pos(), c.size(), sb.status() );
+    if( !dc.includes( sb ) && domain() < sb ) break;
+    Sblock c( sb ); c.crop( b );
+    blocks.push_back( c );
+    }
+  return 0;
+  }
+
+
+int Rescuebook::status_command( const char * const command,
+                                std::string & text ) const
+  {
+  long long pos, size;
+  const int n = std::sscanf( command, "%lli %lli", &pos, &size );
+  if( n != 2 || pos < 0 || size <= 0 ) return 1;
+  std::vector< Sblock > blocks;
+  if( status_command( Block( pos, size ), blocks ) ) return 1;
+  for( unsigned i = 0; i < blocks.size(); ++i )
+    {
+    char buf[80];
+    snprintf( buf, sizeof buf, "0x%08llX  0x%08llX  %c\n",
+              blocks[i].pos(), blocks[i].size(), blocks[i].status() );
+    text += buf;
     }
   return 0;
   }
 
 
+namespace {
+
+// Binary command protocol (option '--command-mode=binary'). All numbers are
+// little-endian. Each record starts with the size of the rest of the record
+// (4 bytes), followed by the command type (1 byte), a result code in
+// replies (1 byte, 0 in requests), 2 reserved bytes, and the id of the
+// request (4 bytes). Requests 'c' and 's' add the position and size of
+// the block (8 bytes each). Replies to 's' add one 24-byte entry per area
+// (position, size, status, and 7 reserved bytes). Error replies may add a
+// message.
+enum { bc_header = 8, bc_range = 16, bc_entry = 24, bc_max_record = 4096,
+       bc_bufsize = 65536 };
+enum { bc_done = 0, bc_error = 1, bc_fatal = 2 };
+
+struct Binary_command
+  {
+  char type;
+  unsigned long id;
+  long long pos, size;
+  };
+
+unsigned long long get_le( const uint8_t * const p, const int n )
+  {
+  unsigned long long v = 0;
+  for( int i = n - 1; i >= 0; --i ) v = ( v << 8 ) | p[i];
+  return v;
+  }
+
+void put_le( std::string & s, unsigned long long v, const int n )
+  { for( int i = 0; i < n; ++i ) { s += (char)( v & 0xFF ); v >>= 8; } }
+
+void put_status( std::string & payload, const std::vector< Sblock > & blocks )
+  {
+  for( unsigned i = 0; i < blocks.size(); ++i )
+    {
+    put_le( payload, blocks[i].pos(), 8 );
+    put_le( payload, blocks[i].size(), 8 );
+    payload += (char)blocks[i].status(); put_le( payload, 0, 7 );
+    }
+  }
+
+void put_reply( std::string & out, const char type, const int result,
+                const unsigned long id, const std::string & payload )
+  {
+  put_le( out, bc_header + payload.size(), 4 );
+  out += type; out += (char)result; put_le( out, 0, 2 ); put_le( out, id, 4 );
+  out += payload;
+  }
+
+} // end namespace
+
+
+// Return values: 1 write error/unknown command, 0 OK.
+// Reads the commands in batches, as many as available, and flushes the
+// replies of each batch at once. Status requests not depending on a copy
+// or finish request of the same batch are answered before executing the
+// batch, so the replies may arrive out of order. An invalid record ends
+// the stream: the commands parsed before it are run, and the mapfile is
+// saved as if the stream had ended there.
+//
+int Rescuebook::do_binary_commands( const int ides, const int odes )
+  {
+  ides_ = ides; odes_ = odes;
+
+  initial_time();
+  int retval = 0;
+  std::string in, out, payload;
+  std::vector< Binary_command > batch;
+  std::vector< Sblock > blocks;
+  uint8_t * const buf = new uint8_t[bc_bufsize];
+  bool eof = false, done = false, invalid = false;
+  while( !done )
+    {
+    if( out.size() )
+      { std::fwrite( out.data(), 1, out.size(), stdout ); std::fflush( stdout );
+        out.clear(); }
+    const int n = read( STDIN_FILENO, buf, bc_bufsize );
+    if( n < 0 && errno == EINTR ) continue;
+    if( n > 0 ) in.append( (const char *)buf, n ); else eof = true;
+    unsigned p = 0;
+    batch.clear();
+    while( in.size() - p >= 4 )
+      {
+      const uint8_t * const r = (const uint8_t *)in.data() + p;
+      const unsigned len = get_le( r, 4 );
+      if( len < bc_header || len > bc_max_record )
+        { invalid = true; break; }	// run the batch parsed, then finish
+      if( in.size() - p < 4 + len ) break;
+      p += 4 + len;
+      Binary_command bc;
+      bc.type = r[4]; bc.id = get_le( r + 8, 4 ); bc.pos = bc.size = 0;
+      if( len == bc_header + bc_range )
+        { bc.pos = get_le( r + 12, 8 ); bc.size = get_le( r + 20, 8 ); }
+      const bool range = ( bc.type == 'c' || bc.type == 's' );
+      if( ( range && len != bc_header + bc_range ) ||
+          ( !range && ( len != bc_header || !std::strchr( "fqu", bc.type ) ) ) )
+        { put_reply( out, bc.type, bc_error, bc.id, "unknown command" );
+          retval = 1; continue; }
+      if( range && ( bc.pos < 0 || bc.size <= 0 ) )
+        { put_reply( out, bc.type, bc_error, bc.id, std::string() );
+          retval = 1; continue; }
+      if( bc.type == 's' )
+        {
+        const Block b( bc.pos, bc.size );
+        bool depends = false;
+        for( unsigned i = 0; i < batch.size() && !depends; ++i )
+          {
+          const Block b2( batch[i].pos, batch[i].size );
+          depends = ( batch[i].type != 'u' &&
+                      ( batch[i].type != 'c' || ( !( b < b2 ) && !( b2 < b ) ) ) );
+          }
+        if( !depends )
+          {
+          blocks.clear(); payload.clear();
+          const int tmp = status_command( b, blocks );
+          put_status( payload, blocks );
+          put_reply( out, 's', tmp ? bc_error : bc_done, bc.id,
+                     tmp ? std::string() : payload );
+          continue;
+          }
+        }
+      batch.push_back( bc );
+      }
+    in.erase( 0, p );
+    if( eof || invalid )		// discard partial or invalid command
+      {
+      Binary_command bc; bc.type = 'f'; bc.id = 0; bc.pos = bc.size = 0;
+      batch.push_back( bc );
+      }
+    for( unsigned i = 0; i < batch.size() && !done; ++i )
+      {
+      const Binary_command & bc = batch[i];
+      if( bc.type == 'q' ) { done = true; break; }
+      int tmp = 0;		// -1 finish, 0 OK, 1 error, 2 fatal error
+      payload.clear();
+      if( bc.type == 'f' || bc.type == 'u' )
+        {
+        const bool finish = ( bc.type == 'f' );
+        if( finish ) compact_sblock_vector();
+        if( !update_mapfile( odes_, true ) )
+          { if( finish ) { emergency_save(); tmp = 2; } else tmp = 1; }
+        else if( finish ) tmp = -1;
+        }
+      else if( bc.type == 'c' ) tmp = copy_command( bc.pos, bc.size );
+      else
+        {
+        blocks.clear();
+        tmp = status_command( Block( bc.pos, bc.size ), blocks );
+        put_status( payload, blocks );
+        }
+      if( tmp > 0 && final_msg().size() )
+        {
+        payload = final_msg();
+        if( final_errno() > 0 )
+          { payload += ": "; payload += std::strerror( final_errno() ); }
+        final_msg( "" );
+        }
+      put_reply( out, bc.type, ( tmp <= 0 ) ? bc_done :
+                 ( tmp == 1 ) ? bc_error : bc_fatal, bc.id, payload );
+      if( tmp ) { if( tmp > 0 ) retval = 1; if( tmp != 1 ) done = true; }
+      }
+    if( invalid )
+      { final_msg( "Invalid record in binary command stream" ); retval = 1; }
+    if( eof || invalid ) done = true;
+    }
+  if( out.size() )
+    { std::fwrite( out.data(), 1, out.size(), stdout ); std::fflush( stdout ); }
+  delete[] buf;
+  if( final_msg().size() ) show_error( final_msg().c_str() );
+  if( close( odes_ ) != 0 )
+    { show_error( "Error closing outfile", errno );
+      if( retval == 0 ) retval = 1; }
+  if( !close_tee_outputs() && retval == 0 ) retval = 1;
+  return retval;
+  }
+
+
 // Return values: 1 write error/unknown command, 0 OK.
 //
 int Rescuebook::do_commands( const int ides, const int odes )
@@ -127,7 +331,11 @@ int Rescuebook::do_commands( const int ides, const int odes )
     else if( command.size() > 1 && command[0] == 'c' )
       tmp = copy_command( command.c_str() + 1 );
     else if( command.size() > 1 && command[0] == 's' )
-      tmp = status_command( command.c_str() + 1 );
+      {
+      std::string text;
+      tmp = status_command( command.c_str() + 1, text );
+      std::fputs( text.c_str(), stdout );
+      }
     else { std::printf( "error: unknown command '%s'\n", command.c_str() );
            retval = 1; continue; }
     if( tmp <= 0 ) std::fputs( "done\n", stdout );
@@ -145,5 +353,6 @@ int Rescuebook::do_commands( const int ides, const int odes )
   if( close( odes_ ) != 0 )
     { show_error( "Error closing outfile", errno );
       if( retval == 0 ) retval = 1; }
+  if( !close_tee_outputs() && retval == 0 ) retval = 1;
   return retval;
   }
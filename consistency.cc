@@ -0,0 +1,206 @@
+/*  GNU ddrescue - Data recovery tool
+    Copyright (C) 2004-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "mapbook.h"
+#include "consistency.h"
+
+
+namespace {
+
+const unsigned long max_table_entries = 1 << 20;	// 16 MiB of memory
+
+extern "C" void * consistency_worker( void * arg )
+  {
+  ((Consistency_checker *)arg)->worker();
+  return 0;
+  }
+
+
+unsigned long long next_random( unsigned long long & state )
+  {
+  state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+  return state;
+  }
+
+
+uint32_t checksum( const uint8_t * const data, const int size )
+  {
+  uint32_t h = 2166136261U;			// FNV-1a
+  for( int i = 0; i < size; ++i ) { h ^= data[i]; h *= 16777619U; }
+  return h;
+  }
+
+} // end namespace
+
+
+Consistency_checker::Consistency_checker( const char * const sidemap_name,
+                                          const long long insize,
+                                          const int hardbs, const int budget,
+                                          const int ides )
+  : sidemap( sidemap_name ), full_domain( 0, -1 ),
+    capacity( max_table_entries ), hardbs_( hardbs ), budget_( budget ),
+    ides_( ides ), rng_main( 0x9E3779B97F4A7C15ULL ),
+    rng_worker( 0xD1B54A32D192ED03ULL ), sectors_seen( 0 ), bytes_read( 0 ),
+    bytes_reread( 0 ), mismatches( 0 ), dirty( true ), quit( false ),
+    started( false )
+  {
+  // keep the unreliable sectors found in previous runs
+  if( !sidemap.read_mapfile( 0, true ) ) sidemap.set_to_status( Sblock::non_tried );
+  sidemap.extend_sblock_vector( insize );
+  sidemap.current_status( Mapfile::finished );
+
+  long alignment = sysconf( _SC_PAGESIZE );
+  if( alignment < hardbs_ || alignment % hardbs_ ) alignment = hardbs_;
+  if( alignment < 2 ) alignment = 0;
+  buf = buf_base = new uint8_t[ alignment + hardbs_ ];
+  if( alignment > 1 )		// align buf for direct disc access
+    {
+    const int disp =
+      alignment - ( reinterpret_cast<unsigned long long> (buf) % alignment );
+    if( disp > 0 && disp < alignment ) buf += disp;
+    }
+  xinit_mutex( &mutex ); xinit_cond( &cv_budget );
+  }
+
+
+Consistency_checker::~Consistency_checker()
+  {
+  stop();
+  xdestroy_cond( &cv_budget ); xdestroy_mutex( &mutex );
+  delete[] buf_base;
+  if( ides_ >= 0 ) close( ides_ );
+  }
+
+
+bool Consistency_checker::start()
+  {
+  const int errcode = pthread_create( &worker_id, 0, consistency_worker, this );
+  if( errcode )
+    { show_error( "Can't create consistency checking thread", errcode );
+      return false; }
+  started = true;
+  return true;
+  }
+
+
+void Consistency_checker::stop()
+  {
+  if( !started ) return;
+  xlock( &mutex ); quit = true; xsignal( &cv_budget ); xunlock( &mutex );
+  pthread_join( worker_id, 0 );
+  started = false;
+  }
+
+
+// Reread random sectors of the table while the budget allows it.
+//
+void Consistency_checker::worker()
+  {
+  while( true )
+    {
+    xlock( &mutex );
+    while( !quit && ( table.empty() ||
+           ( bytes_reread + hardbs_ ) * 100 > bytes_read * budget_ ) )
+      xwait( &cv_budget, &mutex );
+    if( quit ) { xunlock( &mutex ); break; }
+    const unsigned long i = next_random( rng_worker ) % table.size();
+    const Entry entry = table[i];
+    bytes_reread += hardbs_;
+    xunlock( &mutex );
+
+#if defined _POSIX_ADVISORY_INFO && _POSIX_ADVISORY_INFO > 0
+    // don't let the kernel return the copy in its cache
+    posix_fadvise( ides_, entry.pos, hardbs_, POSIX_FADV_DONTNEED );
+#endif
+    int size;
+    do size = pread( ides_, buf, hardbs_, entry.pos );
+      while( size < 0 && errno == EINTR );
+    if( size == hardbs_ && checksum( buf, hardbs_ ) == entry.checksum )
+      continue;
+
+    xlock( &mutex );				// read error or mismatch
+    const Block b( entry.pos, hardbs_ );
+    if( sidemap.find_index( b.pos() ) >= 0 &&
+        sidemap.sblock( sidemap.find_index( b.pos() ) ).includes( b ) )
+      sidemap.change_chunk_status( b, Sblock::finished, full_domain );
+    ++mismatches; dirty = true;
+    if( i < table.size() && table[i].pos == entry.pos )	// don't check again
+      { table[i] = table.back(); table.pop_back(); }
+    xunlock( &mutex );
+    }
+  }
+
+
+// Add to the table a random sample of the whole sectors contained in
+// 'data', and allow the worker to reread more data. The sample is chosen
+// and hashed without holding the mutex, which is taken only to store it.
+//
+void Consistency_checker::data_read( const uint8_t * const data,
+                                     const long long pos, const int size )
+  {
+  long long p = pos;
+  if( p % hardbs_ ) p += hardbs_ - p % hardbs_;
+  sample.clear();
+  for( ; p + hardbs_ <= pos + size; p += hardbs_ )
+    {
+    unsigned long i = capacity;			// append while not full
+    if( (unsigned long long)++sectors_seen > capacity )	// reservoir sampling
+      { i = next_random( rng_main ) % sectors_seen;
+        if( i >= capacity ) continue; }
+    sample.push_back( Sample( i, Entry( p, checksum( data + ( p - pos ),
+                                                     hardbs_ ) ) ) );
+    }
+  xlock( &mutex );
+  bytes_read += size;
+  for( unsigned long j = 0; j < sample.size(); ++j )
+    {
+    const unsigned long i = sample[j].index;
+    if( i < table.size() ) table[i] = sample[j].entry;
+    else if( table.size() < capacity ) table.push_back( sample[j].entry );
+    }
+  xsignal( &cv_budget );
+  xunlock( &mutex );
+  }
+
+
+bool Consistency_checker::write_sidemap( const bool force )
+  {
+  xlock( &mutex );
+  bool ok = true;
+  if( dirty || force )
+    {
+    sidemap.compact_sblock_vector();
+    ok = sidemap.write_mapfile( 0, true );
+    if( ok ) dirty = false;
+    }
+  xunlock( &mutex );
+  return ok;
+  }
@@ -0,0 +1,76 @@
+/*  GNU ddrescue - Data recovery tool
+    Copyright (C) 2004-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Rereads in the background a random sample of the sectors already read,
+// and marks as finished in a side map the sectors whose data have changed
+// (see option '--reread-check').
+class Consistency_checker
+  {
+  struct Entry
+    {
+    long long pos;
+    uint32_t checksum;
+    Entry( const long long p, const uint32_t c ) : pos( p ), checksum( c ) {}
+    };
+  struct Sample				// entry to store at table[index]
+    {
+    unsigned long index;
+    Entry entry;
+    Sample( const unsigned long i, const Entry & e ) : index( i ), entry( e ) {}
+    };
+
+  Mapfile sidemap;			// unreliable sectors are finished
+  const Domain full_domain;
+  std::vector< Entry > table;		// reservoir sample of sectors read
+  std::vector< Sample > sample;		// used only by data_read
+  const unsigned long capacity;
+  const int hardbs_;
+  const int budget_;			// max percentage of bytes reread
+  const int ides_;			// infile opened for this thread
+  uint8_t * buf_base;
+  uint8_t * buf;			// aligned buffer for rereads
+  unsigned long long rng_main, rng_worker;	// xorshift states
+  long long sectors_seen;		// used only by data_read
+  long long bytes_read, bytes_reread;
+  long long mismatches;
+  pthread_t worker_id;
+  pthread_mutex_t mutex;
+  pthread_cond_t cv_budget;		// more data have been read
+  bool dirty;				// sidemap not yet saved
+  bool quit;
+  bool started;
+
+  Consistency_checker( const Consistency_checker & );	// declared as private
+  void operator=( const Consistency_checker & );	// declared as private
+
+public:
+  Consistency_checker( const char * const sidemap_name,
+                       const long long insize, const int hardbs,
+                       const int budget, const int ides );
+  ~Consistency_checker();
+
+  bool start();
+  void stop();
+  void worker();
+  void data_read( const uint8_t * const data, const long long pos,
+                  const int size );
+  bool write_sidemap( const bool force = false );
+
+  const char * sidemap_name() const { return sidemap.filename(); }
+  long long mismatch_count() const { return mismatches; }
+  long long reread_size() const { return bytes_reread; }
+  };
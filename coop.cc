@@ -0,0 +1,285 @@
+/*  GNU ddrescue - Data recovery tool
+    Copyright (C) 2004-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "block.h"
+#include "coop.h"
+
+
+// Layout of the shared file: header, slots, and one word per chunk.
+// A chunk word is 0 if free, 2 * ( slot + 1 ) if leased by slot, or
+// 2 * ( slot + 1 ) + 1 if rescued by slot.
+struct Lease_header
+  {
+  char magic[8];
+  long long domain_pos;
+  long long domain_end;
+  long long chunk_size;
+  long long chunks;
+  long long out_dev, out_ino;		// identity of the shared outfile
+  long long out_offset;			// opos - ipos
+  volatile int ready;			// set by the creator when initialized
+  int padding;
+  };
+
+struct Lease_slot
+  {
+  volatile long long pid;		// 0 = free, < 0 = exited
+  volatile long long heartbeat;		// time of last progress
+  char mapname[496];			// absolute name of the mapfile
+  };
+
+
+namespace {
+
+const char lease_magic[8] = { 'D', 'D', 'R', 'C', 'O', 'O', 'P', '2' };
+
+long long table_size( const long long chunks )
+  { return sizeof (Lease_header) +
+           Lease_table::max_slots * sizeof (Lease_slot) +
+           chunks * sizeof (long long); }
+
+
+bool absolute_name( const char * const name, std::string & abs_name )
+  {
+  abs_name.clear();
+  if( name[0] != '/' )
+    {
+    char buf[4096];
+    if( !getcwd( buf, sizeof buf ) ) return false;
+    abs_name = buf; abs_name += '/';
+    }
+  abs_name += name;
+  return ( abs_name.size() < sizeof ((Lease_slot *)0)->mapname );
+  }
+
+
+// Identifies a regular file by its inode, and a device by its number, so
+// that different nodes for the same device are recognized.
+bool file_identity( const int fd, long long & dev, long long & ino )
+  {
+  struct stat st;
+  if( fstat( fd, &st ) != 0 ) return false;
+  if( S_ISBLK( st.st_mode ) || S_ISCHR( st.st_mode ) )
+    { dev = st.st_rdev; ino = -1; }
+  else { dev = st.st_dev; ino = st.st_ino; }
+  return true;
+  }
+
+} // end namespace
+
+
+Lease_table::~Lease_table()
+  {
+  if( !header ) return;
+  if( slot_ >= 0 ) slots[slot_].pid = -slots[slot_].pid;	// exited
+  munmap( header, map_size );
+  }
+
+
+// Opens the shared file, creating and initializing it if it does not
+// exist, and registers 'mapname' in a slot. A slot of an exited process
+// is reused only by a process with the same mapfile, so that the chunks
+// rescued by the exited process can still be read from its mapfile.
+// All the processes must write to the same outfile 'odes' at the same
+// 'offset', because the chunks rescued by the other processes are only
+// marked as finished in this mapfile, not copied.
+//
+bool Lease_table::open( const Domain & domain, const long long chunk_size,
+                        const char * const mapname, const int odes,
+                        const long long offset, std::string & msg )
+  {
+  if( domain.empty() || domain.end() >= LLONG_MAX )
+    { msg = "Cooperative rescue requires a known input size.";
+      errno = 0; return false; }
+  long long out_dev, out_ino;
+  if( !file_identity( odes, out_dev, out_ino ) )
+    { msg = "Can't stat output file"; return false; }
+  std::string abs_mapname;
+  if( !absolute_name( mapname, abs_mapname ) )
+    { msg = "Mapfile name too long for cooperative rescue.";
+      errno = 0; return false; }
+  const long long csize = ( chunk_size > 0 ) ? chunk_size :
+    std::max( ( domain.size() / 1024 + 0xFFFF ) & ~0xFFFFLL, 1LL << 20 );
+  const long long n = ( domain.size() + csize - 1 ) / csize;
+
+  int fd = ::open( name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644 );
+  if( fd >= 0 )					// create table
+    {
+    map_size = table_size( n );
+    if( ftruncate( fd, map_size ) != 0 )
+      { msg = "Can't create cooperative file"; close( fd ); return false; }
+    void * const p =
+      mmap( 0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( p == MAP_FAILED ) { msg = "Can't map cooperative file"; return false; }
+    header = (Lease_header *)p;
+    std::memcpy( header->magic, lease_magic, sizeof lease_magic );
+    header->domain_pos = domain.pos(); header->domain_end = domain.end();
+    header->chunk_size = csize; header->chunks = n;
+    header->out_dev = out_dev; header->out_ino = out_ino;
+    header->out_offset = offset;
+    __sync_synchronize();			// the rest is already zeroed
+    header->ready = 1;
+    }
+  else
+    {
+    if( errno != EEXIST ) { msg = "Can't open cooperative file"; return false; }
+    fd = ::open( name_.c_str(), O_RDWR );
+    if( fd < 0 ) { msg = "Can't open cooperative file"; return false; }
+    Lease_header h;
+    for( int i = 0; ; ++i )			// wait for the creator
+      {
+      struct stat st;
+      if( fstat( fd, &st ) == 0 && st.st_size >= (long long)sizeof h &&
+          pread( fd, &h, sizeof h, 0 ) == (long)sizeof h && h.ready ) break;
+      if( i >= 500 )
+        { msg = "Cooperative file is not initialized"; errno = 0;
+          close( fd ); return false; }
+      usleep( 10000 );
+      }
+    map_size = table_size( h.chunks );
+    void * const p = ( std::memcmp( h.magic, lease_magic, sizeof h.magic ) == 0 ) ?
+      mmap( 0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) : MAP_FAILED;
+    close( fd );
+    if( p == MAP_FAILED )
+      { msg = "Cooperative file is not valid"; return false; }
+    header = (Lease_header *)p;
+    if( header->domain_pos != domain.pos() || header->domain_end != domain.end() ||
+        ( chunk_size > 0 && header->chunk_size != chunk_size ) )
+      { msg = "Cooperative file was created for a different rescue domain";
+        errno = 0; return false; }
+    if( header->out_dev != out_dev || header->out_ino != out_ino ||
+        header->out_offset != offset )
+      { msg = "Cooperating processes must share the output file and offset";
+        errno = 0; return false; }
+    }
+  slots = (Lease_slot *)( header + 1 );
+  chunks = (volatile long long *)( slots + max_slots );
+
+  const long long pid = getpid();
+  for( int s = 0; s < max_slots && slot_ < 0; ++s )	// same mapfile
+    {
+    const long long old_pid = slots[s].pid;
+    if( old_pid == 0 || abs_mapname != slots[s].mapname ) continue;
+    if( !stale( s ) )
+      { msg = "Mapfile is in use by another cooperating process";
+        errno = 0; return false; }
+    if( __sync_bool_compare_and_swap( &slots[s].pid, old_pid, pid ) ) slot_ = s;
+    }
+  for( int s = 0; s < max_slots && slot_ < 0; ++s )	// free slot
+    if( __sync_bool_compare_and_swap( &slots[s].pid, 0LL, pid ) )
+      {
+      std::strcpy( slots[s].mapname, abs_mapname.c_str() );
+      slot_ = s;
+      }
+  if( slot_ < 0 )
+    { msg = "Too many cooperating processes"; errno = 0; return false; }
+  heartbeat();
+  return true;
+  }
+
+
+bool Lease_table::stale( const int slot ) const
+  {
+  const long long pid = slots[slot].pid;
+  if( pid <= 0 ) return true;
+  if( kill( pid, 0 ) != 0 && errno == ESRCH ) return true;	// died
+  return ( std::time( 0 ) - slots[slot].heartbeat > stale_interval );
+  }
+
+
+// Leases to this process the first chunk that is free, leased by this
+// slot in a previous run, or leased by a stale process.
+// Returns the index of the chunk, or -1 if none can be leased now.
+// 'all_done' is set to true if all the chunks have been rescued.
+//
+long Lease_table::claim( bool & all_done )
+  {
+  const long long mine = 2 * ( slot_ + 1 );
+  all_done = true;
+  for( long i = 0; i < header->chunks; ++i )
+    {
+    const long long w = chunks[i];
+    if( w & 1 ) continue;				// rescued
+    all_done = false;
+    if( w == mine ) { ++claimed_; return i; }
+    if( w == 0 )
+      { if( __sync_bool_compare_and_swap( &chunks[i], 0LL, mine ) )
+          { ++claimed_; return i; }
+        continue; }
+    if( stale( w / 2 - 1 ) &&
+        __sync_bool_compare_and_swap( &chunks[i], w, mine ) )
+      { ++claimed_; ++reclaimed_; return i; }
+    }
+  return -1;
+  }
+
+
+// Marks chunk 'i' as rescued by this process, unless another process has
+// reclaimed it meanwhile.
+void Lease_table::finish( const long i )
+  {
+  const long long mine = 2 * ( slot_ + 1 );
+  if( __sync_bool_compare_and_swap( &chunks[i], mine, mine + 1 ) ) ++rescued_;
+  }
+
+
+void Lease_table::release( const long i )
+  {
+  __sync_bool_compare_and_swap( &chunks[i], 2LL * ( slot_ + 1 ), 0LL );
+  }
+
+
+void Lease_table::heartbeat()
+  { if( slot_ >= 0 ) slots[slot_].heartbeat = std::time( 0 ); }
+
+
+long Lease_table::chunks_size() const { return header->chunks; }
+
+
+Block Lease_table::chunk( const long i ) const
+  {
+  const long long pos = header->domain_pos + i * header->chunk_size;
+  return Block( pos, std::min( header->chunk_size, header->domain_end - pos ) );
+  }
+
+
+int Lease_table::done_by( const long i ) const
+  {
+  const long long w = chunks[i];
+  return ( w & 1 ) ? w / 2 - 1 : -1;
+  }
+
+
+const char * Lease_table::slot_mapname( const int slot ) const
+  { return slots[slot].mapname; }
@@ -0,0 +1,68 @@
+/*  GNU ddrescue - Data recovery tool
+    Copyright (C) 2004-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Table of chunks of the rescue domain shared through a memory-mapped
+// file by several ddrescue processes rescuing the same infile (see option
+// '--cooperative'). Each process registers its mapfile in a slot, and
+// claims chunks with compare-and-swap operations on the chunk words, so
+// that no lock is ever held. A chunk leased by a process that has died,
+// or whose heartbeat is older than 'stale_interval', can be reclaimed.
+struct Lease_header;
+struct Lease_slot;
+
+class Lease_table
+  {
+public:
+  enum { max_slots = 64, stale_interval = 60 };
+
+private:
+  const std::string name_;
+  Lease_header * header;
+  Lease_slot * slots;
+  volatile long long * chunks;		// chunk state words
+  size_t map_size;
+  int slot_;				// slot of this process
+  unsigned long claimed_, reclaimed_, rescued_;
+
+  Lease_table( const Lease_table & );	// declared as private
+  void operator=( const Lease_table & );	// declared as private
+
+  bool stale( const int slot ) const;
+
+public:
+  explicit Lease_table( const char * const name )
+    : name_( name ), header( 0 ), slots( 0 ), chunks( 0 ), map_size( 0 ),
+      slot_( -1 ), claimed_( 0 ), reclaimed_( 0 ), rescued_( 0 ) {}
+  ~Lease_table();
+
+  bool open( const Domain & domain, const long long chunk_size,
+             const char * const mapname, const int odes,
+             const long long offset, std::string & msg );
+  long claim( bool & all_done );
+  void finish( const long i );
+  void release( const long i );
+  void heartbeat();
+
+  long chunks_size() const;
+  Block chunk( const long i ) const;
+  int done_by( const long i ) const;		// slot, or -1 if not done
+  const char * slot_mapname( const int slot ) const;
+  int slot() const { return slot_; }
+  unsigned long claimed() const { return claimed_; }
+  unsigned long reclaimed() const { return reclaimed_; }
+  unsigned long rescued() const { return rescued_; }
+  };
@@ -0,0 +1,465 @@
+/*  GNU ddrescue - Data recovery tool
+    Copyright (C) 2004-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "rational.h"
+#include "block.h"
+#include "mapbook.h"
+#include "rescuebook.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+
+namespace {
+
+extern "C" void * command_server_start( void * arg )
+  {
+  ((Command_server *)arg)->serve();
+  return 0;
+  }
+
+
+bool set_nonblocking( const int fd )
+  {
+  const int flags = fcntl( fd, F_GETFL );
+  return ( flags >= 0 && fcntl( fd, F_SETFL, flags | O_NONBLOCK ) == 0 );
+  }
+
+} // end namespace
+
+
+bool Command_server::start( std::string & msg )
+  {
+  struct sockaddr_un addr;
+  std::memset( &addr, 0, sizeof addr );
+  addr.sun_family = AF_UNIX;
+  if( name_.size() >= sizeof addr.sun_path )
+    { msg = "Socket name too long."; errno = 0; return false; }
+  std::strcpy( addr.sun_path, name_.c_str() );
+  if( pipe( wake_fds ) != 0 )
+    { msg = "Can't create pipe"; wake_fds[0] = wake_fds[1] = -1; return false; }
+  if( !set_nonblocking( wake_fds[0] ) || !set_nonblocking( wake_fds[1] ) )
+    { msg = "Can't set pipe non-blocking"; close_pipe(); return false; }
+  listen_fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if( listen_fd < 0 ) { msg = "Can't create socket"; close_pipe(); return false; }
+  if( bind( listen_fd, (struct sockaddr *)&addr, sizeof addr ) != 0 )
+    { msg = "Can't bind socket"; close( listen_fd ); listen_fd = -1;
+      close_pipe(); return false; }
+  if( listen( listen_fd, 16 ) != 0 )
+    { msg = "Can't listen on socket"; close( listen_fd ); listen_fd = -1;
+      unlink( name_.c_str() ); close_pipe(); return false; }
+  xinit_mutex( &mutex ); xinit_mutex( &omutex ); xinit_cond( &cv );
+  const int errcode =
+    pthread_create( &server_id, 0, command_server_start, this );
+  if( errcode )
+    { xdestroy_cond( &cv ); xdestroy_mutex( &omutex ); xdestroy_mutex( &mutex );
+      close( listen_fd ); listen_fd = -1; unlink( name_.c_str() );
+      close_pipe(); msg = "Can't create server thread"; errno = errcode;
+      return false; }
+  started = true;
+  return true;
+  }
+
+
+// Accepts clients, reads their commands, and sends them their replies
+// until told to quit.
+//
+void Command_server::serve()
+  {
+  std::vector< struct pollfd > fds;
+  while( true )
+    {
+    xlock( &mutex ); const bool q = quit; xunlock( &mutex );
+    if( q ) break;
+    fds.resize( clients.size() + 2 );
+    fds[0].fd = listen_fd; fds[0].events = POLLIN;
+    fds[1].fd = wake_fds[0]; fds[1].events = POLLIN;
+    xlock( &omutex );
+    for( unsigned i = 0; i < clients.size(); ++i )
+      { fds[i+2].fd = clients[i];
+        fds[i+2].events = outbufs[i].size() ? POLLIN | POLLOUT : POLLIN; }
+    xunlock( &omutex );
+    if( poll( &fds[0], fds.size(), 200 ) <= 0 ) continue;
+    if( fds[1].revents )			// discard the wake-up bytes
+      { char buf[64]; while( read( wake_fds[0], buf, sizeof buf ) > 0 ) {} }
+    for( unsigned i = clients.size(); i > 0; --i )	// may close clients
+      {
+      const short revents = fds[i+1].revents;
+      if( !revents ) continue;
+      if( revents & POLLOUT )
+        {
+        xlock( &omutex ); const bool ok = flush_client( i - 1 );
+        xunlock( &omutex );
+        if( !ok ) { close_client( i - 1 ); continue; }
+        }
+      if( !( revents & ( POLLIN | POLLHUP | POLLERR ) ) ) continue;
+      char buf[4096];
+      const int n = read( clients[i-1], buf, sizeof buf );
+      if( n <= 0 )
+        { if( n == 0 || ( errno != EINTR && errno != EAGAIN ) )
+            close_client( i - 1 );
+          continue; }
+      const int fd = clients[i-1];
+      std::string & command = inbufs[i-1];
+      for( int j = 0; j < n; ++j )	// same normalization as do_commands
+        {
+        const unsigned char c = buf[j];
+        if( c == '\n' )
+          {
+          if( command.size() && command[command.size()-1] == ' ' )
+            command.erase( command.size() - 1 );
+          if( command.empty() ) continue;
+          std::string tmp; tmp.swap( command );
+          if( tmp == "q" ) { close_client( i - 1 ); break; }
+          handle_command( fd, tmp );
+          }
+        else if( !std::isspace( c ) ) command += c;
+        else if( command.size() && command[command.size()-1] != ' ' )
+          command += ' ';
+        }
+      }
+    if( fds[0].revents )
+      {
+      const int fd = accept( listen_fd, 0, 0 );
+      if( fd >= 0 && !set_nonblocking( fd ) ) close( fd );
+      else if( fd >= 0 )
+        {
+        xlock( &omutex );
+        clients.push_back( fd ); inbufs.push_back( std::string() );
+        outbufs.push_back( std::string() );
+        xunlock( &omutex );
+        }
+      }
+    }
+  }
+
+
+void Command_server::close_pipe()
+  {
+  for( int i = 0; i < 2; ++i )
+    if( wake_fds[i] >= 0 ) { close( wake_fds[i] ); wake_fds[i] = -1; }
+  }
+
+
+// Discards the pending requests and replies of client 'i' and closes it.
+//
+void Command_server::close_client( const unsigned i )
+  {
+  const int fd = clients[i];
+  xlock( &mutex );
+  for( unsigned j = requests.size(); j > 0; --j )
+    if( requests[j-1].fd == fd ) requests.erase( requests.begin() + j - 1 );
+  xlock( &omutex );
+  xunlock( &mutex );
+  close( fd );
+  clients.erase( clients.begin() + i );
+  inbufs.erase( inbufs.begin() + i );
+  outbufs.erase( outbufs.begin() + i );
+  xunlock( &omutex );
+  }
+
+
+// Sends to client 'i' as much of its output queue as the socket accepts
+// without blocking. Returns false if the client is gone.
+// Called with omutex locked.
+//
+bool Command_server::flush_client( const unsigned i )
+  {
+  std::string & text = outbufs[i];
+  unsigned sz = 0;
+  while( sz < text.size() )
+    {
+    const int n = send( clients[i], text.data() + sz, text.size() - sz,
+                        MSG_NOSIGNAL );
+    if( n > 0 ) sz += n;
+    else if( n < 0 && errno == EINTR ) continue;
+    else if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) break;
+    else { text.clear(); return false; }	// client is gone
+    }
+  text.erase( 0, sz );
+  return true;
+  }
+
+
+// Appends 'text' to the output queue of client 'fd', if still connected,
+// and wakes up the server thread to send it. A client whose queue grows
+// beyond max_outbuf_size is shut down; the server thread then closes it.
+//
+void Command_server::queue_text( const int fd, const std::string & text )
+  {
+  xlock( &omutex );
+  for( unsigned i = 0; i < clients.size(); ++i )
+    if( clients[i] == fd )
+      {
+      if( outbufs[i].size() + text.size() > max_outbuf_size )
+        { outbufs[i].clear(); shutdown( fd, SHUT_RDWR ); }
+      else
+        {
+        if( outbufs[i].empty() && wake_fds[1] >= 0 )
+          { const char c = 0;
+            while( write( wake_fds[1], &c, 1 ) < 0 && errno == EINTR ) {} }
+        outbufs[i] += text;
+        }
+      break;
+      }
+  xunlock( &omutex );
+  }
+
+
+void Command_server::reply( const int fd, const char * const word,
+                            const unsigned long id, const std::string & msg )
+  {
+  char buf[80];
+  snprintf( buf, sizeof buf, "%s %lu", word, id );
+  std::string text( buf );
+  if( msg.size() ) { text += ": "; text += msg; }
+  text += '\n';
+  queue_text( fd, text );
+  }
+
+
+// Queues 'r' and acknowledges it before the rescue thread can complete it.
+//
+void Command_server::submit( const Request & r )
+  {
+  xlock( &mutex );
+  Request r2( r ); r2.id = ++last_id;
+  requests.push_back( r2 );
+  xsignal( &cv );
+  reply( r.fd, "queued", r2.id );
+  xunlock( &mutex );
+  }
+
+
+// Requests 'u' and 'f' get the lowest priority so that they run after
+// the copy requests already queued.
+//
+void Command_server::handle_command( const int fd, const std::string & command )
+  {
+  Request r;
+  r.fd = fd; r.priority = INT_MIN; r.type = command[0]; r.pos = r.end = 0;
+  if( command == "u" || command == "f" ) { submit( r ); return; }
+  if( command.size() > 1 && command[0] == 'c' )
+    {
+    long long pos, size;
+    int priority = 0;
+    const int n = std::sscanf( command.c_str() + 1, "%lli %lli %i",
+                               &pos, &size, &priority );
+    if( n >= 2 && pos >= 0 && size > 0 && priority > INT_MIN )
+      { r.priority = priority; r.pos = pos; r.end = Block( pos, size ).end();
+        submit( r ); return; }
+    }
+  std::string text;
+  if( command.size() > 1 && command[0] == 'c' ) text = "error\n";
+  else if( command.size() > 1 && command[0] == 's' )
+    {
+    xlock( &mutex );
+    const int tmp = book.status_command( command.c_str() + 1, text );
+    xunlock( &mutex );
+    text += tmp ? "error\n" : "done\n";
+    }
+  else text = "error: unknown command '" + command + "'\n";
+  queue_text( fd, text );
+  }
+
+
+// Fails the requests still pending, gives the clients up to 1 second to
+// take their last replies, and closes them.
+//
+void Command_server::stop()
+  {
+  if( !started ) return;
+  xlock( &mutex ); quit = true; xunlock( &mutex );
+  pthread_join( server_id, 0 );
+  for( unsigned i = 0; i < requests.size(); ++i )
+    reply( requests[i].fd, "error", requests[i].id, "daemon finished" );
+  requests.clear();
+  for( int waited = 0; waited < 1000; waited += 50 )
+    {
+    bool pending = false;
+    for( unsigned i = 0; i < clients.size(); ++i )
+      if( outbufs[i].size() && flush_client( i ) && outbufs[i].size() )
+        pending = true;
+    if( !pending ) break;
+    poll( 0, 0, 50 );
+    }
+  for( unsigned i = 0; i < clients.size(); ++i ) close( clients[i] );
+  clients.clear(); inbufs.clear(); outbufs.clear();
+  close( listen_fd ); listen_fd = -1;
+  unlink( name_.c_str() );
+  close_pipe();
+  xdestroy_cond( &cv ); xdestroy_mutex( &omutex ); xdestroy_mutex( &mutex );
+  started = false;
+  }
+
+
+// Copies into 'r' the pending request of highest priority, the oldest
+// one if several have the same priority. If 'wait' is true and no
+// request is pending, waits for one during at most 1 second.
+//
+bool Command_server::next_request( Request & r, const bool wait )
+  {
+  if( requests.empty() && wait )
+    {
+    struct timeval tv;
+    gettimeofday( &tv, 0 );
+    struct timespec deadline;
+    deadline.tv_sec = tv.tv_sec + 1; deadline.tv_nsec = tv.tv_usec * 1000;
+    pthread_cond_timedwait( &cv, &mutex, &deadline );
+    }
+  if( requests.empty() ) return false;
+  unsigned best = 0;
+  for( unsigned i = 1; i < requests.size(); ++i )
+    if( requests[i].priority > requests[best].priority ) best = i;
+  r = requests[best];
+  return true;
+  }
+
+
+void Command_server::advance( const unsigned long id, const long long pos )
+  {
+  for( unsigned i = 0; i < requests.size(); ++i )
+    if( requests[i].id == id ) { requests[i].pos = pos; break; }
+  }
+
+
+// Removes request 'id' and queues its completion record, unless the
+// client has gone.
+//
+void Command_server::complete( const unsigned long id, const bool ok,
+                               const std::string & msg )
+  {
+  for( unsigned i = 0; i < requests.size(); ++i )
+    if( requests[i].id == id )
+      {
+      const int fd = requests[i].fd;
+      requests.erase( requests.begin() + i );
+      reply( fd, ok ? "done" : "error", id, msg );
+      break;
+      }
+  }
+
+
+// Return values: 1 error, 0 OK.
+// Copies the non-tried blocks of the domain in the background, while
+// serving on socket 'name' the requests of the clients. Each copy request
+// reads, one cluster at a time, the unfinished blocks of its range,
+// before any cluster is read for the background copy.
+//
+int Rescuebook::do_daemon( const int ides, const int odes,
+                           const char * const name )
+  {
+  ides_ = ides; odes_ = odes;
+  set_signals();
+  initial_time();
+  Command_server server( *this, name );
+  std::string msg;
+  if( !server.start( msg ) ) { show_error( msg.c_str(), errno ); return 1; }
+  if( verbosity >= 1 )
+    std::printf( "Serving requests on socket '%s'\n", name );
+  long long bulk_pos = domain().pos();
+  bool bulk_done = false, saved = false;
+  int retval = 0;
+  while( !interrupted() )
+    {
+    Command_server::Request r;
+    server.lock();
+    if( !update_mapfile( odes_ ) )		// save at the usual interval
+      { server.unlock(); retval = 1; break; }
+    const bool found = server.next_request( r, bulk_done );
+    if( found && r.type != 'c' )			// 'u' or 'f'
+      {
+      if( r.type == 'f' ) compact_sblock_vector();
+      const bool ok = update_mapfile( odes_, true );
+      server.complete( r.id, ok );
+      server.unlock();
+      if( r.type == 'f' ) { saved = true; if( !ok ) retval = 1; break; }
+      continue;
+      }
+    Block b( found ? r.pos : bulk_pos, softbs() );
+    if( found )
+      {
+      find_chunk( b, Sblock::non_tried, domain(), softbs(), false, true );
+      if( b.size() <= 0 || b.pos() >= r.end )
+        { server.complete( r.id, true ); server.unlock(); continue; }
+      if( b.end() > r.end ) b.size( r.end - b.pos() );
+      }
+    else if( !bulk_done )
+      {
+      find_chunk( b, Sblock::non_tried, domain(), softbs() );
+      if( b.size() <= 0 ) bulk_done = true;
+      }
+    server.unlock();
+    if( b.size() <= 0 ) continue;
+
+    int copied_size = 0, error_size = 0;
+    struct timeval tv0;
+    if( heatmap ) gettimeofday( &tv0, 0 );
+    int tmp = copy_block( b, copied_size, error_size );
+    if( tmp == -1 ) break;		// interrupted while waiting for the read
+    server.lock();
+    if( tmp == 0 )
+      tmp = account_read( b, copied_size, error_size,
+                          heatmap ? elapsed_usecs( tv0 ) : 0,
+                          found ? Sblock::bad_sector : Sblock::non_trimmed );
+    if( !found ) bulk_pos = b.end();
+    else if( tmp == 0 ) server.advance( r.id, b.end() );
+    else
+      {
+      server.complete( r.id, false, final_msg() +
+        ( ( final_errno() > 0 ) ? std::string( ": " ) +
+          std::strerror( final_errno() ) : std::string() ) );
+      final_msg( "" );
+      }
+    server.unlock();
+    if( tmp && !found ) { retval = 1; break; }	// error copying bulk
+    }
+  server.stop();
+  if( !saved )
+    {
+    compact_sblock_vector();
+    if( !update_mapfile( odes_, true ) ) retval = 1;
+    }
+  if( final_msg().size() ) show_error( final_msg().c_str(), final_errno() );
+  if( close( odes_ ) != 0 )
+    { show_error( "Error closing outfile", errno );
+      if( retval == 0 ) retval = 1; }
+  if( !close_tee_outputs() && retval == 0 ) retval = 1;
+  if( retval ) return retval;
+  if( interrupted() ) return signaled_exit();
+  return 0;
+  }
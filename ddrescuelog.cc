@@ -30,9 +30,11 @@
 #include <ctime>
 #include <string>
 #include <vector>
+#include <stdint.h>
 
 #include "arg_parser.h"
 #include "block.h"
+#include "heatmap.h"
 
 
 namespace {
@@ -42,8 +44,8 @@ const char * const program_name = "ddrescuelog";
 const char * invocation_name = program_name;		// default value
 
 enum Mode { m_none, m_and, m_annotate, m_change, m_compare, m_complete,
-            m_create, m_delete, m_done_st, m_invert, m_list, m_or,
-            m_shift, m_status, m_xor };
+            m_create, m_delete, m_done_st, m_heatmap, m_invert, m_list,
+            m_or, m_render, m_shift, m_status, m_xor };
 
 
 void show_help( const int hardbs )
@@ -83,6 +85,8 @@ void show_help( const int hardbs )
                "  -x, --xor-mapfile=<file>        XOR the finished blocks in file with mapfile\n"
                "  -y, --and-mapfile=<file>        AND the finished blocks in file with mapfile\n"
                "  -z, --or-mapfile=<file>         OR the finished blocks in file with mapfile\n"
+               "      --heatmap[=ansi|ppm]        render read statistics saved by ddrescue\n"
+               "      --render-map[=<fmt>,<WxH>]  draw mapfile as ansi or ppm image\n"
                "      --shift                     shift all block positions by (opos - ipos)\n"
                "\nUse '-' to read a mapfile from standard input or to write the mapfile\n"
                "created by '--create-mapfile' to standard output.\n"
@@ -98,6 +102,40 @@ void show_help( const int hardbs )
   }
 
 
+bool parse_heatmap_format( const std::string & arg )
+  {
+  if( arg.empty() || arg == "ansi" ) return false;
+  if( arg == "ppm" ) return true;
+  show_error( "Invalid format for 'heatmap' option.", 0, true );
+  std::exit( 1 );
+  }
+
+
+// Parses '[<format>][,<width>x<height>]'.
+void parse_render_format( const std::string & arg, bool & ppm,
+                          int & width, int & height )
+  {
+  const unsigned long i = arg.find( ',' );
+  const std::string format( arg, 0, i );
+  bool error = false;
+  if( format == "ppm" ) ppm = true;
+  else if( format.size() && format != "ansi" ) error = true;
+  if( !error && i < arg.size() )
+    {
+    int w = 0, h = 0, n = 0;
+    if( std::sscanf( arg.c_str() + i + 1, "%dx%d%n", &w, &h, &n ) != 2 ||
+        i + 1 + n != arg.size() || w < 1 || h < 1 || w > 4096 || h > 4096 ||
+        (long)w * h > 1 << 20 ) error = true;
+    else { width = w; height = h; }
+    }
+  if( error )
+    {
+    show_error( "Invalid argument for 'render-map' option.", 0, true );
+    std::exit( 1 );
+    }
+  }
+
+
 void parse_types( const std::string & arg,
                   std::string & types1, std::string & types2 )
   {
@@ -174,11 +212,12 @@ int do_logic_ops( Domain & domain, const char * const mapname,
   mapfile.split_by_mapfile_borders( mapfile2 );
   mapfile2.split_by_mapfile_borders( mapfile );
 
+  Domain_cursor dc1( domain ), dc2( domain );
   for( long i = 0, j = 0; ; ++i, ++j )
     {
-    while( i < mapfile.sblocks() && !domain.includes( mapfile.sblock( i ) ) )
+    while( i < mapfile.sblocks() && !dc1.includes( mapfile.sblock( i ) ) )
       ++i;
-    while( j < mapfile2.sblocks() && !domain.includes( mapfile2.sblock( j ) ) )
+    while( j < mapfile2.sblocks() && !dc2.includes( mapfile2.sblock( j ) ) )
       ++j;
     if( i >= mapfile.sblocks() || j >= mapfile2.sblocks() ) break;
     const Sblock & sb1 = mapfile.sblock( i );
@@ -233,10 +272,11 @@ int change_types( Domain & domain, const char * const mapname,
   if( domain.empty() ) return empty_domain();
   mapfile.split_by_domain_borders( domain );
 
+  Domain_cursor dc( domain );
   for( long i = 0; i < mapfile.sblocks(); ++i )
     {
     const Sblock & sb = mapfile.sblock( i );
-    if( !domain.includes( sb ) )
+    if( !dc.includes( sb ) )
       { if( domain < sb ) break; else continue; }
     const unsigned j = types1.find( sb.status() );
     if( j < types1.size() )
@@ -279,15 +319,16 @@ int compare_mapfiles( Domain & domain, const char * const mapname,
   if( !as_domain && domain != domain2 ) retval = 1;
   else
     {
+    Domain_cursor dc1( domain ), dc2( domain2 );
     long i = 0, j = 0;
     while( true )
       {
       while( i < mapfile.sblocks() &&
-             ( !domain.includes( mapfile.sblock( i ) ) ||
+             ( !dc1.includes( mapfile.sblock( i ) ) ||
              ( as_domain && mapfile.sblock( i ).status() != Sblock::finished ) ) )
         ++i;
       while( j < mapfile2.sblocks() &&
-             ( !domain2.includes( mapfile2.sblock( j ) ) ||
+             ( !dc2.includes( mapfile2.sblock( j ) ) ||
              ( as_domain && mapfile2.sblock( j ).status() != Sblock::finished ) ) )
         ++j;
       if( ( i < mapfile.sblocks() ) != ( j < mapfile2.sblocks() ) )
@@ -322,6 +363,42 @@ int complete_mapfile( const char * const mapname,
   }
 
 
+// Marks as 'type' the blocks of the run that are in domain. Sorted block
+// lists are thus marked with one change per run instead of one per block.
+//
+// Marks 'b', which is included in 'domain', as 'type', one piece per
+// sblock spanned, because a run read from an unsorted or overlapping list
+// may span blocks already marked.
+void mark_block( Mapfile & mapfile, const Domain & domain, const Block & b,
+                 const Sblock::Status type )
+  {
+  for( long long pos = b.pos(); pos < b.end(); )
+    {
+    const long i = mapfile.find_index( pos );
+    if( i < 0 ) internal_error( "block to mark is not in mapfile." );
+    const Block piece( pos,
+                       std::min( b.end(), mapfile.sblock( i ).end() ) - pos );
+    mapfile.change_chunk_status( piece, type, domain );
+    pos = piece.end();
+    }
+  }
+
+
+void mark_run( Mapfile & mapfile, const Domain & domain, const long long first,
+               const long long count, const int hardbs,
+               const Sblock::Status type )
+  {
+  const Block run( first * hardbs, count * hardbs );
+  if( domain.includes( run ) )
+    { mark_block( mapfile, domain, run, type ); return; }
+  for( long long block = first; block < first + count; ++block )
+    {
+    const Block b( block * hardbs, hardbs );
+    if( domain.includes( b ) ) mark_block( mapfile, domain, b, type );
+    }
+  }
+
+
 int create_mapfile( Domain & domain, const char * const mapname,
                     const int hardbs, const Sblock::Status type1,
                     const Sblock::Status type2, const bool force )
@@ -341,10 +418,15 @@ int create_mapfile( Domain & domain, const char * const mapname,
   mapfile.split_by_domain_borders( domain );
 
   // mark every block read from stdin and in domain as type1
+  long long first = 0, count = 0;	// run of consecutive blocks read
   for( int linenum = 1; ; ++linenum )
     {
     long long block;
     const int n = std::scanf( "%lli\n", &block );
+    if( n == 1 && block >= 0 && block <= LLONG_MAX / hardbs &&
+        count > 0 && block == first + count ) { ++count; continue; }
+    if( count > 0 )
+      mark_run( mapfile, domain, first, count, hardbs, type1 );
     if( n < 0 ) break;				// EOF
     if( n != 1 || block < 0 || block > LLONG_MAX / hardbs )
       {
@@ -353,9 +435,7 @@ int create_mapfile( Domain & domain, const char * const mapname,
       show_error( buf );
       return 2;
       }
-    const Block b( block * hardbs, hardbs );
-    if( domain.includes( b ) )
-      mapfile.change_chunk_status( b, type1, domain );
+    first = block; count = 1;
     }
   mapfile.truncate_vector( domain.end(), true );
   if( !mapfile.write_mapfile( to_stdout ? stdout : 0 ) ) return 1;
@@ -374,10 +454,11 @@ int test_if_done( Domain & domain, const char * const mapname, const bool del )
   if( domain.empty() ) return empty_domain();
   mapfile.split_by_domain_borders( domain );
 
+  Domain_cursor dc( domain );
   for( long i = 0; i < mapfile.sblocks(); ++i )
     {
     const Sblock & sb = mapfile.sblock( i );
-    if( !domain.includes( sb ) )
+    if( !dc.includes( sb ) )
       { if( domain < sb ) break; else continue; }
     if( sb.status() != Sblock::finished )
       {
@@ -436,10 +517,11 @@ int to_badblocks( const long long offset, Domain & domain,
   if( domain.empty() ) return empty_domain();
   mapfile.split_by_domain_borders( domain );
 
+  Domain_cursor dc( domain );
   for( long i = 0; i < mapfile.sblocks(); ++i )
     {
     const Sblock & sb = mapfile.sblock( i );
-    if( !domain.includes( sb ) )
+    if( !dc.includes( sb ) )
       { if( domain < sb ) break; else continue; }
     if( blocktypes.find( sb.status() ) >= blocktypes.size() ) continue;
     for( long long block = ( sb.pos() + offset ) / hardbs;
@@ -457,6 +539,303 @@ int to_badblocks( const long long offset, Domain & domain,
   }
 
 
+// Severity of block status in a zone, from finished (0) to bad-sector (4).
+int status_rank( const Sblock::Status st )
+  {
+  switch( st )
+    {
+    case Sblock::finished:    return 0;
+    case Sblock::non_tried:   return 1;
+    case Sblock::non_trimmed: return 2;
+    case Sblock::non_scraped: return 3;
+    case Sblock::bad_sector:  return 4;
+    }
+  return 0;
+  }
+
+const char rank_char[5] = { '+', '?', '*', '/', '-' };
+const uint8_t rank_rgb[5][3] =		// status colors in PPM images
+  { { 255, 255, 255 }, { 128, 128, 128 }, { 0, 0, 255 }, { 0, 160, 255 },
+    { 255, 0, 255 } };
+
+
+// Heat color of a zone, from red (slowest) through yellow to green
+// (fastest). Zones never read are black.
+void heat_rgb( const Heatmap::Zone & zone, const long long max_rate,
+               uint8_t rgb[3] )
+  {
+  if( zone.reads == 0 ) { rgb[0] = rgb[1] = rgb[2] = 0; return; }
+  const long long rate = zone.rate();
+  const double x = ( max_rate <= 0 || rate >= max_rate ) ? 1.0 :
+                   (double)rate / max_rate;
+  rgb[0] = ( x <= 0.5 ) ? 255 : (uint8_t)( 255 * ( 2 - 2 * x ) );
+  rgb[1] = ( x >= 0.5 ) ? 192 : (uint8_t)( 384 * x );
+  rgb[2] = 0;
+  }
+
+
+// Renders the heatmap of 'mapname' together with the worst status of the
+// blocks in each zone, as ANSI text or as a PPM image. The mapfile is
+// streamed once, so the time is linear in the number of blocks plus zones.
+//
+int render_heatmap( const char * const mapname, const bool ppm )
+  {
+  Mapfile_reader reader( mapname );
+  if( !reader.open() ) return not_readable( mapname );
+  Heatmap heatmap( mapname );
+  if( !heatmap.read_heatmap() ) return 1;
+  const long zones = heatmap.zone_count();
+  const long long zsize = heatmap.zone_size();
+  if( zones <= 0 )
+    {
+    char buf[80];
+    snprintf( buf, sizeof buf, "Heatmap '%s' does not exist or is empty.",
+              heatmap.filename().c_str() );
+    show_error( buf );
+    return 1;
+    }
+
+  std::vector< uint8_t > rank( zones, 0 );
+  Sblock sb;
+  while( reader.read_sblock( sb ) )
+    {
+    const int r = status_rank( sb.status() );
+    if( r == 0 || sb.pos() / zsize >= zones ) continue;
+    const long last = std::min( ( sb.end() - 1 ) / zsize, zones - 1LL );
+    for( long z = sb.pos() / zsize; z <= last; ++z )
+      if( rank[z] < r ) rank[z] = r;
+    }
+  long long max_rate = 0;
+  unsigned long errors = 0, slow_reads = 0;
+  for( long z = 0; z < zones; ++z )
+    {
+    const Heatmap::Zone & zone = heatmap.zone( z );
+    const long long rate = zone.rate();
+    if( rate < LLONG_MAX && rate > max_rate ) max_rate = rate;
+    errors += zone.errors; slow_reads += zone.slow_reads;
+    }
+
+  const int cols = std::min( zones, 50L );
+  const long rows = ( zones + cols - 1 ) / cols;
+  uint8_t rgb[3];
+  if( ppm )
+    {
+    const int cell = 8, strip = 2;	// pixels per zone, status strip
+    std::printf( "P6\n%d %ld\n255\n", cols * cell, rows * cell );
+    std::vector< uint8_t > line( cols * cell * 3 );
+    for( long row = 0; row < rows; ++row )
+      for( int y = 0; y < cell; ++y )
+        {
+        for( int col = 0; col < cols; ++col )
+          {
+          const long z = row * cols + col;
+          if( z >= zones ) rgb[0] = rgb[1] = rgb[2] = 0;
+          else if( y >= cell - strip )
+            { for( int k = 0; k < 3; ++k ) rgb[k] = rank_rgb[rank[z]][k]; }
+          else heat_rgb( heatmap.zone( z ), max_rate, rgb );
+          for( int x = 0; x < cell; ++x )
+            std::memcpy( &line[( col * cell + x ) * 3], rgb, 3 );
+          }
+        std::fwrite( &line[0], 1, line.size(), stdout );
+        }
+    }
+  else
+    {
+    for( long row = 0; row < rows; ++row )
+      {
+      std::printf( "0x%010llX  ", row * cols * zsize );
+      for( int col = 0; col < cols && row * cols + col < zones; ++col )
+        {
+        const long z = row * cols + col;
+        if( heatmap.zone( z ).reads == 0 )
+          std::printf( "\033[0m%c", rank_char[rank[z]] );
+        else
+          {
+          heat_rgb( heatmap.zone( z ), max_rate, rgb );
+          std::printf( "\033[30;48;2;%d;%d;%dm%c",
+                       rgb[0], rgb[1], rgb[2], rank_char[rank[z]] );
+          }
+        }
+      std::fputs( "\033[0m\n", stdout );
+      }
+    std::printf( "\nZone size: %sB,  zones: %ld,  ", format_num( zsize ), zones );
+    std::printf( "max rate: %sB/s,  read errors: %lu,  slow reads: %lu\n",
+                 format_num( max_rate ), errors, slow_reads );
+    }
+  if( std::fclose( stdout ) != 0 )
+    { show_error( "Error closing stdout", errno ); return 1; }
+  return 0;
+  }
+
+
+// Bytes of each status (indexed by status_rank) in a part of the map.
+struct Status_histogram
+  {
+  double bytes[5];
+  };
+
+
+// Accumulates the status histograms of a map streamed in address order
+// into a fixed number of buckets. When a block does not fit, the bucket
+// size is multiplied by a power of 2 and the buckets are merged, so the
+// memory used does not depend on the size of the map, and the total time
+// is linear in the number of blocks plus buckets.
+class Rasterizer
+  {
+  std::vector< Status_histogram > buckets;
+  long long bucket_size;
+
+public:
+  explicit Rasterizer( const long nbuckets )
+    : buckets( nbuckets, Status_histogram() ), bucket_size( 1 ) {}
+
+  // Makes the buckets cover at least [0,end).
+  void grow( const long long end )
+    {
+    const long n = buckets.size();
+    long f = 1;
+    while( ( end - 1 ) / bucket_size / f >= n ) f *= 2;
+    if( f == 1 ) return;
+    for( long j = 0; j < n; ++j )
+      {
+      Status_histogram h = Status_histogram();
+      for( long k = j * f; k < j * f + f && k < n; ++k )
+        for( int r = 0; r < 5; ++r ) h.bytes[r] += buckets[k].bytes[r];
+      buckets[j] = h;
+      }
+    bucket_size *= f;
+    }
+
+  void add( const long long pos, const long long end, const int rank )
+    {
+    if( end <= pos ) return;
+    grow( end );
+    for( long j = pos / bucket_size; j <= ( end - 1 ) / bucket_size; ++j )
+      {
+      const long long bpos = j * bucket_size;
+      const long long bend = ( bpos > LLONG_MAX - bucket_size ) ? LLONG_MAX :
+                             bpos + bucket_size;
+      buckets[j].bytes[rank] += std::min( end, bend ) - std::max( pos, bpos );
+      }
+    }
+
+  // Distributes the buckets covering [0,extent) among the pixels.
+  void resample( std::vector< Status_histogram > & pixels,
+                 const long long extent ) const
+    {
+    const long np = pixels.size();
+    const double psize = (double)extent / np;
+    long p = 0;
+    for( long j = 0; j < (long)buckets.size(); ++j )
+      {
+      const double bpos = (double)j * bucket_size;
+      if( bpos >= extent ) break;
+      const double bend = std::min( bpos + bucket_size, (double)extent );
+      while( p < np - 1 && ( p + 1 ) * psize <= bpos ) ++p;
+      for( long q = p; q < np && q * psize < bend; ++q )
+        {
+        const double share = ( std::min( bend, ( q + 1 ) * psize ) -
+                               std::max( bpos, q * psize ) ) / ( bend - bpos );
+        if( share > 0 )
+          for( int r = 0; r < 5; ++r )
+            pixels[q].bytes[r] += buckets[j].bytes[r] * share;
+        }
+      }
+    }
+  };
+
+
+// Mixes the status colors in proportion to their bytes. Non-trimmed,
+// non-scraped and bad-sector areas weigh at least 25% of the pixel, so
+// that small damaged areas remain visible. Empty pixels are black.
+void pixel_rgb( const Status_histogram & h, uint8_t rgb[3] )
+  {
+  double w[5], total = 0;
+  for( int r = 0; r < 5; ++r ) total += h.bytes[r];
+  if( total <= 0 ) { rgb[0] = rgb[1] = rgb[2] = 0; return; }
+  double sum = 0;
+  for( int r = 0; r < 5; ++r )
+    {
+    w[r] = h.bytes[r] / total;
+    if( r >= 2 && h.bytes[r] > 0 && w[r] < 0.25 ) w[r] = 0.25;
+    sum += w[r];
+    }
+  for( int k = 0; k < 3; ++k )
+    {
+    double c = 0;
+    for( int r = 0; r < 5; ++r ) c += w[r] * rank_rgb[r][k];
+    rgb[k] = (uint8_t)( c / sum + 0.5 );
+    }
+  }
+
+
+// Streams 'mapname' once and draws the part of it in the rescue domain
+// into an image of width x height pixels, as a PPM image or as ANSI text
+// with two pixels per character cell. Each pixel covers the same number
+// of bytes. If the domain has no size limit, the image covers the map up
+// to the end of its last block, ignoring a last block extending to the
+// maximum size.
+//
+int render_map( const Domain & domain, const char * const mapname,
+                const bool ppm, const int width, const int height )
+  {
+  Mapfile_reader reader( mapname );
+  if( !reader.open() ) return not_readable( mapname );
+  const long np = (long)width * height;
+  Rasterizer raster( 2 * np );		// at least 1 bucket per pixel
+  const long long base = domain.pos();
+  const bool bounded = ( domain.end() < LLONG_MAX );
+  long long extent = bounded ? domain.size() : 0;
+  if( extent > 0 ) raster.grow( extent );		// fix the scale
+  Sblock sb;
+  while( reader.read_sblock( sb ) )
+    {
+    if( !bounded && sb.end() >= LLONG_MAX ) continue;
+    const long long pos = std::max( sb.pos(), base );
+    const long long end = std::min( sb.end(), domain.end() );
+    if( pos >= end ) { if( sb.pos() >= domain.end() ) break; continue; }
+    raster.add( pos - base, end - base, status_rank( sb.status() ) );
+    if( !bounded ) extent = end - base;
+    }
+  if( extent <= 0 ) return empty_domain();
+  std::vector< Status_histogram > pixels( np, Status_histogram() );
+  raster.resample( pixels, extent );
+
+  uint8_t rgb[3], rgb2[3];
+  if( ppm )
+    {
+    std::printf( "P6\n%d %d\n255\n", width, height );
+    for( long p = 0; p < np; ++p )
+      { pixel_rgb( pixels[p], rgb ); std::fwrite( rgb, 1, 3, stdout ); }
+    }
+  else
+    {
+    for( int y = 0; y < height; y += 2 )
+      {
+      for( int x = 0; x < width; ++x )
+        {
+        pixel_rgb( pixels[(long)y * width + x], rgb );
+        if( y + 1 < height )
+          {
+          pixel_rgb( pixels[(long)( y + 1 ) * width + x], rgb2 );
+          std::printf( "\033[38;2;%d;%d;%d;48;2;%d;%d;%dm\xE2\x96\x80",
+                       rgb[0], rgb[1], rgb[2], rgb2[0], rgb2[1], rgb2[2] );
+          }
+        else std::printf( "\033[0;38;2;%d;%d;%dm\xE2\x96\x80",
+                          rgb[0], rgb[1], rgb[2] );
+        }
+      std::fputs( "\033[0m\n", stdout );
+      }
+    std::printf( "Begin: %sB,  ", format_num( base ) );
+    std::printf( "size: %sB,  ", format_num( extent ) );
+    std::printf( "bytes per pixel: %sB\n", format_num( ( extent + np - 1 ) / np ) );
+    }
+  if( std::fclose( stdout ) != 0 )
+    { show_error( "Error closing stdout", errno ); return 1; }
+  return 0;
+  }
+
+
 int do_show_status( Domain & domain, const char * const mapname,
                     const bool loose )
   {
@@ -473,10 +852,11 @@ int do_show_status( Domain & domain, const char * const mapname,
   const long true_sblocks = mapfile.sblocks();
   mapfile.split_by_domain_borders( domain );
 
+  Domain_cursor dc( domain );
   for( long i = 0; i < mapfile.sblocks(); ++i )
     {
     const Sblock & sb = mapfile.sblock( i );
-    if( !domain.includes( sb ) )
+    if( !dc.includes( sb ) )
       { if( domain < sb ) break; else continue; }
     switch( sb.status() )
       {
@@ -544,6 +924,9 @@ int main( const int argc, const char * const argv[] )
   bool as_domain = false;
   bool force = false;
   bool loose = false;
+  bool heatmap_ppm = false;
+  bool render_ppm = false;
+  int render_width = 0, render_height = 0;	// 0 = default for format
   std::string types1, types2;
   Sblock::Status type1 = Sblock::finished, type2 = Sblock::bad_sector;
   Sblock::Status complete_type = Sblock::non_tried;
@@ -552,7 +935,7 @@ int main( const int argc, const char * const argv[] )
   for( int i = 1; i < argc; ++i )
     { command_line += ' '; command_line += argv[i]; }
 
-  enum Optcode { opt_shi = 256 };
+  enum Optcode { opt_hm = 256, opt_ren, opt_shi };
   const Arg_parser::Option options[] =
     {
     { 'a', "change-types",        Arg_parser::yes },
@@ -591,6 +974,8 @@ int main( const int argc, const char * const argv[] )
     { 'y', "and-logfile",         Arg_parser::yes },
     { 'z', "or-mapfile",          Arg_parser::yes },
     { 'z', "or-logfile",          Arg_parser::yes },
+    { opt_hm,  "heatmap",         Arg_parser::maybe },
+    { opt_ren, "render-map",      Arg_parser::maybe },
     { opt_shi, "shift",           Arg_parser::no  },
     {  0 , 0,                     Arg_parser::no  } };
 
@@ -641,6 +1026,11 @@ int main( const int argc, const char * const argv[] )
                 second_mapname = ptr; break;
       case 'z': set_mode( program_mode, m_or );
                 second_mapname = ptr; break;
+      case opt_hm:  set_mode( program_mode, m_heatmap );
+                    heatmap_ppm = parse_heatmap_format( arg ); break;
+      case opt_ren: set_mode( program_mode, m_render );
+                    parse_render_format( arg, render_ppm, render_width,
+                                         render_height ); break;
       case opt_shi: set_mode( program_mode, m_shift ); break;
       default : internal_error( "uncaught option." );
       }
@@ -690,6 +1080,11 @@ int main( const int argc, const char * const argv[] )
       case m_create: return create_mapfile( domain, mapname, hardbs,
                                             type1, type2, force );
       case m_delete: return test_if_done( domain, mapname, true );
+      case m_heatmap: return render_heatmap( mapname, heatmap_ppm );
+      case m_render:
+        return render_map( domain, mapname, render_ppm,
+                           render_width ? render_width : render_ppm ? 512 : 64,
+                           render_height ? render_height : render_ppm ? 256 : 32 );
       case m_done_st: return test_if_done( domain, mapname, false );
       case m_invert: return change_types( domain, mapname, "?*/-+", "++++-" );
       case m_list:
@@ -26,6 +26,7 @@
 #include <string>
 #include <vector>
 #include <stdint.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include "block.h"
@@ -68,10 +69,11 @@ int Fillbook::fill_areas()
   const char * const msg = "Filling blocks...";
   bool first_post = true;
 
+  Domain_cursor dc( domain() );
   for( long index = 0; index < sblocks(); ++index )
     {
     const Sblock & sb = sblock( index );
-    if( !domain().includes( sb ) ) { if( domain() < sb ) break; else continue; }
+    if( !dc.includes( sb ) ) { if( domain() < sb ) break; else continue; }
     if( sb.end() <= current_pos() ||
         filltypes.find( sb.status() ) >= filltypes.size() ) continue;
     Block b( sb.pos(), softbs() );	// fill the area a softbs at a time
@@ -159,10 +161,11 @@ int Fillbook::do_fill( const int odes )
   if( current_status() != filling || !domain().includes( current_pos() ) )
     current_pos( 0 );
 
+  Domain_cursor dc( domain() );
   for( long i = 0; i < sblocks(); ++i )
     {
     const Sblock & sb = sblock( i );
-    if( !domain().includes( sb ) ) { if( domain() < sb ) break; else continue; }
+    if( !dc.includes( sb ) ) { if( domain() < sb ) break; else continue; }
     if( filltypes.find( sb.status() ) >= filltypes.size() ) continue;
     if( sb.end() <= current_pos() ) { ++filled_areas; filled_size += sb.size(); }
     else if( sb.includes( current_pos() ) )
@@ -0,0 +1,884 @@
+/*  GNU ddrescue - Data recovery tool
+    Copyright (C) 2004-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+    The metadata-first rescue copies first the areas of the input file
+    holding filesystem metadata, then the areas allocated to files, and
+    finally the rest of the domain (see option '--metadata-first').
+
+    The metadata are located by parsing the data already rescued, read
+    back from the output file. Each round rescues the metadata areas found
+    by the previous one, and then parses them again looking for more (for
+    example the subdirectories of a directory just rescued), until no new
+    areas are found. MBR and GPT partition tables, and filesystems of type
+    ext2/3/4, FAT12/16/32, NTFS, and XFS are recognized.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "rational.h"
+#include "block.h"
+#include "loggers.h"
+#include "mapbook.h"
+#include "rescuebook.h"
+
+
+namespace {
+
+enum { probe_size = 65536 };	// boot sectors, superblocks, and tables
+
+inline unsigned le16( const uint8_t * const p )
+  { return p[0] | ( p[1] << 8 ); }
+inline unsigned long le32( const uint8_t * const p )
+  { return le16( p ) | ( (unsigned long)le16( p + 2 ) << 16 ); }
+inline unsigned long long le64( const uint8_t * const p )
+  { return le32( p ) | ( (unsigned long long)le32( p + 4 ) << 32 ); }
+inline unsigned be16( const uint8_t * const p )
+  { return ( p[0] << 8 ) | p[1]; }
+inline unsigned long be32( const uint8_t * const p )
+  { return ( (unsigned long)be16( p ) << 16 ) | be16( p + 2 ); }
+inline unsigned long long be64( const uint8_t * const p )
+  { return ( (unsigned long long)be32( p ) << 32 ) | be32( p + 4 ); }
+
+
+bool block_pos_less( const Block & b1, const Block & b2 )
+  { return b1.pos() < b2.pos(); }
+
+// Sorts the blocks and joins those overlapping or adjacent.
+void normalize( std::vector< Block > & v )
+  {
+  std::sort( v.begin(), v.end(), block_pos_less );
+  unsigned long j = 0;
+  for( unsigned long i = 0; i < v.size(); ++i )
+    {
+    if( v[i].size() <= 0 ) continue;
+    if( j > 0 && v[i].pos() <= v[j-1].end() )
+      { if( v[i].end() > v[j-1].end() )
+          v[j-1].size( v[i].end() - v[j-1].pos() ); }
+    else v[j++] = v[i];
+    }
+  v.erase( v.begin() + j, v.end() );
+  }
+
+
+// Returns the parts of the blocks in 'v1' not in 'v2'. Both normalized.
+std::vector< Block > subtract( const std::vector< Block > & v1,
+                               const std::vector< Block > & v2 )
+  {
+  std::vector< Block > v;
+  unsigned long j = 0;
+  for( unsigned long i = 0; i < v1.size(); ++i )
+    {
+    long long pos = v1[i].pos();
+    const long long end = v1[i].end();
+    while( j < v2.size() && v2[j].end() <= pos ) ++j;
+    for( unsigned long k = j; k < v2.size() && v2[k].pos() < end; ++k )
+      {
+      if( v2[k].pos() > pos ) v.push_back( Block( pos, v2[k].pos() - pos ) );
+      pos = std::max( pos, v2[k].end() );
+      }
+    if( pos < end ) v.push_back( Block( pos, end - pos ) );
+    }
+  return v;
+  }
+
+
+long long total_size( const std::vector< Block > & v )
+  {
+  long long size = 0;
+  for( unsigned long i = 0; i < v.size(); ++i ) size += v[i].size();
+  return size;
+  }
+
+
+struct Ntfs_run
+  {
+  unsigned long long vcn, lcn, length;		// in clusters
+  };
+
+// Fixes the last two bytes of each sector of an MFT record.
+bool ntfs_fixup( std::vector< uint8_t > & rec )
+  {
+  if( rec.size() < 512 || std::memcmp( &rec[0], "FILE", 4 ) != 0 )
+    return false;
+  const unsigned long ofs = le16( &rec[4] ), count = le16( &rec[6] );
+  if( count == 0 || ofs + 2 * count > rec.size() ||
+      ( count - 1 ) * 512 > rec.size() ) return false;
+  for( unsigned long i = 1; i < count; ++i )
+    {
+    uint8_t * const p = &rec[i*512-2];
+    if( p[0] != rec[ofs] || p[1] != rec[ofs+1] ) return false;
+    p[0] = rec[ofs+2*i]; p[1] = rec[ofs+2*i+1];
+    }
+  return true;
+  }
+
+
+// Decodes the runlists of the non-resident attributes of type 'type'
+// in an MFT record, or of all of them if type is 0. Only unnamed
+// attributes are decoded if type is not 0. Sparse runs are not stored.
+// Returns the data size of the first attribute decoded.
+long long ntfs_attr_runs( const std::vector< uint8_t > & rec,
+                          const unsigned long type,
+                          std::vector< Ntfs_run > & runs )
+  {
+  long long data_size = -1;
+  runs.clear();
+  unsigned long off = le16( &rec[20] );
+  while( off + 16 <= rec.size() )
+    {
+    const uint8_t * const a = &rec[off];
+    const unsigned long t = le32( a ), len = le32( a + 4 );
+    if( t == 0xFFFFFFFFUL || len < 16 || len > rec.size() - off ) break;
+    off += len;
+    if( !a[8] || len < 64 || ( type != 0 && ( t != type || a[9] != 0 ) ) )
+      continue;
+    if( data_size < 0 ) data_size = le64( a + 48 );
+    unsigned long long vcn = le64( a + 16 );
+    long long lcn = 0;
+    for( unsigned long p = le16( a + 32 ); p < len && a[p]; )
+      {
+      const unsigned lsz = a[p] & 15, osz = a[p] >> 4;
+      if( lsz == 0 || lsz > 8 || osz > 8 || p + 1 + lsz + osz > len ) break;
+      unsigned long long length = 0, delta = 0;
+      for( unsigned i = 0; i < lsz; ++i )
+        length |= (unsigned long long)a[p+1+i] << ( 8 * i );
+      for( unsigned i = 0; i < osz; ++i )
+        delta |= (unsigned long long)a[p+1+lsz+i] << ( 8 * i );
+      if( osz > 0 && osz < 8 && ( a[p+lsz+osz] & 0x80 ) )
+        delta |= ~0ULL << ( 8 * osz );			// negative delta
+      if( osz > 0 )					// not sparse
+        {
+        lcn += (long long)delta;
+        if( lcn >= 0 )
+          { const Ntfs_run r = { vcn, (unsigned long long)lcn, length };
+            runs.push_back( r ); }
+        }
+      vcn += length; p += 1 + lsz + osz;
+      }
+    if( type != 0 ) break;
+    }
+  return data_size;
+  }
+
+
+unsigned long fat_entry( const std::vector< uint8_t > & fat, const int bits,
+                         const unsigned long c )
+  {
+  if( bits == 12 )
+    { const unsigned v = le16( &fat[c+c/2] );
+      return ( c & 1 ) ? v >> 4 : v & 0xFFF; }
+  if( bits == 16 ) return le16( &fat[2*c] );
+  return le32( &fat[4*c] ) & 0x0FFFFFFF;
+  }
+
+
+bool ext_has_super( const unsigned long g, const bool sparse_super )
+  {
+  if( !sparse_super || g <= 1 ) return true;
+  for( unsigned long base = 3; base <= 7; base += 2 )	// powers of 3, 5, 7
+    {
+    unsigned long k = g;
+    while( k % base == 0 ) k /= base;
+    if( k == 1 ) return true;
+    }
+  return false;
+  }
+
+
+bool fat_boot_sector( const uint8_t * const p )
+  {
+  const unsigned bps = le16( p + 11 ), spc = p[13];
+  return ( ( p[0] == 0xEB || p[0] == 0xE9 ) && bps >= 512 && bps <= 4096 &&
+           ( bps & ( bps - 1 ) ) == 0 && spc > 0 && ( spc & ( spc - 1 ) ) == 0 &&
+           le16( p + 14 ) > 0 && p[16] >= 1 && p[16] <= 4 &&
+           ( le16( p + 22 ) || le32( p + 36 ) ) &&
+           ( le16( p + 19 ) || le32( p + 32 ) ) );
+  }
+
+
+// Adds the subdirectories found in a block of FAT directory entries.
+// Returns false if the end of the directory has been found.
+bool parse_fat_dir( const std::vector< uint8_t > & buf, const int bits,
+                    std::vector< unsigned long > & dirs )
+  {
+  for( unsigned long off = 0; off + 32 <= buf.size(); off += 32 )
+    {
+    const uint8_t * const e = &buf[off];
+    if( e[0] == 0 ) return false;
+    if( e[0] == 0xE5 || e[0] == '.' ) continue;	// deleted, '.', or '..'
+    const int attr = e[11];
+    if( ( attr & 0x3F ) == 0x0F || ( attr & 0x18 ) != 0x10 ) continue;
+    dirs.push_back( ( ( bits == 32 ) ? (unsigned long)le16( e + 20 ) << 16 : 0 ) |
+                    le16( e + 26 ) );
+    }
+  return true;
+  }
+
+
+// Finds the metadata and the allocated areas of the filesystems in the
+// data already rescued.
+class Fs_scanner
+  {
+  const Mapbook & mb;
+  const int fd;				// outfile opened for reading
+  Block vol;				// volume being scanned
+
+  long long at( const unsigned long long n, const long long unit ) const
+    {
+    if( n > (unsigned long long)( vol.size() / unit ) ) return -1;
+    return vol.pos() + (long long)n * unit;
+    }
+  void add( std::vector< Block > & v, const long long pos, long long size );
+  void meta( const long long pos, const long long size )
+    { add( metadata, pos, size ); }
+  void data( const long long pos, const long long size )
+    { add( allocated, pos, size ); }
+  bool read( const long long pos, const long long size,
+             std::vector< uint8_t > & buf ) const;
+  bool read_meta( const long long pos, const long long size,
+                  std::vector< uint8_t > & buf )
+    { meta( pos, size ); return read( pos, size, buf ); }
+  void add_bitmap_runs( const uint8_t * const bits,
+                        const unsigned long long n, const long long pos,
+                        const long long unit );
+  void found( const char * const name )
+    { if( names.size() ) names += ", "; names += name; }
+
+  void scan_volume( const Block & v, const bool top );
+  void scan_partitions( const std::vector< uint8_t > & mbr );
+  void scan_ebr( const long long ext_start, std::vector< Block > & parts );
+  void scan_gpt( std::vector< Block > & parts );
+  void scan_ext( const std::vector< uint8_t > & sbuf );
+  void map_ext_inode( const uint8_t * const ino, const long long bs );
+  void map_ext_extents( const uint8_t * const node, const long long size,
+                        const long long bs, const int level );
+  void map_ext_blocks( const unsigned long blk, const int level,
+                       const long long bs );
+  void scan_fat( const std::vector< uint8_t > & bbuf );
+  void scan_ntfs( const std::vector< uint8_t > & bbuf );
+  bool walk_xfs_btree( const long long agpos, const long long bs,
+                       const unsigned long aglen, const unsigned long agbno,
+                       const int hdr, const int reclen, const int keylen,
+                       std::vector< uint8_t > & recs, const int level );
+  void scan_xfs( const std::vector< uint8_t > & sbuf );
+
+public:
+  std::vector< Block > metadata;	// in order, joined
+  std::vector< Block > allocated;	// in order, joined
+  std::string names;			// types of the filesystems found
+
+  Fs_scanner( const Mapbook & m, const int f )
+    : mb( m ), fd( f ), vol( 0, 0 ) {}
+
+  void scan()
+    {
+    metadata.clear(); allocated.clear(); names.clear();
+    scan_volume( Block( 0, LLONG_MAX ), true );
+    normalize( metadata ); normalize( allocated );
+    }
+  };
+
+
+void Fs_scanner::add( std::vector< Block > & v, const long long pos,
+                      long long size )
+  {
+  if( pos < 0 || size <= 0 ) return;
+  if( size > LLONG_MAX - pos ) size = LLONG_MAX - pos;
+  Block b( pos, size );
+  b.crop( vol );
+  if( b.size() > 0 ) v.push_back( b );
+  }
+
+
+// Reads an area of the input file from the output file.
+// Returns false if any part of the area has not been rescued yet.
+bool Fs_scanner::read( const long long pos, const long long size,
+                       std::vector< uint8_t > & buf ) const
+  {
+  if( pos < vol.pos() || size <= 0 || size > INT_MAX ||
+      pos > vol.end() - size ) return false;
+  for( long long p = pos; p < pos + size; )
+    {
+    const long i = mb.find_index( p );
+    if( i < 0 || mb.sblock( i ).status() != Sblock::finished ) return false;
+    p = mb.sblock( i ).end();
+    }
+  buf.resize( size );
+  return ( preadblock( fd, &buf[0], size, pos + mb.offset() ) == size );
+  }
+
+
+// Adds as allocated the runs of set bits in a bitmap of 'n' bits, where
+// bit 0 corresponds to the area of size 'unit' at 'pos'.
+void Fs_scanner::add_bitmap_runs( const uint8_t * const bits,
+                                  const unsigned long long n,
+                                  const long long pos, const long long unit )
+  {
+  if( pos < 0 ) return;
+  unsigned long long start = 0;
+  bool in = false;
+  for( unsigned long long i = 0; i < n; ++i )
+    {
+    if( ( i & 7 ) == 0 && i + 8 <= n && bits[i>>3] == ( in ? 0xFF : 0 ) )
+      { i += 7; continue; }				// whole byte in run
+    const bool set = bits[i>>3] & ( 1 << ( i & 7 ) );
+    if( set == in ) continue;
+    if( set ) start = i;
+    else data( pos + start * unit, ( i - start ) * unit );
+    in = set;
+    }
+  if( in ) data( pos + start * unit, ( n - start ) * unit );
+  }
+
+
+void Fs_scanner::scan_volume( const Block & v, const bool top )
+  {
+  vol = v;
+  meta( vol.pos(), probe_size );
+  std::vector< uint8_t > buf;
+  if( read( vol.pos() + 1024, 1024, buf ) && le16( &buf[56] ) == 0xEF53 )
+    { scan_ext( buf ); return; }
+  if( !read( vol.pos(), 512, buf ) ) return;
+  const uint8_t * const p = &buf[0];
+  if( std::memcmp( p, "XFSB", 4 ) == 0 ) scan_xfs( buf );
+  else if( std::memcmp( p + 3, "NTFS    ", 8 ) == 0 ) scan_ntfs( buf );
+  else if( p[510] == 0x55 && p[511] == 0xAA )
+    {
+    if( fat_boot_sector( p ) ) scan_fat( buf );
+    else if( top ) scan_partitions( buf );
+    }
+  }
+
+
+void Fs_scanner::scan_partitions( const std::vector< uint8_t > & mbr )
+  {
+  std::vector< Block > parts;
+  for( int i = 0; i < 4; ++i )
+    {
+    const uint8_t * const e = &mbr[446+16*i];
+    const int type = e[4];
+    const long long start = le32( e + 8 ), count = le32( e + 12 );
+    if( type == 0 || count == 0 ) continue;
+    if( type == 0xEE ) { parts.clear(); scan_gpt( parts ); break; }
+    if( type == 0x05 || type == 0x0F || type == 0x85 ) scan_ebr( start, parts );
+    else parts.push_back( Block( start * 512, count * 512 ) );
+    }
+  for( unsigned long i = 0; i < parts.size(); ++i )
+    scan_volume( parts[i], false );
+  }
+
+
+// Follows the chain of extended boot records of an extended partition.
+void Fs_scanner::scan_ebr( const long long ext_start,
+                           std::vector< Block > & parts )
+  {
+  std::vector< uint8_t > buf;
+  long long next = 0;
+  for( int i = 0; i < 128; ++i )
+    {
+    const long long pos = ( ext_start + next ) * 512;
+    if( !read_meta( pos, 512, buf ) || buf[510] != 0x55 || buf[511] != 0xAA )
+      return;
+    const uint8_t * const e = &buf[446];
+    if( e[4] != 0 && le32( e + 12 ) != 0 )
+      parts.push_back( Block( pos + le32( e + 8 ) * 512LL,
+                              le32( e + 12 ) * 512LL ) );
+    next = le32( e + 24 );
+    if( e[20] == 0 || next == 0 ) return;
+    }
+  }
+
+
+void Fs_scanner::scan_gpt( std::vector< Block > & parts )
+  {
+  std::vector< uint8_t > hbuf, tbuf;
+  for( int ss = 512; ss <= 4096; ss *= 8 )		// sector size
+    {
+    if( !read_meta( ss, 512, hbuf ) ||
+        std::memcmp( &hbuf[0], "EFI PART", 8 ) != 0 ) continue;
+    const unsigned long long lba = le64( &hbuf[72] );
+    const unsigned long n = le32( &hbuf[80] ), esize = le32( &hbuf[84] );
+    if( esize < 128 || esize > 4096 || n > 65536 || n * esize > 1 << 20 ||
+        lba == 0 || lba > ( 1ULL << 40 ) ||
+        !read_meta( lba * ss, n * esize, tbuf ) ) return;
+    for( unsigned long i = 0; i < n; ++i )
+      {
+      const uint8_t * const e = &tbuf[i*esize];
+      bool used = false;
+      for( int j = 0; j < 16; ++j ) if( e[j] ) { used = true; break; }
+      const unsigned long long first = le64( e + 32 ), last = le64( e + 40 );
+      if( used && first <= last && last < ( 1ULL << 40 ) )
+        parts.push_back( Block( first * ss, ( last - first + 1 ) * ss ) );
+      }
+    return;
+    }
+  }
+
+
+void Fs_scanner::scan_ext( const std::vector< uint8_t > & sbuf )
+  {
+  const uint8_t * const sb = &sbuf[0];
+  const unsigned long log_bs = le32( sb + 24 );
+  if( log_bs > 6 ) return;
+  const long long bs = 1024LL << log_bs;
+  const unsigned long compat = le32( sb + 92 ), incompat = le32( sb + 96 );
+  const unsigned long ro_compat = le32( sb + 100 );
+  const bool is64 = incompat & 0x80;
+  const unsigned long long blocks = le32( sb + 4 ) |
+    ( is64 ? (unsigned long long)le32( sb + 0x150 ) << 32 : 0 );
+  const unsigned long first_data_block = le32( sb + 20 );
+  const unsigned long bpg = le32( sb + 32 ), ipg = le32( sb + 40 );
+  const unsigned inode_size = le32( sb + 76 ) ? le16( sb + 88 ) : 128;
+  const unsigned desc_size = ( is64 && le16( sb + 0xFE ) > 32 ) ?
+                             le16( sb + 0xFE ) : 32;
+  if( bpg == 0 || (long long)bpg > 8 * bs || ipg == 0 || inode_size < 128 ||
+      inode_size > bs || desc_size > bs || blocks <= first_data_block )
+    return;
+  found( ( incompat & 0x2C0 ) ? "ext4" : ( compat & 4 ) ? "ext3" : "ext2" );
+  const unsigned long groups = ( blocks - first_data_block + bpg - 1 ) / bpg;
+  const unsigned long first_meta_bg =
+    ( incompat & 0x10 ) ? le32( sb + 0x104 ) : ULONG_MAX;
+  const bool csum = ro_compat & 0x410;		// gdt_csum or metadata_csum
+  const bool sparse_super = ro_compat & 1;
+  const unsigned long dpb = bs / desc_size;
+  std::vector< unsigned long long > bitmaps( groups, 0 );
+  unsigned long long itable0 = 0;
+  std::vector< uint8_t > buf;
+
+  for( unsigned long d = 0; d * dpb < groups; ++d )	// descriptor blocks
+    {
+    unsigned long long blk = first_data_block + 1 + d;
+    if( d >= first_meta_bg )		// first group of meta_bg, + superblock
+      {
+      const unsigned long g = d * dpb;
+      blk = first_data_block + (unsigned long long)g * bpg +
+            ext_has_super( g, sparse_super );
+      }
+    if( !read_meta( at( blk, bs ), bs, buf ) ) continue;
+    for( unsigned long i = 0; i < dpb && d * dpb + i < groups; ++i )
+      {
+      const unsigned long g = d * dpb + i;
+      const uint8_t * const p = &buf[i*desc_size];
+      const bool big = ( desc_size >= 64 );
+      const unsigned long long bb = le32( p ) |
+        ( big ? (unsigned long long)le32( p + 0x20 ) << 32 : 0 );
+      const unsigned long long ib = le32( p + 4 ) |
+        ( big ? (unsigned long long)le32( p + 0x24 ) << 32 : 0 );
+      const unsigned long long it = le32( p + 8 ) |
+        ( big ? (unsigned long long)le32( p + 0x28 ) << 32 : 0 );
+      const unsigned flags = le16( p + 18 );
+      unsigned long used = ipg;
+      if( csum )
+        {
+        const unsigned long unused = le16( p + 0x1C ) |
+          ( big ? (unsigned long)le16( p + 0x32 ) << 16 : 0 );
+        used = ( unused < ipg ) ? ipg - unused : 0;
+        }
+      if( flags & 1 ) used = 0;				// inode_uninit
+      meta( at( bb, bs ), bs );
+      meta( at( ib, bs ), bs );
+      if( used ) meta( at( it, bs ), ( used * inode_size + bs - 1 ) / bs * bs );
+      if( g == 0 ) itable0 = it;
+      if( !( flags & 2 ) ) bitmaps[g] = bb;		// not block_uninit
+      }
+    }
+
+  const long long itpos = at( itable0, bs );
+  if( itable0 && itpos >= 0 )		// root directory and journal
+    {
+    const unsigned long journal_ino = ( compat & 4 ) ? le32( sb + 0xE0 ) : 0;
+    if( read( itpos + inode_size, inode_size, buf ) )
+      map_ext_inode( &buf[0], bs );
+    if( journal_ino > 0 && journal_ino <= ipg &&
+        read( itpos + ( journal_ino - 1 ) * inode_size, inode_size, buf ) )
+      map_ext_inode( &buf[0], bs );
+    }
+
+  for( unsigned long g = 0; g < groups; ++g )		// allocated blocks
+    {
+    if( !bitmaps[g] || !read( at( bitmaps[g], bs ), bs, buf ) ) continue;
+    const unsigned long long first = first_data_block + (unsigned long long)g * bpg;
+    add_bitmap_runs( &buf[0], std::min( (unsigned long long)bpg, blocks - first ),
+                     at( first, bs ), bs );
+    }
+  }
+
+
+// Adds as metadata the blocks of an ext inode, including the blocks of
+// its extent tree or its indirect blocks.
+void Fs_scanner::map_ext_inode( const uint8_t * const ino, const long long bs )
+  {
+  const unsigned long flags = le32( ino + 32 );
+  if( flags & 0x10000000 ) return;			// inline data
+  if( flags & 0x80000 ) { map_ext_extents( ino + 40, 60, bs, 0 ); return; }
+  for( int i = 0; i < 15; ++i )
+    {
+    const unsigned long blk = le32( ino + 40 + 4 * i );
+    if( blk ) map_ext_blocks( blk, ( i < 12 ) ? 0 : i - 11, bs );
+    }
+  }
+
+
+void Fs_scanner::map_ext_extents( const uint8_t * const node,
+                                  const long long size, const long long bs,
+                                  const int level )
+  {
+  if( size < 12 || le16( node ) != 0xF30A || level > 5 ) return;
+  const unsigned entries = le16( node + 2 ), depth = le16( node + 6 );
+  std::vector< uint8_t > buf;
+  for( unsigned i = 0; i < entries && 12 * ( i + 2 ) <= size; ++i )
+    {
+    const uint8_t * const e = node + 12 * ( i + 1 );
+    if( depth == 0 )
+      {
+      unsigned len = le16( e + 4 );
+      if( len > 32768 ) len -= 32768;			// uninitialized
+      meta( at( ( (unsigned long long)le16( e + 6 ) << 32 ) | le32( e + 8 ), bs ),
+            len * bs );
+      }
+    else if( read_meta( at( ( (unsigned long long)le16( e + 8 ) << 32 ) |
+                            le32( e + 4 ), bs ), bs, buf ) )
+      map_ext_extents( &buf[0], bs, bs, level + 1 );
+    }
+  }
+
+
+void Fs_scanner::map_ext_blocks( const unsigned long blk, const int level,
+                                 const long long bs )
+  {
+  const long long pos = at( blk, bs );
+  meta( pos, bs );
+  std::vector< uint8_t > buf;
+  if( level <= 0 || !read( pos, bs, buf ) ) return;
+  for( long i = 0; i + 4 <= bs; i += 4 )
+    {
+    const unsigned long b = le32( &buf[i] );
+    if( b ) map_ext_blocks( b, level - 1, bs );
+    }
+  }
+
+
+void Fs_scanner::scan_fat( const std::vector< uint8_t > & bbuf )
+  {
+  const uint8_t * const b = &bbuf[0];
+  const long long bps = le16( b + 11 );
+  const unsigned long spc = b[13], rsv = le16( b + 14 ), nf = b[16];
+  const unsigned long root_ent = le16( b + 17 );
+  const unsigned long fatsz = le16( b + 22 ) ? le16( b + 22 ) : le32( b + 36 );
+  const unsigned long total = le16( b + 19 ) ? le16( b + 19 ) : le32( b + 32 );
+  const unsigned long root_secs = ( root_ent * 32 + bps - 1 ) / bps;
+  const unsigned long long data_sec = rsv + (unsigned long long)nf * fatsz +
+                                      root_secs;
+  if( total <= data_sec ) return;
+  const unsigned long clusters = ( total - data_sec ) / spc;
+  const int bits = ( clusters < 4085 ) ? 12 : ( clusters < 65525 ) ? 16 : 32;
+  const long long fat_bytes = fatsz * bps;
+  const long long needed = ( ( clusters + 2ULL ) * bits + 7 ) / 8;
+  if( needed > fat_bytes ) return;
+  found( ( bits == 12 ) ? "FAT12" : ( bits == 16 ) ? "FAT16" : "FAT32" );
+  const long long csize = bps * spc;
+  const long long root_pos = at( rsv + nf * fatsz, bps );
+  meta( vol.pos(), rsv * bps );
+  for( unsigned long f = 0; f < nf; ++f )
+    meta( at( rsv + f * fatsz, bps ), fat_bytes );
+  if( root_secs ) meta( root_pos, root_secs * bps );
+  std::vector< uint8_t > fat, buf;
+  bool have_fat = false;			// use a backup FAT if needed
+  for( unsigned long f = 0; f < nf && !have_fat; ++f )
+    have_fat = read( at( rsv + f * fatsz, bps ), needed, fat );
+  if( !have_fat ) return;
+  fat.resize( needed + 1, 0 );			// for the last FAT12 entry
+
+  std::vector< unsigned long > dirs;		// directories to scan
+  std::vector< bool > seen( clusters + 2, false );
+  if( bits == 32 ) dirs.push_back( le32( b + 44 ) );
+  else if( read( root_pos, root_secs * bps, buf ) )
+    parse_fat_dir( buf, bits, dirs );
+  while( !dirs.empty() )
+    {
+    unsigned long c = dirs.back();
+    dirs.pop_back();
+    bool end = false;
+    while( c >= 2 && c < clusters + 2 && !seen[c] )
+      {
+      seen[c] = true;
+      const long long pos = at( data_sec + ( c - 2ULL ) * spc, bps );
+      if( read_meta( pos, csize, buf ) && !end )
+        end = !parse_fat_dir( buf, bits, dirs );
+      c = fat_entry( fat, bits, c );
+      }
+    }
+
+  const unsigned long bad = ( bits == 12 ) ? 0xFF7 :
+                            ( bits == 16 ) ? 0xFFF7 : 0x0FFFFFF7;
+  unsigned long start = 0;
+  bool in = false;
+  for( unsigned long c = 2; c <= clusters + 2; ++c )	// allocated clusters
+    {
+    bool used = false;
+    if( c < clusters + 2 )
+      { const unsigned long v = fat_entry( fat, bits, c );
+        used = ( v != 0 && v != bad ); }
+    if( used == in ) continue;
+    if( used ) start = c;
+    else data( at( data_sec + ( start - 2ULL ) * spc, bps ),
+               ( c - start ) * csize );
+    in = used;
+    }
+  }
+
+
+void Fs_scanner::scan_ntfs( const std::vector< uint8_t > & bbuf )
+  {
+  const uint8_t * const b = &bbuf[0];
+  const long long bps = le16( b + 11 );
+  unsigned long spc = b[13];
+  if( spc > 0x80 ) spc = ( spc >= 0xE0 ) ? 1UL << ( 256 - spc ) : 0;
+  if( bps < 256 || bps > 4096 || spc == 0 ) return;
+  const long long cs = bps * spc;
+  const int cpr = (signed char)b[64];
+  const long long rec_size = ( cpr > 0 ) ? cpr * cs :
+                             ( cpr > -31 ) ? 1LL << -cpr : 0;
+  if( rec_size < 1024 || rec_size > 65536 ) return;
+  const unsigned long long total_clusters = le64( b + 40 ) / spc;
+  found( "NTFS" );
+  meta( vol.pos(), 8192 );				// $Boot
+  meta( at( le64( b + 56 ), cs ), 4 * rec_size );	// $MFTMirr
+  std::vector< uint8_t > rec, buf;
+  std::vector< Ntfs_run > mft_runs, runs, bitmap_runs;
+  if( !read_meta( at( le64( b + 48 ), cs ), rec_size, rec ) ||
+      !ntfs_fixup( rec ) ) return;
+  const long long mft_size = ntfs_attr_runs( rec, 0x80, mft_runs );
+  for( unsigned long i = 0; i < mft_runs.size(); ++i )
+    meta( at( mft_runs[i].lcn, cs ), mft_runs[i].length * cs );
+
+  // Read the MFT in pieces of up to 256 records. Add as metadata the
+  // streams of the system files and the indexes of the directories.
+  const long long piece_size = 256 * rec_size;
+  long long n = 0;				// number of current record
+  for( unsigned long i = 0; i < mft_runs.size(); ++i )
+    {
+    const Ntfs_run & r = mft_runs[i];
+    if( (long long)( r.vcn * cs ) != n * rec_size ) break;	// hole
+    const long long run_pos = at( r.lcn, cs );
+    const long long run_size = r.length * cs;
+    if( run_pos < 0 ) break;
+    for( long long off = 0; off < run_size && n * rec_size < mft_size; )
+      {
+      const long long size =
+        std::min( piece_size, std::min( run_size - off, mft_size - n * rec_size ) );
+      const bool whole = read( run_pos + off, size, buf );
+      for( long long j = 0; j + rec_size <= size; j += rec_size, ++n )
+        {
+        if( whole ) rec.assign( buf.begin() + j, buf.begin() + j + rec_size );
+        else if( !read( run_pos + off + j, rec_size, rec ) ) continue;
+        if( !ntfs_fixup( rec ) ) continue;
+        const unsigned flags = le16( &rec[22] );
+        if( !( flags & 1 ) ) continue;				// not in use
+        if( n < 16 && n != 7 && n != 8 )	// not $Boot or $BadClus
+          {
+          ntfs_attr_runs( rec, 0, runs );
+          if( n == 6 ) ntfs_attr_runs( rec, 0x80, bitmap_runs );
+          }
+        else if( flags & 2 ) ntfs_attr_runs( rec, 0xA0, runs );
+        else continue;
+        for( unsigned long k = 0; k < runs.size(); ++k )
+          meta( at( runs[k].lcn, cs ), runs[k].length * cs );
+        }
+      off += size - size % rec_size;
+      if( size < rec_size ) break;
+      }
+    }
+
+  for( unsigned long i = 0; i < bitmap_runs.size(); ++i )	// $Bitmap
+    {
+    const Ntfs_run & r = bitmap_runs[i];
+    const long long run_pos = at( r.lcn, cs );
+    for( unsigned long long off = 0; off < r.length * cs; off += 1 << 20 )
+      {
+      const unsigned long long first = ( r.vcn * cs + off ) * 8;	// bit
+      if( first >= total_clusters ) break;
+      const unsigned long long bits =
+        std::min( 8ULL << 20, total_clusters - first );
+      if( run_pos >= 0 &&
+          read( run_pos + off, std::min( 1ULL << 20, r.length * cs - off ), buf ) )
+        add_bitmap_runs( &buf[0], std::min( bits, buf.size() * 8ULL ),
+                         at( first, cs ), cs );
+      }
+    }
+  }
+
+
+// Appends to 'recs' the records of a short-format XFS btree.
+// Returns false if any block of the btree can't be read.
+bool Fs_scanner::walk_xfs_btree( const long long agpos, const long long bs,
+                                 const unsigned long aglen,
+                                 const unsigned long agbno, const int hdr,
+                                 const int reclen, const int keylen,
+                                 std::vector< uint8_t > & recs,
+                                 const int level )
+  {
+  std::vector< uint8_t > buf;
+  if( agbno >= aglen || level > 8 ||
+      !read_meta( agpos + agbno * bs, bs, buf ) ) return false;
+  const unsigned long n = be16( &buf[6] );
+  if( be16( &buf[4] ) == 0 )					// leaf
+    {
+    if( hdr + n * reclen > (unsigned long long)bs ) return false;
+    recs.insert( recs.end(), buf.begin() + hdr, buf.begin() + hdr + n * reclen );
+    return true;
+    }
+  const unsigned long maxrecs = ( bs - hdr ) / ( keylen + 4 );
+  if( n > maxrecs ) return false;
+  bool ok = true;
+  for( unsigned long i = 0; i < n; ++i )
+    if( !walk_xfs_btree( agpos, bs, aglen,
+                         be32( &buf[hdr+maxrecs*keylen+4*i] ), hdr, reclen,
+                         keylen, recs, level + 1 ) ) ok = false;
+  return ok;
+  }
+
+
+void Fs_scanner::scan_xfs( const std::vector< uint8_t > & sbuf )
+  {
+  const uint8_t * const sb = &sbuf[0];
+  const long long bs = be32( sb + 4 );
+  const unsigned long agblocks = be32( sb + 84 ), agcount = be32( sb + 88 );
+  const unsigned sectsize = be16( sb + 102 ), inodesize = be16( sb + 104 );
+  const int inopblog = sb[123], agblklog = sb[124];
+  if( bs < 512 || bs > 65536 || ( bs & ( bs - 1 ) ) || agblocks == 0 ||
+      agcount == 0 || sectsize < 512 || sectsize > 32768 || inodesize < 256 ||
+      inodesize > 2048 || inopblog > 8 || agblklog > 31 ) return;
+  found( "XFS" );
+  const int hdr = ( ( be16( sb + 100 ) & 0xF ) == 5 ) ? 56 : 16;	// v5 = crc
+  const unsigned long long logstart = be64( sb + 48 );
+  if( logstart )					// internal log
+    meta( at( ( logstart >> agblklog ) * agblocks +
+              ( logstart & ( ( 1ULL << agblklog ) - 1 ) ), bs ),
+          be32( sb + 96 ) * bs );
+  std::vector< uint8_t > buf, recs;
+  for( unsigned long ag = 0; ag < agcount; ++ag )
+    {
+    const long long agpos = at( (unsigned long long)ag * agblocks, bs );
+    if( !read_meta( agpos, 4 * sectsize, buf ) ) continue;	// sb, agf, agi, agfl
+    const uint8_t * const agf = &buf[sectsize];
+    const uint8_t * const agi = &buf[2*sectsize];
+    if( std::memcmp( agf, "XAGF", 4 ) != 0 ||
+        std::memcmp( agi, "XAGI", 4 ) != 0 ) continue;
+    const unsigned long aglen = std::min( be32( agf + 12 ), agblocks );
+    recs.clear();				// inode btree; chunks of 64 inodes
+    walk_xfs_btree( agpos, bs, aglen, be32( agi + 20 ), hdr, 16, 4, recs, 0 );
+    for( unsigned long i = 0; i + 16 <= recs.size(); i += 16 )
+      meta( agpos + ( be32( &recs[i] ) >> inopblog ) * bs, 64LL * inodesize );
+    recs.clear();			// free space btree sorted by block number
+    if( !walk_xfs_btree( agpos, bs, aglen, be32( agf + 16 ), hdr, 8, 8,
+                         recs, 0 ) ) continue;
+    unsigned long long next = 0;		// the rest of the AG is allocated
+    for( unsigned long i = 0; i + 8 <= recs.size(); i += 8 )
+      {
+      const unsigned long long start = be32( &recs[i] );
+      if( start > next ) data( agpos + next * bs, ( start - next ) * bs );
+      next = std::max( next, start + be32( &recs[i+4] ) );
+      }
+    if( next < aglen ) data( agpos + next * bs, ( aglen - next ) * bs );
+    }
+  }
+
+} // end namespace
+
+
+// Logs each area of 'v' in the events log, if any.
+//
+void Rescuebook::log_areas( const char * const name,
+                            const std::vector< Block > & v )
+  {
+  char buf[80];
+  for( unsigned long i = 0; i < v.size(); ++i )
+    {
+    snprintf( buf, sizeof buf, "%s 0x%08llX  0x%08llX", name, v[i].pos(),
+              v[i].size() );
+    event_logger.print_msg( t1 - t0, percent_rescued(), buf );
+    }
+  }
+
+
+// Return values: 1 I/O error, 0 OK, -1 interrupted, -2 mapfile error.
+// Runs the rescue phases in the parts of 'full_domain' included in
+// 'areas', or in the whole 'full_domain' if 'areas' is empty.
+//
+int Rescuebook::rescue_areas( Domain & full_domain,
+                              const std::vector< Block > & areas )
+  {
+  Domain d( full_domain );
+  if( areas.size() ) d.crop( areas );
+  int retval = 0;
+  if( !d.empty() )
+    {
+    if( !change_domain( d ) ) retval = 1;
+    split_by_domain_borders( d ); initialize_sizes();
+    current_status( copying ); current_pass( 1 ); current_pos( d.pos() );
+    if( retval == 0 ) retval = run_phases();
+    if( retval == 0 && errors_or_timeout() ) retval = 1;
+    if( domain().end() < d.end() && !domain().empty() )	// EOF found
+      full_domain.crop_by_file_size( domain().end() );
+    if( !change_domain( full_domain ) && retval == 0 ) retval = 1;
+    }
+  initialize_sizes();
+  return retval;
+  }
+
+
+// Return values: 1 I/O error, 0 OK, -1 interrupted, -2 mapfile error.
+// Rescues the filesystem metadata in rounds until no new metadata are
+// found, then the areas allocated to files, then the rest of the domain.
+//
+int Rescuebook::metadata_rescue()
+  {
+  Domain full_domain( domain() );
+  Fs_scanner scanner( *this, mdes_ );
+  std::vector< Block > tried;		// metadata areas already rescued
+  int retval = 0;
+  while( true )
+    {
+    scanner.scan();
+    const std::vector< Block > areas( subtract( scanner.metadata, tried ) );
+    if( areas.empty() ) break;
+    tried.insert( tried.end(), areas.begin(), areas.end() );
+    normalize( tried );
+    retval = rescue_areas( full_domain, areas );
+    if( retval ) break;
+    }
+  fs_names = scanner.names;
+  fs_metadata_size = total_size( scanner.metadata );
+  fs_allocated_size = total_size( scanner.allocated );
+  log_areas( "Metadata area", scanner.metadata );
+  log_areas( "Allocated area", scanner.allocated );
+  if( retval == 0 && scanner.allocated.size() )
+    retval = rescue_areas( full_domain, scanner.allocated );
+  if( retval == 0 ) retval = rescue_areas( full_domain, std::vector< Block >() );
+  return retval;
+  }
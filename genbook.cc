@@ -26,6 +26,7 @@
 #include <string>
 #include <vector>
 #include <stdint.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include "block.h"
@@ -166,10 +167,11 @@ int Genbook::do_generate( const int odes )
   finished_size = 0; gensize = 0;
   odes_ = odes;
 
+  Domain_cursor dc( domain() );
   for( long i = 0; i < sblocks(); ++i )
     {
     const Sblock & sb = sblock( i );
-    if( !domain().includes( sb ) )
+    if( !dc.includes( sb ) )
       { if( domain() < sb ) break; else continue; }
     if( sb.status() == Sblock::finished ) finished_size += sb.size();
     if( sb.status() != Sblock::non_tried ) gensize += sb.size();
@@ -0,0 +1,159 @@
+/*  GNU ddrescue - Data recovery tool
+    Copyright (C) 2004-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "block.h"
+#include "heatmap.h"
+
+
+namespace {
+
+void show_heatmap_error( const std::string & filename, const int linenum )
+  {
+  char buf[80];
+  snprintf( buf, sizeof buf, "error in heatmap '%s', line %d.",
+            filename.c_str(), linenum );
+  show_error( buf );
+  }
+
+} // end namespace
+
+
+// Returns false if the heatmap exists but can't be read or is corrupt,
+// after showing an error message. Zones of previous runs are kept, so that
+// the statistics of all the runs add up.
+//
+bool Heatmap::read_heatmap()
+  {
+  FILE * const f = std::fopen( filename_.c_str(), "r" );
+  if( !f )
+    {
+    if( errno == ENOENT ) return true;
+    show_error( "Can't open heatmap", errno ); return false;
+    }
+  char line[256];
+  int linenum = 0;
+  bool error = false;
+  while( !error && std::fgets( line, sizeof line, f ) )
+    {
+    ++linenum;
+    if( line[0] == '#' )
+      {
+      long long zs; long nz;
+      if( std::strncmp( line, "# Zone size:", 12 ) != 0 ) continue;
+      if( zone_size_ > 0 ||		// duplicate header
+          std::sscanf( line, "# Zone size: %lli  Zones: %li", &zs, &nz ) != 2 ||
+          zs <= 0 || nz <= 0 || nz > max_zones ) error = true;
+      else { zone_size_ = zs; zones.assign( nz, Zone() ); }
+      continue;
+      }
+    long long pos;
+    Zone zone;
+    if( zone_size_ <= 0 ||		// data before the zone header
+        std::sscanf( line, "%lli %lli %lli %lli %lu %lu %lu", &pos,
+                     &zone.bytes, &zone.error_bytes, &zone.usecs, &zone.reads,
+                     &zone.errors, &zone.slow_reads ) != 7 ||
+        pos < 0 || pos % zone_size_ != 0 || pos / zone_size_ >= zone_count() )
+      error = true;
+    else zones[pos/zone_size_] = zone;
+    }
+  if( error ) show_heatmap_error( filename_, linenum );
+  else if( std::ferror( f ) )
+    { show_error( "Can't read heatmap", errno ); error = true; }
+  std::fclose( f );
+  if( error ) { zone_size_ = 0; zones.clear(); }
+  return !error;
+  }
+
+
+// Writes the heatmap to a temporary file and then renames it, so that a
+// crash while writing can't leave a truncated heatmap behind.
+//
+bool Heatmap::write_heatmap() const
+  {
+  if( zones.empty() ) return true;
+  std::string tmpname;
+  struct stat st;
+  const bool exists = ( lstat( filename_.c_str(), &st ) == 0 );
+  if( !exists || S_ISREG( st.st_mode ) )
+    { tmpname = filename_ + ".tmp"; std::remove( tmpname.c_str() ); }
+  const char * const name = tmpname.size() ? tmpname.c_str() :
+                                             filename_.c_str();
+  FILE * const f = std::fopen( name, "w" );
+  bool error = !f;
+  if( f )
+    {
+    if( exists && tmpname.size() )
+      fchmod( fileno( f ), st.st_mode & ( S_IRWXU | S_IRWXG | S_IRWXO ) );
+    error = !write_file_header( f, "Heatmap" ) ||
+      std::fprintf( f, "# Zone size: 0x%08llX  Zones: %ld\n",
+                    zone_size_, zone_count() ) < 0 ||
+      std::fputs( "#      pos       bytes  error_bytes  usecs  reads"
+                  "  errors  slow_reads\n", f ) == EOF;
+    }
+  for( unsigned long z = 0; !error && z < zones.size(); ++z )
+    {
+    const Zone & zone = zones[z];
+    if( zone.reads == 0 ) continue;
+    if( std::fprintf( f, "0x%08llX  0x%08llX  0x%08llX  %lld  %lu  %lu  %lu\n",
+                      z * zone_size_, zone.bytes, zone.error_bytes,
+                      zone.usecs, zone.reads, zone.errors,
+                      zone.slow_reads ) < 0 ) error = true;
+    }
+  if( f )
+    {
+    if( !error && tmpname.size() )
+      error = ( std::fflush( f ) != 0 ||
+                ( fdatasync( fileno( f ) ) != 0 && errno != EINVAL ) );
+    if( std::fclose( f ) != 0 ) error = true;
+    }
+  if( tmpname.size() )
+    {
+    if( !error && std::rename( tmpname.c_str(), filename_.c_str() ) != 0 )
+      error = true;
+    if( error )
+      { const int saved_errno = errno;
+        std::remove( tmpname.c_str() ); errno = saved_errno; }
+    }
+  return !error;
+  }
+
+
+// Divides 'size' bytes in about 'nzones' zones of a multiple of 'hardbs'
+// bytes, unless the zones have already been read from the heatmap.
+//
+void Heatmap::set_zones( const long long size, const long nzones,
+                         const int hardbs )
+  {
+  if( zone_size_ > 0 ) return;
+  long long zs = size / nzones + ( size % nzones != 0 );
+  zs += ( hardbs - zs % hardbs ) % hardbs;
+  zone_size_ = std::max( zs, (long long)hardbs );
+  zones.assign( size / zone_size_ + ( size % zone_size_ != 0 ), Zone() );
+  }
@@ -0,0 +1,71 @@
+/*  GNU ddrescue - Data recovery tool
+    Copyright (C) 2004-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Per-zone read statistics of the input file (see '--heatmap').
+// Zone 'z' covers the input positions [z * zone_size, (z+1) * zone_size).
+// Each read is charged to the zone containing its first byte. The zones
+// are allocated once, so that recording a read never allocates memory.
+class Heatmap
+  {
+public:
+  enum { max_zones = 1 << 20 };
+
+  struct Zone
+    {
+    long long bytes;			// bytes read successfully
+    long long error_bytes;		// bytes not read because of errors
+    long long usecs;			// time spent reading
+    unsigned long reads, errors, slow_reads;
+    Zone() : bytes( 0 ), error_bytes( 0 ), usecs( 0 ),
+             reads( 0 ), errors( 0 ), slow_reads( 0 ) {}
+    // bytes per second, or -1 if unknown
+    long long rate() const
+      { return ( usecs > 0 ) ? (long long)( bytes * 1000000.0 / usecs ) :
+                               ( bytes > 0 ) ? LLONG_MAX : -1; }
+    };
+
+private:
+  const std::string filename_;
+  long long zone_size_;
+  std::vector< Zone > zones;
+
+public:
+  explicit Heatmap( const char * const mapname )
+    : filename_( std::string( mapname ) + ".heat" ), zone_size_( 0 ) {}
+
+  bool read_heatmap();
+  bool write_heatmap() const;
+  void set_zones( const long long size, const long nzones,
+                  const int hardbs );
+  void data_read( const long long pos, const int copied_size,
+                  const int error_size, const long long usecs,
+                  const bool slow )
+    {
+    const unsigned long z = pos / zone_size_;
+    if( z >= zones.size() ) return;
+    Zone & zone = zones[z];
+    zone.bytes += copied_size; zone.error_bytes += error_size;
+    zone.usecs += usecs; ++zone.reads;
+    if( error_size > 0 ) ++zone.errors;
+    if( slow ) ++zone.slow_reads;
+    }
+
+  const std::string & filename() const { return filename_; }
+  long long zone_size() const { return zone_size_; }
+  long zone_count() const { return zones.size(); }
+  const Zone & zone( const long z ) const { return zones[z]; }
+  };
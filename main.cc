@@ -35,6 +35,7 @@
 #include <vector>
 #include <fcntl.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
@@ -63,6 +64,19 @@ const char * invocation_name = program_name;		// default value
 
 enum Mode { m_none, m_command, m_fill, m_generate };
 const mode_t outmode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+std::string geometry_msg;	// result of probing the input device, if any
+
+struct Tee_file			// additional output file (see '--tee')
+  {
+  std::string name;
+  long long opos;		// -1 = same as outfile
+  long long offset;		// opos - ipos
+  bool sparse;
+  bool ignore_write_errors;
+
+  Tee_file()
+    : opos( -1 ), offset( 0 ), sparse( false ), ignore_write_errors( false ) {}
+  };
 
 
 void show_help( const int cluster, const int hardbs )
@@ -100,6 +114,7 @@ void show_help( const int cluster, const int hardbs )
                "  -K, --skip-size=[<i>][,<max>]  initial,maximum size to skip on read error\n"
                "  -L, --loose-domain             accept an incomplete domain mapfile\n"
                "  -m, --domain-mapfile=<file>    restrict domain to finished blocks in <file>\n"
+               "                                 (repeat to rescue by priority classes)\n"
                "  -M, --retrim                   mark all failed blocks as non-trimmed\n"
                "  -n, --no-scrape                skip the scraping phase\n"
                "  -N, --no-trim                  skip the trimming phase\n"
@@ -122,18 +137,33 @@ void show_help( const int cluster, const int hardbs )
                "  -y, --synchronous              use synchronous writes for output file\n"
                "  -Z, --max-read-rate=<bytes>    maximum read rate in bytes/s\n"
                "      --ask                      ask for confirmation before starting the copy\n"
-               "      --command-mode             execute commands from standard input\n"
+               "      --command-mode[=binary]    execute commands from standard input\n"
+               "      --converge                 copy from both ends at once, converging\n"
+               "      --cooperative=<file>[,<bytes>]  share chunks with other processes\n"
                "      --cpass=<n>[,<n>]          select what copying pass(es) to run\n"
+               "      --daemon=<socket>          serve commands on a Unix socket\n"
                "      --delay-slow=<interval>    initial delay before checking slow reads [30]\n"
+               "      --group-sync=[<bytes>][,i]  sync outfile every <bytes> or i seconds [16Mi,1]\n"
+               "      --hash-regions=<bytes>[,<n>]  hash rescued data per region using <n> threads\n"
+               "      --heatmap[=<n>]            record read statistics of <n> zones [1000]\n"
                "      --log-events=<file>        log significant events in <file>\n"
                "      --log-rates=<file>         log rates and error sizes in <file>\n"
                "      --log-reads=<file>         log all read operations in <file>\n"
                "      --mapfile-interval=[i][,i]   save/sync mapfile at given interval [auto]\n"
                "      --max-slow-reads=<n>         maximum number of slow reads allowed\n"
+               "      --metadata-first           rescue filesystem metadata and used data first\n"
+               "      --overlap                  trim and scrape in parallel with copying\n"
                "      --pause-on-error=<interval>  time to wait after each read error [0]\n"
                "      --pause-on-pass=<interval>   time to wait between passes [0]\n"
+               "      --planner[=<bytes>]        read first the areas of highest expected yield\n"
+               "      --read-timeout=<interval>  abandon reads that take longer than <interval>\n"
+               "      --reread-check=<file>[,<pct>]  reread good sectors, mark changed ones in <file>\n"
                "      --reset-slow               reset slow reads if rate rises above min\n"
                "      --same-file                allow infile and outfile to be the same file\n"
+               "      --skip-identical           don't rewrite data already present in outfile\n"
+               "      --skip-model=<model>       size to skip on errors: doubling, adaptive\n"
+               "      --status-interval=<interval>  time between updates of the status lines [1]\n"
+               "      --tee=<file>[,<opos>[,<flags>]]  also write rescued data to <file>\n"
                "\nNumbers may be in decimal, hexadecimal, or octal, and may be followed by a\n"
                "multiplier: s = sectors, k = 1000, Ki = 1024, M = 10^6, Mi = 2^20, etc...\n"
                "Time intervals have the format 1[.5][smhd] or 1/2[smhd].\n"
@@ -223,6 +253,44 @@ bool check_identical( const char * const iname, const char * const oname,
   }
 
 
+bool check_tee_files( const char * const iname, const char * const oname,
+                      const char * const mapname,
+                      const std::vector< Tee_file > & tee_files,
+                      const bool force )
+  {
+  for( unsigned i = 0; i < tee_files.size(); ++i )
+    {
+    const char * const tname = tee_files[i].name.c_str();
+    const char * msg = 0;
+    for( unsigned j = 0; j < i && !msg; ++j )
+      if( tee_files[j].name == tee_files[i].name )
+        msg = "The same tee file is given more than once.";
+    std::string mapname_bak;
+    if( mapname ) { mapname_bak = mapname; mapname_bak += ".bak"; }
+    if( !msg && check_identical( iname, tname, mapname, mapname_bak, false ) )
+      return false;
+    struct stat ost, tst;
+    if( !msg && ( std::strcmp( oname, tname ) == 0 ||
+        ( stat( oname, &ost ) == 0 && stat( tname, &tst ) == 0 &&
+          ost.st_ino == tst.st_ino && ost.st_dev == tst.st_dev ) ) )
+      msg = "Outfile and tee file are the same.";
+    if( msg ) { show_error( msg ); return false; }
+    if( ( !force || tee_files[i].sparse ) &&
+        stat( tname, &tst ) == 0 && !S_ISREG( tst.st_mode ) )
+      {
+      show_error( "Tee file exists and is not a regular file." );
+      if( !force )
+        show_error( "Use '--force' if you really want to overwrite it, but be\n"
+                    "          aware that all existing data in the tee file will be lost.",
+                    0, true );
+      else show_error( "Only regular files can be sparse.", 0, true );
+      return false;
+      }
+    }
+  return true;
+  }
+
+
 bool check_files( const char * const iname, const char * const oname,
                   const char * const mapname, const Rb_options & rb_opts,
                   const bool force, const bool generate,
@@ -436,19 +504,101 @@ long long adjusted_insize( const int ides, const Domain * const test_domain )
 
 
 int do_rescue( const long long offset, Domain & domain,
-               const Domain * const test_domain, const Mb_options & mb_opts,
+               const Domain * const test_domain,
+               const Domain * const hang_domain, const Mb_options & mb_opts,
                const Rb_options & rb_opts, const char * const iname,
                const char * const oname, const char * const mapname,
                const int cluster, const int hardbs, const int o_direct_out,
                const int o_trunc, const bool ask, const bool command_mode,
+               const bool binary_commands,
                const bool preallocate, const bool synchronous,
-               const bool verify_input_size )
+               const bool verify_input_size,
+               const std::vector< Tee_file > & tee_files,
+               const long long hash_region_size, const int hash_threads,
+               const char * const sidemap_name, const int reread_budget,
+               const char * const coop_name, const long long coop_chunk_size,
+               const char * const daemon_name,
+               const std::vector< Domain > & priority_domains,
+               const long heatmap_zones )
   {
   if( rb_opts.same_file && o_trunc )
     {
     show_error( "Option '--same-file' is incompatible with '--truncate'.", 0, true );
     return 1;
     }
+  if( hash_region_size > 0 && !mapname )
+    {
+    show_error( "Mapfile required with option '--hash-regions'.", 0, true );
+    return 1;
+    }
+  if( heatmap_zones > 0 && !mapname )
+    {
+    show_error( "Mapfile required with option '--heatmap'.", 0, true );
+    return 1;
+    }
+  if( hash_region_size > 0 && command_mode )
+    {
+    show_error( "Option '--hash-regions' is incompatible with command mode.", 0, true );
+    return 1;
+    }
+  if( sidemap_name && command_mode )
+    {
+    show_error( "Option '--reread-check' is incompatible with command mode.", 0, true );
+    return 1;
+    }
+  if( coop_name && !mapname )
+    {
+    show_error( "Mapfile required with option '--cooperative'.", 0, true );
+    return 1;
+    }
+  if( coop_name && command_mode )
+    {
+    show_error( "Option '--cooperative' is incompatible with command mode.", 0, true );
+    return 1;
+    }
+  if( rb_opts.metadata_first && ( command_mode || coop_name || daemon_name ) )
+    {
+    show_error( "Option '--metadata-first' is incompatible with '--cooperative',\n"
+                "          '--daemon', and command mode.", 0, true );
+    return 1;
+    }
+  if( priority_domains.size() && ( command_mode || daemon_name ||
+                                   rb_opts.planner_zone_size != 0 ) )
+    {
+    show_error( "Several domain mapfiles are incompatible with '--daemon',\n"
+                "          '--planner', and command mode.", 0, true );
+    return 1;
+    }
+  if( daemon_name && ( command_mode || coop_name || hash_region_size > 0 ||
+                       sidemap_name || rb_opts.read_timeout > 0 ||
+                       rb_opts.overlap || rb_opts.converge ||
+                       rb_opts.planner_zone_size != 0 ) )
+    {
+    show_error( "Option '--daemon' is incompatible with command mode and with\n"
+                "          options '--cooperative', '--converge', '--hash-regions',\n"
+                "          '--overlap', '--planner', '--read-timeout', and\n"
+                "          '--reread-check'.", 0, true );
+    return 1;
+    }
+  if( rb_opts.read_timeout > 0 && command_mode )
+    {
+    show_error( "Option '--read-timeout' is incompatible with command mode.", 0, true );
+    return 1;
+    }
+  if( rb_opts.overlap && ( rb_opts.read_timeout > 0 ||
+                           rb_opts.planner_zone_size != 0 || command_mode ) )
+    {
+    show_error( "Option '--overlap' is incompatible with '--read-timeout',\n"
+                "          '--planner', and command mode.", 0, true );
+    return 1;
+    }
+  if( rb_opts.converge && ( rb_opts.read_timeout > 0 ||
+                            rb_opts.planner_zone_size != 0 || command_mode ) )
+    {
+    show_error( "Option '--converge' is incompatible with '--read-timeout',\n"
+                "          '--planner', and command mode.", 0, true );
+    return 1;
+    }
 
   // use same flags as reopen_infile
   const int ides = open( iname, O_RDONLY | rb_opts.o_direct_in | O_BINARY );
@@ -460,6 +610,9 @@ int do_rescue( const long long offset, Domain & domain,
 
   Rescuebook rescuebook( offset, insize, domain, test_domain, mb_opts, rb_opts,
                          iname, mapname, cluster, hardbs, synchronous );
+  rescuebook.set_hang_domain( hang_domain );
+  if( priority_domains.size() )
+    rescuebook.set_priority_domains( priority_domains );
 
   if( verify_input_size )
     {
@@ -512,11 +665,67 @@ int do_rescue( const long long offset, Domain & domain,
 #endif
     }
 
+  for( unsigned i = 0; i < tee_files.size(); ++i )
+    {
+    const Tee_file & tee = tee_files[i];
+    const int tdes = open( tee.name.c_str(), O_CREAT | O_WRONLY |
+                           o_direct_out | o_trunc | O_BINARY, outmode );
+    if( tdes < 0 )
+      { show_error( "Can't open tee file", errno ); return 1; }
+    if( lseek( tdes, 0, SEEK_SET ) )
+      { show_error( "Tee file is not seekable." ); close( tdes ); return 1; }
+    if( !rescuebook.add_tee_output( tee.name.c_str(), tee.offset, tdes,
+                                    tee.sparse || rescuebook.sparse,
+                                    tee.ignore_write_errors ) )
+      return 1;
+    }
+
+  if( sidemap_name )
+    {
+    const int cides = open( iname, O_RDONLY | rb_opts.o_direct_in | O_BINARY );
+    if( cides < 0 )
+      { show_error( "Can't open input file", errno ); return 1; }
+    if( !rescuebook.set_consistency_checker( sidemap_name, reread_budget,
+                                             cides ) )
+      return 1;
+    }
+  if( rescuebook.skip_identical )
+    {
+    const int cdes = open( oname, O_RDONLY | O_BINARY );
+    if( cdes < 0 )
+      { show_error( "Can't open output file for reading", errno ); return 1; }
+    rescuebook.set_compare_file( cdes );
+    }
+  if( hash_region_size > 0 )
+    {
+    const int rdes = open( oname, O_RDONLY | O_BINARY );
+    if( rdes < 0 )
+      { show_error( "Can't open output file for reading", errno ); return 1; }
+    if( !rescuebook.set_hash_manifest( hash_region_size, hash_threads, rdes ) )
+      return 1;
+    }
+  if( heatmap_zones > 0 && !rescuebook.set_heatmap( heatmap_zones ) )
+    return 1;
+
+  if( rescuebook.metadata_first )
+    {
+    const int mdes = open( oname, O_RDONLY | O_BINARY );
+    if( mdes < 0 )
+      { show_error( "Can't open output file for reading", errno ); return 1; }
+    rescuebook.set_metadata_file( mdes );
+    }
+
   if( rescuebook.filename() && !rescuebook.mapfile_exists() &&
       !rescuebook.write_mapfile( 0, true ) )
     { show_error( "Can't create mapfile", errno ); return 1; }
+  if( coop_name &&
+      !rescuebook.set_lease_table( coop_name, coop_chunk_size, odes ) )
+    return 1;
 
-  if( command_mode ) return rescuebook.do_commands( ides, odes );
+  if( command_mode )
+    return binary_commands ? rescuebook.do_binary_commands( ides, odes ) :
+                             rescuebook.do_commands( ides, odes );
+  if( daemon_name ) return rescuebook.do_daemon( ides, odes, daemon_name );
 
   if( !event_logger.open_file() )
     { show_error( "Can't open file for logging events", errno ); return 1; }
@@ -531,13 +740,56 @@ int do_rescue( const long long offset, Domain & domain,
     std::printf( "    Starting positions: infile = %sB,  outfile = %sB\n",
                  format_num( rescuebook.domain().pos() ),
                  format_num( rescuebook.domain().pos() + rescuebook.offset() ) );
+    for( unsigned i = 0; i < tee_files.size(); ++i )
+      std::printf( "    Tee file '%s' at position %sB%s\n",
+                   tee_files[i].name.c_str(),
+                   format_num( rescuebook.domain().pos() + tee_files[i].offset ),
+                   tee_files[i].ignore_write_errors ? " (optional)" : "" );
+    if( sidemap_name )
+      std::printf( "    Reread check: '%s'  Max reread: %d%%\n",
+                   sidemap_name, reread_budget );
+    if( rescuebook.group_sync_size > 0 )
+      std::printf( "    Group sync: every %sB or %ds\n",
+                   format_num( rescuebook.group_sync_size ),
+                   rescuebook.group_sync_interval );
+    if( rescuebook.planner_zone_size > 0 )
+      std::printf( "    Planner zone size: %sB\n",
+                   format_num( rescuebook.planner_zone_size ) );
+    else if( rescuebook.planner_zone_size < 0 )
+      std::fputs( "    Planner zone size: auto\n", stdout );
+    if( coop_name && coop_chunk_size > 0 )
+      std::printf( "    Cooperative rescue: '%s'  Chunk size: %sB\n",
+                   coop_name, format_num( coop_chunk_size ) );
+    else if( coop_name )
+      std::printf( "    Cooperative rescue: '%s'  Chunk size: auto\n",
+                   coop_name );
+    if( priority_domains.size() )
+      std::printf( "    Priority classes: %u\n",
+                   (unsigned)priority_domains.size() );
+    if( rescuebook.metadata_first )
+      std::fputs( "    Rescuing filesystem metadata first\n", stdout );
+    if( rescuebook.converge )
+      std::fputs( "    Copying from both ends at once\n", stdout );
+    if( rescuebook.overlap )
+      std::fputs( "    Trimming and scraping overlapped with copying\n", stdout );
+    if( rescuebook.read_timeout > 0 )
+      std::printf( "    Read timeout: %gs%s\n", rescuebook.read_timeout / 1000.0,
+                   rescuebook.reopen_on_error ? " (reopen infile)" : "" );
+    if( heatmap_zones > 0 )
+      std::printf( "    Heatmap: '%s.heat'\n", mapname );
+    if( hash_region_size > 0 )
+      std::printf( "    Hash manifest: '%s.hash'  Region size: %sB\n",
+                   mapname, format_num( hash_region_size ) );
     std::printf( "    Copy block size: %3d sectors", cluster );
     if( rescuebook.skipbs > 0 )
       std::printf( "       Initial skip size: %lld sectors\n",
                    rescuebook.skipbs / hardbs );
     else
       std::fputs( "       Skipping disabled\n", stdout );
+    if( rescuebook.skipbs > 0 && rescuebook.skip_model == Skip_model::adaptive )
+      std::fputs( "    Skip model: adaptive\n", stdout );
     std::printf( "Sector size: %sBytes\n", format_num( hardbs, 99999 ) );
+    if( geometry_msg.size() ) std::fputs( geometry_msg.c_str(), stdout );
     if( verbosity >= 2 )
       {
       bool nl = false;
@@ -577,6 +829,7 @@ int do_rescue( const long long offset, Domain & domain,
       std::printf( "Direct out: %s    ", o_direct_out ? "yes" : "no " );
       std::printf( "Sparse: %s    ", rescuebook.sparse ? "yes" : "no " );
       std::printf( "Truncate: %s    ", o_trunc ? "yes" : "no " );
+      if( rescuebook.skip_identical ) std::fputs( "Skip identical", stdout );
       std::fputc( '\n', stdout );
       std::printf( "Trim: %s         ", !rescuebook.notrim ? "yes" : "no " );
       std::printf( "Scrape: %s        ", !rescuebook.noscrape ? "yes" : "no " );
@@ -602,6 +855,17 @@ int do_rescue( const long long offset, Domain & domain,
 
 namespace {
 
+// Returns true if the binary command protocol is selected.
+//
+bool parse_command_protocol( const char * const arg )
+  {
+  if( !arg[0] || std::strcmp( arg, "text" ) == 0 ) return false;
+  if( std::strcmp( arg, "binary" ) == 0 ) return true;
+  show_error( "Invalid protocol in option '--command-mode'.", 0, true );
+  std::exit( 1 );
+  }
+
+
 void parse_cpass( const char * p, Rb_options & rb_opts )
   {
   rb_opts.cpass_bitset = 0;
@@ -652,13 +916,71 @@ void parse_mapfile_intervals( const char * const ptr, Mb_options & mb_opts )
   }
 
 
+void parse_group_sync( const char * const ptr, Rb_options & rb_opts,
+                       const int hardbs )
+  {
+  const char * tail = ptr;
+
+  rb_opts.group_sync_size = 16 << 20;
+  if( tail[0] && tail[0] != ',' )
+    rb_opts.group_sync_size = getnum( ptr, hardbs, hardbs, LLONG_MAX, &tail );
+  if( tail[0] == ',' )
+    rb_opts.group_sync_interval = parse_time_interval( tail + 1 );
+  else if( tail[0] )
+    {
+    show_error( "Bad separator in argument of '--group-sync'", 0, true );
+    std::exit( 1 );
+    }
+  if( rb_opts.group_sync_interval < 1 )
+    {
+    show_error( "Minimum 'group sync interval' is 1 second." );
+    std::exit( 1 );
+    }
+  }
+
+
 void parse_pause_on_error( const char * const p, Rb_options & rb_opts )
   {
   rb_opts.simulated_poe = ( p[0] == 's' );
-  if( rb_opts.simulated_poe )
-    rb_opts.pause_on_error = parse_rational_time( p + 1 );
+  rb_opts.pause_on_error = parse_rational_time( p + rb_opts.simulated_poe );
+  }
+
+
+void parse_status_interval( const char * const ptr, Rb_options & rb_opts )
+  {
+  const Rational r = parse_rational_time( ptr );
+  rb_opts.status_interval = ( r >= 86400 ) ? 86400000 : ( r * 1000 ).round();
+  if( rb_opts.status_interval < 10 )
+    {
+    show_error( "Minimum 'status interval' is 0.01 seconds." );
+    std::exit( 1 );
+    }
+  }
+
+
+void parse_read_timeout( const char * const ptr, Rb_options & rb_opts )
+  {
+  const Rational r = parse_rational_time( ptr );
+  rb_opts.read_timeout = ( r >= 86400 ) ? 86400000 : ( r * 1000 ).round();
+  if( rb_opts.read_timeout < 10 )
+    {
+    show_error( "Minimum 'read timeout' is 0.01 seconds." );
+    std::exit( 1 );
+    }
+  }
+
+
+void parse_skip_model( const char * const ptr, Rb_options & rb_opts )
+  {
+  if( std::strcmp( ptr, "doubling" ) == 0 )
+    rb_opts.skip_model = Skip_model::doubling;
+  else if( std::strcmp( ptr, "adaptive" ) == 0 )
+    rb_opts.skip_model = Skip_model::adaptive;
   else
-    rb_opts.pause_on_error = parse_time_interval( p );
+    {
+    show_error( "Bad argument in option '--skip-model'", 0, true );
+    std::exit( 1 );
+    }
   }
 
 
@@ -690,6 +1012,125 @@ void parse_skipbs( const char * const ptr, Rb_options & rb_opts,
   }
 
 
+void parse_reread_check( const char * const ptr, const char ** const namep,
+                         int & budget )
+  {
+  const char * const p = std::strchr( ptr, ',' );
+  static std::string name;
+  name.assign( ptr, p ? p - ptr : std::strlen( ptr ) );
+  if( name.empty() )
+    { show_error( "Missing file name in option '--reread-check'.", 0, true );
+      std::exit( 1 ); }
+  if( p ) budget = getnum( p + 1, 0, 1, 100 );
+  *namep = name.c_str();
+  }
+
+
+// Recognized format: <file>[,<bytes>]
+//
+void parse_cooperative( const char * const ptr, const char ** const namep,
+                        long long & chunk_size, const int hardbs )
+  {
+  const char * const p = std::strchr( ptr, ',' );
+  static std::string name;
+  name.assign( ptr, p ? p - ptr : std::strlen( ptr ) );
+  if( name.empty() )
+    { show_error( "Missing file name in option '--cooperative'.", 0, true );
+      std::exit( 1 ); }
+  if( p ) chunk_size = getnum( p + 1, hardbs, hardbs, 1LL << 40 );
+  if( chunk_size % hardbs )
+    { show_error( "Chunk size of '--cooperative' is not a multiple of sector size.",
+                  0, true ); std::exit( 1 ); }
+  *namep = name.c_str();
+  }
+
+
+void parse_hash_regions( const char * const ptr, long long & region_size,
+                         int & threads, const int hardbs )
+  {
+  const char * tail = ptr;
+  region_size = getnum( ptr, hardbs, 4096, 1LL << 40, &tail );
+  if( tail[0] == ',' ) threads = getnum( tail + 1, 0, 1, 64 );
+  else if( tail[0] )
+    {
+    show_error( "Bad separator in argument of '--hash-regions'", 0, true );
+    std::exit( 1 );
+    }
+  }
+
+
+// Recognized format: <file>[,<opos>[,<flags>]]
+// Where <flags> is a combination of 's' (sparse writes) and 'w' (ignore
+// write errors).
+//
+void parse_tee( const char * const ptr, std::vector< Tee_file > & tee_files,
+                const int hardbs )
+  {
+  Tee_file tee;
+  const char * p = std::strchr( ptr, ',' );
+  tee.name.assign( ptr, p ? p - ptr : std::strlen( ptr ) );
+  if( tee.name.empty() )
+    { show_error( "Missing file name in option '--tee'.", 0, true );
+      std::exit( 1 ); }
+  if( p )
+    {
+    ++p;
+    if( *p != ',' ) tee.opos = getnum( p, hardbs, 0, LLONG_MAX, &p );
+    if( *p == ',' )
+      for( ++p; *p; ++p )
+        switch( *p )
+          {
+          case 's': tee.sparse = true; break;
+          case 'w': tee.ignore_write_errors = true; break;
+          default : show_error( "Invalid flag in option '--tee'.", 0, true );
+                    std::exit( 1 );
+          }
+    else if( *p )
+      { show_error( "Bad separator in argument of '--tee'", 0, true );
+        std::exit( 1 ); }
+    }
+  tee_files.push_back( tee );
+  }
+
+
+// Set the default sector size (and cluster size if 'set_cluster') from
+// the geometry reported by the input device. The physical sector size is
+// used only if it is a power of 2 multiple of the logical sector size and
+// the device is correctly aligned; otherwise reads of a physical sector
+// could straddle two of them.
+//
+void probe_input_geometry( const char * const iname, int & hardbs,
+                           int & cluster, const bool set_cluster,
+                           const int max_hardbs )
+  {
+  const int ides = open( iname, O_RDONLY | O_BINARY );
+  if( ides < 0 ) return;
+  struct stat st;
+  Device_geometry dg;
+  const bool ok = fstat( ides, &st ) == 0 && S_ISBLK( st.st_mode ) &&
+                  device_geometry( ides, dg );
+  close( ides );
+  if( !ok || dg.logical_bs > max_hardbs ) return;
+  hardbs = dg.logical_bs;
+  const int pbs = dg.physical_bs;
+  if( pbs > hardbs && pbs <= max_hardbs && pbs % hardbs == 0 &&
+      ( pbs & ( pbs - 1 ) ) == 0 && dg.alignment_offset == 0 )
+    hardbs = pbs;
+  if( set_cluster && dg.io_opt >= 65536 && dg.io_opt <= 1 << 20 &&
+      dg.io_opt % hardbs == 0 )
+    cluster = dg.io_opt / hardbs;
+  char buf[160];
+  snprintf( buf, sizeof buf, "Input device geometry: logical %d, physical %d,"
+            " io_min %d, io_opt %d, alignment offset %d\n",
+            dg.logical_bs, dg.physical_bs, dg.io_min, dg.io_opt,
+            dg.alignment_offset );
+  geometry_msg = buf;
+  if( pbs > hardbs && dg.alignment_offset != 0 )
+    geometry_msg += "warning: Physical sectors are misaligned; "
+                    "using logical sector size.\n";
+  }
+
+
 void check_o_direct()
   {
   if( O_DIRECT == 0 )
@@ -742,7 +1183,7 @@ int main( const int argc, const char * const argv[] )
   long long ipos = 0;
   long long opos = -1;
   long long max_size = -1;
-  const char * domain_mapfile_name = 0;
+  std::vector< const char * > domain_mapfile_names;	// priority classes
   const char * test_mode_mapfile_name = 0;
   const int cluster_bytes = 65536;
   const int default_hardbs = 512;
@@ -761,13 +1202,25 @@ int main( const int argc, const char * const argv[] )
   bool preallocate = false;
   bool synchronous = false;
   bool verify_input_size = false;
+  std::vector< Tee_file > tee_files;
+  long long hash_region_size = 0;	// 0 = don't hash
+  int hash_threads = 2;
+  const char * sidemap_name = 0;
+  int reread_budget = 5;		// percent of bytes read
+  const char * coop_name = 0;
+  long long coop_chunk_size = 0;	// 0 = auto
+  const char * daemon_name = 0;
+  long heatmap_zones = 0;		// 0 = no heatmap
+  bool binary_commands = false;
   if( argc > 0 ) invocation_name = argv[0];
   command_line = invocation_name;
   for( int i = 1; i < argc; ++i )
     { command_line += ' '; command_line += argv[i]; }
 
-  enum { opt_ask = 256, opt_cm, opt_cpa, opt_ds, opt_eoe, opt_eve, opt_mi,
-         opt_msr, opt_poe, opt_pop, opt_rat, opt_rea, opt_rs, opt_sf };
+  enum { opt_ask = 256, opt_cm, opt_cnv, opt_coo, opt_cpa, opt_dae, opt_ds,
+         opt_eoe, opt_eve, opt_gs, opt_hm, opt_hr, opt_mdf, opt_mi, opt_msr, opt_ovl,
+         opt_pla, opt_poe, opt_pop, opt_rat, opt_rea, opt_rrc, opt_rs, opt_rto,
+         opt_sf, opt_si, opt_skm, opt_sti, opt_tee };
   const Arg_parser::Option options[] =
     {
     { 'a', "min-read-rate",        Arg_parser::yes },
@@ -817,26 +1270,55 @@ int main( const int argc, const char * const argv[] )
     { 'y', "synchronous",          Arg_parser::no  },
     { 'Z', "max-read-rate",        Arg_parser::yes },
     { opt_ask, "ask",              Arg_parser::no  },
-    { opt_cm,  "command-mode",     Arg_parser::no  },
+    { opt_cm,  "command-mode",     Arg_parser::maybe },
+    { opt_cnv, "converge",         Arg_parser::no  },
+    { opt_coo, "cooperative",      Arg_parser::yes },
     { opt_cpa, "cpass",            Arg_parser::yes },
+    { opt_dae, "daemon",           Arg_parser::yes },
     { opt_ds,  "delay-slow",       Arg_parser::yes },
     { opt_eoe, "exit-on-error",    Arg_parser::no  },
     { opt_eve, "log-events",       Arg_parser::yes },
+    { opt_gs,  "group-sync",       Arg_parser::maybe },
+    { opt_hm,  "heatmap",          Arg_parser::maybe },
+    { opt_hr,  "hash-regions",     Arg_parser::yes },
+    { opt_mdf, "metadata-first",   Arg_parser::no  },
     { opt_mi,  "mapfile-interval", Arg_parser::yes },
     { opt_msr, "max-slow-reads",   Arg_parser::yes },
+    { opt_ovl, "overlap",          Arg_parser::no  },
     { opt_poe, "pause-on-error",   Arg_parser::yes },
     { opt_pop, "pause-on-pass",    Arg_parser::yes },
     { opt_pop, "pause",            Arg_parser::yes },
+    { opt_pla, "planner",          Arg_parser::maybe },
     { opt_rat, "log-rates",        Arg_parser::yes },
     { opt_rea, "log-reads",        Arg_parser::yes },
+    { opt_rto, "read-timeout",     Arg_parser::yes },
+    { opt_rrc, "reread-check",     Arg_parser::yes },
     { opt_rs,  "reset-slow",       Arg_parser::no  },
     { opt_sf,  "same-file",        Arg_parser::no  },
+    { opt_si,  "skip-identical",   Arg_parser::no  },
+    { opt_skm, "skip-model",       Arg_parser::yes },
+    { opt_sti, "status-interval",  Arg_parser::yes },
+    { opt_tee, "tee",              Arg_parser::yes },
     {  0 , 0,                      Arg_parser::no  } };
 
   const Arg_parser parser( argc, argv, options );
   if( parser.error().size() )				// bad option
     { show_error( parser.error().c_str(), 0, true ); return 1; }
 
+  {				// probe input device unless '-b' is given
+  bool probe = true, set_cluster = true;
+  int i = 0;
+  for( ; i < parser.arguments() && parser.code( i ); ++i )
+    switch( parser.code( i ) )
+      {
+      case 'b': case 'F': case 'G': case 'h': case 'V': probe = false; break;
+      case 'c': set_cluster = false; break;
+      }
+  if( probe && i < parser.arguments() )
+    probe_input_geometry( parser.argument( i ).c_str(), hardbs, cluster,
+                          set_cluster, max_hardbs );
+  }
+
   int argind = 0;
   for( ; argind < parser.arguments(); ++argind )
     {
@@ -870,7 +1352,7 @@ int main( const int argc, const char * const argv[] )
       case 'J': rb_opts.verify_on_error = true; break;
       case 'K': parse_skipbs( arg, rb_opts, hardbs ); break;
       case 'L': loose = true; break;
-      case 'm': set_name( &domain_mapfile_name, arg, code ); break;
+      case 'm': domain_mapfile_names.push_back( arg ); break;
       case 'M': rb_opts.retrim = true; break;
       case 'n': rb_opts.noscrape = true; break;
       case 'N': rb_opts.notrim = true; break;
@@ -895,31 +1377,55 @@ int main( const int argc, const char * const argv[] )
       case 'y': synchronous = true; break;
       case 'Z': rb_opts.max_read_rate = getnum( arg, hardbs, 1 ); break;
       case opt_ask: ask = true; break;
-      case opt_cm:  set_mode( program_mode, m_command ); break;
+      case opt_cm:  set_mode( program_mode, m_command );
+                    binary_commands = parse_command_protocol( arg ); break;
+      case opt_cnv: rb_opts.converge = true; break;
+      case opt_coo: parse_cooperative( arg, &coop_name, coop_chunk_size,
+                                       hardbs ); break;
       case opt_cpa: parse_cpass( arg, rb_opts ); break;
+      case opt_dae: daemon_name = arg; break;
       case opt_ds:  rb_opts.delay_slow = parse_time_interval( arg ); break;
       case opt_eoe: rb_opts.max_read_errors = 0; break;
+      case opt_gs:  parse_group_sync( arg, rb_opts, hardbs ); break;
       case opt_eve: if( event_logger.set_filename( arg ) ) break;
             show_error( "Events logfile exists and is not a regular file." );
             return 1;
+      case opt_hm:  heatmap_zones = arg[0] ? getnum( arg, 0, 1, 1 << 20 ) : 1000;
+                    break;
+      case opt_hr:  parse_hash_regions( arg, hash_region_size, hash_threads,
+                                        hardbs ); break;
+      case opt_mdf: rb_opts.metadata_first = true; break;
       case opt_mi:  parse_mapfile_intervals( arg, mb_opts ); break;
       case opt_msr: rb_opts.max_slow_reads = getnum( arg, 0, 0, LONG_MAX );
                     break;
+      case opt_ovl: rb_opts.overlap = true; break;
       case opt_poe: parse_pause_on_error( arg, rb_opts ); break;
       case opt_pop: rb_opts.pause_on_pass = parse_time_interval( arg ); break;
+      case opt_pla: rb_opts.planner_zone_size =
+                      arg[0] ? getnum( arg, hardbs, hardbs ) : -1; break;
       case opt_rat: if( rate_logger.set_filename( arg ) ) break;
             show_error( "Rates logfile exists and is not a regular file." );
             return 1;
       case opt_rea: if( read_logger.set_filename( arg ) ) break;
             show_error( "Reads logfile exists and is not a regular file." );
             return 1;
+      case opt_rrc: parse_reread_check( arg, &sidemap_name, reread_budget );
+                    break;
       case opt_rs:  rb_opts.reset_slow = true; break;
+      case opt_rto: parse_read_timeout( arg, rb_opts ); break;
       case opt_sf:  rb_opts.same_file = true; break;
+      case opt_si:  rb_opts.skip_identical = true; break;
+      case opt_skm: parse_skip_model( arg, rb_opts ); break;
+      case opt_sti: parse_status_interval( arg, rb_opts ); break;
+      case opt_tee: parse_tee( arg, tee_files, hardbs ); break;
       default : internal_error( "uncaught option." );
       }
     } // end process options
 
   if( opos < 0 ) opos = ipos;
+  for( unsigned i = 0; i < tee_files.size(); ++i )
+    tee_files[i].offset = ( ( tee_files[i].opos >= 0 ) ?
+                            tee_files[i].opos : opos ) - ipos;
   if( hardbs < 1 ) hardbs = default_hardbs;
   if( cluster >= INT_MAX / hardbs ) cluster = ( INT_MAX / hardbs ) - 1;
   if( cluster < 1 ) cluster = cluster_bytes / hardbs;
@@ -935,10 +1441,32 @@ int main( const int argc, const char * const argv[] )
   // end scan arguments
 
   if( !check_files( iname, oname, mapname, rb_opts, force,
-                    program_mode == m_generate, preallocate ) )
+                    program_mode == m_generate, preallocate ) ||
+      !check_tee_files( iname, oname, mapname, tee_files, force ) )
     return 1;
-
-  Domain domain( ipos, max_size, domain_mapfile_name, loose );
+  if( sidemap_name && ( std::strcmp( sidemap_name, iname ) == 0 ||
+                        std::strcmp( sidemap_name, oname ) == 0 ||
+                        ( mapname && std::strcmp( sidemap_name, mapname ) == 0 ) ) )
+    { show_error( "Side map of '--reread-check' is the same as another file." );
+      return 1; }
+  if( synchronous && rb_opts.group_sync_size > 0 )
+    { show_error( "Options '-y' and '--group-sync' are incompatible.", 0, true );
+      return 1; }
+
+  Domain domain( ipos, max_size, domain_mapfile_names.size() ?
+                 domain_mapfile_names[0] : 0, loose );
+  std::vector< Domain > priority_domains;  // each class minus previous ones
+  if( domain_mapfile_names.size() > 1 )
+    {
+    priority_domains.push_back( domain );
+    for( unsigned i = 1; i < domain_mapfile_names.size(); ++i )
+      {
+      Domain d( ipos, max_size, domain_mapfile_names[i], loose );
+      d.remove( domain );
+      priority_domains.push_back( d );
+      domain.join( d );
+      }
+    }
 
   switch( program_mode )
     {
@@ -949,6 +1477,15 @@ int main( const int argc, const char * const argv[] )
       if( rb_opts.same_file )
         { show_error( "Option '--same-file' is incompatible with fill mode.", 0, true );
         return 1; }
+      if( tee_files.size() )
+        { show_error( "Option '--tee' is incompatible with fill mode.", 0, true );
+        return 1; }
+      if( hash_region_size > 0 )
+        { show_error( "Option '--hash-regions' is incompatible with fill mode.", 0, true );
+        return 1; }
+      if( sidemap_name )
+        { show_error( "Option '--reread-check' is incompatible with fill mode.", 0, true );
+        return 1; }
       if( rb_opts != Rb_options() || test_mode_mapfile_name ||
           verify_input_size || preallocate || o_trunc )
         show_error( "warning: Options -aACdeEHIJKlMnOpPrRStTuxX are ignored in fill mode." );
@@ -958,6 +1495,15 @@ int main( const int argc, const char * const argv[] )
       if( ask )
         { show_error( "Option '--ask' is incompatible with generate mode.", 0, true );
           return 1; }
+      if( tee_files.size() )
+        { show_error( "Option '--tee' is incompatible with generate mode.", 0, true );
+          return 1; }
+      if( hash_region_size > 0 )
+        { show_error( "Option '--hash-regions' is incompatible with generate mode.", 0, true );
+          return 1; }
+      if( sidemap_name )
+        { show_error( "Option '--reread-check' is incompatible with generate mode.", 0, true );
+          return 1; }
       if( fb_opts != Fb_options() || rb_opts != Rb_options() || synchronous ||
           test_mode_mapfile_name || verify_input_size || preallocate ||
           o_direct_out || o_trunc )
@@ -971,11 +1517,22 @@ int main( const int argc, const char * const argv[] )
         { show_error( "Option '-w' is incompatible with rescue mode.", 0, true );
           return 1; }
       const Domain test_domain( 0, -1, test_mode_mapfile_name, loose );
+      // in test mode, non-scraped blocks simulate reads that never return
+      const bool hang_mode = test_mode_mapfile_name &&
+        rb_opts.read_timeout > 0 && std::strcmp( test_mode_mapfile_name, "-" );
+      const Domain hang_domain( 0, -1, hang_mode ? test_mode_mapfile_name : 0,
+                                loose, Sblock::non_scraped );
       return do_rescue( opos - ipos, domain,
-                        test_mode_mapfile_name ? &test_domain : 0, mb_opts,
+                        test_mode_mapfile_name ? &test_domain : 0,
+                        hang_mode ? &hang_domain : 0, mb_opts,
                         rb_opts, iname, oname, mapname, cluster, hardbs,
                         o_direct_out, o_trunc, ask, program_mode == m_command,
-                        preallocate, synchronous, verify_input_size );
+                        binary_commands,
+                        preallocate, synchronous, verify_input_size,
+                        tee_files, hash_region_size, hash_threads,
+                        sidemap_name, reread_budget, coop_name,
+                        coop_chunk_size, daemon_name, priority_domains,
+                        heatmap_zones );
       }
     }
   }
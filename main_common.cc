@@ -149,12 +149,14 @@ void set_name( const char ** name, const char * new_name, const char opt )
   }
 
 
-const char * get_timestamp( const long t = 0 )
+// 'buf' must be at least 80 bytes long. Thread-safe, as the mapfile may
+// be written by the persister thread.
+const char * get_timestamp( char * const buf, const long t = 0 )
   {
-  static char buf[80];
   const time_t tt = t ? t : std::time( 0 );
-  const struct tm * const tm = std::localtime( &tt );
-  if( !tm || std::strftime( buf, sizeof buf, "%Y-%m-%d %H:%M:%S", tm ) == 0 )
+  struct tm tm;
+  if( !localtime_r( &tt, &tm ) ||
+      std::strftime( buf, 80, "%Y-%m-%d %H:%M:%S", &tm ) == 0 )
     buf[0] = 0;
   return buf;
   }
@@ -217,20 +219,21 @@ long initial_time()
 
 bool write_file_header( FILE * const f, const char * const filetype )
   {
-  static std::string timestamp;
+  char buf[80];
+  const char * const timestamp = get_timestamp( buf, initial_time() );
 
-  if( timestamp.empty() ) timestamp = get_timestamp( initial_time() );
   return ( std::fprintf( f, "# %s. Created by %s version %s\n"
                             "# Command line: %s\n"
                             "# Start time:   %s\n",
            filetype, Program_name, PROGVERSION, command_line.c_str(),
-           timestamp.c_str() ) >= 0 );
+           timestamp ) >= 0 );
   }
 
 
 bool write_timestamp( FILE * const f )
   {
-  const char * const timestamp = get_timestamp();
+  char buf[80];
+  const char * const timestamp = get_timestamp( buf );
 
   return ( !timestamp || !timestamp[0] ||
            std::fprintf( f, "# Current time: %s\n", timestamp ) >= 0 );
@@ -240,8 +243,9 @@ bool write_timestamp( FILE * const f )
 bool write_final_timestamp( FILE * const f )
   {
   static std::string timestamp;
+  char buf[80];
 
-  if( timestamp.empty() ) timestamp = get_timestamp();
+  if( timestamp.empty() ) timestamp = get_timestamp( buf );
   return ( std::fprintf( f, "# End time:     %s\n", timestamp.c_str() ) >= 0 );
   }
 
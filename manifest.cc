@@ -0,0 +1,501 @@
+/*  GNU ddrescue - Data recovery tool
+    Copyright (C) 2004-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "mapbook.h"
+#include "sha256.h"
+#include "manifest.h"
+
+
+struct Hash_manifest::Job
+  {
+  enum Type { feed, discard, readback, image };
+  std::vector< uint8_t > data;		// data to feed
+  long long pos, size;			// block to read back
+  long region;
+  Type type;
+  bool final;				// last feed of region
+
+  Job( const Type t, const long r )
+    : pos( 0 ), size( 0 ), region( r ), type( t ), final( false ) {}
+  };
+
+
+struct Hash_manifest::Worker
+  {
+  Hash_manifest * manifest;
+  std::deque< Job * > queue;
+  std::map< long, Sha256 > contexts;	// regions being hashed in order
+  pthread_t id;
+  pthread_cond_t cv_job;		// a job has been queued
+  bool quit;
+  bool started;
+
+  explicit Worker( Hash_manifest * const m )
+    : manifest( m ), quit( false ), started( false )
+    { xinit_cond( &cv_job ); }
+  ~Worker()
+    {
+    for( unsigned i = 0; i < queue.size(); ++i ) delete queue[i];
+    xdestroy_cond( &cv_job );
+    }
+  };
+
+
+namespace {
+
+const long long max_queued_bytes = 32 << 20;
+
+extern "C" void * hash_worker( void * arg )
+  {
+  Hash_manifest::Worker & w = *(Hash_manifest::Worker *)arg;
+  w.manifest->worker( w );
+  return 0;
+  }
+
+
+bool block_finished( const Block & b, const Mapfile & mapfile )
+  {
+  if( b.size() <= 0 || mapfile.sblocks() <= 0 ) return false;
+  long i = mapfile.find_index( b.pos() );
+  if( i < 0 ) return false;
+  for( ; i < mapfile.sblocks() && mapfile.sblock( i ).pos() < b.end(); ++i )
+    if( mapfile.sblock( i ).status() != Sblock::finished ) return false;
+  return true;
+  }
+
+
+void digest_to_hex( const uint8_t * const digest, std::string & hex )
+  {
+  const char * const xdigits = "0123456789abcdef";
+  hex.clear();
+  for( int i = 0; i < Sha256::digest_size; ++i )
+    { hex += xdigits[digest[i] >> 4]; hex += xdigits[digest[i] & 0x0F]; }
+  }
+
+
+bool hex_to_digest( const char * const hex, uint8_t * const digest )
+  {
+  if( std::strlen( hex ) != 2 * Sha256::digest_size ) return false;
+  for( int i = 0; i < 2 * Sha256::digest_size; ++i )
+    {
+    const unsigned char ch = hex[i];
+    int d;
+    if( ch >= '0' && ch <= '9' ) d = ch - '0';
+    else if( ch >= 'a' && ch <= 'f' ) d = ch - 'a' + 10;
+    else if( ch >= 'A' && ch <= 'F' ) d = ch - 'A' + 10;
+    else return false;
+    if( i % 2 == 0 ) digest[i/2] = d << 4; else digest[i/2] |= d;
+    }
+  return true;
+  }
+
+} // end namespace
+
+
+Hash_manifest::Hash_manifest( const char * const mapname,
+                              const long long region_size,
+                              const long long offset, const int rdes )
+  : filename_( std::string( mapname ) + ".hash" ),
+    region_size_( region_size ), offset_( offset ), rdes_( rdes ),
+    image_index( 0 ), image_pos( -1 ), queued_bytes( 0 ), pending_jobs( 0 ), read_errno( 0 ),
+    rewrite_pending( false )
+  {
+  xinit_mutex( &mutex ); xinit_cond( &cv_space ); xinit_cond( &cv_idle );
+  }
+
+
+Hash_manifest::~Hash_manifest()
+  {
+  for( unsigned i = 0; i < workers.size(); ++i )
+    {
+    Worker & w = *workers[i];
+    xlock( &mutex ); w.quit = true; xsignal( &w.cv_job ); xunlock( &mutex );
+    if( w.started ) pthread_join( w.id, 0 );
+    delete workers[i];
+    }
+  xdestroy_cond( &cv_idle ); xdestroy_cond( &cv_space );
+  xdestroy_mutex( &mutex );
+  if( rdes_ >= 0 ) close( rdes_ );
+  }
+
+
+Block Hash_manifest::region_block( const long r, const Mapfile & mapfile ) const
+  {
+  const long long pos = r * region_size_;
+  const long long end = std::min( pos + region_size_, mapfile.extent().end() );
+  return Block( pos, std::max( 0LL, end - pos ) );
+  }
+
+
+// Make room for region 'r' in entries and stream_pos.
+void Hash_manifest::ensure_region( const long r )
+  {
+  const long old_size = stream_pos.size();
+  if( r < old_size ) return;
+  xlock( &mutex );
+  if( (long)entries.size() <= r ) entries.resize( r + 1 );
+  stream_pos.resize( r + 1 );
+  for( long i = old_size; i <= r; ++i )
+    stream_pos[i] = entries[i].size ? -2 : i * region_size_;
+  xunlock( &mutex );
+  }
+
+
+void Hash_manifest::queue_job( Job * const job )
+  {
+  Worker & w = *workers[job->region % workers.size()];
+  xlock( &mutex );
+  while( queued_bytes > max_queued_bytes ) xwait( &cv_space, &mutex );
+  queued_bytes += job->data.size();
+  ++pending_jobs;
+  w.queue.push_back( job );
+  xsignal( &w.cv_job );
+  xunlock( &mutex );
+  }
+
+
+// Read the hashes saved by a previous run, discarding those of regions
+// that are no longer completely finished in mapfile.
+//
+bool Hash_manifest::read_manifest( const Mapfile & mapfile )
+  {
+  FILE * const f = std::fopen( filename_.c_str(), "r" );
+  rewrite_pending = true;
+  if( !f ) return ( errno == ENOENT );
+  char line[256];
+  bool size_ok = false;
+  while( std::fgets( line, sizeof line, f ) )
+    {
+    if( line[0] == '#' )
+      {
+      long long rs;
+      if( std::sscanf( line, "# Region size: %lli", &rs ) == 1 )
+        size_ok = ( rs == region_size_ );
+      continue;
+      }
+    if( !size_ok ) break;
+    long long pos, size;
+    char hex[80];
+    Entry entry;
+    if( std::sscanf( line, "%lli %lli %79s", &pos, &size, hex ) != 3 ||
+        pos < 0 || pos % region_size_ != 0 || size <= 0 ||
+        size > region_size_ || !hex_to_digest( hex, entry.digest ) )
+      continue;
+    const long r = pos / region_size_;
+    entry.size = size;
+    if( (long)entries.size() <= r ) entries.resize( r + 1 );
+    entries[r] = entry;
+    }
+  std::fclose( f );
+  if( !size_ok ) { entries.clear(); return true; }
+  rewrite_pending = false;
+  for( unsigned long r = 0; r < entries.size(); ++r )
+    if( entries[r].size > 0 )
+      {
+      const Block rb = region_block( r, mapfile );
+      if( entries[r].size != rb.size() || !block_finished( rb, mapfile ) )
+        { entries[r].size = 0; rewrite_pending = true; }
+      }
+  return true;
+  }
+
+
+bool Hash_manifest::start( const int threads, const Mapfile & mapfile,
+                           const Domain & domain )
+  {
+  if( !read_manifest( mapfile ) )
+    { show_error( "Can't read hash manifest", errno ); return false; }
+  for( long i = 0; i < domain.blocks(); ++i )
+    image_blocks.push_back( domain.block( i ) );
+  image_pos = image_blocks.empty() ? -1 : image_blocks.front().pos();
+  for( int i = 0; i < threads; ++i )
+    {
+    Worker * const w = new Worker( this );
+    workers.push_back( w );
+    const int errcode = pthread_create( &w->id, 0, hash_worker, w );
+    if( errcode )
+      { show_error( "Can't create hashing thread", errcode ); return false; }
+    w->started = true;
+    }
+  return true;
+  }
+
+
+void Hash_manifest::worker( Worker & w )
+  {
+  const int bufsize = 65536;
+  std::vector< uint8_t > buf;
+  while( true )
+    {
+    xlock( &mutex );
+    while( w.queue.empty() && !w.quit ) xwait( &w.cv_job, &mutex );
+    if( w.queue.empty() ) { xunlock( &mutex ); break; }
+    Job * const job = w.queue.front();
+    w.queue.pop_front();
+    queued_bytes -= job->data.size();
+    xsignal( &cv_space );
+    xunlock( &mutex );
+
+    Entry entry;
+    int errcode = 0;
+    if( job->type == Job::image )
+      image_ctx.update( &job->data[0], job->data.size() );
+    else if( job->type == Job::feed )
+      {
+      Sha256 & ctx = w.contexts[job->region];
+      ctx.update( &job->data[0], job->data.size() );
+      if( job->final )
+        {
+        ctx.finish( entry.digest ); entry.size = region_size_;
+        w.contexts.erase( job->region );
+        }
+      }
+    else if( job->type == Job::discard ) w.contexts.erase( job->region );
+    else						// read back
+      {
+      Sha256 ctx;
+      if( buf.empty() ) buf.resize( bufsize );
+      for( long long pos = job->pos; pos < job->pos + job->size; )
+        {
+        const int size = std::min( (long long)bufsize, job->pos + job->size - pos );
+        const int rd = preadblock( rdes_, &buf[0], size, pos + offset_ );
+        if( rd < size )
+          {
+          if( errno ) { errcode = errno; break; }
+          std::memset( &buf[rd], 0, size - rd );	// sparse outfile
+          }
+        ctx.update( &buf[0], size );
+        pos += size;
+        }
+      if( !errcode ) { ctx.finish( entry.digest ); entry.size = job->size; }
+      }
+
+    xlock( &mutex );
+    if( entry.size > 0 )
+      { entries[job->region] = entry; unsaved.push_back( job->region ); }
+    if( errcode ) read_errno = errcode;
+    if( --pending_jobs <= 0 ) xbroadcast( &cv_idle );
+    xunlock( &mutex );
+    delete job;
+    }
+  }
+
+
+// Called after the status of the block has been changed to finished.
+// 'buf' contains the 'size' bytes rescued at input position 'pos'.
+//
+void Hash_manifest::data_rescued( const uint8_t * const buf,
+                                  const long long pos, const int size,
+                                  const Mapfile & mapfile )
+  {
+  image_data( buf, pos, size );
+  const long long end = pos + size;
+  for( long long p = pos; p < end; )
+    {
+    const long r = p / region_size_;
+    const long long rpos = r * region_size_;
+    const long long rend = rpos + region_size_;
+    const int len = std::min( end, rend ) - p;
+    ensure_region( r );
+    long long & sp = stream_pos[r];
+    if( sp == p )				// data arrived in order
+      {
+      Job * const job = new Job( Job::feed, r );
+      job->data.assign( buf + ( p - pos ), buf + ( p - pos + len ) );
+      job->final = ( p + len >= rend );
+      sp = job->final ? -2 : p + len;
+      queue_job( job );
+      }
+    else if( sp >= 0 )
+      { if( sp > rpos ) queue_job( new Job( Job::discard, r ) ); sp = -1; }
+    if( sp != -2 )
+      {
+      const Block rb = region_block( r, mapfile );
+      if( block_finished( rb, mapfile ) )	// hash it from outfile
+        {
+        if( sp > rpos ) queue_job( new Job( Job::discard, r ) );
+        Job * const job = new Job( Job::readback, r );
+        job->pos = rb.pos(); job->size = rb.size();
+        queue_job( job );
+        sp = -2;
+        }
+      }
+    p += len;
+    }
+  }
+
+
+// Queue the finished regions not yet hashed, for example those finished
+// in a previous run, or the last region if it is incomplete.
+//
+void Hash_manifest::hash_finished_regions( const Mapfile & mapfile )
+  {
+  long long last_end = 0;			// end of last finished block
+  for( long i = mapfile.sblocks() - 1; i >= 0; --i )
+    if( mapfile.sblock( i ).status() == Sblock::finished )
+      { last_end = mapfile.sblock( i ).end(); break; }
+  if( last_end <= 0 ) return;
+  const long last_region = ( last_end - 1 ) / region_size_;
+  ensure_region( last_region );
+  for( long r = 0; r <= last_region; ++r )
+    {
+    long long & sp = stream_pos[r];
+    if( sp == -2 ) continue;
+    const Block rb = region_block( r, mapfile );
+    if( !block_finished( rb, mapfile ) ) continue;
+    if( sp > rb.pos() ) queue_job( new Job( Job::discard, r ) );
+    Job * const job = new Job( Job::readback, r );
+    job->pos = rb.pos(); job->size = rb.size();
+    queue_job( job );
+    sp = -2;
+    }
+  }
+
+
+void Hash_manifest::wait_idle()
+  {
+  xlock( &mutex );
+  while( pending_jobs > 0 ) xwait( &cv_idle, &mutex );
+  xunlock( &mutex );
+  }
+
+
+// Feed the image hash with data rescued in domain order. Any other data
+// means that the image must be read back from outfile at the end.
+//
+void Hash_manifest::image_data( const uint8_t * const buf,
+                                const long long pos, const int size )
+  {
+  if( image_pos < 0 ) return;
+  const Block & db = image_blocks[image_index];
+  if( pos != image_pos || pos + size > db.end() ) { image_pos = -1; return; }
+  Job * const job = new Job( Job::image, 0 );	// always on worker 0
+  job->data.assign( buf, buf + size );
+  queue_job( job );
+  image_pos += size;
+  if( image_pos >= db.end() )
+    image_pos = ( ++image_index < (long)image_blocks.size() ) ?
+                image_blocks[image_index].pos() : -2;
+  }
+
+
+// Compute the image hash if all the rescue domain (up to the end of
+// mapfile) is finished. Must be called after 'wait_idle'.
+// Returns false only if outfile can't be read.
+//
+bool Hash_manifest::finish_image( const Mapfile & mapfile )
+  {
+  const long long extent_end = mapfile.extent().end();
+  std::vector< Block > blocks;
+  for( unsigned long i = 0; i < image_blocks.size(); ++i )
+    {
+    Block b( image_blocks[i] );
+    if( b.pos() >= extent_end ) break;
+    if( b.end() > extent_end ) b.size( extent_end - b.pos() );
+    if( !block_finished( b, mapfile ) ) return true;
+    blocks.push_back( b );
+    }
+  if( blocks.empty() || blocks.back().end() >= LLONG_MAX ) return true;
+  uint8_t digest[Sha256::digest_size];
+  const bool streamed = ( image_pos == -2 ||
+    ( image_pos == blocks.back().end() &&
+      image_index == (long)blocks.size() - 1 ) );
+  if( streamed ) image_ctx.finish( digest );
+  else						// read it back
+    {
+    const int bufsize = 65536;
+    std::vector< uint8_t > buf( bufsize );
+    Sha256 ctx;
+    for( unsigned long i = 0; i < blocks.size(); ++i )
+      for( long long pos = blocks[i].pos(); pos < blocks[i].end(); )
+        {
+        const int size = std::min( (long long)bufsize, blocks[i].end() - pos );
+        const int rd = preadblock( rdes_, &buf[0], size, pos + offset_ );
+        if( rd < size )
+          {
+          if( errno ) { read_errno = errno; return false; }
+          std::memset( &buf[rd], 0, size - rd );	// sparse outfile
+          }
+        ctx.update( &buf[0], size );
+        pos += size;
+        }
+    ctx.finish( digest );
+    }
+  digest_to_hex( digest, image_hex );
+  return true;
+  }
+
+
+// Append the hashes computed since the last call. Rewrite the whole file
+// if it contains stale hashes or if 'final_mapfile' is not null.
+//
+bool Hash_manifest::write_manifest( const Mapfile * const final_mapfile )
+  {
+  const bool has_image = ( final_mapfile && image_hex.size() );
+  xlock( &mutex );
+  const bool full = ( rewrite_pending || final_mapfile );
+  if( !full && unsaved.empty() ) { xunlock( &mutex ); return true; }
+  FILE * const f = std::fopen( filename_.c_str(), full ? "w" : "a" );
+  bool error = !f;
+  std::string hex;
+  if( f && full )
+    {
+    error = !write_file_header( f, "Hash manifest" ) ||
+      std::fprintf( f, "# Region size: 0x%08llX  Algorithm: SHA-256\n",
+                    region_size_ ) < 0;
+    if( !error && has_image &&
+        std::fprintf( f, "# Image hash:  %s\n", image_hex.c_str() ) < 0 )
+      error = true;
+    if( !error && std::fputs( "#      pos        size  sha256\n", f ) < 0 )
+      error = true;
+    for( unsigned long r = 0; !error && r < entries.size(); ++r )
+      if( entries[r].size > 0 )
+        {
+        digest_to_hex( entries[r].digest, hex );
+        if( std::fprintf( f, "0x%08llX  0x%08llX  %s\n", r * region_size_,
+                          entries[r].size, hex.c_str() ) < 0 ) error = true;
+        }
+    }
+  else if( f )
+    for( unsigned i = 0; !error && i < unsaved.size(); ++i )
+      {
+      const long r = unsaved[i];
+      digest_to_hex( entries[r].digest, hex );
+      if( std::fprintf( f, "0x%08llX  0x%08llX  %s\n", r * region_size_,
+                        entries[r].size, hex.c_str() ) < 0 ) error = true;
+      }
+  if( f && std::fclose( f ) != 0 ) error = true;
+  if( !error ) { unsaved.clear(); rewrite_pending = false; }
+  xunlock( &mutex );
+  return !error;
+  }
@@ -0,0 +1,91 @@
+/*  GNU ddrescue - Data recovery tool
+    Copyright (C) 2004-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Per-region SHA-256 hashes of the rescued data (see '--hash-regions').
+// Region 'r' covers the input positions [r * region_size, (r+1) * region_size).
+// Data are hashed as they are rescued if they arrive in order. Else the
+// region is read back from outfile once it is completely finished.
+// The image hash covers the data of the whole rescue domain. It is
+// computed by worker 0 if all the data arrive in order, else by reading
+// back outfile once the domain is finished.
+class Hash_manifest
+  {
+public:
+  struct Job;
+  struct Worker;
+
+private:
+  struct Entry
+    {
+    long long size;			// size of data hashed, or 0 if no hash
+    uint8_t digest[Sha256::digest_size];
+    Entry() : size( 0 ) {}
+    };
+
+  const std::string filename_;
+  const long long region_size_;
+  const long long offset_;		// outfile offset (opos - ipos)
+  const int rdes_;			// outfile opened for reading
+  std::vector< Block > image_blocks;	// rescue domain
+  long image_index;			// domain block containing image_pos
+  long long image_pos;			// next pos expected by image_ctx
+					// -1 = out of order, -2 = done
+  Sha256 image_ctx;			// updated only by worker 0
+  std::string image_hex;		// image hash, or empty
+  std::vector< Worker * > workers;
+  std::vector< Entry > entries;		// shared with the workers
+  std::vector< long > unsaved;		// regions hashed since last save
+  std::vector< long long > stream_pos;	// next pos expected per region
+					// -1 = out of order, -2 = done
+  pthread_mutex_t mutex;
+  pthread_cond_t cv_space;		// queue has space for more data
+  pthread_cond_t cv_idle;		// all queued jobs have been processed
+  long long queued_bytes;
+  long pending_jobs;
+  int read_errno;			// errno of last failed read of outfile
+  bool rewrite_pending;			// file contains stale entries
+
+  Hash_manifest( const Hash_manifest & );	// declared as private
+  void operator=( const Hash_manifest & );	// declared as private
+
+  Block region_block( const long r, const Mapfile & mapfile ) const;
+  void ensure_region( const long r );
+  void queue_job( Job * const job );
+  bool read_manifest( const Mapfile & mapfile );
+  void image_data( const uint8_t * const buf, const long long pos,
+                   const int size );
+
+public:
+  Hash_manifest( const char * const mapname, const long long region_size,
+                 const long long offset, const int rdes );
+  ~Hash_manifest();
+
+  bool start( const int threads, const Mapfile & mapfile,
+              const Domain & domain );
+  void worker( Worker & w );
+  void data_rescued( const uint8_t * const buf, const long long pos,
+                     const int size, const Mapfile & mapfile );
+  void hash_finished_regions( const Mapfile & mapfile );
+  void wait_idle();
+  bool write_manifest( const Mapfile * const final_mapfile = 0 );
+  bool finish_image( const Mapfile & mapfile );
+
+  const std::string & filename() const { return filename_; }
+  long long region_size() const { return region_size_; }
+  const std::string & image_hash() const { return image_hex; }
+  int read_error() const { return read_errno; }
+  };
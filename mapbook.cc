@@ -27,6 +27,7 @@
 #include <string>
 #include <vector>
 #include <stdint.h>
+#include <pthread.h>
 #include <termios.h>
 #include <unistd.h>
 
@@ -46,6 +47,13 @@ void input_pos_error( const long long pos, const long long insize )
   show_error( buf );
   }
 
+
+extern "C" void * persister_thread( void * arg )
+  {
+  ((Mapbook *)arg)->persister();
+  return 0;
+  }
+
 } // end namespace
 
 
@@ -96,7 +104,10 @@ Mapbook::Mapbook( const long long offset, const long long insize,
     softbs_( cluster * hardbs_ ),
     iobuf_size_( softbs_ + hardbs_ ),	// +hardbs for direct unaligned reads
     final_errno_( 0 ), um_t1( 0 ), um_t1s( 0 ), um_prev_mf_sync( false ),
-    mapfile_exists_( false )
+    mapfile_exists_( false ), snapshot( 0 ), snapshot_odes( -1 ),
+    snapshot_sync( false ), save_pending( false ), save_failed( false ),
+    persister_quit( false ), persister_started( false ),
+    persister_disabled( false )
   {
   long alignment = sysconf( _SC_PAGESIZE );
   if( alignment < hardbs_ || alignment % hardbs_ ) alignment = hardbs_;
@@ -129,7 +140,100 @@ Mapbook::Mapbook( const long long offset, const long long insize,
   }
 
 
+Mapbook::~Mapbook()
+  {
+  stop_persister();
+  delete snapshot;
+  delete[] iobuf_base;
+  }
+
+
+// Saves in the background the snapshots handed off by update_mapfile.
+// The outfiles are synced before writing each snapshot so that the mapfile
+// never runs ahead of data.
+//
+void Mapbook::persister()
+  {
+  xlock( &pmutex );
+  while( true )
+    {
+    while( !save_pending && !persister_quit ) xwait( &cv_save, &pmutex );
+    if( !save_pending ) break;			// quit
+    const int odes = snapshot_odes;
+    const bool mf_sync = snapshot_sync;
+    xunlock( &pmutex );
+    bool ok = sync_outfiles( odes );	// don't save a mapfile ahead of data
+    if( ok )
+      { backup_mapfile( mf_sync );
+        ok = snapshot->write_mapfile( 0, true, mf_sync ); }
+    xlock( &pmutex );
+    if( !ok ) save_failed = true;
+    save_pending = false;
+    xbroadcast( &cv_save );
+    }
+  xunlock( &pmutex );
+  }
+
+
+// Waits for the save in progress, if any, and ends the persister thread.
+//
+void Mapbook::stop_persister()
+  {
+  if( !persister_started ) return;
+  xlock( &pmutex ); persister_quit = true; xbroadcast( &cv_save );
+  xunlock( &pmutex );
+  pthread_join( persister_id, 0 );
+  xdestroy_cond( &cv_save ); xdestroy_mutex( &pmutex );
+  persister_started = false; persister_quit = false;
+  }
+
+
+// Renames the mapfile to mapfile.bak if the mapfile was fsynced.
+//
+void Mapbook::backup_mapfile( const bool mf_sync )
+  {
+  if( um_prev_mf_sync )
+    {
+    std::string mapname_bak( filename() ); mapname_bak += ".bak";
+    std::remove( mapname_bak.c_str() );		// break possible hard link
+    // keep the mapfile in place until the new one replaces it atomically
+    if( link( filename(), mapname_bak.c_str() ) != 0 )
+      std::rename( filename(), mapname_bak.c_str() );
+    }
+  um_prev_mf_sync = mf_sync;
+  }
+
+
+// Hands off a snapshot of the mapfile to the persister thread, starting
+// it if needed. Returns false if the snapshot can't be saved in background.
+//
+bool Mapbook::start_save( const int odes, const bool mf_sync )
+  {
+  if( persister_disabled ) return false;
+  if( !persister_started )
+    {
+    xinit_mutex( &pmutex ); xinit_cond( &cv_save );
+    if( pthread_create( &persister_id, 0, persister_thread, this ) != 0 )
+      { xdestroy_cond( &cv_save ); xdestroy_mutex( &pmutex );
+        persister_disabled = true; return false; }
+    persister_started = true;
+    }
+  // the persister is idle, so the snapshot can be modified without locking
+  if( !snapshot ) snapshot = new Mapfile( *this );
+  else snapshot->copy_state( *this );
+  xlock( &pmutex );
+  snapshot_odes = odes; snapshot_sync = mf_sync; save_pending = true;
+  xbroadcast( &cv_save );
+  xunlock( &pmutex );
+  return true;
+  }
+
+
 // Writes periodically the mapfile to disc.
+// Periodic saves are made in background by the persister thread so that a
+// slow mapfile disc does not stall the rescue. If the previous snapshot is
+// still being saved, the save is postponed. Forced saves, and the saves
+// following a failed background save, are made in the calling thread.
 // Returns false only if update is attempted and fails.
 //
 bool Mapbook::update_mapfile( const int odes, const bool force )
@@ -140,15 +244,27 @@ bool Mapbook::update_mapfile( const int odes, const bool force )
   const long t2 = std::time( 0 );
   if( um_t1 == 0 || um_t1 > t2 ) um_t1 = um_t1s = t2;	// initialize
   if( !force && t2 - um_t1 < interval ) return true;
+  bool failed = false;
+  if( persister_started )
+    {
+    xlock( &pmutex );
+    const bool busy = save_pending;
+    failed = save_failed; save_failed = false;
+    xunlock( &pmutex );
+    if( busy && !force ) return true;		// try again later
+    if( force ) stop_persister();		// wait for the save to finish
+    }
   const bool mf_sync = ( force || t2 - um_t1s >= mapfile_sync_interval );
-  if( odes >= 0 ) fsync( odes );
-  if( um_prev_mf_sync )
+  checkpoint();
+  if( !force && !failed && start_save( odes, mf_sync ) )
+    { um_t1 = t2; if( mf_sync ) um_t1s = t2; return true; }
+  if( !sync_outfiles( odes ) )
     {
-    std::string mapname_bak( filename() ); mapname_bak += ".bak";
-    std::remove( mapname_bak.c_str() );		// break possible hard link
-    std::rename( filename(), mapname_bak.c_str() );
+    if( verbosity >= 0 )
+      { std::fputc( '\n', stderr ); show_error( "Error syncing output file", errno ); }
+    return false;
     }
-  um_prev_mf_sync = mf_sync;
+  backup_mapfile( mf_sync );
 
   while( true )
     {
@@ -38,22 +38,44 @@ class Mapbook : public Mapfile, public Mb_options
   long um_t1, um_t1s;			// variables for update_mapfile
   bool um_prev_mf_sync;
   bool mapfile_exists_;
+					// variables for the persister thread
+  Mapfile * snapshot;			// copy of the mapfile being saved
+  pthread_t persister_id;
+  pthread_mutex_t pmutex;
+  pthread_cond_t cv_save;		// a save has been requested or done
+  int snapshot_odes;
+  bool snapshot_sync;
+  bool save_pending;			// the snapshot is being saved
+  bool save_failed;			// the last background save failed
+  bool persister_quit;
+  bool persister_started;
+  bool persister_disabled;		// thread could not be created
 
   bool save_mapfile( const char * const name );
+  void backup_mapfile( const bool mf_sync );
+  bool start_save( const int odes, const bool mf_sync );
 
   Mapbook( const Mapbook & );		// declared as private
   void operator=( const Mapbook & );	// declared as private
 
 protected:
   bool emergency_save();
+  // called before writing the mapfile so that it never runs ahead of data
+  // may be called from the persister thread. Returns false if error.
+  virtual bool sync_outfiles( const int odes )
+    { return ( odes < 0 || fsync( odes ) == 0 || errno == EINVAL ); }
+  // called from the main thread before each save of the mapfile
+  virtual void checkpoint() {}
+  void stop_persister();
 
 public:
   Mapbook( const long long offset, const long long insize,
            Domain & dom, const Mb_options & mb_opts,
            const char * const mapname, const int cluster,
            const int hardbs, const bool complete_only, const bool rescue );
-  ~Mapbook() { delete[] iobuf_base; }
+  ~Mapbook();
 
+  void persister();
   bool update_mapfile( const int odes = -1, const bool force = false );
 
   const Domain & domain() const { return domain_; }
@@ -74,6 +96,7 @@ public:
 
   void truncate_domain( const long long end )
     { domain_.crop_by_file_size( end ); }
+  void set_domain( const Domain & d ) { domain_ = d; }
   };
 
 
@@ -173,8 +196,19 @@ const char * format_time( const long t, const bool low_prec = false );
 int readblock( const int fd, uint8_t * const buf, const int size );
 int readblockp( const int fd, uint8_t * const buf, const int size,
                 const long long pos );
+int preadblock( const int fd, uint8_t * const buf, const int size,
+                const long long pos );
 int writeblockp( const int fd, const uint8_t * const buf, const int size,
                  const long long pos );
+void xinit_mutex( pthread_mutex_t * const mutex );
+void xinit_cond( pthread_cond_t * const cond );
+void xdestroy_mutex( pthread_mutex_t * const mutex );
+void xdestroy_cond( pthread_cond_t * const cond );
+void xlock( pthread_mutex_t * const mutex );
+void xunlock( pthread_mutex_t * const mutex );
+void xwait( pthread_cond_t * const cond, pthread_mutex_t * const mutex );
+void xsignal( pthread_cond_t * const cond );
+void xbroadcast( pthread_cond_t * const cond );
 bool interrupted();
 void set_signals();
 int signaled_exit();
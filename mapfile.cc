@@ -20,51 +20,273 @@
 #include <algorithm>
 #include <cctype>
 #include <cerrno>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <string>
 #include <vector>
+#include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "block.h"
 
 
+// Reads lines from a mapfile loaded in memory, or from a stream once the
+// data in memory is exhausted, with the same rules used by 'std::fgets'
+// plus 'std::sscanf' on each line in older versions, so that the line
+// numbers reported for errors are the same.
+//
+class Line_reader
+  {
+  const char * p;
+  const char * const end;
+  FILE * const f;
+  int linenum_;
+
+  int raw_char()
+    {
+    if( p < end ) return (unsigned char)*p++;
+    return f ? std::getc( f ) : EOF;
+    }
+
+  int next_char( const bool allow_comment = true )
+    {
+    int ch = raw_char();
+    if( ch == '#' && allow_comment )			// comment
+      { do ch = raw_char(); while( ch != '\n' && ch != EOF ); }
+    return ch;
+    }
+
+public:
+  enum { maxlen = 127 };
+
+  Line_reader( const char * const b, const char * const e )
+    : p( b ), end( e ), f( 0 ), linenum_( 0 ) {}
+  explicit Line_reader( FILE * const stream )
+    : p( 0 ), end( 0 ), f( stream ), linenum_( 0 ) {}
+
+  int linenum() const { return linenum_; }
+  const char * pos() const { return p; }
+
+  // Read a line discarding comments, leading whitespace and blank lines.
+  // Returns 0 if at EOF.
+  const char * get_line( char buf[maxlen+1] )
+    {
+    int ch, len = 1;
+
+    while( len == 1 )			// while line is blank
+      {
+      do { ch = next_char(); if( ch == '\n' ) ++linenum_; }
+      while( std::isspace( ch ) );
+      len = 0;
+      while( true )
+        {
+        if( ch == EOF ) { if( len > 0 ) ch = '\n'; else break; }
+        if( len < maxlen ) buf[len++] = ch;
+        if( ch == '\n' ) { ++linenum_; break; }
+        ch = next_char( std::isspace( ch ) );
+        }
+      }
+    if( len > 0 ) { buf[len] = 0; return buf; }
+    else return 0;
+    }
+  };
+
+
 namespace {
 
-int my_fgetc( FILE * const f, const bool allow_comment = true )
+// Parse an integer the same way as the conversions "%lli" (base == 0) and
+// "%d" (base == 10) of 'std::sscanf' do, saturating on overflow.
+// Return false if no number is found.
+//
+bool parse_integer( const char * & ptr, long long & value, const int base0 )
+  {
+  const char * p = ptr;
+  while( std::isspace( (unsigned char)*p ) ) ++p;
+  const bool negative = ( *p == '-' );
+  if( *p == '+' || *p == '-' ) ++p;
+  int base = base0;
+  bool prefix = false;		// like sscanf, accept "0x" alone as zero
+  if( base == 0 )
+    {
+    base = 10;
+    if( *p == '0' )
+      {
+      base = 8;
+      if( p[1] == 'x' || p[1] == 'X' ) { base = 16; p += 2; prefix = true; }
+      }
+    }
+  const unsigned long long limit = negative ? 1ULL + LLONG_MAX : LLONG_MAX;
+  unsigned long long v = 0;
+  bool overflow = false;
+  const char * const digits = p;
+  while( true )
+    {
+    const int ch = (unsigned char)*p;
+    int d;
+    if( std::isdigit( ch ) ) d = ch - '0';
+    else if( std::isxdigit( ch ) ) d = std::tolower( ch ) - 'a' + 10;
+    else break;
+    if( d >= base ) break;
+    if( v > ( limit - d ) / base ) overflow = true; else v = v * base + d;
+    ++p;
+    }
+  if( p == digits && !prefix ) return false;
+  ptr = p;
+  if( overflow ) value = negative ? LLONG_MIN : LLONG_MAX;
+  else if( negative ) value = ( v == limit ) ? LLONG_MIN : -(long long)v;
+  else value = v;
+  return true;
+  }
+
+
+bool parse_char( const char * & p, char & ch )
+  {
+  while( std::isspace( (unsigned char)*p ) ) ++p;
+  if( *p == 0 ) return false;
+  ch = *p++;
+  return true;
+  }
+
+
+// Parse a line like 'std::sscanf( line, "%lli %lli %c\n", ... )' does,
+// and return true if it is a valid block line.
+//
+bool parse_block_line( const char * line, long long & pos, long long & size,
+                       char & ch )
   {
-  int ch = std::fgetc( f );
-  if( ch == '#' && allow_comment )			// comment
-    { do ch = std::fgetc( f ); while( ch != '\n' && ch != EOF ); }
-  return ch;
+  return ( parse_integer( line, pos, 0 ) && parse_integer( line, size, 0 ) &&
+           parse_char( line, ch ) && pos >= 0 && Sblock::isstatus( ch ) &&
+           ( size > 0 || ( size == 0 && pos == 0 ) ) );
   }
 
 
-// Read a line discarding comments, leading whitespace and blank lines.
-// Returns 0 if at EOF.
+// A part of the mapfile, beginning at the start of a line, that is parsed
+// independently. The continuity of its first block with the blocks of the
+// previous chunk is checked after all the chunks have been parsed.
 //
-const char * my_fgets( FILE * const f, int & linenum )
+struct Chunk
+  {
+  const char * begin;
+  const char * end;
+  int default_sblock_status;
+  Sblock_vector sblock_vector;	// blocks read, gaps filled if loose
+  long long first_pos;		// pos of first block read
+  int first_line;		// line of first block read, relative to chunk
+  int error_line;		// line of first error, relative to chunk, or 0
+  int lines;			// number of lines counted
+
+  Chunk() : begin( 0 ), end( 0 ), default_sblock_status( 0 ), first_pos( 0 ),
+            first_line( 0 ), error_line( 0 ), lines( 0 ) {}
+  };
+
+
+void parse_chunk( Chunk & chunk )
   {
-  const int maxlen = 127;
-  static char buf[maxlen+1];
-  int ch, len = 1;
+  const bool loose = Sblock::isstatus( chunk.default_sblock_status );
+  Line_reader reader( chunk.begin, chunk.end );
+  char buf[Line_reader::maxlen+1];
+  Sblock_vector & sv = chunk.sblock_vector;
 
-  while( len == 1 )			// while line is blank
+  while( true )
     {
-    do { ch = my_fgetc( f ); if( ch == '\n' ) ++linenum; }
-    while( std::isspace( ch ) );
-    len = 0;
-    while( true )
+    const char * const line = reader.get_line( buf );
+    if( !line ) break;
+    long long pos, size;
+    char ch;
+    if( !parse_block_line( line, pos, size, ch ) )
+      { chunk.error_line = reader.linenum(); break; }
+    const Sblock sb( pos, size, Sblock::Status( ch ) );
+    if( sv.empty() )
+      { chunk.first_pos = sb.pos(); chunk.first_line = reader.linenum(); }
+    else
       {
-      if( ch == EOF ) { if( len > 0 ) ch = '\n'; else break; }
-      if( len < maxlen ) buf[len++] = ch;
-      if( ch == '\n' ) { ++linenum; break; }
-      ch = my_fgetc( f, std::isspace( ch ) );
+      const long long end = sv.end( sv.size() - 1 );
+      if( sb.pos() != end )
+        {
+        if( loose && sb.pos() > end )
+          sv.push_back( Sblock( end, sb.pos() - end,
+                                Sblock::Status( chunk.default_sblock_status ) ) );
+        else if( end > 0 ) { chunk.error_line = reader.linenum(); break; }
+        }
       }
+    sv.push_back( sb );
+    }
+  chunk.lines = reader.linenum();
+  }
+
+
+// Chunks 'first', 'first + step', 'first + 2 * step'... parsed by a thread.
+struct Chunk_stride
+  {
+  std::vector< Chunk > * chunks;
+  unsigned first;
+  unsigned step;
+  };
+
+
+void parse_stride( const Chunk_stride & stride )
+  {
+  std::vector< Chunk > & chunks = *stride.chunks;
+  for( unsigned i = stride.first; i < chunks.size(); i += stride.step )
+    parse_chunk( chunks[i] );
+  }
+
+
+extern "C" void * parse_chunk_thread( void * arg )
+  {
+  parse_stride( *(const Chunk_stride *)arg );
+  return 0;
+  }
+
+
+// Split the buffer in chunks beginning at line boundaries, and parse them
+// in parallel if the buffer is large enough. The split depends only on the
+// size of the buffer, so that the same mapfile is always parsed the same
+// way; the number of processors just limits the number of threads.
+//
+void parse_chunks( const char * const begin, const char * const end,
+                   const int default_sblock_status,
+                   std::vector< Chunk > & chunks )
+  {
+  const long min_chunk_size = 1 << 20;
+  const long max_chunks = 16;
+  const long n = std::max( 1L, std::min( max_chunks,
+                                         ( end - begin ) / min_chunk_size ) );
+  const char * b = begin;
+  for( long i = 1; i <= n && b < end; ++i )
+    {
+    const char * e = ( i < n ) ? begin + ( ( end - begin ) / n ) * i : end;
+    if( e <= b ) continue;
+    e = (const char *)std::memchr( e - 1, '\n', end - ( e - 1 ) );
+    e = e ? e + 1 : end;
+    chunks.push_back( Chunk() );
+    chunks.back().begin = b; chunks.back().end = e;
+    chunks.back().default_sblock_status = default_sblock_status;
+    b = e;
+    }
+  long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+  if( cpus < 1 ) cpus = 1;
+  const unsigned nthreads = std::min( (unsigned long)cpus,
+                                      (unsigned long)chunks.size() );
+  std::vector< Chunk_stride > strides( nthreads );
+  std::vector< pthread_t > threads( nthreads );
+  std::vector< bool > started( nthreads, false );
+  for( unsigned i = 0; i < nthreads; ++i )
+    {
+    strides[i].chunks = &chunks; strides[i].first = i;
+    strides[i].step = nthreads;
+    if( i > 0 ) started[i] = ( pthread_create( &threads[i], 0,
+                               parse_chunk_thread, &strides[i] ) == 0 );
     }
-  if( len > 0 ) { buf[len] = 0; return buf; }
-  else return 0;
+  for( unsigned i = 0; i < nthreads; ++i )
+    if( !started[i] ) parse_stride( strides[i] );	// stride 0 or no thread
+  for( unsigned i = 1; i < nthreads; ++i )
+    if( started[i] ) pthread_join( threads[i], 0 );
   }
 
 
@@ -75,57 +297,84 @@ void show_mapfile_error( const char * const mapname, const int linenum )
   show_error( buf );
   }
 
+
+// Write 'value' like "0x%08llX" does. Returns a pointer past the last char.
+//
+char * format_hex( char * p, unsigned long long value )
+  {
+  static const char digits[] = "0123456789ABCDEF";
+  char tmp[16];
+  int len = 0;
+  do { tmp[len++] = digits[value & 0x0F]; value >>= 4; } while( value );
+  *p++ = '0'; *p++ = 'x';
+  for( int i = len; i < 8; ++i ) *p++ = '0';
+  while( len > 0 ) *p++ = tmp[--len];
+  return p;
+  }
+
+
+// Make the rename of a file in directory of 'name' persistent.
+void sync_directory( const char * const name )
+  {
+  std::string dirname( name );
+  const unsigned long i = dirname.rfind( '/' );
+  if( i >= dirname.size() ) dirname = ".";
+  else dirname.resize( ( i > 0 ) ? i : 1 );
+  const int fd = open( dirname.c_str(), O_RDONLY );
+  if( fd >= 0 ) { fsync( fd ); close( fd ); }
+  }
+
 } // end namespace
 
 
 void Mapfile::compact_sblock_vector()
   {
-  unsigned long l;
-  for( l = 1; l < sblock_vector.size(); ++l )
-    if( sblock_vector[l-1].status() == sblock_vector[l].status() ) break;
-  if( l >= sblock_vector.size() ) return;	// already compacted
-  std::vector< Sblock > new_vector;
-  for( l = 0; l < sblock_vector.size(); )
+  const unsigned long size = sblock_vector.size();
+  if( size < 2 ) return;
+  unsigned long w = 0;				// last block kept
+  for( unsigned long r = 1; r < size; ++r )
     {
-    Sblock run( sblock_vector[l] );
-    unsigned long r = l + 1;
-    while( r < sblock_vector.size() &&
-           sblock_vector[r].status() == run.status() ) ++r;
-    if( r > l + 1 ) run.size( sblock_vector[r-1].end() - run.pos() );
-    new_vector.push_back( run );
-    l = r;
+    const Sblock::Status st = sblock_vector.status( r );
+    if( st != sblock_vector.status( w ) )
+      { ++w; sblock_vector.status( w, st ); }
+    sblock_vector.end( w, sblock_vector.end( r ) );
     }
-  sblock_vector.swap( new_vector );
+  sblock_vector.truncate( w + 1 );
   }
 
 
+// Blocks are processed in a single pass, joining them in place.
+//
 void Mapfile::join_subsectors( const int hardbs )
   {
-  for( unsigned long i = 0; i + 1 < sblock_vector.size(); )
+  const unsigned long size = sblock_vector.size();
+  if( size < 2 ) return;
+  unsigned long w = 0;				// last block kept (sb1)
+  for( unsigned long r = 1; r < size; ++r )	// next block read (sb2)
     {
-    const long long boundary = sblock_vector[i].end();
+    const long long boundary = sblock_vector.end( w );
+    const long long end2 = sblock_vector.end( r );
+    const Sblock::Status st1 = sblock_vector.status( w );
+    const Sblock::Status st2 = sblock_vector.status( r );
     const int rest = boundary % hardbs;		// size of subsector in sb1
-    if( rest <= 0 ) { ++i; continue; }
-    Sblock & sb1 = sblock_vector[i];
-    Sblock & sb2 = sblock_vector[i+1];
-    const Sblock::Status st1 = sb1.status();
-    const Sblock::Status st2 = sb2.status();
-    if( st1 == Sblock::finished || st2 == Sblock::finished ) { ++i; continue; }
-    // move subsector to the block with the less processed state
-    if( Sblock::processed_state( st1 ) <= Sblock::processed_state( st2 ) )
-      {
-      if( sb2.size() > hardbs - rest )		// move subsector to sb1
-        { sb1.shift_boundary( sb2, boundary + hardbs - rest ); ++i; continue; }
-      }
-    else
+    bool join = false;
+    if( rest > 0 && st1 != Sblock::finished && st2 != Sblock::finished )
       {
-      if( sb1.size() > rest )			// move subsector to sb2
-        { sb1.shift_boundary( sb2, boundary - rest ); ++i; continue; }
-      sb1.status( st2 );			// keep status of sb2
+      // move subsector to the block with the less processed state
+      if( Sblock::processed_state( st1 ) <= Sblock::processed_state( st2 ) )
+        {
+        if( end2 - boundary > hardbs - rest )	// move subsector to sb1
+          sblock_vector.end( w, boundary + hardbs - rest );
+        else join = true;
+        }
+      else if( boundary - sblock_vector.pos( w ) > rest )
+        sblock_vector.end( w, boundary - rest );	// move subsector to sb2
+      else { sblock_vector.status( w, st2 ); join = true; }	// keep st2
       }
-    sb1.enlarge( sb2.size() );			// join both blocks
-    sblock_vector.erase( sblock_vector.begin() + i + 1 );
+    if( !join ) { ++w; sblock_vector.status( w, st2 ); }
+    sblock_vector.end( w, end2 );		// join both blocks if join
     }
+  sblock_vector.truncate( w + 1 );
   }
 
 
@@ -137,18 +386,18 @@ void Mapfile::extend_sblock_vector( const long long insize )
     sblock_vector.push_back( sb );
     return;
     }
-  Sblock & front = sblock_vector.front();
-  if( front.pos() > 0 )
-    sblock_vector.insert( sblock_vector.begin(), Sblock( 0, front.pos(),
-                                                         Sblock::non_tried ) );
-  Sblock & back = sblock_vector.back();
+  const long long front_pos = sblock_vector.pos( 0 );
+  if( front_pos > 0 )
+    sblock_vector.insert( 0, Sblock( 0, front_pos, Sblock::non_tried ) );
+  const long last = sblocks() - 1;
+  const Sblock back = sblock_vector.back();
   const long long end = back.end();
   if( insize > 0 )
     {
     if( back.pos() >= insize )
       {
       if( back.pos() == insize && back.status() != Sblock::finished )
-        { sblock_vector.pop_back(); return; }
+        { sblock_vector.truncate( last ); return; }
       show_error( "Last block in mapfile begins past end of input file.\n"
                   "          Use '-C' if you are reading from a partial copy.",
                   0, true );
@@ -157,7 +406,7 @@ void Mapfile::extend_sblock_vector( const long long insize )
     if( end > insize )
       {
       if( back.status() != Sblock::finished )
-        { back.size( insize - back.pos() ); return; }
+        { sblock_vector.end( last, insize ); return; }
       show_error( "Rescued data in mapfile goes past end of input file.\n"
                   "          Use '-C' if you are reading from a partial copy.",
                   0, true );
@@ -179,29 +428,29 @@ void Mapfile::shift_blocks( const long long offset )
   if( sblock_vector.empty() ) return;
   if( offset > 0 )
     {
-    if( sblock_vector.front().status() == Sblock::non_tried )
-      sblock_vector.front().enlarge( offset );
-    else
-      insert_sblock( 0, Sblock( 0, offset, Sblock::non_tried ) );
-    for( unsigned long i = 1; i < sblock_vector.size(); ++i )
+    const long long front_pos = sblock_vector.pos( 0 );
+    long long pos = front_pos;			// old pos of block i
+    for( unsigned long i = 0; i < sblock_vector.size(); ++i )
       {
-      sblock_vector[i].shift( offset );
-      if( sblock_vector[i].size() <= 0 )
-        { sblock_vector.erase( sblock_vector.begin() + i, sblock_vector.end() );
-          break; }
+      if( i > 0 && pos >= LLONG_MAX - offset )
+        { sblock_vector.truncate( i ); break; }
+      pos = sblock_vector.end( i );
+      sblock_vector.end( i, ( pos > LLONG_MAX - offset ) ?
+                            LLONG_MAX : pos + offset );
       }
+    if( sblock_vector.status( 0 ) != Sblock::non_tried )
+      sblock_vector.insert( 0, Sblock( 0, front_pos + offset,
+                                       Sblock::non_tried ) );
     }
   else if( offset < 0 )
     {
-    for( unsigned long i = 0; i < sblock_vector.size(); ++i )
-      if( sblock_vector[i].end() + offset > 0 )
-        {
-        if( i > 0 )
-          sblock_vector.erase( sblock_vector.begin(), sblock_vector.begin() + i );
-        break;
-        }
-    for( unsigned long i = 0; i < sblock_vector.size(); ++i )
-      sblock_vector[i].shift( offset );
+    unsigned long i = 0;
+    while( i < sblock_vector.size() && sblock_vector.end( i ) + offset <= 0 )
+      ++i;
+    if( i < sblock_vector.size() ) sblock_vector.erase_front( i );
+    sblock_vector.first_pos( std::max( sblock_vector.pos( 0 ) + offset, 0LL ) );
+    for( i = 0; i < sblock_vector.size(); ++i )
+      sblock_vector.end( i, std::max( sblock_vector.end( i ) + offset, 0LL ) );
     }
   }
 
@@ -212,10 +461,10 @@ void Mapfile::shift_blocks( const long long offset )
 bool Mapfile::truncate_vector( const long long end, const bool force )
   {
   unsigned long i = sblock_vector.size();
-  while( i > 0 && sblock_vector[i-1].pos() >= end ) --i;
+  while( i > 0 && sblock_vector.pos( i - 1 ) >= end ) --i;
   if( !force )
     for( unsigned long j = i; j < sblock_vector.size(); ++j )
-      if( sblock_vector[j].status() == Sblock::finished ) return false;
+      if( sblock_vector.status( j ) == Sblock::finished ) return false;
   if( i == 0 )
     {
     sblock_vector.clear();
@@ -223,13 +472,13 @@ bool Mapfile::truncate_vector( const long long end, const bool force )
     }
   else
     {
-    Sblock & sb = sblock_vector[i-1];
-    if( sb.includes( end ) )
+    if( sblock_vector.end( i - 1 ) > end )
       {
-      if( !force && sb.status() == Sblock::finished ) return false;
-      sb.size( end - sb.pos() );
+      if( !force && sblock_vector.status( i - 1 ) == Sblock::finished )
+        return false;
+      sblock_vector.end( i - 1, end );
       }
-    sblock_vector.erase( sblock_vector.begin() + i, sblock_vector.end() );
+    sblock_vector.truncate( i );
     }
   return true;
   }
@@ -237,6 +486,8 @@ bool Mapfile::truncate_vector( const long long end, const bool force )
 
 // Returns true if mapfile exists and is readable.
 // Fills the gaps if 'default_sblock_status' is a valid status character.
+// The mapfile is mapped in memory (or read whole if it can't be mapped),
+// then parsed in parallel chunks.
 //
 bool Mapfile::read_mapfile( const int default_sblock_status, const bool ro )
   {
@@ -247,64 +498,118 @@ bool Mapfile::read_mapfile( const int default_sblock_status, const bool ro )
   else if( ro || ( !(f = std::fopen( filename_, "r+" )) && errno != ENOENT ) )
     { f = std::fopen( filename_, "r" ); read_only_ = true; }
   if( !f ) return false;
-  int linenum = 0;
   const bool loose = Sblock::isstatus( default_sblock_status );
   sblock_vector.clear();
 
-  const char * line = my_fgets( f, linenum );
+  const char * data = 0;
+  long long data_size = 0;
+  void * map = MAP_FAILED;
+  std::string contents;
+  struct stat st;
+  if( fstat( fileno( f ), &st ) == 0 && S_ISREG( st.st_mode ) &&
+      st.st_size > 0 && st.st_size <= LONG_MAX &&
+      ( map = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fileno( f ), 0 ) )
+      != MAP_FAILED )
+    { data = (const char *)map; data_size = st.st_size; }
+  else
+    {
+    char buf[65536];
+    while( true )
+      {
+      const int rd = std::fread( buf, 1, sizeof buf, f );
+      if( rd > 0 ) contents.append( buf, rd );
+      if( rd < (int)sizeof buf ) break;
+      }
+    data = contents.data(); data_size = contents.size();
+    }
+
+  Line_reader reader( data, data + data_size );
+  char buf[Line_reader::maxlen+1];
+  int linenum = 0;
+  const char * line = reader.get_line( buf );
+  linenum = reader.linenum();
   if( line )						// status line
     {
-    char ch;
     current_pass_ = 1;					// default value
-    const int n = std::sscanf( line, "%lli %c %d\n",
-                               &current_pos_, &ch, &current_pass_ );
+    long long pos, pass = 1;
+    char ch = 0;
+    const char * p = line;
+    const int n = !parse_integer( p, pos, 0 ) ? 0 :
+                  !parse_char( p, ch ) ? 1 :
+                  !parse_integer( p, pass, 10 ) ? 2 : 3;
+    if( n >= 1 ) current_pos_ = pos;
+    if( n >= 3 ) current_pass_ = ( pass >= 1 && pass <= INT_MAX ) ? pass : 0;
     if( ( n == 3 || n == 2 ) && current_pos_ >= 0 && isstatus( ch ) &&
         current_pass_ >= 1 )
       current_status_ = Status( ch );
     else
       { show_mapfile_error( filename_, linenum ); std::exit( 2 ); }
 
-    while( true )
+    std::vector< Chunk > chunks;
+    parse_chunks( reader.pos(), data + data_size, default_sblock_status,
+                  chunks );
+    unsigned long total = 0;
+    for( unsigned i = 0; i < chunks.size(); ++i )
+      total += chunks[i].sblock_vector.size() + 1;
+    sblock_vector.reserve( total );
+    for( unsigned i = 0; i < chunks.size(); ++i )	// check continuity
       {
-      line = my_fgets( f, linenum );
-      if( !line ) break;
-      long long pos, size;
-      const int n = std::sscanf( line, "%lli %lli %c\n", &pos, &size, &ch );
-      if( n == 3 && pos >= 0 && Sblock::isstatus( ch ) &&
-          ( size > 0 || ( size == 0 && pos == 0 ) ) )
+      Chunk & chunk = chunks[i];
+      if( chunk.sblock_vector.size() )
         {
-        const Sblock sb( pos, size, Sblock::Status( ch ) );
         const long long end = sblock_vector.size() ?
-                              sblock_vector.back().end() : 0;
-        if( sb.pos() != end )
+                              sblock_vector.end( sblocks() - 1 ) : 0;
+        if( chunk.first_pos != end )
           {
-          if( loose && sb.pos() > end )
-            { const Sblock sb2( end, sb.pos() - end,
+          if( loose && chunk.first_pos > end )
+            { const Sblock sb2( end, chunk.first_pos - end,
                                 Sblock::Status( default_sblock_status ) );
               sblock_vector.push_back( sb2 ); }
           else if( end > 0 )
-            { show_mapfile_error( filename_, linenum ); std::exit( 2 ); }
+            { show_mapfile_error( filename_, linenum + chunk.first_line );
+              std::exit( 2 ); }
           }
-        sblock_vector.push_back( sb );
+        sblock_vector.append( chunk.sblock_vector );
+        Sblock_vector().swap( chunk.sblock_vector );	// free memory
         }
-      else
-        { show_mapfile_error( filename_, linenum ); std::exit( 2 ); }
+      if( chunk.error_line > 0 )
+        { show_mapfile_error( filename_, linenum + chunk.error_line );
+          std::exit( 2 ); }
+      linenum += chunk.lines;
       }
     }
-  if( std::ferror( f ) || !std::feof( f ) || std::fclose( f ) != 0 )
+  if( map != MAP_FAILED ) munmap( map, data_size );
+  if( std::ferror( f ) || std::fclose( f ) != 0 )
     { show_mapfile_error( filename_, linenum ); std::exit( 2 ); }
   return true;
   }
 
 
+// If writing to 'filename_', the mapfile is first written to a temporary
+// file and then renamed over the old mapfile, so that a crash during the
+// write never leaves a truncated mapfile.
+//
 bool Mapfile::write_mapfile( FILE * f, const bool timestamp,
                              const bool mf_sync,
                              const Domain * const annotate_domainp ) const
   {
   const bool f_given = ( f != 0 );
+  std::string tmpname;
 
   if( !f && !filename_ ) return false;
-  if( !f ) { f = std::fopen( filename_, "w" ); if( !f ) return false; }
+  if( !f )
+    {
+    struct stat st;
+    const bool exists = ( lstat( filename_, &st ) == 0 );
+    if( !exists || S_ISREG( st.st_mode ) )	// else write in place
+      {
+      tmpname = filename_; tmpname += ".tmp";
+      std::remove( tmpname.c_str() );		// break possible hard link
+      }
+    f = std::fopen( tmpname.size() ? tmpname.c_str() : filename_, "w" );
+    if( !f ) return false;
+    if( tmpname.size() && exists ) fchmod( fileno( f ), st.st_mode & 07777 );
+    }
   write_file_header( f, "Mapfile" );
   if( timestamp ) write_timestamp( f );
   if( current_msg.size() ) std::fprintf( f, "# %s\n", current_msg.c_str() );
@@ -315,25 +620,51 @@ bool Mapfile::write_mapfile( FILE * f, const bool timestamp,
                    "0x%08llX     %c               %d%s\n"
                    "#      pos        size  status\n",
                 current_pos_, current_status_, current_pass_, buf );
+  const int obuf_size = 1 << 20;
+  std::vector< char > obuf( obuf_size );
+  char * const obegin = &obuf[0];
+  char * p = obegin;
   for( unsigned long i = 0; i < sblock_vector.size(); ++i )
     {
-    const Sblock & sb = sblock_vector[i];
+    if( p - obegin > obuf_size - 128 )
+      { std::fwrite( obegin, 1, p - obegin, f ); p = obegin; }
+    const Sblock sb( sblock_vector[i] );
+    p = format_hex( p, sb.pos() ); *p++ = ' '; *p++ = ' ';
+    p = format_hex( p, sb.size() ); *p++ = ' '; *p++ = ' ';
+    *p++ = sb.status();
     if( annotate_domainp && annotate_domainp->includes( sb ) )
+      {
       snprintf( buf, sizeof buf, "\t#  %9sB  %9s%c", format_num( sb.pos() ),
                 format_num( sb.size() ), ( sb.size() > 999999 ) ? 'B' : ' ' );
-    else buf[0] = 0;
-    std::fprintf( f, "0x%08llX  0x%08llX  %c%s\n",
-                  sb.pos(), sb.size(), sb.status(), buf );
+      for( const char * q = buf; *q; ++q ) *p++ = *q;
+      }
+    *p++ = '\n';
     }
-  if( mf_sync ) fsync( fileno( f ) );
-  return ( f_given || std::fclose( f ) == 0 );
+  if( p > obegin ) std::fwrite( obegin, 1, p - obegin, f );
+  std::fflush( f );
+  bool error = false;
+  if( tmpname.size() )		// data must be on disc before the rename
+    error = ( fdatasync( fileno( f ) ) != 0 && errno != EINVAL );
+  else if( mf_sync ) fsync( fileno( f ) );
+  if( f_given ) return true;
+  if( std::ferror( f ) ) error = true;
+  if( std::fclose( f ) != 0 || error ||
+      ( tmpname.size() && std::rename( tmpname.c_str(), filename_ ) != 0 ) )
+    {
+    if( tmpname.size() )
+      { const int saved_errno = errno; std::remove( tmpname.c_str() );
+        errno = saved_errno; }
+    return false;
+    }
+  if( tmpname.size() && mf_sync ) sync_directory( filename_ );
+  return true;
   }
 
 
 bool Mapfile::blank() const
   {
   for( unsigned long i = 0; i < sblock_vector.size(); ++i )
-    if( sblock_vector[i].status() != Sblock::non_tried )
+    if( sblock_vector.status( i ) != Sblock::non_tried )
       return false;
   return true;
   }
@@ -345,30 +676,36 @@ void Mapfile::split_by_domain_borders( const Domain & domain )
     {
     const Block & db = domain.block( 0 );
     unsigned long i = 0;
-    while( i < sblock_vector.size() && sblock_vector[i] < db ) ++i;
+    while( i < sblock_vector.size() && sblock_vector.end( i ) <= db.pos() ) ++i;
     if( i < sblock_vector.size() ) try_split_sblock_by( db.pos(), i );
     i = sblock_vector.size();
-    while( i > 0 && db < sblock_vector[i-1] ) --i;
+    while( i > 0 && db.end() <= sblock_vector.pos( i - 1 ) ) --i;
     if( i > 0 ) try_split_sblock_by( db.end(), i - 1 );
     }
-  else
+  else if( sblock_vector.size() )
     {
-    std::vector< Sblock > new_vector;
+    Sblock_vector new_vector;
+    new_vector.reserve( sblock_vector.size() + 2 * domain.blocks() );
     long j = 0;
-    for( unsigned long i = 0; i < sblock_vector.size(); )
+    unsigned long i = 0;
+    Sblock sb( sblock_vector[i] );
+    while( true )
       {
-      Sblock & sb = sblock_vector[i];
       while( j < domain.blocks() && domain.block( j ) < sb ) ++j;
       if( j >= domain.blocks() )		// end of domain tail copy
-        { new_vector.insert( new_vector.end(),
-                             sblock_vector.begin() + i, sblock_vector.end() );
+        { new_vector.push_back( sb );
+          while( ++i < sblock_vector.size() )
+            new_vector.push_back( sblock_vector[i] );
           break; }
       const Block & db = domain.block( j );
       if( sb.strictly_includes( db.pos() ) )
         new_vector.push_back( sb.split( db.pos() ) );
       if( sb.strictly_includes( db.end() ) )
         new_vector.push_back( sb.split( db.end() ) );
-      if( sb.pos() < db.end() ) { new_vector.push_back( sb ); ++i; }
+      if( sb.pos() < db.end() )
+        { new_vector.push_back( sb );
+          if( ++i >= sblock_vector.size() ) break;
+          sb = sblock_vector[i]; }
       }
     sblock_vector.swap( new_vector );
     }
@@ -377,22 +714,30 @@ void Mapfile::split_by_domain_borders( const Domain & domain )
 
 void Mapfile::split_by_mapfile_borders( const Mapfile & mapfile )
   {
-  std::vector< Sblock > new_vector;
+  if( sblock_vector.empty() ) return;
+  Sblock_vector new_vector;
+  new_vector.reserve( sblock_vector.size() + 2 * mapfile.sblocks() );
   long j = 0;
-  for( unsigned long i = 0; i < sblock_vector.size(); )
+  unsigned long i = 0;
+  Sblock sb( sblock_vector[i] );
+  while( true )
     {
-    Sblock & sb = sblock_vector[i];
-    while( j < mapfile.sblocks() && mapfile.sblock( j ) < sb ) ++j;
+    while( j < mapfile.sblocks() && mapfile.sblock_vector.end( j ) <= sb.pos() )
+      ++j;
     if( j >= mapfile.sblocks() )		// end of mapfile tail copy
-      { new_vector.insert( new_vector.end(),
-                           sblock_vector.begin() + i, sblock_vector.end() );
+      { new_vector.push_back( sb );
+        while( ++i < sblock_vector.size() )
+          new_vector.push_back( sblock_vector[i] );
         break; }
-    const Sblock & db = mapfile.sblock( j );
+    const Sblock db( mapfile.sblock( j ) );
     if( sb.strictly_includes( db.pos() ) )
       new_vector.push_back( sb.split( db.pos() ) );
     if( sb.strictly_includes( db.end() ) )
       new_vector.push_back( sb.split( db.end() ) );
-    if( sb.pos() < db.end() ) { new_vector.push_back( sb ); ++i; }
+    if( sb.pos() < db.end() )
+      { new_vector.push_back( sb );
+        if( ++i >= sblock_vector.size() ) break;
+        sb = sblock_vector[i]; }
     }
   sblock_vector.swap( new_vector );
   }
@@ -401,11 +746,12 @@ void Mapfile::split_by_mapfile_borders( const Mapfile & mapfile )
 long Mapfile::find_index( const long long pos ) const
   {
   if( index_ < 0 || index_ >= sblocks() ) index_ = sblocks() / 2;
-  while( index_ + 1 < sblocks() && pos >= sblock_vector[index_+1].pos() )
+  while( index_ + 1 < sblocks() && pos >= sblock_vector.pos( index_ + 1 ) )
     ++index_;
-  while( index_ > 0 && pos < sblock_vector[index_].pos() )
+  while( index_ > 0 && pos < sblock_vector.pos( index_ ) )
     --index_;
-  if( !sblock_vector[index_].includes( pos ) ) index_ = -1;
+  if( pos < sblock_vector.pos( index_ ) || pos >= sblock_vector.end( index_ ) )
+    index_ = -1;
   return index_;
   }
 
@@ -422,29 +768,30 @@ bool Mapfile::find_chunk( Block & b, const Sblock::Status st,
                           const bool unfinished ) const
   {
   if( b.size() <= 0 ) return false;
-  if( b.pos() < sblock_vector.front().pos() )
-    b.pos( sblock_vector.front().pos() );
+  if( b.pos() < sblock_vector.pos( 0 ) )
+    b.pos( sblock_vector.pos( 0 ) );
   if( find_index( b.pos() ) < 0 ) { b.size( 0 ); return false; }
+  Domain_cursor dc( domain );
   long i;
   bool block_found = false;
   for( i = index_; i < sblocks(); ++i )
     {
-    const Sblock::Status ist = sblock_vector[i].status();
+    const Sblock::Status ist = sblock_vector.status( i );
     if( ( ist == st || ( unfinished && ist != Sblock::finished ) ) &&
-        domain.includes( sblock_vector[i] ) )
+        dc.includes( sblock_vector[i] ) )
       {
       block_found = true;
       if( !after_finished || i <= 0 ||
-          sblock_vector[i-1].status() == Sblock::finished )
+          sblock_vector.status( i - 1 ) == Sblock::finished )
         { index_ = i; break; }
       }
     }
   if( i >= sblocks() ) { b.size( 0 ); return block_found; }
-  if( b.pos() < sblock_vector[index_].pos() )
-    b.pos( sblock_vector[index_].pos() );
+  if( b.pos() < sblock_vector.pos( index_ ) )
+    b.pos( sblock_vector.pos( index_ ) );
   if( !sblock_vector[index_].includes( b ) )
     b.crop( sblock_vector[index_] );
-  if( b.end() != sblock_vector[index_].end() )
+  if( b.end() != sblock_vector.end( index_ ) )
     b.align_end( alignment );
   return block_found;
   }
@@ -460,25 +807,26 @@ bool Mapfile::rfind_chunk( Block & b, const Sblock::Status st,
                            const bool before_finished ) const
   {
   if( b.size() <= 0 ) return false;
-  if( b.end() > sblock_vector.back().end() )
-    b.end( sblock_vector.back().end() );
+  if( b.end() > sblock_vector.end( sblocks() - 1 ) )
+    b.end( sblock_vector.end( sblocks() - 1 ) );
   if( find_index( b.end() - 1 ) < 0 ) { b.size( 0 ); return false; }
+  Domain_cursor dc( domain );
   long i;
   bool block_found = false;
   for( i = index_; i >= 0; --i )
-    if( sblock_vector[i].status() == st && domain.includes( sblock_vector[i] ) )
+    if( sblock_vector.status( i ) == st && dc.includes( sblock_vector[i] ) )
       {
       block_found = true;
       if( !before_finished || i + 1 >= sblocks() ||
-          sblock_vector[i+1].status() == Sblock::finished )
+          sblock_vector.status( i + 1 ) == Sblock::finished )
         { index_ = i; break; }
       }
   if( i < 0 ) { b.size( 0 ); return block_found; }
-  if( b.end() > sblock_vector[index_].end() )
-    b.end( sblock_vector[index_].end() );
+  if( b.end() > sblock_vector.end( index_ ) )
+    b.end( sblock_vector.end( index_ ) );
   if( !sblock_vector[index_].includes( b ) )
     b.crop( sblock_vector[index_] );
-  if( b.pos() != sblock_vector[index_].pos() )
+  if( b.pos() != sblock_vector.pos( index_ ) )
     b.align_pos( alignment );
   return block_found;
   }
@@ -504,57 +852,54 @@ int Mapfile::change_chunk_status( const Block & b, const Sblock::Status st,
     internal_error( "can't change status of chunk not in rescue domain." );
   if( !sblock_vector[index_].includes( b ) )
     internal_error( "can't change status of chunk spread over more than 1 block." );
-  const Sblock::Status old_st = sblock_vector[index_].status();
+  const Sblock::Status old_st = sblock_vector.status( index_ );
   if( old_stp ) *old_stp = old_st;
   if( st == old_st ) return 0;
   const bool old_st_good = Sblock::is_good_status( old_st );
   const bool new_st_good = Sblock::is_good_status( st );
   bool bl_st_good = ( index_ <= 0 ||
-                      Sblock::is_good_status( sblock_vector[index_-1].status() ) ||
+                      Sblock::is_good_status( sblock_vector.status( index_ - 1 ) ) ||
                       !domain.includes( sblock_vector[index_-1] ) );
   bool br_st_good = ( index_ + 1 >= sblocks() ||
-                      Sblock::is_good_status( sblock_vector[index_+1].status() ) ||
+                      Sblock::is_good_status( sblock_vector.status( index_ + 1 ) ) ||
                       !domain.includes( sblock_vector[index_+1] ) );
 
-  if( sblock_vector[index_].pos() < b.pos() )
+  if( sblock_vector.pos( index_ ) < b.pos() )
     {
-    if( sblock_vector[index_].end() == b.end() &&
-        index_ + 1 < sblocks() && sblock_vector[index_+1].status() == st &&
+    if( sblock_vector.end( index_ ) == b.end() &&
+        index_ + 1 < sblocks() && sblock_vector.status( index_ + 1 ) == st &&
         domain.includes( sblock_vector[index_+1] ) )
       {
-      sblock_vector[index_].shift_boundary( sblock_vector[index_+1], b.pos() );
+      sblock_vector.end( index_, b.pos() );	// shift boundary
       return 0;
       }
-    insert_sblock( index_, sblock_vector[index_].split( b.pos() ) );
+    const long long pos = sblock_vector.pos( index_ );
+    sblock_vector.insert( index_, Sblock( pos, b.pos() - pos, old_st ) );
     ++index_;
     bl_st_good = old_st_good;
     }
-  if( sblock_vector[index_].size() > b.size() )
+  if( sblock_vector.end( index_ ) > b.end() )
     {
-    if( index_ > 0 && sblock_vector[index_-1].status() == st &&
+    if( index_ > 0 && sblock_vector.status( index_ - 1 ) == st &&
         domain.includes( sblock_vector[index_-1] ) )
-      sblock_vector[index_-1].shift_boundary( sblock_vector[index_], b.end() );
+      sblock_vector.end( index_ - 1, b.end() );	// shift boundary
     else
-      insert_sblock( index_,
-                     Sblock( sblock_vector[index_].split( b.end() ), st ) );
+      sblock_vector.insert( index_, Sblock( b, st ) );
     br_st_good = old_st_good;
     }
   else
     {
-    sblock_vector[index_].status( st );
+    sblock_vector.status( index_, st );
     const bool bl_join = ( index_ > 0 &&
-                           sblock_vector[index_-1].status() == st &&
+                           sblock_vector.status( index_ - 1 ) == st &&
                            domain.includes( sblock_vector[index_-1] ) );
     const bool br_join = ( index_ + 1 < sblocks() &&
-                           sblock_vector[index_+1].status() == st &&
+                           sblock_vector.status( index_ + 1 ) == st &&
                            domain.includes( sblock_vector[index_+1] ) );
     if( bl_join || br_join )
       {
-      if( br_join ) sblock_vector[index_].join( sblock_vector[index_+1] );
-      if( bl_join )
-        { --index_; sblock_vector[index_].join( sblock_vector[index_+1] ); }
-      sblock_vector.erase( sblock_vector.begin() + ( index_ + 1 ),
-                           sblock_vector.begin() + ( index_ + 1 + bl_join + br_join ) );
+      if( bl_join ) --index_;
+      sblock_vector.join( index_, bl_join + br_join );
       }
     }
   int retval = 0;
@@ -578,3 +923,48 @@ const char * Mapfile::status_name( const Mapfile::Status st )
     }
   return "unknown";			// should not be reached
   }
+
+
+Mapfile_reader::~Mapfile_reader()
+  {
+  delete reader;
+  if( f && f != stdin ) std::fclose( f );
+  }
+
+
+bool Mapfile_reader::open()
+  {
+  if( std::strcmp( filename_, "-" ) == 0 ) f = stdin;
+  else f = std::fopen( filename_, "r" );
+  if( !f ) return false;
+  reader = new Line_reader( f );
+  char buf[Line_reader::maxlen+1];
+  const char * line = reader->get_line( buf );
+  if( line )						// status line
+    {
+    long long pos, pass = 1;
+    char ch = 0;
+    const int n = !parse_integer( line, pos, 0 ) ? 0 :
+                  !parse_char( line, ch ) ? 1 :
+                  !parse_integer( line, pass, 10 ) ? 2 : 3;
+    if( n < 2 || pos < 0 || !Mapfile::isstatus( ch ) || pass < 1 )
+      { show_mapfile_error( filename_, reader->linenum() ); std::exit( 2 ); }
+    }
+  return true;
+  }
+
+
+bool Mapfile_reader::read_sblock( Sblock & sb )
+  {
+  char buf[Line_reader::maxlen+1];
+  const char * const line = reader->get_line( buf );
+  if( !line ) return false;
+  long long pos, size;
+  char ch;
+  if( !parse_block_line( line, pos, size, ch ) ||
+      ( next_pos >= 0 && pos != next_pos ) )	// first block may be anywhere
+    { show_mapfile_error( filename_, reader->linenum() ); std::exit( 2 ); }
+  sb = Sblock( pos, size, Sblock::Status( ch ) );
+  next_pos = sb.end();
+  return true;
+  }
@@ -23,6 +23,7 @@
 
 #ifdef USE_NON_POSIX
 #include <cctype>
+#include <climits>
 #include <sys/ioctl.h>
 
 namespace {
@@ -56,6 +57,8 @@ bool device_id( const int fd, std::string & id_str )
   return true;
   }
 
+bool device_geometry( const int, Device_geometry & ) { return false; }
+
 #elif defined(__CYGWIN__)
 #include <io.h>
 #define _WIN32_WINNT 0x0600	// >= Vista, for BusTypeSata
@@ -105,7 +108,10 @@ bool device_id( const int fd, std::string & id_str )
   return true;
   }
 
+bool device_geometry( const int, Device_geometry & ) { return false; }
+
 #else				// use linux by default
+#include <linux/fs.h>
 #include <linux/hdreg.h>
 
 bool device_id( const int fd, std::string & id_str )
@@ -122,10 +128,37 @@ bool device_id( const int fd, std::string & id_str )
   return false;
   }
 
+bool device_geometry( const int fd, Device_geometry & dg )
+  {
+  int logical_bs = 0;
+  unsigned int tmp = 0;
+
+  if( ioctl( fd, BLKSSZGET, &logical_bs ) != 0 || logical_bs <= 0 )
+    return false;
+  dg = Device_geometry();
+  dg.logical_bs = dg.physical_bs = logical_bs;
+#ifdef BLKPBSZGET
+  if( ioctl( fd, BLKPBSZGET, &tmp ) == 0 && tmp > 0 && tmp <= INT_MAX )
+    dg.physical_bs = tmp;
+#endif
+#ifdef BLKIOMIN
+  if( ioctl( fd, BLKIOMIN, &tmp ) == 0 && tmp <= INT_MAX ) dg.io_min = tmp;
+#endif
+#ifdef BLKIOOPT
+  if( ioctl( fd, BLKIOOPT, &tmp ) == 0 && tmp <= INT_MAX ) dg.io_opt = tmp;
+#endif
+#ifdef BLKALIGNOFF
+  int offset = 0;
+  if( ioctl( fd, BLKALIGNOFF, &offset ) == 0 ) dg.alignment_offset = offset;
+#endif
+  return true;
+  }
+
 #endif
 
 #else	// USE_NON_POSIX
 
 bool device_id( const int, std::string & ) { return false; }
+bool device_geometry( const int, Device_geometry & ) { return false; }
 
 #endif
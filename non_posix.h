@@ -15,4 +15,18 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+struct Device_geometry
+  {
+  int logical_bs;		// smallest addressable unit (BLKSSZGET)
+  int physical_bs;		// smallest unit written atomically (BLKPBSZGET)
+  int io_min;			// minimum preferred I/O size, or 0
+  int io_opt;			// optimal I/O size, or 0
+  int alignment_offset;		// offset of first physical sector boundary
+
+  Device_geometry()
+    : logical_bs( 0 ), physical_bs( 0 ), io_min( 0 ), io_opt( 0 ),
+      alignment_offset( 0 ) {}
+  };
+
 bool device_id( const int fd, std::string & id_str );
+bool device_geometry( const int fd, Device_geometry & dg );
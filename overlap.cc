@@ -0,0 +1,234 @@
+/*  GNU ddrescue - Data recovery tool
+    Copyright (C) 2004-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "rational.h"
+#include "block.h"
+#include "mapbook.h"
+#include "rescuebook.h"
+
+
+namespace {
+
+extern "C" void * overlap_worker_start( void * arg )
+  {
+  ((Overlap_worker *)arg)->worker();
+  return 0;
+  }
+
+} // end namespace
+
+
+Overlap_worker::Overlap_worker( const Domain * const test_domain,
+                                const Rational & pause_on_error,
+                                const int hardbs, const int o_direct_in )
+  : test_domain_( test_domain ), pause_on_error_( pause_on_error ),
+    hardbs_( hardbs ), o_direct_in_( o_direct_in ), fd_( -1 ),
+    first( 0 ), count( 0 ), task( 0, 0 ), task_pos( 0 ), task_end( 0 ),
+    lbad( false ), rbad( false ), scrape( false ), leased( false ),
+    finished( false ), quit( false ), started( false )
+  {
+  long alignment = sysconf( _SC_PAGESIZE );
+  if( alignment < hardbs || alignment % hardbs ) alignment = hardbs;
+  if( alignment < 2 ) alignment = 0;
+  buf = buf_base = new uint8_t[ alignment + max_results * hardbs ];
+  if( alignment > 1 )
+    {
+    const int disp =
+      alignment - ( reinterpret_cast<unsigned long long> (buf) % alignment );
+    if( disp > 0 && disp < alignment ) buf += disp;
+    }
+  }
+
+
+Overlap_worker::~Overlap_worker()
+  {
+  stop();
+  if( fd_ >= 0 ) close( fd_ );
+  delete[] buf_base;
+  }
+
+
+// The worker reads from its own descriptor so that the infile can be
+// reopened (option '-O') while a read is in progress.
+//
+bool Overlap_worker::start( const int ides )
+  {
+  fd_ = dup( ides );
+  if( fd_ < 0 ) return false;
+  xinit_mutex( &mutex ); xinit_cond( &cv );
+  const int errcode = pthread_create( &worker_id, 0, overlap_worker_start, this );
+  if( errcode )
+    { xdestroy_cond( &cv ); xdestroy_mutex( &mutex ); errno = errcode;
+      return false; }
+  started = true;
+  return true;
+  }
+
+
+// Reads sector 'b' into the next free slot and queues the result.
+// Returns false if the read had an error or if told to quit.
+// Called with the mutex locked.
+//
+bool Overlap_worker::read_sector( const Block & b )
+  {
+  while( count >= max_results && !quit ) xwait( &cv, &mutex );
+  if( quit ) return false;
+  const int slot = ( first + count ) % max_results;
+  uint8_t * const data = buf + slot * hardbs_;
+  xunlock( &mutex );
+  int copied_size = 0, errcode = 0;
+  struct timeval tv0, tv1;
+  gettimeofday( &tv0, 0 );
+  if( !test_domain_ || test_domain_->includes( b ) )
+    {
+    const int pre = o_direct_in_ ? b.pos() % hardbs_ : 0;	// b is in 1 sector
+    const int size = o_direct_in_ ? hardbs_ : b.size();
+    copied_size = preadblock( fd_, data, size, b.pos() - pre );
+    errcode = errno;
+    copied_size -= std::min( pre, copied_size );
+    if( copied_size > b.size() ) copied_size = b.size();
+    if( pre > 0 && copied_size > 0 )
+      std::copy( data + pre, data + pre + copied_size, data );
+    }
+  else errcode = EIO;
+  gettimeofday( &tv1, 0 );
+  if( errcode ) pause_interval( pause_on_error_ );
+  xlock( &mutex );
+  Result & r = results[slot];
+  r.b = b; r.copied_size = copied_size; r.errcode = errcode;
+  r.usecs = std::max( 0LL, ( tv1.tv_sec - tv0.tv_sec ) * 1000000LL +
+                           tv1.tv_usec - tv0.tv_usec );
+  ++count;
+  xbroadcast( &cv );
+  return ( errcode == 0 && copied_size == b.size() && !quit );
+  }
+
+
+// Trims both edges of the task like Rescuebook::trim_errors, or scrapes
+// it, leaving in [task_pos, task_end) the part not trimmed.
+//
+void Overlap_worker::trim_task()
+  {
+  long long pos = task.pos();
+  long long end = task.end();
+  bool error_found = lbad && !scrape;
+  while( pos < end && !error_found )		// trim leading edge
+    {
+    Block b( pos, std::min( (long long)hardbs_, end - pos ) );
+    if( b.end() != end ) b.align_end( hardbs_ );
+    pos = b.end();
+    if( !read_sector( b ) )
+      { if( quit ) return; if( !scrape ) error_found = true; }
+    }
+  error_found = rbad;
+  while( pos < end && !error_found )		// trim trailing edge
+    {
+    const int size = std::min( (long long)hardbs_, end - pos );
+    Block b( end - size, size );
+    if( b.pos() != pos ) b.align_pos( hardbs_ );
+    end = b.pos();
+    if( !read_sector( b ) ) { if( quit ) return; error_found = true; }
+    }
+  task_pos = pos; task_end = end;
+  finished = true;
+  xbroadcast( &cv );
+  }
+
+
+void Overlap_worker::worker()
+  {
+  xlock( &mutex );
+  while( true )
+    {
+    while( ( !leased || finished ) && !quit ) xwait( &cv, &mutex );
+    if( quit ) break;
+    trim_task();
+    }
+  xunlock( &mutex );
+  }
+
+
+// Tells the worker to quit after the current read, and waits for it.
+// The results already queued can still be retrieved.
+//
+void Overlap_worker::stop()
+  {
+  if( !started ) return;
+  xlock( &mutex ); quit = true; xbroadcast( &cv ); xunlock( &mutex );
+  pthread_join( worker_id, 0 );
+  xdestroy_cond( &cv ); xdestroy_mutex( &mutex );
+  started = false;
+  }
+
+
+void Overlap_worker::lease( const Block & b, const bool scrape_,
+                            const bool lbad_, const bool rbad_ )
+  {
+  if( leased ) internal_error( "block already leased to overlap worker." );
+  xlock( &mutex );
+  task = b; scrape = scrape_; lbad = lbad_; rbad = rbad_;
+  leased = true; finished = false;
+  xbroadcast( &cv );
+  xunlock( &mutex );
+  }
+
+
+// Gets the oldest queued result without removing it from the queue.
+// Returns false if the queue is empty.
+//
+bool Overlap_worker::front( Result & r, const uint8_t ** const data )
+  {
+  if( started ) xlock( &mutex );
+  const bool found = ( count > 0 );
+  if( found ) { r = results[first]; *data = buf + first * hardbs_; }
+  if( started ) xunlock( &mutex );
+  return found;
+  }
+
+
+void Overlap_worker::pop()
+  {
+  if( started ) xlock( &mutex );
+  if( count > 0 ) { first = ( first + 1 ) % max_results; --count; }
+  if( started ) { xbroadcast( &cv ); xunlock( &mutex ); }
+  }
+
+
+// Returns true, and the part of the task not trimmed, if the worker is
+// done with the task and all its results have been retrieved.
+//
+bool Overlap_worker::returned( long long & pos, long long & end )
+  {
+  if( !leased || !started ) return false;
+  xlock( &mutex );
+  const bool done = ( finished && count == 0 );
+  if( done ) { pos = task_pos; end = task_end; leased = false; }
+  xunlock( &mutex );
+  return done;
+  }
@@ -0,0 +1,300 @@
+/*  GNU ddrescue - Data recovery tool
+    Copyright (C) 2004-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+    The planner divides the rescue domain in zones of equal size and keeps
+    statistics of the reads done in each zone. Instead of running the
+    passes in sequence, it repeatedly chooses the zone and action (copy,
+    trim, scrape, or retry) with the highest expected number of bytes
+    rescued per second, and then reads one chunk.
+
+    For each zone and action, the probability of a read returning data is
+    estimated from the reads done by that action in the zone and its two
+    neighbours, weighted against the global success rate of the action.
+    The time of a read is estimated from the read rate of the zone and
+    from the mean time lost in each read error (including the pause set
+    with '--pause-on-error').
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "rational.h"
+#include "block.h"
+#include "mapbook.h"
+#include "rescuebook.h"
+
+
+namespace {
+
+enum Action { a_copy, a_trim, a_scrape, a_retry, actions };
+
+// a priori probability of a read returning data, for each action
+const double prior_success[actions] = { 0.9, 0.5, 0.3, 0.1 };
+
+struct Zone
+  {
+  Block target[actions];	// next area for each action, or size 0
+  Block first_bad;		// first bad-sector chunk in zone, or size 0
+  long long good_bytes;		// bytes read in this zone
+  long long time_us;		// time spent reading this zone
+  long long retry_pos;		// next position to retry
+  long ok[actions];		// reads that returned some data
+  long tries[actions];
+  int retry_pass;
+
+  Zone() : good_bytes( 0 ), time_us( 0 ), retry_pos( 0 ), retry_pass( 1 )
+    {
+    for( int a = 0; a < actions; ++a )
+      { target[a].assign( 0, 0 ); ok[a] = tries[a] = 0; }
+    first_bad.assign( 0, 0 );
+    }
+  };
+
+
+struct Totals
+  {
+  long long good_bytes;		// bytes read
+  long long time_us;		// time spent in reads that returned data
+  long long error_time_us;	// time spent in read errors
+  long errors;
+  long ok[actions];
+  long tries[actions];
+
+  Totals() : good_bytes( 0 ), time_us( 0 ), error_time_us( 0 ), errors( 0 )
+    { for( int a = 0; a < actions; ++a ) ok[a] = tries[a] = 0; }
+  };
+
+
+long long now_us()
+  {
+  struct timeval tv;
+  gettimeofday( &tv, 0 );
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+  }
+
+
+// Finds the next area to read in [zpos,zend) for each action.
+void refresh_zone( Zone & z, const long long zpos, const long long zend,
+                   const Mapbook & mb, const int max_retries )
+  {
+  for( int a = 0; a < actions; ++a ) z.target[a].assign( 0, 0 );
+  z.first_bad.assign( 0, 0 );
+  long i = mb.find_index( zpos );
+  if( i < 0 ) return;
+  Domain_cursor dc( mb.domain() );
+  for( ; i < mb.sblocks() && mb.sblock( i ).pos() < zend; ++i )
+    {
+    const Sblock & sb = mb.sblock( i );
+    if( sb.status() == Sblock::finished || !dc.includes( sb ) ) continue;
+    const long long pos = std::max( sb.pos(), zpos );
+    const Block c( pos, std::min( sb.end(), zend ) - pos );
+    Block * t = 0;
+    switch( sb.status() )
+      {
+      case Sblock::non_tried:   t = &z.target[a_copy]; break;
+      case Sblock::non_trimmed: if( z.target[a_trim].size() <= 0 )
+                                  z.target[a_trim] = sb;	// whole sblock
+                                break;
+      case Sblock::non_scraped: t = &z.target[a_scrape]; break;
+      case Sblock::bad_sector:
+        if( z.first_bad.size() <= 0 ) z.first_bad = c;
+        if( z.target[a_retry].size() <= 0 && c.end() > z.retry_pos )
+          z.target[a_retry].assign( std::max( c.pos(), z.retry_pos ),
+                        c.end() - std::max( c.pos(), z.retry_pos ) );
+        break;
+      case Sblock::finished: break;
+      }
+    if( t && t->size() <= 0 ) *t = c;
+    }
+  if( max_retries == 0 ) z.target[a_retry].assign( 0, 0 );
+  else if( z.target[a_retry].size() <= 0 && z.first_bad.size() > 0 &&
+           ( max_retries < 0 || z.retry_pass < max_retries ) )
+    { ++z.retry_pass; z.retry_pos = zpos; z.target[a_retry] = z.first_bad; }
+  }
+
+} // end namespace
+
+
+// Return values: 1 I/O error, 0 OK, -1 interrupted, -2 mapfile error.
+// Read the domain in the order given by the expected yield of each area.
+//
+int Rescuebook::plan_rescue()
+  {
+  static const char * const msgs[actions] = {
+    "Copying non-tried blocks... (planner)",
+    "Trimming failed blocks... (planner)",
+    "Scraping failed blocks... (planner)",
+    "Retrying bad sectors... (planner)" };
+  static const Status statuses[actions] =
+    { copying, trimming, scraping, retrying };
+  const long long base = domain().pos();
+  long long zsize = planner_zone_size;
+  if( zsize < 0 )			// auto: at most 1024 zones of >= 1 MiB
+    zsize = std::max( 1LL << 20, ( domain().end() - base ) / 1024 );
+  zsize = std::max( zsize, (long long)hardbs() );
+  zsize = ( ( zsize + softbs() - 1 ) / softbs() ) * softbs();
+  const long nzones = ( domain().end() - base + zsize - 1 ) / zsize;
+  std::vector< Zone > zones( nzones );
+  std::vector< double > scores( nzones * actions, 0 );
+  std::vector< double > expected( nzones * actions, 0 );
+  Totals totals;
+  const long long poe_us = ( pause_on_error > 0 ) ?
+                           ( pause_on_error * 1000000 ).round() : 0;
+  const bool enabled[actions] = { true, !notrim, !noscrape, max_retries != 0 };
+  long last_rescore = -1;
+  int prev_action = -1;
+  planner_projected = planner_achieved = 0;
+  for( long z = 0; z < nzones; ++z )
+    { zones[z].retry_pos = base + z * zsize;
+      refresh_zone( zones[z], base + z * zsize, base + ( z + 1 ) * zsize,
+                    *this, max_retries ); }
+  first_post = true;
+
+  while( true )
+    {
+    const double rate = ( totals.good_bytes + 10 * 100000.0 ) /	// bytes/us
+                        ( totals.time_us + 100000.0 );
+    const double error_us = ( totals.error_time_us + 1000.0 + poe_us ) /
+                            ( totals.errors + 1 );
+    const long now = std::time( 0 );
+    const bool rescore_all = ( now != last_rescore );
+    if( rescore_all ) last_rescore = now;
+    long best = -1;
+    for( long z = 0; z < nzones; ++z )
+      for( int a = 0; a < actions; ++a )
+        {
+        const long k = z * actions + a;
+        if( rescore_all || scores[k] < 0 )
+          {
+          const Zone & zn = zones[z];
+          const long long size = zn.target[a].size();
+          if( !enabled[a] || size <= 0 ) { scores[k] = 0; continue; }
+          const long long s =
+            std::min( size, (long long)( ( a == a_copy ) ? softbs() : hardbs() ) );
+          double ok = zn.ok[a], tries = zn.tries[a];
+          if( z > 0 )
+            { ok += zones[z-1].ok[a] / 2.0; tries += zones[z-1].tries[a] / 2.0; }
+          if( z + 1 < nzones )
+            { ok += zones[z+1].ok[a] / 2.0; tries += zones[z+1].tries[a] / 2.0; }
+          const double gp = ( totals.ok[a] + 2 * prior_success[a] ) /
+                            ( totals.tries[a] + 2 );
+          const double p = ( ok + 4 * gp ) / ( tries + 4 );
+          const double zrate = ( zn.good_bytes + rate * 1000000 ) /
+                               ( zn.time_us + 1000000.0 );
+          const double t = p * s / zrate + ( 1 - p ) * error_us;
+          expected[k] = p * s;
+          scores[k] = expected[k] / std::max( t, 1.0 );
+          }
+        if( scores[k] > 0 && ( best < 0 || scores[k] > scores[best] ) )
+          best = k;
+        }
+    if( best < 0 ) break;				// nothing left to do
+    const long z = best / actions;
+    const int a = best % actions;
+    Zone & zn = zones[z];
+    const long long zpos = base + z * zsize;
+    long long lo = zpos, hi = zpos + zsize;		// zones to refresh
+    Block b( zn.target[a] );
+    bool forward = true;
+    if( a == a_copy || a == a_scrape || a == a_retry )
+      {
+      const int size = ( a == a_copy ) ? softbs() : hardbs();
+      if( b.size() > size ) b.size( size );
+      if( b.end() != zn.target[a].end() ) b.align_end( size );
+      }
+    else					// trim one edge of the sblock
+      {
+      const long idx = find_index( b.pos() );
+      if( idx < 0 || sblock( idx ).status() != Sblock::non_trimmed ||
+          sblock( idx ).pos() != b.pos() )		// stale target
+        { refresh_zone( zn, zpos, zpos + zsize, *this, max_retries );
+          for( int i = 0; i < actions; ++i ) scores[z*actions+i] = -1;
+          continue; }
+      const Sblock sb( sblock( idx ) );
+      const bool lbad = ( idx > 0 &&
+                          sblock( idx - 1 ).status() == Sblock::bad_sector );
+      const bool rbad = ( idx + 1 < sblocks() &&
+                          sblock( idx + 1 ).status() == Sblock::bad_sector );
+      lo = std::min( lo, sb.pos() ); hi = std::max( hi, sb.end() );
+      if( lbad && rbad )		// leave block for the scraping phase
+        { change_chunk_status( sb, Sblock::non_scraped ); b.size( 0 ); }
+      else if( !lbad )
+        {
+        b.assign( sb.pos(), std::min( (long long)hardbs(), sb.size() ) );
+        if( b.end() != sb.end() ) b.align_end( hardbs() );
+        }
+      else
+        {
+        const int size = std::min( (long long)hardbs(), sb.size() );
+        b.assign( sb.end() - size, size );
+        if( b.pos() != sb.pos() ) b.align_pos( hardbs() );
+        forward = false;
+        }
+      }
+    if( b.size() > 0 )
+      {
+      if( a != prev_action && !first_post ) current_status( statuses[a], msgs[a] );
+      prev_action = a;
+      planner_projected += (long long)( expected[best] + 0.5 );
+      int copied_size = 0, error_size = 0;
+      const long long t_start = now_us();
+      const int retval = copy_and_update( b, copied_size, error_size, msgs[a],
+                                          statuses[a], ( a == a_retry ) ?
+                                          zn.retry_pass : 1, forward,
+                                          ( a == a_copy ) ?
+                                          Sblock::non_trimmed : Sblock::bad_sector );
+      if( retval ) return retval;
+      const long long dt = now_us() - t_start + ( error_size > 0 ? poe_us : 0 );
+      planner_achieved += copied_size;
+      if( a == a_retry ) zn.retry_pos = b.end();
+      Zone & rz = zones[( b.pos() - base ) / zsize];	// zone really read
+      ++rz.tries[a]; ++totals.tries[a];
+      rz.time_us += dt;
+      if( copied_size > 0 )
+        { ++rz.ok[a]; ++totals.ok[a]; rz.good_bytes += copied_size;
+          totals.good_bytes += copied_size; totals.time_us += dt; }
+      else { ++totals.errors; totals.error_time_us += dt; }
+      if( copied_size + error_size < b.size() )		// EOF
+        { lo = base; hi = base + nzones * zsize; }
+      update_rates();
+      if( error_size > 0 && pause_on_error > 0 ) do_pause_on_error();
+      if( !update_mapfile( odes_ ) ) return -2;
+      if( b.end() > hi ) hi = b.end();
+      }
+    const long zlo = std::max( 0LL, ( lo - base ) / zsize - 1 );
+    const long zhi = std::min( (long long)nzones, ( hi - base - 1 ) / zsize + 2 );
+    for( long i = zlo; i < zhi; ++i )		// neighbours change scores
+      {
+      if( i * zsize + base < hi && ( i + 1 ) * zsize + base > lo )
+        refresh_zone( zones[i], base + i * zsize, base + ( i + 1 ) * zsize,
+                      *this, max_retries );
+      for( int j = 0; j < actions; ++j ) scores[i*actions+j] = -1;
+      }
+    }
+  return 0;
+  }
@@ -22,19 +22,27 @@
 #include <cerrno>
 #include <climits>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <string>
 #include <vector>
 #include <stdint.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #include "rational.h"
 #include "block.h"
 #include "loggers.h"
 #include "mapbook.h"
 #include "rescuebook.h"
+#include "consistency.h"
+#include "sha256.h"
+#include "manifest.h"
+#include "heatmap.h"
+#include "coop.h"
 
 
 namespace {
@@ -51,14 +59,98 @@ long long round_up( long long size, const int hardbs )
   return size;
   }
 
+
+extern "C" void * status_thread_start( void * arg )
+  {
+  ((Rescuebook *)arg)->status_thread();
+  return 0;
+  }
+
 } // end namespace
 
 
-void Rescuebook::change_chunk_status( const Block & b, const Sblock::Status st )
+long long elapsed_usecs( const struct timeval & tv0 )
+  {
+  struct timeval tv1;
+  gettimeofday( &tv1, 0 );
+  return std::max( 0LL, ( tv1.tv_sec - tv0.tv_sec ) * 1000000LL +
+                        tv1.tv_usec - tv0.tv_usec );
+  }
+
+
+// Pauses for 'interval' seconds, including any fraction of a second.
+// Returns early if interrupted by a signal that stops the rescue.
+//
+void pause_interval( const Rational & interval )
+  {
+  if( interval.error() || interval <= 0 ) return;
+  const int num = interval.numerator(), den = interval.denominator();
+  struct timespec ts;
+  ts.tv_sec = num / den;
+  ts.tv_nsec = ( ( num % den ) * 1000000000LL ) / den;
+  while( nanosleep( &ts, &ts ) != 0 && errno == EINTR && !interrupted() ) {}
+  }
+
+
+void Skip_model::close_area()
+  {
+  if( area_start < 0 ) return;
+  const long long size = llabs( area_edge - area_start );
+  if( areas.size() < max_areas ) areas.push_back( size );
+  else { areas[index] = size; if( ++index >= areas.size() ) index = 0; }
+  area_start = area_edge = -1;
+  }
+
+
+void Skip_model::new_pass( const Kind kind, const long long skipbs,
+                           const long long max_skipbs )
+  {
+  areas.clear(); index = 0;
+  area_start = area_edge = -1;
+  skip_size = skipbs_ = skipbs; max_skipbs_ = max_skipbs; kind_ = kind;
+  }
+
+
+// Returns the size to skip after a read error in block 'b'.
+// The adaptive model takes as estimate of the remaining extent of the
+// current damaged area the median of the remaining extents of the
+// previous areas at least as large as the current one, which minimizes
+// the expected number of bytes of bad area read plus good area skipped.
+// With less than two such areas it falls back to doubling.
+//
+long long Skip_model::error_found( const Block & b, const bool forward )
+  {
+  if( area_start < 0 ) area_start = forward ? b.pos() : b.end();
+  area_edge = forward ? b.end() : b.pos();
+  if( kind_ == adaptive )
+    {
+    const long long extent = llabs( area_edge - area_start );
+    std::vector< long long > remaining;
+    for( unsigned i = 0; i < areas.size(); ++i )
+      if( areas[i] >= extent ) remaining.push_back( areas[i] - extent );
+    if( remaining.size() >= 2 )
+      {
+      std::vector< long long >::iterator median =
+        remaining.begin() + ( remaining.size() - 1 ) / 2;
+      std::nth_element( remaining.begin(), median, remaining.end() );
+      return std::min( *median, max_skipbs_ );
+      }
+    }
+  const long long size = skip_size;
+  if( skip_size <= max_skipbs_ / 2 ) skip_size *= 2;
+  else skip_size = max_skipbs_;
+  return size;
+  }
+
+
+// Returns the previous status of the chunk.
+//
+Sblock::Status Rescuebook::change_chunk_status( const Block & b,
+                                                const Sblock::Status st )
   {
   Sblock::Status old_st = st;
   bad_areas += Mapfile::change_chunk_status( b, st, domain(), &old_st );
-  if( st == old_st ) return;
+  if( st == old_st ) return old_st;
   switch( old_st )
     {
     case Sblock::non_tried:     non_tried_size -= b.size(); break;
@@ -75,13 +167,55 @@ void Rescuebook::change_chunk_status( const Block & b, const Sblock::Status st )
     case Sblock::bad_sector:          bad_size += b.size(); break;
     case Sblock::finished:       finished_size += b.size(); break;
     }
+  return old_st;
+  }
+
+
+// Makes durable the data written since the last sync (see option
+// '--group-sync'). If the sync fails, the blocks written are returned to
+// their previous status so that the mapfile never claims data that may
+// not be on disc.
+//
+bool Rescuebook::commit_group()
+  {
+  group_t1 = std::time( 0 );
+  if( group_blocks.empty() ) return true;
+  std::string msg;
+  int saved_errno = 0;
+  if( fdatasync( odes_ ) != 0 && errno != EINVAL )
+    { msg = "Write error"; saved_errno = errno; }
+  for( unsigned i = 0; i < tee_outputs.size(); ++i )
+    if( !tee_outputs[i]->sync() && !tee_outputs[i]->ignore_write_errors() &&
+        msg.empty() )
+      { msg = "Write error in tee file '" + tee_outputs[i]->name() + '\'';
+        saved_errno = errno; }
+  if( msg.size() )
+    {
+    for( unsigned long i = 0; i < group_blocks.size(); ++i )
+      change_chunk_status( group_blocks[i], group_blocks[i].status() );
+    final_msg( msg, saved_errno ); e_code |= 8;
+    }
+  group_blocks.clear(); group_bytes = 0;
+  return msg.empty();
+  }
+
+
+// Sets the domain after committing the pending group, whose blocks can't
+// be returned to their previous status once outside of the domain.
+// Returns false if the commit failed.
+//
+bool Rescuebook::change_domain( const Domain & d )
+  {
+  const bool ok = ( group_sync_size <= 0 || commit_group() );
+  set_domain( d );
+  return ok;
   }
 
 
 void Rescuebook::do_pause_on_error()
   {
   if( simulated_poe ) tp += pause_on_error;
-  else if( pause_on_error >= 1 ) sleep( pause_on_error.trunc() );
+  else pause_interval( pause_on_error );
   }
 
 
@@ -109,13 +243,136 @@ bool Rescuebook::extend_outfile_size()
   }
 
 
-// Return values: 2 bad infile, 1 I/O error, 0 OK.
+void Rescuebook::finish_consistency_check( int & retval )
+  {
+  if( !checker->write_sidemap( true ) )
+    {
+    show_error( "Error writing consistency side map", errno );
+    if( retval == 0 ) retval = 1;
+    }
+  }
+
+
+void Rescuebook::finish_hash_manifest( int & retval )
+  {
+  if( !hash_manifest->finish_image( *this ) )
+    {
+    show_error( "Error reading outfile to hash image",
+                hash_manifest->read_error() );
+    if( retval == 0 ) retval = 1;
+    }
+  else if( hash_manifest->read_error() )
+    show_error( "warning: Error reading outfile to hash regions",
+                hash_manifest->read_error() );
+  if( !hash_manifest->write_manifest( this ) )
+    {
+    show_error( "Error writing hash manifest", errno );
+    if( retval == 0 ) retval = 1;
+    }
+  const std::string & hex = hash_manifest->image_hash();
+  if( verbosity >= 0 && hex.size() )
+    std::printf( "Image hash (SHA-256 of rescue domain): %s\n", hex.c_str() );
+  }
+
+
+bool Rescuebook::close_tee_outputs()
+  {
+  bool error = false;
+  for( unsigned i = 0; i < tee_outputs.size(); ++i )
+    if( !tee_outputs[i]->close_file() )
+      {
+      const std::string msg = "Error closing tee file '" +
+                              tee_outputs[i]->name() + '\'';
+      show_error( msg.c_str(), errno ); error = true;
+      }
+  return !error;
+  }
+
+
+// Returns false if the sync of outfile or of a tee file whose write
+// errors are not ignored fails.
+//
+bool Rescuebook::sync_outfiles( const int odes )
+  {
+  bool ok = ( odes < 0 || fsync( odes ) == 0 || errno == EINVAL );
+  int saved_errno = ok ? 0 : errno;
+  for( unsigned i = 0; i < tee_outputs.size(); ++i )
+    if( !tee_outputs[i]->sync() && !tee_outputs[i]->ignore_write_errors() &&
+        ok ) { ok = false; saved_errno = errno; }
+  if( !ok ) errno = saved_errno;
+  return ok;
+  }
+
+
+void Rescuebook::checkpoint()
+  {
+  if( group_sync_size > 0 ) commit_group();
+  // errors are ignored here because these files are rewritten at the end
+  if( hash_manifest ) hash_manifest->write_manifest();
+  if( checker ) checker->write_sidemap();
+  if( heatmap ) heatmap->write_heatmap();
+  }
+
+
+// Reads 'size' bytes from position 'pos' of infile into iobuf.
+// Returns the number of bytes read, as readblockp, or -1 if the rescue
+// can't continue, with 'retval' set to the value copy_block must return
+// (1 error or hung read, -1 interrupted, -2 mapfile write error).
+// If a watchdog is set, the read is done by a worker thread and abandoned
+// if it does not return before read_timeout; errno is then set to
+// ETIMEDOUT and the infile is reopened if reopen_on_error. While waiting,
+// the status and the mapfile are kept up to date, and the read is also
+// abandoned if the rescue is interrupted or must stop.
+//
+int Rescuebook::read_infile( const int size, const long long pos,
+                             const bool hang, int & retval )
+  {
+  retval = 1;
+  if( !watchdog ) return readblockp( ides_, iobuf(), size, pos );
+  if( Read_watchdog::hung_reads() >= Read_watchdog::max_hung_reads )
+    { final_msg( "Too many hung reads" ); return -1; }
+  if( !watchdog->start_read( ides_, size, pos, hang ) )
+    { final_msg( "Can't create read thread", errno ); return -1; }
+  for( int waited = 0; waited < read_timeout; )
+    {
+    const int ms = std::min( read_timeout - waited, status_interval );
+    const int rd = watchdog->wait_read( ms );
+    if( rd >= 0 )
+      {
+      const int saved_errno = errno;
+      std::memcpy( iobuf(), watchdog->buffer(), rd );
+      errno = saved_errno;
+      return rd;
+      }
+    waited += ms;
+    update_rates(); show_status( -1 );		// keep status and timeout live
+    if( !update_mapfile( odes_ ) ) retval = -2;
+    else if( interrupted() ) retval = -1;
+    else if( !errors_or_timeout() ) continue;
+    watchdog->abandon( reopen_on_error );
+    if( reopen_on_error ) ides_ = -1;
+    return -1;
+    }
+  watchdog->abandon( reopen_on_error );
+  ++timed_out_reads;
+  char msg[80];
+  snprintf( msg, sizeof msg, "Read timed out at position 0x%08llX", pos );
+  event_logger.print_msg( t1 - t0, percent_rescued(), msg );
+  if( reopen_on_error ) { ides_ = -1; if( !reopen_infile() ) return -1; }
+  errno = ETIMEDOUT;
+  return 0;
+  }
+
+
+// Return values: 2 bad infile, 1 I/O error, 0 OK, -1 interrupted,
+// -2 mapfile write error.
 // If OK && copied_size + error_size < b.size(), it means EOF has been reached.
 //
 int Rescuebook::copy_block( const Block & b, int & copied_size, int & error_size )
   {
   if( b.size() <= 0 ) internal_error( "bad size copying a Block." );
-  if( !test_domain || test_domain->includes( b ) )
+  const bool hang = hang_domain && hang_domain->includes( b.pos() );
+  if( !test_domain || test_domain->includes( b ) || hang )
     {
     if( o_direct_in )
       {
@@ -125,31 +382,78 @@ int Rescuebook::copy_block( const Block & b, int & copied_size, int & error_size
       const int size = pre + b.size() + post;
       if( size > iobuf_size() )
         internal_error( "(size > iobuf_size) copying a Block." );
-      copied_size = readblockp( ides_, iobuf(), size, b.pos() - pre );
+      int retval;
+      copied_size = read_infile( size, b.pos() - pre, hang, retval );
+      if( copied_size < 0 ) return retval;
       copied_size -= std::min( pre, copied_size );
       if( copied_size > b.size() ) copied_size = b.size();
       if( pre > 0 && copied_size > 0 )
         std::memmove( iobuf(), iobuf() + pre, copied_size );
       }
-    else copied_size = readblockp( ides_, iobuf(), b.size(), b.pos() );
+    else
+      {
+      int retval;
+      copied_size = read_infile( b.size(), b.pos(), hang, retval );
+      if( copied_size < 0 ) return retval;
+      }
     error_size = errno ? b.size() - copied_size : 0;
     if( errno == EINVAL )
       { final_msg( "Unaligned read error. Is sector size correct?" ); return 1; }
     }
   else { copied_size = 0; error_size = b.size(); }
+  return write_block( b, copied_size, error_size );
+  }
+
 
+// Writes to outfile the 'copied_size' bytes read into iobuf from 'b'.
+// Return values: 1 error, 0 OK.
+//
+int Rescuebook::write_block( const Block & b, const int copied_size,
+                             const int error_size )
+  {
   if( copied_size > 0 )
     {
     iobuf_ipos = b.pos();
+    if( checker ) checker->data_read( iobuf(), b.pos(), copied_size );
     const long long pos = b.pos() + offset();
-    if( sparse_size >= 0 && block_is_zero( iobuf(), copied_size ) )
+    const bool zero = ( ( sparse_size >= 0 || tee_outputs.size() ) &&
+                        block_is_zero( iobuf(), copied_size ) );
+    for( unsigned i = 0; i < tee_outputs.size(); ++i )
+      tee_outputs[i]->start_write( iobuf(), copied_size, b.pos(), zero );
+    bool write_error = false;
+    int write_errno = 0;
+    if( sparse_size >= 0 && zero )
       {
       const long long end = pos + copied_size;
       if( end > sparse_size ) sparse_size = end;
       }
+    else if( cdes_ >= 0 &&
+             readblockp( cdes_, cmp_buf, copied_size, pos ) == copied_size &&
+             std::memcmp( cmp_buf, iobuf(), copied_size ) == 0 )
+      skipped_size += copied_size;		// outfile already has the data
     else if( writeblockp( odes_, iobuf(), copied_size, pos ) != copied_size ||
              ( synchronous_ && fsync( odes_ ) != 0 && errno != EINVAL ) )
-      { final_msg( "Write error", errno ); return 1; }
+      { write_error = true; write_errno = errno; }
+    const Tee_output * failed_tee = 0;	// first required tee that failed
+    for( unsigned i = 0; i < tee_outputs.size(); ++i )	// wait for all
+      {
+      Tee_output & tee = *tee_outputs[i];
+      if( tee.finish_write() ) continue;
+      if( tee.ignore_write_errors() )
+        {
+        const std::string msg = "Write error in tee file '" + tee.name() +
+                                "'; no more data will be written to it";
+        event_logger.print_msg( t1 - t0, percent_rescued(), msg.c_str() );
+        }
+      else if( !failed_tee ) failed_tee = &tee;
+      }
+    if( write_error ) { final_msg( "Write error", write_errno ); return 1; }
+    if( failed_tee )
+      {
+      const std::string msg = "Write error in tee file '" +
+                              failed_tee->name() + '\'';
+      final_msg( msg, failed_tee->write_errno() ); return 1;
+      }
     }
   else iobuf_ipos = -1;
 
@@ -185,10 +489,11 @@ void Rescuebook::initialize_sizes()
   bad_size = finished_size = 0;
   bad_areas = 0;
 
+  Domain_cursor dc( domain() );
   for( long i = 0; i < sblocks(); ++i )
     {
     const Sblock & sb = sblock( i );
-    if( !domain().includes( sb ) )
+    if( !dc.includes( sb ) )
       { if( domain() < sb ) break; else { good = true; continue; } }
     switch( sb.status() )
       {
@@ -230,33 +535,161 @@ int Rescuebook::copy_and_update( const Block & b, int & copied_size,
   show_status( b.pos(), msg );
   if( errors_or_timeout() ) return 1;
   if( interrupted() ) return -1;
-  int retval = copy_block( b, copied_size, error_size );
-  if( retval == 0 )
+  struct timeval tv0;
+  if( heatmap ) gettimeofday( &tv0, 0 );
+  const int retval = copy_block( b, copied_size, error_size );
+  if( retval ) return retval;
+  return account_read( b, copied_size, error_size,
+                       heatmap ? elapsed_usecs( tv0 ) : 0, st );
+  }
+
+
+// Records in the heatmap the read of 'b', which took 'usecs' microseconds,
+// and updates the mapfile and the counters. Every read of infile, by
+// either head or by the overlap worker, is accounted here.
+// Return values: 1 error, 0 OK.
+//
+int Rescuebook::account_read( const Block & b, const int copied_size,
+                              const int error_size, const long long usecs,
+                              const Sblock::Status st )
+  {
+  if( heatmap )
+    {
+    const long long limit = ( min_read_rate > 0 ) ? min_read_rate : a_rate / 10;
+    const bool slow = ( copied_size > 0 && limit > 0 &&
+                        copied_size * 1000000.0 < (double)limit * usecs );
+    heatmap->data_read( b.pos(), copied_size, error_size, usecs, slow );
+    }
+  return update_block( b, copied_size, error_size, st );
+  }
+
+
+// Updates the mapfile and the counters after reading 'b'.
+// Return values: 1 error, 0 OK.
+//
+int Rescuebook::update_block( const Block & b, const int copied_size,
+                              const int error_size, const Sblock::Status st )
+  {
+  int retval = 0;
+  if( copied_size + error_size < b.size() )			// EOF
+    {
+    if( group_sync_size > 0 && !commit_group() ) retval = 1;
+    if( complete_only ) truncate_domain( b.pos() + copied_size + error_size );
+    else if( !truncate_vector( b.pos() + copied_size + error_size ) )
+      { final_msg( "EOF found below the size calculated from mapfile" );
+        retval = 1; }
+    initialize_sizes();
+    }
+  if( copied_size > 0 )
     {
-    if( copied_size + error_size < b.size() )			// EOF
+    const Block b2( b.pos(), copied_size );
+    const Sblock::Status old_st = change_chunk_status( b2, Sblock::finished );
+    if( hash_manifest )
+      hash_manifest->data_rescued( iobuf(), b.pos(), copied_size, *this );
+    if( group_sync_size > 0 && old_st != Sblock::finished )
       {
-      if( complete_only ) truncate_domain( b.pos() + copied_size + error_size );
-      else if( !truncate_vector( b.pos() + copied_size + error_size ) )
-        { final_msg( "EOF found below the size calculated from mapfile" );
-          retval = 1; }
-      initialize_sizes();
+      group_blocks.push_back( Sblock( b2, old_st ) );
+      group_bytes += copied_size;
+      if( ( group_bytes >= group_sync_size ||
+            std::time( 0 ) - group_t1 >= group_sync_interval ) &&
+          !commit_group() ) retval = 1;
       }
-    if( copied_size > 0 )
-      change_chunk_status( Block( b.pos(), copied_size ), Sblock::finished );
-    if( error_size > 0 )
+    }
+  if( error_size > 0 )
+    {
+    error_sum += error_size;
+    ++read_errors;
+    if( read_errors > max_read_errors ) { e_code |= 16; retval = 1; }
+    const Sblock::Status st2 =
+      ( error_size > hardbs() ) ? st : Sblock::bad_sector;
+    change_chunk_status( Block( b.pos() + copied_size, error_size ), st2 );
+    struct stat istat;
+    if( stat( iname_, &istat ) != 0 )
+      { final_msg( "Input file disappeared", errno ); retval = 1; }
+    }
+  return retval;
+  }
+
+
+bool Rescuebook::start_overlap()
+  {
+  const Rational pause = simulated_poe ? Rational( 0 ) : pause_on_error;
+  overlap_worker =
+    new Overlap_worker( test_domain, pause, hardbs(), o_direct_in );
+  if( overlap_worker->start( ides_ ) ) return true;
+  final_msg( "Can't create overlap worker thread", errno );
+  delete overlap_worker; overlap_worker = 0;
+  return false;
+  }
+
+
+// Writes the sectors read by the overlap worker, returns to the mapfile
+// the block leased, and leases the next damaged area left behind by the
+// copying passes, trimming areas before scraping any.
+// If 'last', the worker has been stopped and nothing is leased.
+// Returns false if error.
+//
+bool Rescuebook::service_overlap( const bool last )
+  {
+  Overlap_worker::Result r;
+  const uint8_t * data = 0;
+  while( overlap_worker->front( r, &data ) )
+    {
+    if( r.errcode == EINVAL )
+      { final_msg( "Unaligned read error. Is sector size correct?" );
+        return false; }
+    const int error_size = r.errcode ? r.b.size() - r.copied_size : 0;
+    if( r.copied_size > 0 ) std::memcpy( iobuf(), data, r.copied_size );
+    overlap_worker->pop();
+    if( write_block( r.b, r.copied_size, error_size ) != 0 ||
+        account_read( r.b, r.copied_size, error_size, r.usecs,
+                      Sblock::bad_sector ) != 0 )
+      return false;
+    if( error_size > 0 && simulated_poe ) do_pause_on_error();
+    }
+  if( last ) return true;
+  long long pos, end;
+  if( overlap_worker->returned( pos, end ) && pos < end )
+    {						// leave rest for scraping
+    const long index = find_index( end - 1 );
+    if( index >= 0 && domain().includes( sblock( index ) ) &&
+        sblock( index ).status() == Sblock::non_trimmed )
+      change_chunk_status( sblock( index ), Sblock::non_scraped );
+    }
+  if( !overlap_worker->idle() ) return true;
+  for( int i = 0; i < 2; ++i )
+    {
+    const bool scrape = ( i > 0 );
+    if( scrape ? ( noscrape || non_scraped_size <= 0 ) :
+                 ( notrim || non_trimmed_size <= 0 ) ) continue;
+    const Sblock::Status st = scrape ? Sblock::non_scraped : Sblock::non_trimmed;
+    Domain_cursor dc( domain() );
+    for( long idx = 0; idx < sblocks(); ++idx )
       {
-      error_sum += error_size;
-      ++read_errors;
-      if( read_errors > max_read_errors ) { e_code |= 16; retval = 1; }
-      const Sblock::Status st2 =
-        ( error_size > hardbs() ) ? st : Sblock::bad_sector;
-      change_chunk_status( Block( b.pos() + copied_size, error_size ), st2 );
-      struct stat istat;
-      if( stat( iname_, &istat ) != 0 )
-        { final_msg( "Input file disappeared", errno ); retval = 1; }
+      const Sblock & sb = sblock( idx );
+      if( !dc.includes( sb ) )
+        { if( domain() < sb ) break; else continue; }
+      if( sb.status() != st ) continue;
+      const bool lbad = ( idx > 0 &&
+                          sblock( idx - 1 ).status() == Sblock::bad_sector );
+      const bool rbad = ( idx + 1 < sblocks() &&
+                          sblock( idx + 1 ).status() == Sblock::bad_sector );
+      overlap_worker->lease( sb, scrape, lbad, rbad );
+      return true;
       }
     }
-  return retval;
+  return true;
+  }
+
+
+// Stops the overlap worker and writes the sectors it has already read.
+// Any block still leased keeps its status for the trimming phase.
+//
+void Rescuebook::stop_overlap( int & retval )
+  {
+  overlap_worker->stop();
+  if( !service_overlap( true ) && ( retval == 0 || retval == -1 ) ) retval = 1;
+  delete overlap_worker; overlap_worker = 0;
   }
 
 
@@ -279,10 +712,13 @@ int Rescuebook::copy_non_tried()
       {
       if( pass != first_pass ) resume = false;
       first_post = true;
-      snprintf( msgbuf + msglen, ( sizeof msgbuf ) - msglen, "%d %s",
-                pass, forward ? "(forwards)" : "(backwards)" );
-      int retval = forward ? fcopy_non_tried( msgbuf, pass, resume ) :
-                             rcopy_non_tried( msgbuf, pass, resume );
+      snprintf( msgbuf + msglen, ( sizeof msgbuf ) - msglen, "%d %s", pass,
+                converge ? "(converging)" :
+                forward ? "(forwards)" : "(backwards)" );
+      skipper.new_pass( skip_model, skipbs, max_skipbs );
+      rskipper.new_pass( skip_model, skipbs, max_skipbs );
+      const int retval =
+        prioritized_pass( copying, msgbuf, pass, resume, forward );
       if( retval != -3 ) return retval;
       }
     if( pass >= 2 && min_read_rate >= 0 ) min_read_rate = -1;	// reset rate
@@ -300,7 +736,6 @@ int Rescuebook::fcopy_non_tried( const char * const msg, const int pass,
                                  const bool resume )
   {
   long long pos = 0;
-  long long eskip_size = skipbs;	// size to skip on error if skipbs > 0
   long long sskip_size = 0;		// size to skip on slow if skipbs > 0
   const bool after_finished = (pass == 3 || pass == 4 );
   bool block_found = false;
@@ -319,12 +754,13 @@ int Rescuebook::fcopy_non_tried( const char * const msg, const int pass,
       block_found = true;
     if( b.size() <= 0 ) break;
     if( pos != b.pos() )		// reset size on block change
-      { eskip_size = skipbs; current_slow = false; }
+      { skipper.good_read(); current_slow = false; }
     pos = b.end();
     int copied_size = 0, error_size = 0;
     const int retval = copy_and_update( b, copied_size, error_size, msg,
                                         copying, pass, true, Sblock::non_trimmed );
     if( retval ) return retval;
+    if( overlap_worker && !service_overlap() ) return 1;
     const bool slow = update_rates();
     if( slow )
       { ++slow_reads;
@@ -335,28 +771,23 @@ int Rescuebook::fcopy_non_tried( const char * const msg, const int pass,
       if( pause_on_error > 0 ) do_pause_on_error();
       if( skipbs > 0 && pass <= 4 )		// don't skip if skipbs == 0
         {
-        b.pos( pos );
         if( pass >= 2 )	// skip rest of block at first error or slow read
-          b.size( -1 );
+          b.assign( pos, -1 );
         else if( error_size > 0 )
-          {
-          b.size( eskip_size );
-          if( eskip_size <= max_skipbs / 2 ) eskip_size *= 2;
-          else eskip_size = max_skipbs;
-          }
+          b.assign( pos, skipper.error_found( b, true ) );
         else				// slow read on pass 1
           {
           if( !prev_slow )
             sskip_size = std::max( skipbs, std::min( c_rate, max_skipbs ) );
           else if( sskip_size <= max_skipbs / 2 ) sskip_size *= 2;
           else sskip_size = max_skipbs;
-          b.size( sskip_size );
+          b.assign( pos, sskip_size );
           }
         find_chunk( b, Sblock::non_tried, domain(), hardbs() );
         if( pos == b.pos() && b.size() > 0 ) pos = b.end();	// skip
         }
       }
-    else if( error_size == 0 && copied_size > 0 ) eskip_size = skipbs;	// reset
+    else if( error_size == 0 && copied_size > 0 ) skipper.good_read();	// reset
     if( !update_mapfile( odes_ ) ) return -2;
     }
   if( !block_found ) return 0;
@@ -372,7 +803,6 @@ int Rescuebook::rcopy_non_tried( const char * const msg, const int pass,
                                  const bool resume )
   {
   long long end = LLONG_MAX;
-  long long eskip_size = skipbs;	// size to skip on error if skipbs > 0
   long long sskip_size = 0;		// size to skip on slow if skipbs > 0
   const bool before_finished = (pass == 3 || pass == 4 );
   bool block_found = false;
@@ -391,12 +821,13 @@ int Rescuebook::rcopy_non_tried( const char * const msg, const int pass,
       block_found = true;
     if( b.size() <= 0 ) break;
     if( end != b.end() )		// reset size on block change
-      { eskip_size = skipbs; current_slow = false; }
+      { skipper.good_read(); current_slow = false; }
     end = b.pos();
     int copied_size = 0, error_size = 0;
     const int retval = copy_and_update( b, copied_size, error_size, msg,
                                         copying, pass, false, Sblock::non_trimmed );
     if( retval ) return retval;
+    if( overlap_worker && !service_overlap() ) return 1;
     const bool slow = update_rates();
     if( slow )
       { ++slow_reads;
@@ -411,9 +842,8 @@ int Rescuebook::rcopy_non_tried( const char * const msg, const int pass,
           b.assign( 0, end );
         else if( error_size > 0 )
           {
-          b.assign( end - eskip_size, eskip_size );
-          if( eskip_size <= max_skipbs / 2 ) eskip_size *= 2;
-          else eskip_size = max_skipbs;
+          const long long size = skipper.error_found( b, false );
+          b.assign( end - size, size );
           }
         else				// slow read on pass 1
           {
@@ -427,7 +857,173 @@ int Rescuebook::rcopy_non_tried( const char * const msg, const int pass,
         if( end == b.end() && b.size() > 0 ) end = b.pos();	// skip
         }
       }
-    else if( error_size == 0 && copied_size > 0 ) eskip_size = skipbs;	// reset
+    else if( error_size == 0 && copied_size > 0 ) skipper.good_read();	// reset
+    if( !update_mapfile( odes_ ) ) return -2;
+    }
+  if( !block_found ) return 0;
+  return -3;
+  }
+
+
+// Starts reading 'b' with head_reader, as copy_block would read it.
+// Return values: -1 error, 0 not read (outside test domain), 1 started.
+//
+int Rescuebook::start_head_read( const Block & b, int & pre )
+  {
+  pre = 0;
+  if( test_domain && !test_domain->includes( b ) ) return 0;
+  int size = b.size();
+  if( o_direct_in )
+    {
+    pre = b.pos() % hardbs();
+    const int disp = b.end() % hardbs();
+    size = pre + b.size() + ( ( disp > 0 ) ? hardbs() - disp : 0 );
+    }
+  if( head_reader->start_read( ides_, size, b.pos() - pre, false ) ) return 1;
+  final_msg( "Can't create read thread", errno );
+  return -1;
+  }
+
+
+// Waits for the read started by start_head_read and writes its data.
+// Return values: 1 error, 0 OK.
+//
+int Rescuebook::finish_head_read( const Block & b, const int started,
+                                  const int pre, int & copied_size,
+                                  int & error_size )
+  {
+  if( started <= 0 ) { copied_size = 0; error_size = b.size(); }
+  else
+    {
+    int rd;
+    while( ( rd = head_reader->wait_read( status_interval ) ) < 0 )
+      { update_rates(); show_status( -1 ); }
+    const int saved_errno = errno;
+    copied_size = std::min( rd - std::min( pre, rd ), (int)b.size() );
+    if( copied_size > 0 )
+      std::memcpy( iobuf(), head_reader->buffer() + pre, copied_size );
+    error_size = saved_errno ? b.size() - copied_size : 0;
+    if( saved_errno == EINVAL )
+      { final_msg( "Unaligned read error. Is sector size correct?" ); return 1; }
+    }
+  return write_block( b, copied_size, error_size );
+  }
+
+
+// Return values: 1 I/O error, 0 OK, -1 interrupted, -2 mapfile error.
+// Read the non-tried part of the domain with two heads converging from
+// both ends, skipping over the damaged areas. Each head owns the area
+// on its side of the other; they stop where they meet. The reverse head
+// reads from head_reader while the forward head reads from this thread.
+//
+int Rescuebook::ccopy_non_tried( const char * const msg, const int pass )
+  {
+  long long pos = 0, end = LLONG_MAX;		// positions of the heads
+  long long fskip_size = 0, rskip_size = 0;	// sizes to skip on slow
+  const bool near_finished = (pass == 3 || pass == 4 );
+  bool block_found = false;
+
+  while( pos < end )
+    {
+    Block fb( pos, softbs() );
+    if( find_chunk( fb, Sblock::non_tried, domain(), softbs(), near_finished ) )
+      block_found = true;
+    if( fb.pos() >= end ) fb.size( 0 );
+    else if( fb.end() > end ) fb.end( end );
+    Block rb( end - softbs(), softbs() );
+    if( rfind_chunk( rb, Sblock::non_tried, domain(), softbs(), near_finished ) )
+      block_found = true;
+    if( rb.size() > 0 && fb.size() > 0 && rb.pos() < fb.end() )
+      rb.crop( Block( fb.end(), end - fb.end() ) );	// meeting point
+    else if( rb.end() <= pos ) rb.size( 0 );
+    else if( rb.pos() < pos ) rb.crop( Block( pos, end - pos ) );
+    if( fb.size() <= 0 && rb.size() <= 0 ) break;
+    if( fb.size() > 0 )
+      {
+      if( pos != fb.pos() ) { skipper.good_read(); current_slow = false; }
+      pos = fb.end();
+      }
+    if( rb.size() > 0 )
+      {
+      if( end != rb.end() ) { rskipper.good_read(); current_slow = false; }
+      end = rb.pos();
+      }
+    int fcopied = 0, ferror = 0, rcopied = 0, rerror = 0;
+    int retval = 0;
+    if( fb.size() > 0 && rb.size() > 0 )	// both heads read at once
+      {
+      int pre;
+      struct timeval tv0;
+      gettimeofday( &tv0, 0 );
+      const int started = start_head_read( rb, pre );
+      if( started < 0 ) return 1;
+      retval = copy_and_update( fb, fcopied, ferror, msg, copying, pass,
+                                true, Sblock::non_trimmed );
+      int retval2 = finish_head_read( rb, started, pre, rcopied, rerror );
+      if( retval2 == 0 )
+        retval2 = account_read( rb, rcopied, rerror, elapsed_usecs( tv0 ),
+                                Sblock::non_trimmed );
+      if( retval == 0 ) retval = retval2;
+      }
+    else if( fb.size() > 0 )
+      retval = copy_and_update( fb, fcopied, ferror, msg, copying, pass,
+                                true, Sblock::non_trimmed );
+    else
+      retval = copy_and_update( rb, rcopied, rerror, msg, copying, pass,
+                                false, Sblock::non_trimmed );
+    if( retval ) return retval;
+    if( overlap_worker && !service_overlap() ) return 1;
+    const bool slow = update_rates();
+    if( slow )
+      { ++slow_reads;
+        if( slow_reads > max_slow_reads ) { e_code |= 32; return 1; } }
+    const bool fskip = ( fb.size() > 0 && ( ferror > 0 || ( slow && pass <= 2 ) ) );
+    const bool rskip = ( rb.size() > 0 && ( rerror > 0 || ( slow && pass <= 2 ) ) );
+    if( ( fskip || rskip ) && reopen_on_error && !reopen_infile() ) return 1;
+    if( fskip )
+      {
+      if( pause_on_error > 0 ) do_pause_on_error();
+      if( skipbs > 0 && pass <= 4 && pos < end )	// don't skip if skipbs == 0
+        {
+        if( pass >= 2 ) fb.assign( pos, end - pos );	// skip rest of block
+        else if( ferror > 0 ) fb.assign( pos, skipper.error_found( fb, true ) );
+        else				// slow read on pass 1
+          {
+          if( !prev_slow )
+            fskip_size = std::max( skipbs, std::min( c_rate, max_skipbs ) );
+          else if( fskip_size <= max_skipbs / 2 ) fskip_size *= 2;
+          else fskip_size = max_skipbs;
+          fb.assign( pos, fskip_size );
+          }
+        find_chunk( fb, Sblock::non_tried, domain(), hardbs() );
+        if( pos == fb.pos() && fb.size() > 0 ) pos = std::min( fb.end(), end );
+        }
+      }
+    else if( fb.size() > 0 && ferror == 0 && fcopied > 0 ) skipper.good_read();
+    if( rskip )
+      {
+      if( pause_on_error > 0 ) do_pause_on_error();
+      if( skipbs > 0 && pass <= 4 && pos < end )
+        {
+        if( pass >= 2 ) rb.assign( pos, end - pos );
+        else if( rerror > 0 )
+          {
+          const long long size = rskipper.error_found( rb, false );
+          rb.assign( end - size, size );
+          }
+        else
+          {
+          if( !prev_slow )
+            rskip_size = std::max( skipbs, std::min( c_rate, max_skipbs ) );
+          else if( rskip_size <= max_skipbs / 2 ) rskip_size *= 2;
+          else rskip_size = max_skipbs;
+          rb.assign( end - rskip_size, rskip_size );
+          }
+        rfind_chunk( rb, Sblock::non_tried, domain(), hardbs() );
+        if( end == rb.end() && rb.size() > 0 ) end = std::max( rb.pos(), pos );
+        }
+      }
+    else if( rb.size() > 0 && rerror == 0 && rcopied > 0 ) rskipper.good_read();
     if( !update_mapfile( odes_ ) ) return -2;
     }
   if( !block_found ) return 0;
@@ -439,17 +1035,17 @@ int Rescuebook::rcopy_non_tried( const char * const msg, const int pass,
 // Trim both edges of each damaged area sequentially. If any edge is
 // adjacent to a bad sector, leave it for the scraping phase.
 //
-int Rescuebook::trim_errors()
+int Rescuebook::trim_domain()
   {
   const char * const msg = reverse ? "Trimming failed blocks... (backwards)" :
                                      "Trimming failed blocks... (forwards)";
-  first_post = true;
 
+  Domain_cursor dc( domain() );
   for( long i = 0; i < sblocks(); )
     {
     const long idx = reverse ? sblocks() - 1 - i : i;
     const Sblock sb( sblock( idx ) );
-    if( !domain().includes( sb ) )
+    if( !dc.includes( sb ) )
       { if( ( !reverse && domain() < sb ) || ( reverse && domain() > sb ) )
           break;
         ++i; continue; }
@@ -508,16 +1104,16 @@ int Rescuebook::trim_errors()
 // Return values: 1 I/O error, 0 OK, -1 interrupted, -2 mapfile error.
 // Scrape the damaged areas sequentially.
 //
-int Rescuebook::scrape_errors()
+int Rescuebook::scrape_domain()
   {
   const char * const msg = reverse ? "Scraping failed blocks... (backwards)" :
                                      "Scraping failed blocks... (forwards)";
-  first_post = true;
 
+  Domain_cursor dc( domain() );
   for( long i = 0; i < sblocks(); )
     {
     const Sblock sb( sblock( reverse ? sblocks() - 1 - i : i ) );
-    if( !domain().includes( sb ) )
+    if( !dc.includes( sb ) )
       { if( ( !reverse && domain() < sb ) || ( reverse && domain() > sb ) )
           break;
         ++i; continue; }
@@ -561,8 +1157,8 @@ int Rescuebook::copy_errors()
     first_post = true;
     snprintf( msgbuf + msglen, ( sizeof msgbuf ) - msglen, "%d %s",
               pass - first_pass + 1, forward ? "(forwards)" : "(backwards)" );
-    int retval = forward ? fcopy_errors( msgbuf, pass, resume ) :
-                           rcopy_errors( msgbuf, pass, resume );
+    const int retval =
+      prioritized_pass( retrying, msgbuf, pass, resume, forward );
     if( retval != -3 ) return retval;
     resume = false;
     if( !unidirectional ) forward = !forward;
@@ -656,6 +1252,7 @@ bool Rescuebook::update_rates( const bool force )
     if( verbosity >= 0 )
       {
       std::fputs( "\n\n\n\n\n\n", stdout );
+      if( skip_identical ) std::fputc( '\n', stdout );
       if( preview_lines > 0 )
         for( int i = -2; i < preview_lines; ++i ) std::fputc( '\n', stdout );
       }
@@ -698,6 +1295,7 @@ bool Rescuebook::update_rates( const bool force )
       if( max_error_rate >= 0 && error_rate > max_error_rate ) e_code |= 1;
       }
     rates_updated = true;
+    if( lease_table ) lease_table->heartbeat();
     if( !force_update )
       {
       t1 = t2;
@@ -713,75 +1311,113 @@ bool Rescuebook::update_rates( const bool force )
   }
 
 
-void Rescuebook::show_status( const long long ipos, const char * const msg,
-                              const bool force )
+// Formats in 'text' the status lines, starting with the escape sequences
+// that move the cursor back to the first line.
+//
+void Rescuebook::format_status( std::string & text, const char * const msg )
   {
   const char * const up = "\x1B[A";
+  char buf[128];
 
+  text = "\r";
+  for( int i = 0; i < 6; ++i ) text += up;
+  if( skip_identical ) text += up;
+  if( preview_lines > 0 )
+    {
+    for( int i = -2; i < preview_lines; ++i ) text += up;
+    text += "Data preview:\n";
+    for( int i = 0; i < preview_lines; ++i )
+      {
+      if( iobuf_ipos >= 0 )
+        {
+        const uint8_t * const p = iobuf() + ( 16 * i );
+        snprintf( buf, sizeof buf, "%010llX ",
+                  ( iobuf_ipos + ( 16 * i ) ) & 0xFFFFFFFFFFLL );
+        text += buf;
+        for( int j = 0; j < 16; ++j )
+          { snprintf( buf, sizeof buf, " %02X", p[j] ); text += buf;
+            if( j == 7 ) text += ' '; }
+        text += "  ";
+        for( int j = 0; j < 16; ++j )
+          text += std::isprint( p[j] ) ? (char)p[j] : '.';
+        text += '\n';
+        }
+      else if( i == ( preview_lines - 1 ) / 2 )
+        text += "                            No data available                                 \n";
+      else
+        text += "                                                                              \n";
+      }
+    text += '\n';
+    }
+  snprintf( buf, sizeof buf, "     ipos: %9sB, non-trimmed: %9sB,  current rate: %8sB/s\n",
+            format_num( last_ipos ), format_num( non_trimmed_size ),
+            format_num( c_rate, 99999 ) );
+  text += buf;
+  snprintf( buf, sizeof buf, "     opos: %9sB, non-scraped: %9sB,  average rate: %8sB/s\n",
+            format_num( last_ipos + offset() ),
+            format_num( non_scraped_size ), format_num( a_rate, 99999 ) );
+  text += buf;
+  snprintf( buf, sizeof buf, "non-tried: %9sB,  bad-sector: %9sB,    error rate: %8sB/s\n",
+            format_num( non_tried_size ), format_num( bad_size ),
+            format_num( error_rate, 99999 ) );
+  text += buf;
+  snprintf( buf, sizeof buf, "  rescued: %9sB,   bad areas: %8lu,        run time: %11s\n",
+            format_num( finished_size ), bad_areas, format_time( t1 - t0 ) );
+  text += buf;
+  snprintf( buf, sizeof buf, "pct rescued:  %s, read errors:%9lu,  remaining time: %11s\n",
+            percent_rescued(), read_errors,
+            format_time( remaining_time, remaining_time >= 180 ) );
+  text += buf;
+  if( min_read_rate >= -1 )
+    { snprintf( buf, sizeof buf, " slow reads:%9lu,", slow_reads ); text += buf; }
+  else text += "                      ";
+  snprintf( buf, sizeof buf, "        time since last successful read: %11s\n",
+            format_time( ( ts > t0 ) ? t1 - ts : -1 ) );
+  text += buf;
+  if( skip_identical )
+    {
+    snprintf( buf, sizeof buf, "  skipped: %9sB  (identical data not rewritten)\n",
+              format_num( skipped_size ) );
+    text += buf;
+    }
+  if( msg && msg[0] && !errors_or_timeout() )
+    {
+    const int len = std::strlen( msg ); text += '\r'; text += msg;
+    for( int i = len; i < oldlen; ++i ) text += ' ';
+    oldlen = len;
+    }
+  }
+
+
+// Counters are updated and logged once per second. The status lines are
+// formatted here, but they are printed by the status thread, at the rate
+// set by '--status-interval', so that a slow or stalled terminal never
+// delays the rescue. If the status thread is not running, the status is
+// printed here once per second.
+//
+void Rescuebook::show_status( const long long ipos, const char * const msg,
+                              const bool force )
+  {
   if( ipos >= 0 ) last_ipos = ipos;
+  const bool urgent = ( force || first_post );
   if( rates_updated || force || first_post )
     {
     if( verbosity >= 0 )
       {
-      std::printf( "\r%s%s%s%s%s%s", up, up, up, up, up, up );
-      if( preview_lines > 0 )
-        {
-        for( int i = -2; i < preview_lines; ++i ) std::fputs( up, stdout );
-        std::fputs( "Data preview:\n", stdout );
-        for( int i = 0; i < preview_lines; ++i )
-          {
-          if( iobuf_ipos >= 0 )
-            {
-            const uint8_t * const p = iobuf() + ( 16 * i );
-            std::printf( "%010llX ", ( iobuf_ipos + ( 16 * i ) ) & 0xFFFFFFFFFFLL );
-            for( int j = 0; j < 16; ++j )
-              { std::printf( " %02X", p[j] );
-                if( j == 7 ) std::fputc( ' ', stdout ); }
-            std::fputs( "  ", stdout );
-            for( int j = 0; j < 16; ++j )
-              std::fputc( std::isprint( p[j] ) ? p[j] : '.', stdout );
-            std::fputc( '\n', stdout );
-            }
-          else if( i == ( preview_lines - 1 ) / 2 )
-            std::fputs( "                            No data available                                 \n", stdout );
-          else
-            std::fputs( "                                                                              \n", stdout );
-          }
-        std::fputc( '\n', stdout );
-        }
-      std::printf( "     ipos: %9sB, non-trimmed: %9sB,  current rate: %8sB/s\n",
-                   format_num( last_ipos ), format_num( non_trimmed_size ),
-                   format_num( c_rate, 99999 ) );
-      std::printf( "     opos: %9sB, non-scraped: %9sB,  average rate: %8sB/s\n",
-                   format_num( last_ipos + offset() ),
-                   format_num( non_scraped_size ), format_num( a_rate, 99999 ) );
-      std::printf( "non-tried: %9sB,  bad-sector: %9sB,    error rate: %8sB/s\n",
-                   format_num( non_tried_size ), format_num( bad_size ),
-                   format_num( error_rate, 99999 ) );
-      std::printf( "  rescued: %9sB,   bad areas: %8lu,        run time: %11s\n",
-                   format_num( finished_size ), bad_areas,
-                   format_time( t1 - t0 ) );
       if( first_post ) sliding_avg.reset();
       else sliding_avg.add_term( c_rate );
       const long long s_rate = domain().full() ? 0 : sliding_avg();
-      const long remaining_time = ( s_rate <= 0 ) ? -1 :
+      remaining_time = ( s_rate <= 0 ) ? -1 :
         std::min( std::min( (long long)LONG_MAX, 315359999968464000LL ),
                   ( non_tried_size + non_trimmed_size + non_scraped_size +
                     ( max_retries ? bad_size : 0 ) + s_rate - 1 ) / s_rate );
-      std::printf( "pct rescued:  %s, read errors:%9lu,  remaining time: %11s\n",
-                   percent_rescued(), read_errors,
-                   format_time( remaining_time, remaining_time >= 180 ) );
-      if( min_read_rate >= -1 ) std::printf( " slow reads:%9lu,", slow_reads );
-      else std::fputs( "                      ", stdout );
-      std::printf( "        time since last successful read: %11s\n",
-                   format_time( ( ts > t0 ) ? t1 - ts : -1 ) );
-      if( msg && msg[0] && !errors_or_timeout() )
+      if( !ui_started )
         {
-        const int len = std::strlen( msg ); std::printf( "\r%s", msg );
-        for( int i = len; i < oldlen; ++i ) std::fputc( ' ', stdout );
-        oldlen = len;
+        std::string text;
+        format_status( text, msg );
+        std::fputs( text.c_str(), stdout );
+        std::fflush( stdout );
         }
-      std::fflush( stdout );
       }
     rate_logger.print_line( t1 - t0, last_ipos, a_rate, c_rate, bad_areas,
                             bad_size );
@@ -789,6 +1425,74 @@ void Rescuebook::show_status( const long long ipos, const char * const msg,
     rates_updated = false;
     first_post = false;
     }
+  if( ui_started )		// never wait for the status thread
+    {
+    if( urgent ) xlock( &ui_mutex );
+    else if( pthread_mutex_trylock( &ui_mutex ) != 0 ) return;
+    if( urgent || ui_frame_wanted )
+      {
+      format_status( ui_frame, msg );
+      ui_frame_ready = true; ui_frame_wanted = false;
+      xsignal( &ui_cv );
+      }
+    xunlock( &ui_mutex );
+    }
+  }
+
+
+// Prints the status lines formatted by show_status, asking for a new frame
+// every 'status_interval' milliseconds.
+//
+void Rescuebook::status_thread()
+  {
+  std::string text;
+  xlock( &ui_mutex );
+  while( true )
+    {
+    struct timeval tv;
+    gettimeofday( &tv, 0 );
+    long long usec = tv.tv_usec + status_interval * 1000LL;
+    struct timespec deadline;
+    deadline.tv_sec = tv.tv_sec + usec / 1000000;
+    deadline.tv_nsec = ( usec % 1000000 ) * 1000;
+    while( !ui_frame_ready && !ui_quit &&
+           pthread_cond_timedwait( &ui_cv, &ui_mutex, &deadline ) == 0 ) {}
+    if( !ui_frame_ready && !ui_quit )
+      {
+      ui_frame_wanted = true;
+      while( !ui_frame_ready && !ui_quit ) xwait( &ui_cv, &ui_mutex );
+      }
+    if( !ui_frame_ready ) break;			// quit
+    text.swap( ui_frame ); ui_frame_ready = false;
+    xunlock( &ui_mutex );
+    std::fputs( text.c_str(), stdout );
+    std::fflush( stdout );
+    xlock( &ui_mutex );
+    }
+  xunlock( &ui_mutex );
+  }
+
+
+void Rescuebook::start_status_thread()
+  {
+  if( verbosity < 0 || ui_started ) return;
+  xinit_mutex( &ui_mutex ); xinit_cond( &ui_cv );
+  ui_frame_ready = ui_frame_wanted = ui_quit = false;
+  if( pthread_create( &ui_id, 0, status_thread_start, this ) == 0 )
+    ui_started = true;
+  else { xdestroy_cond( &ui_cv ); xdestroy_mutex( &ui_mutex ); }
+  }
+
+
+// Waits until the last frame requested has been printed.
+//
+void Rescuebook::stop_status_thread()
+  {
+  if( !ui_started ) return;
+  xlock( &ui_mutex ); ui_quit = true; xsignal( &ui_cv ); xunlock( &ui_mutex );
+  pthread_join( ui_id, 0 );
+  xdestroy_cond( &ui_cv ); xdestroy_mutex( &ui_mutex );
+  ui_started = false;
   }
 
 
@@ -804,23 +1508,40 @@ Rescuebook::Rescuebook( const long long offset, const long long insize,
     error_rate( 0 ),
     error_sum( 0 ),
     sparse_size( sparse ? 0 : -1 ),
+    skipped_size( 0 ),
     non_tried_size( 0 ),
     non_trimmed_size( 0 ),
     non_scraped_size( 0 ),
     bad_size( 0 ),
     finished_size( 0 ),
     test_domain( test_dom ),
+    hang_domain( 0 ),
     iname_( iname ),
     read_errors( 0 ),
     slow_reads( 0 ),
     e_code( 0 ),
     synchronous_( synchronous ),
+    group_bytes( 0 ),
+    group_t1( std::time( 0 ) ),
+    hash_manifest( 0 ),
+    checker( 0 ),
+    heatmap( 0 ),
+    lease_table( 0 ),
+    watchdog( ( read_timeout > 0 ) ? new Read_watchdog( iobuf_size(), hardbs )
+                                   : 0 ),
+    overlap_worker( 0 ),
+    head_reader( rb_opts.converge ? new Read_watchdog( iobuf_size(), hardbs )
+                                  : 0 ),
+    timed_out_reads( 0 ), planner_projected( 0 ), planner_achieved( 0 ),
+    cdes_( -1 ), mdes_( -1 ), fs_metadata_size( 0 ), fs_allocated_size( 0 ),
+    cmp_buf( 0 ),
     voe_ipos( -1 ), voe_buf( new uint8_t[hardbs] ),
     a_rate( 0 ), c_rate( 0 ), first_size( 0 ), last_size( 0 ),
     iobuf_ipos( -1 ), last_ipos( 0 ), t0( 0 ), t1( 0 ), ts( 0 ), tp( 0 ),
     oldlen( 0 ), rates_updated( false ), current_slow( false ),
-    prev_slow( false ), sliding_avg( 30 ), first_post( false ),
-    first_read( true )
+    prev_slow( false ), sliding_avg( 30 ), remaining_time( -1 ),
+    first_post( false ), first_read( true ), ui_frame_ready( false ),
+    ui_frame_wanted( false ), ui_quit( false ), ui_started( false )
   {
   if( preview_lines > softbs() / 16 ) preview_lines = softbs() / 16;
   if( skipbs < 0 )
@@ -833,11 +1554,12 @@ Rescuebook::Rescuebook( const long long offset, const long long insize,
   skipbs = round_up( skipbs, hardbs );		// make multiple of hardbs
   max_skipbs = round_up( max_skipbs, hardbs );
 
+  Domain_cursor dc( domain() );
   if( retrim )
     for( long index = 0; index < sblocks(); ++index )
       {
       const Sblock & sb = sblock( index );
-      if( !domain().includes( sb ) )
+      if( !dc.includes( sb ) )
         { if( domain() < sb ) break; else continue; }
       if( sb.status() == Sblock::non_scraped ||
           sb.status() == Sblock::bad_sector )
@@ -847,7 +1569,7 @@ Rescuebook::Rescuebook( const long long offset, const long long insize,
     for( long index = 0; index < sblocks(); ++index )
       {
       const Sblock & sb = sblock( index );
-      if( !domain().includes( sb ) )
+      if( !dc.includes( sb ) )
         { if( domain() < sb ) break; else continue; }
       if( sb.status() == Sblock::non_scraped ||
           sb.status() == Sblock::non_trimmed )
@@ -858,16 +1580,288 @@ Rescuebook::Rescuebook( const long long offset, const long long insize,
   }
 
 
-// Return values: 1 I/O error, 0 OK.
+Rescuebook::~Rescuebook()
+  {
+  stop_status_thread();
+  stop_persister();		// it may be using the tee outputs
+  delete checker;
+  delete lease_table;
+  delete hash_manifest;
+  delete heatmap;
+  delete overlap_worker;
+  delete head_reader;
+  delete watchdog;
+  delete[] cmp_buf;
+  if( cdes_ >= 0 ) close( cdes_ );
+  if( mdes_ >= 0 ) close( mdes_ );
+  for( unsigned i = 0; i < tee_outputs.size(); ++i ) delete tee_outputs[i];
+  delete[] voe_buf;
+  }
+
+
+bool Rescuebook::add_tee_output( const char * const name,
+                                 const long long offset, const int odes,
+                                 const bool sparse,
+                                 const bool ignore_write_errors )
+  {
+  Tee_output * const tee = new Tee_output( name, offset, odes, sparse,
+                                           ignore_write_errors, synchronous_ );
+  tee_outputs.push_back( tee );
+  if( !tee->start() )
+    { show_error( "Can't create tee writer thread", tee->write_errno() );
+      return false; }
+  return true;
+  }
+
+
+void Rescuebook::set_compare_file( const int cdes )
+  {
+  cdes_ = cdes;
+  if( !cmp_buf ) cmp_buf = new uint8_t[iobuf_size()];
+  }
+
+
+bool Rescuebook::set_consistency_checker( const char * const sidemap_name,
+                                          const int budget, const int cides )
+  {
+  const long long insize = ( extent().end() < LLONG_MAX ) ? extent().end() : 0;
+  checker = new Consistency_checker( sidemap_name, insize,
+                                     hardbs(), budget, cides );
+  return checker->start();
+  }
+
+
+bool Rescuebook::set_lease_table( const char * const name,
+                                  const long long chunk_size, const int odes )
+  {
+  lease_table = new Lease_table( name );
+  std::string msg;
+  if( lease_table->open( domain(), chunk_size, filename(), odes, offset(),
+                         msg ) ) return true;
+  show_error( msg.c_str(), errno );
+  return false;
+  }
+
+
+// The zones cover the input file, or the domain if the size of the input
+// file is not known.
 //
-int Rescuebook::do_rescue( const int ides, const int odes )
+bool Rescuebook::set_heatmap( const long zones )
   {
-  bool copy_pending = false, trim_pending = false, scrape_pending = false;
-  ides_ = ides; odes_ = odes;
+  heatmap = new Heatmap( filename() );
+  if( !heatmap->read_heatmap() ) return false;
+  const long long size = ( extent().end() < LLONG_MAX ) ? extent().end() :
+                                                          domain().end();
+  if( size >= LLONG_MAX )
+    { show_error( "Size of input file unknown; can't divide it in zones." );
+      return false; }
+  heatmap->set_zones( size, zones, hardbs() );
+  return true;
+  }
 
+
+bool Rescuebook::set_hash_manifest( const long long region_size,
+                                    const int threads, const int rdes )
+  {
+  hash_manifest = new Hash_manifest( filename(), region_size, offset(), rdes );
+  return hash_manifest->start( threads, *this, domain() );
+  }
+
+
+// Splits the mapfile at the borders of the priority classes so that no
+// sblock belongs to more than one class.
+//
+void Rescuebook::set_priority_domains( const std::vector< Domain > & pds )
+  {
+  priority_domains = pds;
+  for( unsigned i = 0; i < priority_domains.size(); ++i )
+    split_by_domain_borders( priority_domains[i] );
+  }
+
+
+// Return values: 1 I/O error, 0 OK, -1 interrupted, -2 mapfile error,
+// -3 blocks left for the next pass.
+// Runs one pass of phase 'st' over the current domain.
+//
+int Rescuebook::run_pass( const Status st, const char * const msg,
+                          const int pass, const bool resume,
+                          const bool forward )
+  {
+  switch( st )
+    {
+    case copying: return converge ? ccopy_non_tried( msg, pass ) :
+                         forward ? fcopy_non_tried( msg, pass, resume ) :
+                                   rcopy_non_tried( msg, pass, resume );
+    case trimming: return trim_domain();
+    case scraping: return scrape_domain();
+    case retrying: return forward ? fcopy_errors( msg, pass, resume ) :
+                                    rcopy_errors( msg, pass, resume );
+    default: break;
+    }
+  internal_error( "invalid phase in run_pass." );
+  return 1;
+  }
+
+
+// Return values: 1 I/O error, 0 OK, -1 interrupted, -2 mapfile error,
+// -3 blocks left for the next pass.
+// Runs one pass of phase 'st' over each priority class in turn, so that
+// the extents of a class are exhausted before those of the next class
+// are touched. Only the class containing current_pos is resumed. The
+// sizes always refer to the whole current domain.
+//
+int Rescuebook::prioritized_pass( const Status st, const char * const msg,
+                                  const int pass, const bool resume,
+                                  const bool forward )
+  {
+  if( priority_domains.empty() )
+    return run_pass( st, msg, pass, resume, forward );
+  Domain full_domain( domain() );
+  int retval = 0;
+  for( unsigned c = 0; c < priority_domains.size(); ++c )
+    {
+    Domain d( priority_domains[c] );
+    d.crop( full_domain );
+    if( d.empty() ) continue;
+    if( !change_domain( d ) ) { retval = 1; break; }
+    int rv = run_pass( st, msg, pass, resume, forward );
+    if( domain().empty() )				// EOF found
+      full_domain.crop_by_file_size( d.pos() );
+    else if( domain().end() < d.end() )
+      full_domain.crop_by_file_size( domain().end() );
+    if( !change_domain( full_domain ) && ( rv == 0 || rv == -3 ) ) rv = 1;
+    if( rv == -3 ) retval = -3;
+    else if( rv != 0 ) { retval = rv; break; }
+    }
+  initialize_sizes();
+  return retval;
+  }
+
+
+// Return values: 1 I/O error, 0 OK, -1 interrupted, -2 mapfile error.
+// Runs the rescue phases pending in the current domain.
+//
+int Rescuebook::run_phases()
+  {
+  bool copy_pending = false, trim_pending = false, scrape_pending = false;
   if( non_tried_size ) copy_pending = trim_pending = scrape_pending = true;
   if( non_trimmed_size )              trim_pending = scrape_pending = true;
   if( non_scraped_size )                             scrape_pending = true;
+  int retval = 0;
+  if( planner_zone_size != 0 )
+    { if( !errors_or_timeout() ) retval = plan_rescue(); }
+  else
+    {
+    if( copy_pending && !errors_or_timeout() )
+      {
+      if( overlap && !start_overlap() ) retval = 1;
+      else retval = copy_non_tried();
+      if( overlap_worker ) stop_overlap( retval );
+      }
+    if( retval == 0 && trim_pending && !notrim && !errors_or_timeout() )
+      retval = trim_errors();
+    if( retval == 0 && scrape_pending && !noscrape && !errors_or_timeout() )
+      retval = scrape_errors();
+    if( retval == 0 && max_retries != 0 && !errors_or_timeout() )
+      retval = copy_errors();
+    }
+  return retval;
+  }
+
+
+// Return values: 1 I/O error, 0 OK, -1 interrupted, -2 mapfile error.
+// Rescues the chunks leased from the shared table one at a time, by
+// restricting the domain to each chunk, until all the chunks have been
+// rescued by this or other processes. A chunk is marked as rescued only
+// after saving the mapfile, so that the other processes can read it.
+//
+int Rescuebook::cooperative_rescue()
+  {
+  Domain full_domain( domain() );
+  int retval = 0;
+  while( retval == 0 && !errors_or_timeout() )
+    {
+    bool all_done;
+    lease_table->heartbeat();
+    const long i = lease_table->claim( all_done );
+    if( i < 0 )
+      {
+      if( all_done ) break;
+      if( interrupted() ) { retval = -1; break; }
+      show_status( -1, "Waiting for cooperating processes" );
+      sleep( 1 ); update_rates(); continue;
+      }
+    Domain d( full_domain );
+    d.crop( lease_table->chunk( i ) );
+    if( !d.empty() )
+      {
+      if( !change_domain( d ) ) retval = 1;
+      split_by_domain_borders( d ); initialize_sizes();
+      current_status( copying ); current_pass( 1 ); current_pos( d.pos() );
+      if( retval == 0 ) retval = run_phases();
+      if( retval == 0 && errors_or_timeout() ) retval = 1;
+      if( domain().end() < d.end() && !domain().empty() )	// EOF found
+        full_domain.crop_by_file_size( domain().end() );
+      if( !change_domain( full_domain ) && retval == 0 ) retval = 1;
+      }
+    if( retval == 0 && !update_mapfile( odes_, true ) ) retval = -2;
+    if( retval == 0 ) lease_table->finish( i ); else lease_table->release( i );
+    }
+  if( !change_domain( full_domain ) && retval == 0 ) retval = 1;
+  merge_cooperative();
+  initialize_sizes();
+  return retval;
+  }
+
+
+// Copies into this mapfile the status of the chunks rescued by other
+// processes, as recorded in their mapfiles. Their data are already in
+// outfile because Lease_table::open requires a shared outfile.
+//
+void Rescuebook::merge_cooperative()
+  {
+  std::vector< Mapfile * > mapfiles( Lease_table::max_slots, (Mapfile *)0 );
+  std::vector< bool > failed( Lease_table::max_slots, false );
+  for( long i = 0; i < lease_table->chunks_size(); ++i )
+    {
+    const int s = lease_table->done_by( i );
+    if( s < 0 || s == lease_table->slot() || failed[s] ) continue;
+    if( !mapfiles[s] )
+      {
+      mapfiles[s] = new Mapfile( lease_table->slot_mapname( s ) );
+      if( !mapfiles[s]->read_mapfile( 0, true ) )
+        {
+        const std::string msg = "Can't read mapfile of cooperating process '" +
+                                std::string( mapfiles[s]->filename() ) + '\'';
+        event_logger.echo_msg( msg.c_str() );
+        failed[s] = true; continue;
+        }
+      }
+    const Mapfile & mf = *mapfiles[s];
+    Domain d( domain() );
+    d.crop( lease_table->chunk( i ) );
+    if( d.empty() ) continue;
+    for( long j = 0; j < d.blocks(); ++j )
+      for( long long pos = d.block( j ).pos(); pos < d.block( j ).end(); )
+        {
+        const long k = mf.find_index( pos );
+        const long index = find_index( pos );
+        if( k < 0 || index < 0 ) break;
+        const long long end = std::min( std::min( d.block( j ).end(),
+                              mf.sblock( k ).end() ), sblock( index ).end() );
+        change_chunk_status( Block( pos, end - pos ), mf.sblock( k ).status() );
+        pos = end;
+        }
+    }
+  for( unsigned s = 0; s < mapfiles.size(); ++s ) delete mapfiles[s];
+  }
+
+
+// Return values: 1 I/O error, 0 OK.
+//
+int Rescuebook::do_rescue( const int ides, const int odes )
+  {
+  ides_ = ides; odes_ = odes;
   set_signals();
   if( verbosity >= 0 )
     {
@@ -896,16 +1890,13 @@ int Rescuebook::do_rescue( const int ides, const int odes )
     }
   int retval = 0;
   update_rates();				// first call
-  if( copy_pending && !errors_or_timeout() )
-    retval = copy_non_tried();
-  if( retval == 0 && trim_pending && !notrim && !errors_or_timeout() )
-    retval = trim_errors();
-  if( retval == 0 && scrape_pending && !noscrape && !errors_or_timeout() )
-    retval = scrape_errors();
-  if( retval == 0 && max_retries != 0 && !errors_or_timeout() )
-    retval = copy_errors();
+  start_status_thread();
+  retval = lease_table ? cooperative_rescue() :
+           metadata_first ? metadata_rescue() : run_phases();
   if( !rates_updated ) update_rates( true );	// force update of e_code
   show_status( -1, retval ? 0 : "Finished", true );
+  stop_status_thread();
+  if( checker ) checker->stop();		// no more rereads
 
   const bool signaled = ( retval == -1 );
   if( signaled ) retval = 0;
@@ -929,6 +1920,57 @@ int Rescuebook::do_rescue( const int ides, const int odes )
       if( e_code & 16 ) event_logger.echo_msg( "Too many read errors" );
       if( e_code & 32 ) event_logger.echo_msg( "Too many slow reads" );
       }
+    if( checker && checker->mismatch_count() > 0 )
+      {
+      char buf[80];
+      snprintf( buf, sizeof buf, "Input file returned inconsistent data in "
+                "%lld sectors", checker->mismatch_count() );
+      event_logger.echo_msg( buf );
+      }
+    if( planner_zone_size != 0 && retval != -2 )
+      {
+      char buf[80];
+      snprintf( buf, sizeof buf, "Planner yield: projected %sB, achieved %sB",
+                format_num( planner_projected ), format_num( planner_achieved ) );
+      event_logger.echo_msg( buf );
+      }
+    if( metadata_first && retval != -2 )
+      {
+      if( fs_names.empty() )
+        event_logger.echo_msg( "Metadata first: no filesystem found" );
+      else
+        {
+        char buf[160];
+        snprintf( buf, sizeof buf, "Metadata first: %s; metadata %sB, "
+                  "allocated data %sB", fs_names.c_str(),
+                  format_num( fs_metadata_size ),
+                  format_num( fs_allocated_size ) );
+        event_logger.echo_msg( buf );
+        }
+      }
+    if( lease_table && retval != -2 )
+      {
+      char buf[80];
+      snprintf( buf, sizeof buf, "Cooperative rescue: %lu of %ld chunks "
+                "rescued by this process (%lu reclaimed)",
+                lease_table->rescued(), lease_table->chunks_size(),
+                lease_table->reclaimed() );
+      event_logger.echo_msg( buf );
+      }
+    if( skip_identical && skipped_size > 0 )
+      {
+      char buf[80];
+      snprintf( buf, sizeof buf, "Identical data not rewritten: %sB",
+                format_num( skipped_size ) );
+      event_logger.echo_msg( buf );
+      }
+    for( unsigned i = 0; i < tee_outputs.size(); ++i )
+      if( tee_outputs[i]->failed() && tee_outputs[i]->ignore_write_errors() )
+        {
+        const std::string msg = "Write error in tee file '" +
+                                tee_outputs[i]->name() + "' was ignored";
+        event_logger.echo_msg( msg.c_str() );
+        }
     if( verbosity >= 0 )
       { std::fputc( '\n', stdout ); std::fflush( stdout ); }
     }
@@ -941,13 +1983,32 @@ int Rescuebook::do_rescue( const int ides, const int odes )
       show_error( "Error extending output file size." );
       if( retval == 0 ) retval = 1;
       }
+    for( unsigned i = 0; i < tee_outputs.size(); ++i )
+      if( !tee_outputs[i]->extend_size( min_outfile_size ) )
+        {
+        const std::string msg = "Error extending size of tee file '" +
+                                tee_outputs[i]->name() + '\'';
+        show_error( msg.c_str() );
+        if( retval == 0 && !tee_outputs[i]->ignore_write_errors() ) retval = 1;
+        }
+    if( hash_manifest )
+      {
+      if( retval == 0 && !signaled ) hash_manifest->hash_finished_regions( *this );
+      hash_manifest->wait_idle();
+      }
     compact_sblock_vector();
     if( !update_mapfile( odes_, true ) && retval == 0 ) retval = 1;
+    if( hash_manifest ) finish_hash_manifest( retval );
+    if( heatmap && !heatmap->write_heatmap() )
+      { show_error( "Error writing heatmap", errno );
+        if( retval == 0 ) retval = 1; }
     }
+  if( checker ) finish_consistency_check( retval );
   if( final_msg().size() ) show_error( final_msg().c_str(), final_errno() );
   if( close( odes_ ) != 0 )
     { show_error( "Error closing outfile", errno );
       if( retval == 0 ) retval = 1; }
+  if( !close_tee_outputs() && retval == 0 ) retval = 1;
   event_logger.print_eor( t1 - t0, percent_rescued(), current_pos(),
                           status_name( current_status() ) );
   if( !event_logger.close_file() )
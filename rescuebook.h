@@ -43,15 +43,50 @@ public:
   };
 
 
+// Chooses the size to skip after each read error in the first copying
+// pass (see option '--skip-model'). 'doubling' doubles the size after
+// each consecutive error. 'adaptive' estimates the remaining extent of
+// the damaged area from the sizes of the last areas found in the pass.
+class Skip_model
+  {
+public:
+  enum Kind { doubling, adaptive };
+
+private:
+  enum { max_areas = 64 };
+  std::vector< long long > areas;	// sizes of the last damaged areas
+  unsigned index;			// next area to replace
+  long long area_start;			// start of current damaged area, or -1
+  long long area_edge;			// far edge of last error in area
+  long long skip_size;			// next size for doubling
+  long long skipbs_, max_skipbs_;
+  Kind kind_;
+
+  void close_area();
+
+public:
+  Skip_model()
+    : index( 0 ), area_start( -1 ), area_edge( -1 ), skip_size( 0 ),
+      skipbs_( 0 ), max_skipbs_( 0 ), kind_( doubling ) {}
+
+  void new_pass( const Kind kind, const long long skipbs,
+                 const long long max_skipbs );
+  void good_read() { close_area(); skip_size = skipbs_; }
+  long long error_found( const Block & b, const bool forward );
+  };
+
+
 struct Rb_options
   {
   enum { min_skipbs = 65536 };
 
   const long long max_max_skipbs;
+  long long group_sync_size;	// bytes written per sync, or 0 = disabled
   long long max_error_rate;
   long long min_outfile_size;
   long long max_read_rate;
   long long min_read_rate;	// -2 = not set, -1 = reset
+  long long planner_zone_size;	// 0 = fixed pass order, -1 = auto
   long long skipbs;		// initial size to skip on read error
   long long max_skipbs;		// maximum size to skip on read error
   unsigned long max_bad_areas;
@@ -59,46 +94,65 @@ struct Rb_options
   unsigned long max_slow_reads;
   int cpass_bitset;		// 1 << ( pass - 1 ) for passes 1 to 5
   int delay_slow;
+  int group_sync_interval;	// max seconds between syncs
   int max_retries;
   int o_direct_in;		// O_DIRECT or 0
   Rational pause_on_error;
   int pause_on_pass;
   int preview_lines;		// preview lines to show. 0 = disable
+  Skip_model::Kind skip_model;
+  int status_interval;		// milliseconds between status updates
+  int read_timeout;		// milliseconds per read, or 0 = no watchdog
   int timeout;
   bool complete_only;
+  bool converge;			// copy from both ends at once
+  bool metadata_first;		// rescue filesystem metadata first
   bool new_bad_areas_only;
   bool noscrape;
   bool notrim;
+  bool overlap;			// trim and scrape while copying
   bool reopen_on_error;
   bool reset_slow;
   bool retrim;
   bool reverse;
   bool same_file;
   bool simulated_poe;
+  bool skip_identical;		// don't rewrite identical data in outfile
   bool sparse;
   bool try_again;
   bool unidirectional;
   bool verify_on_error;
 
   Rb_options()
-    : max_max_skipbs( 1LL << 60 ), max_error_rate( -1 ), min_outfile_size( -1 ),
-      max_read_rate( 0 ), min_read_rate( -2 ), skipbs( -1 ),
+    : max_max_skipbs( 1LL << 60 ), group_sync_size( 0 ), max_error_rate( -1 ),
+      min_outfile_size( -1 ),
+      max_read_rate( 0 ), min_read_rate( -2 ), planner_zone_size( 0 ),
+      skipbs( -1 ),
       max_skipbs( max_max_skipbs ), max_bad_areas( ULONG_MAX ),
       max_read_errors( ULONG_MAX ), max_slow_reads( ULONG_MAX ),
-      cpass_bitset( 31 ), delay_slow( 30 ), max_retries( 0 ), o_direct_in( 0 ),
+      cpass_bitset( 31 ), delay_slow( 30 ), group_sync_interval( 1 ),
+      max_retries( 0 ), o_direct_in( 0 ),
       pause_on_error( 0 ), pause_on_pass( 0 ), preview_lines( 0 ),
-      timeout( -1 ), complete_only( false ), new_bad_areas_only( false ),
-      noscrape( false ), notrim( false ), reopen_on_error( false ),
+      skip_model( Skip_model::doubling ),
+      status_interval( 1000 ), read_timeout( 0 ), timeout( -1 ),
+      complete_only( false ), converge( false ), metadata_first( false ),
+      new_bad_areas_only( false ),
+      noscrape( false ), notrim( false ), overlap( false ),
+      reopen_on_error( false ),
       reset_slow( false ), retrim( false ), reverse( false ),
-      same_file( false ), simulated_poe( false ), sparse( false ),
+      same_file( false ), simulated_poe( false ), skip_identical( false ),
+      sparse( false ),
       try_again( false ), unidirectional( false ), verify_on_error( false )
       {}
 
   bool operator==( const Rb_options & o ) const
-    { return ( max_error_rate == o.max_error_rate &&
+    { return ( group_sync_size == o.group_sync_size &&
+               group_sync_interval == o.group_sync_interval &&
+               max_error_rate == o.max_error_rate &&
                min_outfile_size == o.min_outfile_size &&
                max_read_rate == o.max_read_rate &&
                min_read_rate == o.min_read_rate &&
+               planner_zone_size == o.planner_zone_size &&
                skipbs == o.skipbs && max_skipbs == o.max_skipbs &&
                max_bad_areas == o.max_bad_areas &&
                max_read_errors == o.max_read_errors &&
@@ -109,15 +163,21 @@ struct Rb_options
                o_direct_in == o.o_direct_in &&
                pause_on_error == o.pause_on_error &&
                pause_on_pass == o.pause_on_pass &&
-               preview_lines == o.preview_lines && timeout == o.timeout &&
-               complete_only == o.complete_only &&
+               preview_lines == o.preview_lines &&
+               skip_model == o.skip_model &&
+               status_interval == o.status_interval &&
+               read_timeout == o.read_timeout && timeout == o.timeout &&
+               complete_only == o.complete_only && converge == o.converge &&
+               metadata_first == o.metadata_first &&
                new_bad_areas_only == o.new_bad_areas_only &&
                noscrape == o.noscrape && notrim == o.notrim &&
+               overlap == o.overlap &&
                reopen_on_error == o.reopen_on_error &&
                reset_slow == o.reset_slow &&
                retrim == o.retrim && reverse == o.reverse &&
                same_file == o.same_file &&
                simulated_poe == o.simulated_poe &&
+               skip_identical == o.skip_identical &&
                sparse == o.sparse && try_again == o.try_again &&
                unidirectional == o.unidirectional &&
                verify_on_error == o.verify_on_error ); }
@@ -126,13 +186,236 @@ struct Rb_options
   };
 
 
+// Additional output file written in parallel with outfile from the same
+// buffer (see option '--tee').
+class Tee_output
+  {
+  const std::string name_;
+  const long long offset_;		// opos - ipos for this output
+  long long sparse_size_;		// end position of pending writes, or -1
+  int odes_;
+  const bool ignore_write_errors_;
+  const bool synchronous_;
+  bool failed_;				// stop writing after a write error
+  pthread_t worker_id;
+  pthread_mutex_t mutex;
+  pthread_cond_t cv_request;		// a write has been requested
+  pthread_cond_t cv_done;		// the requested write has finished
+  const uint8_t * buf_;			// data of the requested write
+  int size_;
+  long long pos_;
+  int errno_;				// errno of last failed write, or 0
+  bool pending;				// a write is in progress
+  bool quit;
+  bool started;
+
+  Tee_output( const Tee_output & );	// declared as private
+  void operator=( const Tee_output & );	// declared as private
+
+public:
+  Tee_output( const char * const name, const long long offset,
+              const int odes, const bool sparse,
+              const bool ignore_write_errors, const bool synchronous );
+  ~Tee_output();
+
+  bool start();
+  void worker();
+  void start_write( const uint8_t * const buf, const int size,
+                    const long long ipos, const bool zero );
+  bool finish_write();
+  bool sync() const { return ( failed_ || fsync( odes_ ) == 0 || errno == EINVAL ); }
+  bool extend_size( const long long min_outfile_size ) const;
+  bool close_file();
+
+  const std::string & name() const { return name_; }
+  int write_errno() const { return errno_; }
+  bool failed() const { return failed_; }
+  bool ignore_write_errors() const { return ignore_write_errors_; }
+  bool sparse() const { return sparse_size_ >= 0; }
+  };
+
+
+// Reads infile from a worker thread so that a read that never returns
+// can be abandoned after a deadline (see option '--read-timeout'), or so
+// that a second read can run at the same time (see option '--converge').
+// An abandoned worker is left behind and frees itself if its read ever
+// returns. A new worker is created for the next read.
+struct Read_worker;
+
+class Read_watchdog
+  {
+  Read_worker * worker;			// worker for the next read, or 0
+  const int bufsize_;
+  const int hardbs_;
+  bool pending;				// a read is in progress
+
+  Read_watchdog( const Read_watchdog & );	// declared as private
+  void operator=( const Read_watchdog & );	// declared as private
+
+public:
+  enum { max_hung_reads = 16 };		// abandoned reads not yet returned
+
+  Read_watchdog( const int bufsize, const int hardbs )
+    : worker( 0 ), bufsize_( bufsize ), hardbs_( hardbs ), pending( false ) {}
+  ~Read_watchdog();
+
+  bool start_read( const int fd, const int size, const long long pos,
+                   const bool hang );
+  int wait_read( const int ms );
+  const uint8_t * buffer() const;
+  void abandon( const bool close_fd );
+  static int hung_reads();
+  };
+
+
+// Trims or scrapes, from a worker thread, the damaged areas left behind
+// by the copying passes (see option '--overlap'). The rescuebook leases
+// one block at a time to the worker, which reads it sector by sector and
+// queues the results. Only the rescuebook updates the mapfile.
+class Overlap_worker
+  {
+public:
+  struct Result
+    {
+    Block b;
+    int copied_size;
+    int errcode;			// errno of the read
+    long long usecs;			// time spent reading
+    Result() : b( 0, 0 ), copied_size( 0 ), errcode( 0 ), usecs( 0 ) {}
+    };
+
+private:
+  enum { max_results = 16 };		// reads queued before blocking
+  const Domain * const test_domain_;
+  const Rational pause_on_error_;	// real pause after each error
+  const int hardbs_;
+  const int o_direct_in_;
+  int fd_;				// dup of infile descriptor
+  uint8_t * buf_base;
+  uint8_t * buf;			// one sector per queued result
+  Result results[max_results];
+  int first, count;			// queued results
+  Block task;				// leased block
+  long long task_pos, task_end;		// part of task not yet trimmed
+  bool lbad, rbad;			// task is next to a bad sector
+  bool scrape;				// scrape task instead of trimming it
+  bool leased;				// task not yet returned
+  bool finished;			// worker is done with the task
+  bool quit;
+  pthread_t worker_id;
+  pthread_mutex_t mutex;
+  pthread_cond_t cv;			// new task, free slot, result, or quit
+  bool started;
+
+  Overlap_worker( const Overlap_worker & );	// declared as private
+  void operator=( const Overlap_worker & );	// declared as private
+
+  bool read_sector( const Block & b );
+  void trim_task();
+
+public:
+  Overlap_worker( const Domain * const test_domain,
+                  const Rational & pause_on_error, const int hardbs,
+                  const int o_direct_in );
+  ~Overlap_worker();
+
+  bool start( const int ides );
+  void worker();
+  void stop();
+  bool idle() const { return !leased; }
+  void lease( const Block & b, const bool scrape_, const bool lbad_,
+              const bool rbad_ );
+  bool front( Result & r, const uint8_t ** const data );
+  void pop();
+  bool returned( long long & pos, long long & end );
+  };
+
+
+class Rescuebook;
+
+// Serves command-mode requests from several clients connected to a Unix
+// socket (see option '--daemon'). Copy requests are queued and completed
+// asynchronously by the rescue thread, highest priority first. Status
+// requests are answered at once from the mapfile in memory.
+// The client sockets are non-blocking. Replies are appended to the output
+// queue of each client and sent by the server thread, so that a client
+// that does not read its replies never blocks the rescue thread.
+class Command_server
+  {
+public:
+  struct Request
+    {
+    unsigned long id;
+    int fd;				// client that sent the request
+    int priority;
+    char type;				// 'c' copy, 'u' update, 'f' finish
+    long long pos, end;			// part of the range not yet copied
+    };
+
+private:
+  enum { max_outbuf_size = 1 << 20 };	// close clients that don't read
+  const Rescuebook & book;
+  const std::string name_;
+  int listen_fd;
+  int wake_fds[2];			// pipe to wake up the server thread
+  std::vector< int > clients;		// changed only by the server thread
+  std::vector< std::string > inbufs;	// partial commands of each client
+  std::vector< std::string > outbufs;	// replies not yet sent to each client
+  std::vector< Request > requests;	// pending requests
+  unsigned long last_id;
+  pthread_t server_id;
+  pthread_mutex_t mutex;		// protects requests and the mapfile
+  pthread_mutex_t omutex;		// protects clients changes and outbufs
+  pthread_cond_t cv;			// new request
+  bool quit;
+  bool started;
+
+  Command_server( const Command_server & );	// declared as private
+  void operator=( const Command_server & );	// declared as private
+
+  void close_pipe();
+  void close_client( const unsigned i );
+  bool flush_client( const unsigned i );
+  void queue_text( const int fd, const std::string & text );
+  void reply( const int fd, const char * const word, const unsigned long id,
+              const std::string & msg = std::string() );
+  void submit( const Request & r );
+  void handle_command( const int fd, const std::string & command );
+
+public:
+  Command_server( const Rescuebook & b, const char * const name )
+    : book( b ), name_( name ), listen_fd( -1 ), last_id( 0 ),
+      quit( false ), started( false ) { wake_fds[0] = wake_fds[1] = -1; }
+  ~Command_server() { stop(); }
+
+  bool start( std::string & msg );
+  void serve();
+  void stop();
+  void lock() { xlock( &mutex ); }
+  void unlock() { xunlock( &mutex ); }
+					// called with the mutex locked
+  bool next_request( Request & r, const bool wait );
+  void advance( const unsigned long id, const long long pos );
+  void complete( const unsigned long id, const bool ok,
+                 const std::string & msg = std::string() );
+  };
+
+
+class Consistency_checker;
+class Hash_manifest;
+class Heatmap;
+class Lease_table;
+
 class Rescuebook : public Mapbook, public Rb_options
   {
   long long error_rate, error_sum;
   long long sparse_size;		// end position of pending writes
+  long long skipped_size;		// identical data not rewritten
   long long non_tried_size, non_trimmed_size, non_scraped_size;
   long long bad_size, finished_size;
   const Domain * const test_domain;	// good/bad map for test mode
+  const Domain * hang_domain;		// reads that hang in test mode, or 0
+  std::vector< Domain > priority_domains;	// classes, highest first
   const char * const iname_;
   unsigned long bad_areas;		// bad areas found so far
   unsigned long read_errors, slow_reads;
@@ -142,6 +425,26 @@ class Rescuebook : public Mapbook, public Rb_options
 					// 8 other (explained in final_msg),
 					// 16 read_errors, 32 slow_reads
   const bool synchronous_;
+  std::vector< Sblock > group_blocks;	// blocks written since last sync
+  long long group_bytes;		// with their previous status
+  long group_t1;			// time of last group sync
+  std::vector< Tee_output * > tee_outputs;
+  Hash_manifest * hash_manifest;	// per-region hashes, or 0
+  Consistency_checker * checker;	// background rereads, or 0
+  Heatmap * heatmap;			// per-zone read statistics, or 0
+  Lease_table * lease_table;		// chunks shared with other processes
+  Read_watchdog * watchdog;		// reads with deadline, or 0
+  Overlap_worker * overlap_worker;	// trims while copying, or 0
+  Read_watchdog * head_reader;		// reads of the reverse head, or 0
+  unsigned long timed_out_reads;
+  long long planner_projected;		// expected bytes of planned reads
+  long long planner_achieved;		// bytes really read by the planner
+  int cdes_;				// outfile opened for reading, or -1
+  int mdes_;				// same for '--metadata-first'
+  std::string fs_names;			// filesystems found
+  long long fs_metadata_size;		// size of their metadata
+  long long fs_allocated_size;		// size of the data allocated to files
+  uint8_t * cmp_buf;			// existing data read from outfile
   long long voe_ipos;			// pos of last good sector read, or -1
   uint8_t * const voe_buf;		// copy of last good sector read
 					// variables for update_rates
@@ -152,40 +455,101 @@ class Rescuebook : public Mapbook, public Rb_options
   Rational tp;				// cumulated pause_on_error
   int oldlen;
   bool rates_updated, current_slow, prev_slow;
+  Skip_model skipper;			// skip sizes after read errors
+  Skip_model rskipper;			// same for the reverse head
   Sliding_average sliding_avg;		// variables for show_status
+  long remaining_time;			// estimated remaining time, or -1
   bool first_post;			// first read in current pass
   bool first_read;			// first read overall
+					// variables for the status thread
+  std::string ui_frame;			// status lines waiting to be printed
+  pthread_t ui_id;
+  pthread_mutex_t ui_mutex;
+  pthread_cond_t ui_cv;			// frame ready or quit
+  bool ui_frame_ready;
+  bool ui_frame_wanted;			// interval elapsed, frame not ready
+  bool ui_quit;
+  bool ui_started;
 
-  void change_chunk_status( const Block & b, const Sblock::Status st );
+  Sblock::Status change_chunk_status( const Block & b,
+                                     const Sblock::Status st );
+  bool commit_group();
+  bool change_domain( const Domain & d );
   void do_pause_on_error();
   bool extend_outfile_size();
+  bool close_tee_outputs();
+  void finish_hash_manifest( int & retval );
+  void finish_consistency_check( int & retval );
+  int read_infile( const int size, const long long pos, const bool hang,
+                   int & retval );
   int copy_block( const Block & b, int & copied_size, int & error_size );
+  int write_block( const Block & b, const int copied_size,
+                   const int error_size );
+  int update_block( const Block & b, const int copied_size,
+                    const int error_size, const Sblock::Status st );
+  int account_read( const Block & b, const int copied_size,
+                    const int error_size, const long long usecs,
+                    const Sblock::Status st );
   void initialize_sizes();
   bool errors_or_timeout()
     { if( bad_areas > max_bad_areas ) e_code |= 2; return ( e_code != 0 ); }
-  const char * percent_rescued() const
-    { return format_percentage( finished_size, domain().in_size(), 3, 2 ); }
+  const char * percent_rescued() const	// domain may be a priority class
+    { return format_percentage( finished_size, non_tried_size +
+             non_trimmed_size + non_scraped_size + bad_size + finished_size,
+             3, 2 ); }
   int copy_and_update( const Block & b, int & copied_size,
                        int & error_size, const char * const msg,
                        const Status curr_st, const int curr_pass,
                        const bool forward,
                        const Sblock::Status st = Sblock::bad_sector );
   bool reopen_infile();
+  bool start_overlap();
+  bool service_overlap( const bool last = false );
+  void stop_overlap( int & retval );
   int copy_non_tried();
   int fcopy_non_tried( const char * const msg, const int pass,
                        const bool resume );
   int rcopy_non_tried( const char * const msg, const int pass,
                        const bool resume );
-  int trim_errors();
-  int scrape_errors();
+  int start_head_read( const Block & b, int & pre );
+  int finish_head_read( const Block & b, const int started, const int pre,
+                        int & copied_size, int & error_size );
+  int ccopy_non_tried( const char * const msg, const int pass );
+  int trim_domain();
+  int scrape_domain();
+  int run_pass( const Status st, const char * const msg, const int pass,
+                const bool resume, const bool forward );
+  int prioritized_pass( const Status st, const char * const msg,
+                        const int pass, const bool resume,
+                        const bool forward );
+  int trim_errors()
+    { first_post = true;
+      return prioritized_pass( trimming, 0, 1, false, true ); }
+  int scrape_errors()
+    { first_post = true;
+      return prioritized_pass( scraping, 0, 1, false, true ); }
   int copy_errors();
+  int plan_rescue();
+  int run_phases();
+  int cooperative_rescue();
+  void merge_cooperative();
+  void log_areas( const char * const name, const std::vector< Block > & v );
+  int rescue_areas( Domain & full_domain, const std::vector< Block > & areas );
+  int metadata_rescue();
   int fcopy_errors( const char * const msg, const int pass, const bool resume );
   int rcopy_errors( const char * const msg, const int pass, const bool resume );
   bool update_rates( const bool force = false );
+  void format_status( std::string & text, const char * const msg );
   void show_status( const long long ipos, const char * const msg = 0,
                     const bool force = false );
+  void start_status_thread();
+  void stop_status_thread();
+  int copy_command( long long pos, const long long size );
   int copy_command( const char * const command );
-  int status_command( const char * const command ) const;
+
+protected:
+  bool sync_outfiles( const int odes );
+  void checkpoint();
 
 public:
   Rescuebook( const long long offset, const long long insize,
@@ -193,8 +557,35 @@ public:
               const Mb_options & mb_opts, const Rb_options & rb_opts,
               const char * const iname, const char * const mapname,
               const int cluster, const int hardbs, const bool synchronous );
-  ~Rescuebook() { delete[] voe_buf; }
+  ~Rescuebook();
 
+  bool add_tee_output( const char * const name, const long long offset,
+                       const int odes, const bool sparse,
+                       const bool ignore_write_errors );
+  void set_compare_file( const int cdes );
+  void set_hang_domain( const Domain * const hang_dom )
+    { hang_domain = hang_dom; }
+  void set_metadata_file( const int mdes ) { mdes_ = mdes; }
+  void set_priority_domains( const std::vector< Domain > & pds );
+  bool set_consistency_checker( const char * const sidemap_name,
+                                const int budget, const int cides );
+  bool set_hash_manifest( const long long region_size, const int threads,
+                          const int rdes );
+  bool set_heatmap( const long zones );
+  bool set_lease_table( const char * const name, const long long chunk_size,
+                        const int odes );
+
+  int status_command( const Block & b, std::vector< Sblock > & blocks ) const;
+  int status_command( const char * const command, std::string & text ) const;
   int do_commands( const int ides, const int odes );
+  int do_binary_commands( const int ides, const int odes );
+  int do_daemon( const int ides, const int odes, const char * const name );
   int do_rescue( const int ides, const int odes );
+  void status_thread();
   };
+
+
+// Defined in rescuebook.cc
+//
+long long elapsed_usecs( const struct timeval & tv0 );
+void pause_interval( const Rational & interval );
@@ -0,0 +1,118 @@
+/*  GNU ddrescue - Data recovery tool
+    Copyright (C) 2004-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstring>
+#include <stdint.h>
+
+#include "sha256.h"
+
+
+namespace {
+
+const uint32_t K[64] = {
+  0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1,
+  0x923F82A4, 0xAB1C5ED5, 0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+  0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174, 0xE49B69C1, 0xEFBE4786,
+  0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+  0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147,
+  0x06CA6351, 0x14292967, 0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+  0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85, 0xA2BFE8A1, 0xA81A664B,
+  0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+  0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A,
+  0x5B9CCA4F, 0x682E6FF3, 0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+  0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2 };
+
+inline uint32_t ror( const uint32_t x, const int n )
+  { return ( x >> n ) | ( x << ( 32 - n ) ); }
+
+} // end namespace
+
+
+void Sha256::reset()
+  {
+  state[0] = 0x6A09E667; state[1] = 0xBB67AE85;
+  state[2] = 0x3C6EF372; state[3] = 0xA54FF53A;
+  state[4] = 0x510E527F; state[5] = 0x9B05688C;
+  state[6] = 0x1F83D9AB; state[7] = 0x5BE0CD19;
+  total_size = 0;
+  }
+
+
+void Sha256::process_block( const uint8_t * const block )
+  {
+  uint32_t w[64];
+  for( int i = 0; i < 16; ++i )
+    w[i] = ( (uint32_t)block[4*i] << 24 ) | ( (uint32_t)block[4*i+1] << 16 ) |
+           ( (uint32_t)block[4*i+2] << 8 ) | block[4*i+3];
+  for( int i = 16; i < 64; ++i )
+    {
+    const uint32_t s0 = ror( w[i-15], 7 ) ^ ror( w[i-15], 18 ) ^ ( w[i-15] >> 3 );
+    const uint32_t s1 = ror( w[i-2], 17 ) ^ ror( w[i-2], 19 ) ^ ( w[i-2] >> 10 );
+    w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for( int i = 0; i < 64; ++i )
+    {
+    const uint32_t S1 = ror( e, 6 ) ^ ror( e, 11 ) ^ ror( e, 25 );
+    const uint32_t ch = ( e & f ) ^ ( ~e & g );
+    const uint32_t t1 = h + S1 + ch + K[i] + w[i];
+    const uint32_t S0 = ror( a, 2 ) ^ ror( a, 13 ) ^ ror( a, 22 );
+    const uint32_t maj = ( a & b ) ^ ( a & c ) ^ ( b & c );
+    const uint32_t t2 = S0 + maj;
+    h = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+    }
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+  state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+  }
+
+
+void Sha256::update( const uint8_t * const data, const long size )
+  {
+  long i = 0;
+  int used = total_size % 64;
+  total_size += size;
+  if( used > 0 )
+    {
+    const int len = ( size < 64 - used ) ? size : 64 - used;
+    std::memcpy( buffer + used, data, len );
+    i = len; used += len;
+    if( used < 64 ) return;
+    process_block( buffer );
+    }
+  for( ; i + 64 <= size; i += 64 ) process_block( data + i );
+  if( i < size ) std::memcpy( buffer, data + i, size - i );
+  }
+
+
+void Sha256::finish( uint8_t digest[digest_size] )
+  {
+  const uint64_t bits = total_size * 8;
+  const int used = total_size % 64;
+  uint8_t pad[72];
+  const int padlen = ( ( used < 56 ) ? 56 : 120 ) - used;
+  pad[0] = 0x80;
+  std::memset( pad + 1, 0, padlen - 1 );
+  for( int i = 0; i < 8; ++i ) pad[padlen+i] = bits >> ( 56 - 8 * i );
+  update( pad, padlen + 8 );
+  for( int i = 0; i < 8; ++i )
+    {
+    digest[4*i] = state[i] >> 24; digest[4*i+1] = state[i] >> 16;
+    digest[4*i+2] = state[i] >> 8; digest[4*i+3] = state[i];
+    }
+  reset();
+  }
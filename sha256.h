@@ -0,0 +1,35 @@
+/*  GNU ddrescue - Data recovery tool
+    Copyright (C) 2004-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// SHA-256 message digest as defined in FIPS 180-4.
+class Sha256
+  {
+  uint32_t state[8];
+  uint64_t total_size;			// number of bytes processed
+  uint8_t buffer[64];			// partial block not yet processed
+
+  void process_block( const uint8_t * const block );
+
+public:
+  enum { digest_size = 32 };
+
+  Sha256() { reset(); }
+
+  void reset();
+  void update( const uint8_t * const data, const long size );
+  void finish( uint8_t digest[digest_size] );
+  };
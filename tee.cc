@@ -0,0 +1,181 @@
+/*  GNU ddrescue - Data recovery tool
+    Copyright (C) 2004-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "rational.h"
+#include "block.h"
+#include "mapbook.h"
+#include "rescuebook.h"
+
+
+namespace {
+
+extern "C" void * tee_worker( void * arg )
+  {
+  ((Tee_output *)arg)->worker();
+  return 0;
+  }
+
+} // end namespace
+
+
+Tee_output::Tee_output( const char * const name, const long long offset,
+                        const int odes, const bool sparse,
+                        const bool ignore_write_errors,
+                        const bool synchronous )
+  : name_( name ), offset_( offset ), sparse_size_( sparse ? 0 : -1 ),
+    odes_( odes ), ignore_write_errors_( ignore_write_errors ),
+    synchronous_( synchronous ), failed_( false ), buf_( 0 ), size_( 0 ),
+    pos_( 0 ), errno_( 0 ), pending( false ), quit( false ), started( false )
+  {
+  xinit_mutex( &mutex ); xinit_cond( &cv_request ); xinit_cond( &cv_done );
+  }
+
+
+Tee_output::~Tee_output()
+  {
+  if( started )
+    {
+    xlock( &mutex ); quit = true; xsignal( &cv_request ); xunlock( &mutex );
+    pthread_join( worker_id, 0 );
+    }
+  xdestroy_cond( &cv_done ); xdestroy_cond( &cv_request );
+  xdestroy_mutex( &mutex );
+  if( odes_ >= 0 ) close( odes_ );
+  }
+
+
+bool Tee_output::start()
+  {
+  if( !started )
+    {
+    const int errcode = pthread_create( &worker_id, 0, tee_worker, this );
+    if( errcode ) { errno_ = errcode; return false; }
+    started = true;
+    }
+  return true;
+  }
+
+
+// Writes the requested blocks until told to quit.
+//
+void Tee_output::worker()
+  {
+  while( true )
+    {
+    xlock( &mutex );
+    while( !pending && !quit ) xwait( &cv_request, &mutex );
+    if( !pending ) { xunlock( &mutex ); break; }
+    const uint8_t * const buf = buf_;
+    const int size = size_;
+    const long long pos = pos_;
+    xunlock( &mutex );
+
+    int errcode = 0;
+    errno = 0;
+    if( writeblockp( odes_, buf, size, pos ) != size )
+      errcode = errno ? errno : EIO;		// short write sets no errno
+    else if( synchronous_ && fsync( odes_ ) != 0 && errno != EINVAL )
+      errcode = errno;
+
+    xlock( &mutex );
+    if( errcode ) errno_ = errcode;
+    pending = false;
+    xsignal( &cv_done );
+    xunlock( &mutex );
+    }
+  }
+
+
+// Start writing 'size' bytes from 'buf' at 'ipos' + offset.
+// 'buf' must not be modified until 'finish_write' returns.
+//
+void Tee_output::start_write( const uint8_t * const buf, const int size,
+                              const long long ipos, const bool zero )
+  {
+  if( failed_ || size <= 0 ) return;
+  const long long pos = ipos + offset_;
+  if( sparse_size_ >= 0 && zero )
+    {
+    const long long end = pos + size;
+    if( end > sparse_size_ ) sparse_size_ = end;
+    return;
+    }
+  xlock( &mutex );
+  buf_ = buf; size_ = size; pos_ = pos; pending = true;
+  xsignal( &cv_request );
+  xunlock( &mutex );
+  }
+
+
+// Wait for the write started by 'start_write' to finish.
+// Returns false if the write failed. After a failure, no more writes are
+// attempted on this output.
+//
+bool Tee_output::finish_write()
+  {
+  if( failed_ ) return true;		// failure was already reported
+  xlock( &mutex );
+  while( pending ) xwait( &cv_done, &mutex );
+  const bool error = ( errno_ != 0 );
+  xunlock( &mutex );
+  if( error ) failed_ = true;
+  return !error;
+  }
+
+
+bool Tee_output::extend_size( const long long min_outfile_size ) const
+  {
+  if( failed_ ) return true;
+  const long long min_size = std::max( min_outfile_size, sparse_size_ );
+  if( min_size <= 0 ) return true;
+  const long long size = lseek( odes_, 0, SEEK_END );
+  if( size < 0 ) return false;
+  if( min_size > size )
+    {
+    int ret;
+    do ret = ftruncate( odes_, min_size );
+      while( ret != 0 && errno == EINTR );
+    if( ret != 0 || lseek( odes_, 0, SEEK_END ) != min_size )
+      {
+      const uint8_t zero = 0;		// if ftruncate fails, write a zero
+      if( writeblockp( odes_, &zero, 1, min_size - 1 ) != 1 ) return false;
+      }
+    fsync( odes_ );
+    }
+  return true;
+  }
+
+
+bool Tee_output::close_file()
+  {
+  if( odes_ < 0 ) return true;
+  const int fd = odes_;
+  odes_ = -1;
+  return ( close( fd ) == 0 );
+  }
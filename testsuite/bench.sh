@@ -0,0 +1,266 @@
+#! /bin/sh
+# Benchmark for mapfile handling in GNU ddrescue and ddrescuelog
+# Copyright (C) 2019 Antonio Diaz Diaz.
+#
+# This script is free software: you have unlimited permission
+# to copy, distribute and modify it.
+#
+# Usage: bench.sh <testdir> [<blocks> [<real_mapfile>...]]
+#
+# Times the loading, scanning and rewriting of a synthetic mapfile of
+# <blocks> blocks of random size and status (default 1000000), and of any
+# real-world mapfiles given. The startup of ddrescue includes the
+# normalization of the mapfile (joining of subsectors, etc).
+# Then times scans of the synthetic mapfile restricted to a fragmented
+# domain of <blocks> / 10 extents.
+# Finally compares the fixed pass order with '--planner', and the skip
+# models of '--skip-model', on simulated devices (test mode) by the time
+# needed to rescue 90%, 99%, and 100% of the readable data, using a cost
+# model of 100 MB/s, 10 ms per read error, and 0.1 ms per read applied to
+# the reads logged by each run. The read errors found while copying
+# non-tried blocks are also shown. The copying passes of '--converge' are
+# modeled as two independent queues: each read is charged to the nearer
+# head, and each pass takes the time of the slower head.
+# The wall time of '--overlap' is compared with the fixed pass order on a
+# simulated device with a real pause of 1 s after each read error.
+# Then times the text and binary protocols of the command mode.
+# Finally times the recording of a heatmap during a rescue, the rendering
+# of a heatmap, and the rasterized drawing of the synthetic mapfile.
+
+LC_ALL=C
+export LC_ALL
+objdir=`pwd`
+DDRESCUE="${objdir}"/ddrescue
+DDRESCUELOG="${objdir}"/ddrescuelog
+blocks=1000000
+[ -n "$2" ] && blocks="$2"
+framework_failure() { echo "failure in testing framework" ; exit 1 ; }
+
+if [ ! -f "${DDRESCUE}" ] || [ ! -x "${DDRESCUE}" ] ; then
+	echo "${DDRESCUE}: cannot execute"
+	exit 1
+fi
+
+if [ -d tmp ] ; then rm -rf tmp ; fi
+mkdir tmp
+cd "${objdir}"/tmp || framework_failure
+
+# print the time in seconds since the epoch, with decimals if available
+now() {
+	t=`date +%s.%N 2> /dev/null`
+	case "$t" in *N*|"") date +%s ;; *) echo "$t" ;; esac
+}
+
+# run a command discarding its output and print the time it took
+bench() {
+	label="$1" ; shift
+	t0=`now`
+	"$@" > /dev/null 2>&1
+	t1=`now`
+	awk -v a="$t0" -v b="$t1" -v l="$label" \
+		'BEGIN { printf "  %-32s %8.3f s\n", l, b - a }'
+}
+
+bench_mapfile() {
+	case "$1" in /*) map="$1" ;; *) map="${objdir}/$1" ;; esac
+	cp "${map}" map || framework_failure
+	bench "ddrescuelog -t" "${DDRESCUELOG}" -t map
+	bench "ddrescuelog -l-" "${DDRESCUELOG}" -b512 -l- map
+	bench "ddrescuelog -n (rewrite)" "${DDRESCUELOG}" -f -n map
+	bench "ddrescuelog -p (compare)" "${DDRESCUELOG}" -p map map
+	printf "" > in || framework_failure
+	bench "ddrescue startup -b512" "${DDRESCUE}" -q -s0 -b512 in out map
+	bench "ddrescue startup -b4096" "${DDRESCUE}" -q -s0 -b4096 in out map
+	rm -f map out
+}
+
+# rescue the simulated device <infile> described by the test-mode mapfile
+# $2 and print the time that the reads logged would take on a real drive
+bench_sim() {
+	label="$1" ; map="$2" ; shift ; shift
+	rm -f map out reads
+	"${DDRESCUE}" -q -H "${map}" "$@" --pause-on-error=s0.01 \
+		--log-reads=reads in out map > /dev/null 2>&1 || framework_failure
+	awk -v l="${label}" -v size=67108864 'function hex( s,   i, v ) {
+		v = 0
+		for( i = 3; i <= length( s ); ++i )
+			v = v * 16 + index( "0123456789ABCDEF", substr( s, i, 1 ) ) - 1
+		return v }
+		/^# / { copying = /Copying.*Pass/ ; if( copying ) seen = 1
+		two = /converging/ ; t += ( tf > tr ) ? tf : tr ; tf = tr = 0
+		hf = 0 ; hr = size }
+		/^0x/ {
+		c = 100 + $3 / 100 + ( ( $4 > 0 ) ? 10000 : 0 ); got += $3
+		if( !two ) t += c
+		else { p = hex( $1 )		# charge read to the nearer head
+		       if( p - hf <= hr - p ) { hf = p ; tf += c }
+		       else { hr = p ; tr += c } }
+		if( copying && $4 > 0 ) ++errors
+		T[n] = t + ( ( tf > tr ) ? tf : tr ); G[n++] = got }
+		END {
+		split( "0.9 0.99 1", f, " " )
+		for( i = 0; i < n; ++i ) for( j = 1; j <= 3; ++j )
+			if( !( j in at ) && G[i] >= got * f[j] ) at[j] = T[i] / 1e6
+		printf "  %-12s 90%% %7.2f s  99%% %7.2f s  100%% %7.2f s  " \
+			"errors copying %s\n", l, at[1], at[2], at[3],
+			seen ? errors + 0 : "n/a" }' reads
+}
+
+echo "Generating synthetic mapfile of ${blocks} blocks..."
+awk -v n="${blocks}" 'BEGIN {
+	srand( 1 ); split( "?*/-+", st, "" ); pos = 0
+	print "0x0  ?  1"
+	for( i = 0; i < n; ++i )
+		{
+		size = 1 + int( rand() * 65536 )	# creates many subsectors
+		printf "%.0f  %.0f  %s\n", pos, size, st[1 + int( rand() * 5 )]
+		pos += size
+		}
+	}' > synthetic || framework_failure
+
+echo "synthetic (${blocks} blocks):"
+bench_mapfile tmp/synthetic
+
+echo "synthetic restricted to fragmented domain ($(( blocks / 10 )) extents):"
+awk -v n="$(( blocks / 10 ))" 'BEGIN {
+	srand( 2 ); stride = 327680 ; pos = 0
+	print "0x0  ?  1"
+	for( i = 0; i < n; ++i )
+		{
+		size = 512 * ( 1 + int( rand() * ( stride / 1024 ) ) )
+		printf "%.0f  %.0f  +\n%.0f  %.0f  ?\n", pos, size, pos + size,
+			stride - size
+		pos += stride
+		}
+	}' > domain || framework_failure
+cp synthetic map || framework_failure
+"${DDRESCUELOG}" -a '?*/,+-+' map > finished 2> /dev/null || framework_failure
+dd if=/dev/null of=in bs=1 2> /dev/null \
+	seek=`tail -n 1 map | awk '{ printf "%.0f", $1 + $2 }'` || framework_failure
+bench "ddrescuelog -m -t" "${DDRESCUELOG}" -m domain -t map
+bench "ddrescuelog -m -l-" "${DDRESCUELOG}" -m domain -b512 -l- map
+bench "ddrescuelog -m -p (compare)" "${DDRESCUELOG}" -m domain -p map map
+bench "ddrescue -m (no data to read)" "${DDRESCUE}" -q -m domain in out finished
+rm -f map finished in out
+
+dd if=/dev/null of=in bs=1 seek=67108864 2> /dev/null || framework_failure
+
+echo "simulated device with a damaged stripe and scattered defects:"
+awk 'BEGIN {
+	srand( 3 ); pos = 0; end = 64 * 1048576
+	print "0x0  ?  1"
+	while( pos < end )
+		{
+		if( pos >= 8388608 && pos < 12582912 )		# damaged stripe
+			{ size = 512 * ( 1 + int( rand() * 64 ) ); bad = 0.7 }
+		else if( pos >= 33554432 && pos < 41943040 )	# scattered defects
+			{ size = 512 * ( 1 + int( rand() * 16 ) ); bad = 0.15 }
+		else { size = 512 * ( 1 + int( rand() * 8192 ) ); bad = 0.02 }
+		if( pos + size > end ) size = end - pos
+		printf "%.0f  %.0f  %s\n", pos, size, ( rand() < bad ) ? "-" : "+"
+		pos += size
+		}
+	}' > sim || framework_failure
+bench_sim "pass order" sim
+bench_sim "--planner" sim --planner
+bench_sim "--converge" sim --converge
+
+echo "simulated device with many small scattered defects:"
+awk 'BEGIN {
+	srand( 5 ); pos = 0; end = 64 * 1048576
+	print "0x0  ?  1"
+	while( pos < end )
+		{
+		size = 512 * ( 1 + int( rand() * 256 ) )
+		if( pos + size > end ) size = end - pos
+		printf "%.0f  %.0f  +\n", pos, size ; pos += size
+		if( pos >= end ) break
+		size = 512 * ( 1 + int( rand() * 8 ) )
+		if( pos + size > end ) size = end - pos
+		printf "%.0f  %.0f  -\n", pos, size ; pos += size
+		}
+	}' > sim || framework_failure
+bench_sim "doubling" sim --skip-model=doubling
+bench_sim "adaptive" sim --skip-model=adaptive
+
+echo "simulated device with head-crash stripes:"
+awk 'BEGIN {
+	srand( 7 ); pos = 0; end = 64 * 1048576
+	print "0x0  ?  1"
+	while( pos < end )
+		{
+		size = 1048576 * ( 4 + int( rand() * 8 ) )
+		if( pos + size > end ) size = end - pos
+		printf "%.0f  %.0f  +\n", pos, size ; pos += size
+		if( pos >= end ) break
+		size = 512 * int( 1024 + rand() * 6144 )
+		if( pos + size > end ) size = end - pos
+		printf "%.0f  %.0f  -\n", pos, size ; pos += size
+		}
+	}' > sim || framework_failure
+bench_sim "doubling" sim --skip-model=doubling
+bench_sim "adaptive" sim --skip-model=adaptive
+bench_sim "--converge" sim --converge
+
+echo "simulated device with 8 small bad areas and 1 s pause per error:"
+awk 'BEGIN {
+	print "0x0  ?  1"
+	for( i = 0; i < 8; ++i )
+		printf "%.0f  512  +\n%.0f  1024  -\n%.0f  522752  +\n",
+			i * 524288, i * 524288 + 512, i * 524288 + 1536
+	}' > sim || framework_failure
+rm -f map out
+bench "pass order" "${DDRESCUE}" -q -s4Mi -H sim --pause-on-error=1 in out map
+rm -f map out
+bench "--overlap" "${DDRESCUE}" -q -s4Mi -H sim --pause-on-error=1 --overlap \
+	in out map
+
+echo "command mode, 100000 pairs of copy and status commands of 512 bytes:"
+awk 'BEGIN { for( i = 0; i < 100000; ++i )
+		printf "c %d 512\ns %d 512\n", i * 512, i * 512 ; print "f" }' \
+	> tcmd || framework_failure
+awk 'function le( v, n,   i ) {
+		for( i = 0; i < n; ++i ) { printf "%c", v % 256 ; v = int( v / 256 ) } }
+	function rec( t, id, pos ) {
+		le( 24, 4 ) ; printf "%s%c%c%c", t, 0, 0, 0 ; le( id, 4 )
+		le( pos, 8 ) ; le( 512, 8 ) }
+	BEGIN { for( i = 0; i < 100000; ++i )
+			{ rec( "c", 2 * i, i * 512 ) ; rec( "s", 2 * i + 1, i * 512 ) }
+		le( 8, 4 ) ; printf "f%c%c%c", 0, 0, 0 ; le( 0, 4 ) }' \
+	> bcmd || framework_failure
+rm -f map out
+bench "text (copying)" sh -c "'${DDRESCUE}' --command-mode in out map < tcmd"
+bench "text (finished)" sh -c "'${DDRESCUE}' --command-mode in out map < tcmd"
+rm -f map out
+bench "binary (copying)" \
+	sh -c "'${DDRESCUE}' --command-mode=binary in out map < bcmd"
+bench "binary (finished)" \
+	sh -c "'${DDRESCUE}' --command-mode=binary in out map < bcmd"
+
+echo "heatmap, 131072 reads of 512 bytes, and rendering of the synthetic mapfile:"
+rm -f map map.heat out
+bench "rescue -c1" "${DDRESCUE}" -q -c1 in out map
+rm -f map out
+bench "rescue -c1 --heatmap" "${DDRESCUE}" -q -c1 --heatmap in out map
+tail -n 1 synthetic | awk '{ zs = int( ( $1 + $2 + 999 ) / 1000 )
+	srand( 3 ) ; print "# Zone size: " zs "  Zones: 1000"
+	for( i = 0; i < 1000; ++i )
+		printf "%.0f  %.0f  0  %d  1  0  0\n", i * zs, zs,
+			1 + int( rand() * 1000000 ) }' > synthetic.heat ||
+	framework_failure
+bench "ddrescuelog --heatmap" "${DDRESCUELOG}" --heatmap synthetic
+bench "ddrescuelog --heatmap=ppm" "${DDRESCUELOG}" --heatmap=ppm synthetic
+bench "ddrescuelog --render-map" "${DDRESCUELOG}" --render-map synthetic
+bench "ddrescuelog --render-map=ppm" "${DDRESCUELOG}" --render-map=ppm synthetic
+bench "  same, 1024x1024 pixels" \
+	"${DDRESCUELOG}" --render-map=ppm,1024x1024 synthetic
+rm -f sim map map.heat in out reads tcmd bcmd synthetic.heat
+
+shift ; [ $# -gt 0 ] && shift
+for map in "$@" ; do
+	echo "${map}:"
+	bench_mapfile "${map}"
+done
+
+cd "${objdir}" && rm -rf tmp
+exit 0
@@ -132,8 +132,6 @@ printf "testing ddrescue-%s..." "$2"
 [ $? = 1 ] || test_failed $LINENO
 "${DDRESCUE}" -q -i -1 ${in} out
 [ $? = 1 ] || test_failed $LINENO
-"${DDRESCUE}" -q -m ${map1} -m ${map2} ${in} out mapfile
-[ $? = 1 ] || test_failed $LINENO
 "${DDRESCUE}" -q -m ${map2i} ${in} out mapfile
 [ $? = 2 ] || test_failed $LINENO
 "${DDRESCUE}" -q -w ${in} out mapfile
@@ -144,6 +142,12 @@ printf "testing ddrescue-%s..." "$2"
 [ $? = 1 ] || test_failed $LINENO
 "${DDRESCUE}" -q --cpass=6 ${in} out
 [ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --group-sync=0 ${in} out
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --group-sync=,0 ${in} out
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q -y --group-sync ${in} out
+[ $? = 1 ] || test_failed $LINENO
 "${DDRESCUE}" -q --mapfile-interval=-2 ${in} out
 [ $? = 1 ] || test_failed $LINENO
 "${DDRESCUE}" -q --mapfile-interval=30, ${in} out
@@ -160,6 +164,40 @@ printf "testing ddrescue-%s..." "$2"
 [ $? = 1 ] || test_failed $LINENO
 "${DDRESCUE}" -q --same-file -t ${in} out
 [ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --status-interval=0 ${in} out
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --read-timeout=0 ${in} out
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --skip-model=halving ${in} out
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --overlap --planner ${in} out
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --converge --read-timeout=1 ${in} out
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --cooperative=coop ${in} out
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --daemon=sock --command-mode ${in} out
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --metadata-first --cooperative=coop ${in} out mapfile
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --tee=out ${in} out
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --tee=out3,0,x ${in} out
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q -F- --tee=out3 ${in} out mapfile
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --hash-regions=4Ki ${in} out
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --reread-check=,5 ${in} out
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --reread-check=sidemap,101 ${in} out
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --reread-check=sidemap --command-mode ${in} out
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --hash-regions=1Ki ${in} out mapfile
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --hash-regions=4Ki,0 ${in} out mapfile
+[ $? = 1 ] || test_failed $LINENO
 
 rm -f mapfile || framework_failure
 "${DDRESCUE}" -q -t -p -J -b1024 -i15kB ${in} out mapfile || test_failed $LINENO
@@ -172,6 +210,365 @@ rm -f out mapfile || framework_failure
 "${DDRESCUE}" -q -R -s15000 --cpass=5 ${in} out mapfile || test_failed $LINENO
 cmp ${in} out || test_failed $LINENO
 
+rm -f out out3 out4 mapfile || framework_failure
+"${DDRESCUE}" -q -H ${map1} --tee=out3 --tee=out4,1000,sw ${in} out mapfile ||
+	test_failed $LINENO
+"${DDRESCUE}" -q -r1 -H ${map2} --tee=out3 --tee=out4,1000,sw ${in} out mapfile ||
+	test_failed $LINENO
+cmp ${in} out || test_failed $LINENO
+cmp ${in} out3 || test_failed $LINENO
+"${DDRESCUE}" -q -i1000 -o0 out4 out5 || test_failed $LINENO
+cmp ${in} out5 || test_failed $LINENO
+rm -f out3 out4 out5 || framework_failure
+
+rm -f out mapfile mapfile2 || framework_failure
+"${DDRESCUE}" -q -r1 -H ${map2} ${in} out mapfile2 || test_failed $LINENO
+rm -f out || framework_failure
+"${DDRESCUE}" -q --planner -H ${map1} ${in} out mapfile || test_failed $LINENO
+"${DDRESCUE}" -q -r1 --planner=4Ki -H ${map2} ${in} out mapfile ||
+	test_failed $LINENO
+cmp ${in} out || test_failed $LINENO
+rm -f out mapfile || framework_failure
+"${DDRESCUE}" -q -r1 --planner=4Ki -H ${map2} ${in} out mapfile ||
+	test_failed $LINENO
+"${DDRESCUELOG}" -p mapfile mapfile2 || test_failed $LINENO
+rm -f mapfile2 || framework_failure
+
+rm -f out mapfile || framework_failure
+"${DDRESCUE}" -q --skip-model=adaptive -K64Ki -H ${map1} ${in} out mapfile ||
+	test_failed $LINENO
+"${DDRESCUE}" -q -R -r1 --skip-model=adaptive -H ${map2} ${in} out mapfile ||
+	test_failed $LINENO
+cmp ${in} out || test_failed $LINENO
+
+rm -f out mapfile mapfile2 || framework_failure
+"${DDRESCUE}" -q -c1 -H ${map1} ${in} out mapfile2 || test_failed $LINENO
+rm -f out || framework_failure
+"${DDRESCUE}" -q -c1 --overlap -H ${map1} ${in} out mapfile ||
+	test_failed $LINENO
+"${DDRESCUELOG}" -p mapfile mapfile2 || test_failed $LINENO
+"${DDRESCUE}" -q -r1 --overlap -H ${map2} ${in} out mapfile ||
+	test_failed $LINENO
+cmp ${in} out || test_failed $LINENO
+rm -f out mapfile || framework_failure
+"${DDRESCUE}" -q -c1 --converge -H ${map1} ${in} out mapfile ||
+	test_failed $LINENO
+"${DDRESCUELOG}" -p mapfile mapfile2 || test_failed $LINENO
+"${DDRESCUE}" -q -r1 --converge --overlap -H ${map2} ${in} out mapfile ||
+	test_failed $LINENO
+cmp ${in} out || test_failed $LINENO
+rm -f out mapfile coop mapfile3 mapfile4 || framework_failure
+"${DDRESCUE}" -q -c1 --cooperative=coop,4Ki -H ${map1} ${in} out mapfile3 &
+"${DDRESCUE}" -q -c1 --cooperative=coop,4Ki -H ${map1} ${in} out mapfile4 ||
+	test_failed $LINENO
+wait $! || test_failed $LINENO
+"${DDRESCUE}" -q --cooperative=coop,4Ki -H ${map1} ${in} out mapfile ||
+	test_failed $LINENO
+"${DDRESCUELOG}" -p mapfile mapfile2 || test_failed $LINENO
+"${DDRESCUE}" -q --cooperative=coop,8Ki -H ${map1} ${in} out mapfile3
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --cooperative=coop,4Ki -H ${map1} ${in} out2 mapfile3
+[ $? = 1 ] || test_failed $LINENO
+[ -s out2 ] && test_failed $LINENO
+"${DDRESCUE}" -q --cooperative=coop,4Ki -H ${map1} -o1Ki ${in} out mapfile3
+[ $? = 1 ] || test_failed $LINENO
+rm -f out out2 mapfile coop mapfile3 mapfile4 || framework_failure
+"${DDRESCUE}" -q -Z1Ki --cooperative=coop,4Ki ${in} out mapfile3 &
+sleep 1 ; kill -9 $! 2> /dev/null ; wait $!	# leave a stale lease
+"${DDRESCUE}" -q --cooperative=coop,4Ki ${in} out mapfile4 ||
+	test_failed $LINENO
+cmp ${in} out || test_failed $LINENO
+rm -f mapfile2 coop mapfile3 mapfile4 || framework_failure
+
+rm -f out mapfile reads || framework_failure
+printf "30\n31\n32\n" | "${DDRESCUELOG}" -b2048 -s72776 -c mapfile3 ||
+	test_failed $LINENO
+"${DDRESCUELOG}" -b2048 -s72776 -c-+ mapfile4 < /dev/null || test_failed $LINENO
+"${DDRESCUE}" -q -m mapfile3 -m mapfile4 --log-reads=reads ${in} out mapfile ||
+	test_failed $LINENO
+cmp ${in} out || test_failed $LINENO
+# the blocks of the first class are read first
+[ "$(awk '/^0x/ { print $1 ; exit }' reads)" = 0x0000F000 ] ||
+	test_failed $LINENO
+rm -f out mapfile || framework_failure
+"${DDRESCUE}" -q -r1 -m mapfile3 -m mapfile4 -H ${map1} ${in} out mapfile ||
+	test_failed $LINENO
+"${DDRESCUE}" -q -r1 -H ${map1} ${in} out2 mapfile2 || test_failed $LINENO
+"${DDRESCUELOG}" -p mapfile mapfile2 || test_failed $LINENO
+"${DDRESCUE}" -q --planner -m mapfile3 -m mapfile4 ${in} out mapfile
+[ $? = 1 ] || test_failed $LINENO
+rm -f out2 mapfile2 mapfile3 mapfile4 reads || framework_failure
+
+rm -f out mapfile mapfile.heat || framework_failure
+"${DDRESCUE}" -q --heatmap ${in} out
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q --heatmap=40 -H ${map1} ${in} out mapfile ||
+	test_failed $LINENO
+grep -q "^# Zone size: 0x00000800  Zones: 35$" mapfile.heat ||
+	test_failed $LINENO
+"${DDRESCUELOG}" --heatmap mapfile > heat || test_failed $LINENO
+grep -q "zones: 35, .* read errors: [1-9]" heat || test_failed $LINENO
+"${DDRESCUELOG}" --heatmap=ppm mapfile > heat || test_failed $LINENO
+[ "$(head -n 2 heat | tr '\n' ' ')" = "P6 280 8 " ] || test_failed $LINENO
+"${DDRESCUELOG}" --heatmap=png mapfile > heat
+[ $? = 1 ] || test_failed $LINENO
+rm -f out2 mapfile2 mapfile2.heat || framework_failure
+"${DDRESCUE}" -q -c1 --converge --heatmap=8 ${in} out2 mapfile2 ||
+	test_failed $LINENO
+zones=`sed -n 's/^# Zone size: .*  Zones: //p' mapfile2.heat`
+[ "$(grep -c '^0x' mapfile2.heat)" = "${zones}" ] || test_failed $LINENO
+[ -e mapfile2.heat.tmp ] && test_failed $LINENO
+"${DDRESCUELOG}" --heatmap mapfile2 > heat || test_failed $LINENO
+cp mapfile2.heat mapfile3 || framework_failure
+sed -n '/^0x/p' mapfile3 > mapfile2.heat || framework_failure
+"${DDRESCUE}" -q --heatmap=8 ${in} out2 mapfile2	# data without header
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUELOG}" -q --heatmap mapfile2 > heat
+[ $? = 1 ] || test_failed $LINENO
+sed 's/^\(# Zone size: \).*$/\1 0  Zones: 8/' mapfile3 > mapfile2.heat ||
+	framework_failure
+cp mapfile2.heat mapfile4 || framework_failure
+"${DDRESCUE}" -q --heatmap=8 ${in} out2 mapfile2
+[ $? = 1 ] || test_failed $LINENO
+cmp mapfile2.heat mapfile4 || test_failed $LINENO	# not overwritten
+sed '$s/^0x[0-9A-F]*/0x7FFFFFFF/' mapfile3 > mapfile2.heat ||
+	framework_failure
+"${DDRESCUELOG}" -q --heatmap mapfile2 > heat
+[ $? = 1 ] || test_failed $LINENO
+rm -f out2 mapfile2 mapfile2.heat mapfile3 mapfile4 || framework_failure
+"${DDRESCUELOG}" --render-map=ppm,40x10 mapfile > heat || test_failed $LINENO
+[ "$(head -n 2 heat | tr '\n' ' ')" = "P6 40 10 " ] || test_failed $LINENO
+[ "$(wc -c < heat)" -eq 1213 ] || test_failed $LINENO
+"${DDRESCUELOG}" --render-map mapfile > heat || test_failed $LINENO
+[ "$(wc -l < heat)" -eq 17 ] || test_failed $LINENO
+grep -q "^Begin: 0 B,  size: 71680 B,  bytes per pixel: 35 B$" heat ||
+	test_failed $LINENO
+cat mapfile | "${DDRESCUELOG}" --render-map=,8x2 - > heat ||
+	test_failed $LINENO
+grep -q "size: 71680 B,  bytes per pixel: 4480 B$" heat || test_failed $LINENO
+"${DDRESCUELOG}" --render-map=png mapfile > heat
+[ $? = 1 ] || test_failed $LINENO
+printf "0x1000 +\n0x1000 0x2000 +\n0x3000 0x1000 -\n" > mapfile2 ||
+	framework_failure
+"${DDRESCUELOG}" --render-map=,4x2 mapfile2 > heat || test_failed $LINENO
+grep -q "size: 16384 B,  bytes per pixel: 2048 B$" heat || test_failed $LINENO
+printf "# Zone size: 0x1000  Zones: 4\n0x1000  0x1000  0  100  1  0  0\n" \
+	> mapfile2.heat || framework_failure
+"${DDRESCUELOG}" --heatmap mapfile2 > heat || test_failed $LINENO
+printf "0x1000 +\n0x1000 0x2000 +\n0x4000 0x1000 -\n" > mapfile2 ||
+	framework_failure
+"${DDRESCUELOG}" -q --render-map mapfile2 > heat
+[ $? = 2 ] || test_failed $LINENO
+printf "# c\n\n  0x0 + 1 # status\n0 0x1000 +\n\t0x1000 0x2000 - # %0200d\n# end\n0x3000 0x1000 +\n" 0 \
+	> mapfile2 || framework_failure
+printf "0 +\n0 0x1000 +\n0x1000 0x2000 -\n0x3000 0x1000 +\n" > mapfile3 ||
+	framework_failure
+"${DDRESCUELOG}" --render-map=,8x2 mapfile2 > heat || test_failed $LINENO
+"${DDRESCUELOG}" --render-map=,8x2 mapfile3 > mapfile4 || test_failed $LINENO
+cmp heat mapfile4 || test_failed $LINENO
+printf "0x5000 0x1000 +\n" >> mapfile2 || framework_failure
+"${DDRESCUELOG}" --render-map mapfile2 2> mapfile4
+[ $? = 2 ] || test_failed $LINENO
+grep -q "line 8\.$" mapfile4 || test_failed $LINENO
+rm -f mapfile3 mapfile4 || framework_failure
+rm -f mapfile2 mapfile2.heat || framework_failure
+"${DDRESCUELOG}" --render-map=ppm,0x10 mapfile > heat
+[ $? = 1 ] || test_failed $LINENO
+rm -f mapfile.heat heat || framework_failure
+
+# the input geometry is only probed on block devices; a device reporting
+# no optimal I/O size leaves the default cluster size alone, and '-c'
+# always overrides it
+rm -f out2 mapfile2 logfile || framework_failure
+"${DDRESCUE}" -v -s512 ${in} out2 mapfile2 > logfile || test_failed $LINENO
+grep -q "Copy block size: 128 sectors" logfile || test_failed $LINENO
+grep -q "Input device geometry" logfile && test_failed $LINENO
+if loopdev=$(losetup -f -r --show "${in}" 2> /dev/null) ; then
+	rm -f out2 mapfile2 logfile || framework_failure
+	"${DDRESCUE}" -v -s512 ${loopdev} out2 mapfile2 > logfile ||
+		test_failed $LINENO
+	if grep -q "io_opt 0," logfile ||
+	   ! grep -q "Input device geometry" logfile ; then
+		grep -q "Copy block size: 128 sectors" logfile || test_failed $LINENO
+	fi
+	rm -f out2 mapfile2 logfile || framework_failure
+	"${DDRESCUE}" -v -s512 -c16 ${loopdev} out2 mapfile2 > logfile ||
+		test_failed $LINENO
+	grep -q "Copy block size:  16 sectors" logfile || test_failed $LINENO
+	losetup -d ${loopdev}
+fi
+rm -f out2 mapfile2 logfile || framework_failure
+
+rm -f out mapfile logfile || framework_failure
+"${DDRESCUE}" -q --metadata-first --log-events=logfile ${in} out mapfile ||
+	test_failed $LINENO
+cmp ${in} out || test_failed $LINENO
+grep -q "no filesystem found" logfile || test_failed $LINENO
+if mke2fs -V > /dev/null 2>&1 &&
+   mke2fs -q -F -t ext4 -d "${testdir}" fs.img 4M > /dev/null 2>&1 ; then
+	rm -f out mapfile logfile reads || framework_failure
+	"${DDRESCUE}" -q --metadata-first --log-events=logfile --log-reads=reads \
+		fs.img out mapfile || test_failed $LINENO
+	cmp fs.img out || test_failed $LINENO
+	grep -q "Metadata first: ext4" logfile || test_failed $LINENO
+	# metadata are read out of address order
+	awk '/^0x/ { if( $1 < last ) back = 1 ; last = $1 } END { exit !back }' \
+		reads || test_failed $LINENO
+fi
+rm -f fs.img logfile reads || framework_failure
+
+# hand-built images of each filesystem type and partition table supported
+# by '--metadata-first' (see fs_images.txt); the areas found are logged
+mkimages() {
+	awk 'function hex( s,  i, n ) { n = 0 ; s = toupper( s )
+		for( i = 1 ; i <= length( s ) ; ++i )
+			n = n * 16 + index( "0123456789ABCDEF", substr( s, i, 1 ) ) - 1
+		return n }
+	/^#/ || NF == 0 { next }
+	$1 == "image" { print ; next }
+	{ s = "" ; for( i = 2 ; i <= NF ; ++i ) s = s sprintf( "\\%03o", hex( $i ) )
+	  print hex( $1 ), s }' "$1" |
+	while read -r pos bytes ; do
+		if [ "${pos}" = image ] ; then
+			img=${bytes% *}
+			rm -f "${img}" &&
+			dd if=/dev/zero of="${img}" bs=1 count=0 seek=${bytes#* } \
+				2> /dev/null || return 1
+		else
+			printf "${bytes}" |
+				dd of="${img}" bs=1 seek=${pos} conv=notrunc 2> /dev/null ||
+				return 1
+		fi
+	done
+}
+fs_check() {		# image, filesystem name, areas expected
+	rm -f out2 mapfile2 logfile || framework_failure
+	"${DDRESCUE}" -q --metadata-first --log-events=logfile $1 out2 mapfile2 ||
+		test_failed $LINENO $1
+	cmp $1 out2 || test_failed $LINENO $1
+	grep -q "Metadata first: $2; " logfile || test_failed $LINENO $1
+	[ "$(sed -n -e 's/^.*  Metadata area /M /p' \
+	            -e 's/^.*  Allocated area /A /p' logfile)" = "$3" ] ||
+		test_failed $LINENO $1
+}
+mkimages "${testdir}"/fs_images.txt || framework_failure
+fs_check fat12.img FAT12 "M 0x00000000  0x00021C00
+A 0x00021A00  0x00000800"
+fs_check fat16.img FAT16 "M 0x00000000  0x0002C200
+M 0x0002C600  0x00000200
+A 0x0002C000  0x00000800"
+fs_check fat32.img FAT32 "M 0x00000000  0x000A7400
+A 0x000A7000  0x00000800"
+fs_check ntfs.img NTFS "M 0x00000000  0x00010000
+M 0x00020000  0x00009000
+M 0x00030000  0x00001000
+A 0x00000000  0x00004000
+A 0x00020000  0x00009000
+A 0x00030000  0x00001000
+A 0x0003C000  0x00002000"
+fs_check xfs.img XFS "M 0x00000000  0x00010000
+M 0x00040000  0x00000800
+M 0x00041000  0x00002000
+M 0x00048000  0x00004000
+M 0x00080000  0x00000800
+M 0x00090000  0x00008000
+M 0x000C0000  0x00000800
+A 0x00000000  0x00014000
+A 0x0002C000  0x0001E000"
+fs_check mbr.img FAT12 "M 0x00000000  0x00010000
+M 0x00020000  0x00010000
+M 0x00100000  0x00000200
+M 0x00108000  0x00010000
+A 0x00039C00  0x00000400"
+fs_check gpt.img FAT12 "M 0x00000000  0x00010000
+M 0x00020000  0x00010000
+M 0x00100000  0x00010000
+A 0x00039C00  0x00000400"
+rm -f *.img out2 mapfile2 logfile || framework_failure
+
+if perl -MIO::Socket::UNIX -e 1 2> /dev/null ; then
+	rm -f out mapfile sock || framework_failure
+	"${DDRESCUE}" -q --daemon=sock ${in} out mapfile &
+	pid=$!
+	i=0
+	while [ ! -S sock ] && [ $i -lt 10 ] ; do sleep 1 ; i=$((i + 1)) ; done
+	perl -MIO::Socket::UNIX -e '$s = IO::Socket::UNIX->new( Peer => "sock" )
+		or exit 1; print $s "c 0x8000 0x1000 5\ns 0 0x100\nf\n";
+		print while( <$s> );' > copy || test_failed $LINENO
+	wait $pid || test_failed $LINENO
+	grep -q '^done 1$' copy || test_failed $LINENO
+	grep -q '^done 2$' copy || test_failed $LINENO
+	cmp ${in} out || test_failed $LINENO
+	"${DDRESCUELOG}" -D mapfile || test_failed $LINENO
+	[ -S sock ] && test_failed $LINENO
+
+	# a client that does not read its replies does not stop the others,
+	# the mapfile is saved at the usual interval, and reads are accounted
+	rm -f out2 mapfile2 mapfile2.heat sock copy || framework_failure
+	"${DDRESCUE}" -q -c1 --mapfile-interval=1 --heatmap=8 --daemon=sock \
+		${in} out2 mapfile2 &
+	pid=$!
+	i=0
+	while [ ! -S sock ] && [ $i -lt 10 ] ; do sleep 1 ; i=$((i + 1)) ; done
+	perl -MIO::Socket::UNIX -e '$m = IO::Socket::UNIX->new( Peer => "sock" )
+		or exit 1; print $m "s 0 0x100\n" x 20000; sleep 30' &
+	pid2=$!
+	i=0
+	while ! "${DDRESCUELOG}" -q -D mapfile2 2> /dev/null && [ $i -lt 10 ] ; do
+		sleep 1 ; i=$((i + 1)) ; done
+	[ $i -lt 10 ] || test_failed $LINENO
+	perl -MIO::Socket::UNIX -e '$s = IO::Socket::UNIX->new( Peer => "sock" )
+		or exit 1; print $s "s 0 0x100\nf\n";
+		print while( <$s> );' > copy || test_failed $LINENO
+	wait $pid || test_failed $LINENO
+	kill $pid2 2> /dev/null
+	grep -q '^done 1$' copy || test_failed $LINENO
+	cmp ${in} out2 || test_failed $LINENO
+	awk '/^0x/ { reads += $5 } END { exit !( reads >= 143 ) }' mapfile2.heat ||
+		test_failed $LINENO
+	rm -f out2 mapfile2 mapfile2.heat copy || framework_failure
+fi
+
+rm -f out sidemap || framework_failure
+"${DDRESCUE}" -q -c1 --reread-check=sidemap,100 ${in} out || test_failed $LINENO
+cmp ${in} out || test_failed $LINENO
+[ -f sidemap ] || test_failed $LINENO
+grep -q '^0x[0-9A-F]*  0x[0-9A-F]*  +' sidemap && test_failed $LINENO
+rm -f out sidemap || framework_failure
+if [ -c /dev/urandom ] ; then		# infile returning different data
+	"${DDRESCUE}" -c1 -s1Mi --reread-check=sidemap,100 /dev/urandom out \
+		> logfile 2>&1 || test_failed $LINENO
+	grep -q 'inconsistent data in [1-9]' logfile || test_failed $LINENO
+	grep -q '^0x[0-9A-F]*  0x[0-9A-F]*  +' sidemap || test_failed $LINENO
+fi
+rm -f out sidemap logfile || framework_failure
+
+cat ${in1} > out2 || framework_failure
+rm -f logfile || framework_failure
+"${DDRESCUE}" -q -c1 --skip-identical --log-events=logfile ${in} out2 ||
+	test_failed $LINENO
+cmp ${in} out2 || test_failed $LINENO
+grep -q "Identical data not rewritten" logfile || test_failed $LINENO
+rm -f out2 logfile || framework_failure
+
+rm -f out mapfile mapfile.hash || framework_failure
+"${DDRESCUE}" -q --hash-regions=4Ki ${in} out mapfile || test_failed $LINENO
+grep -e '^0x' -e '^# Image hash' mapfile.hash > hash1 || test_failed $LINENO
+rm -f out mapfile mapfile.hash || framework_failure
+"${DDRESCUE}" -q -c1 -H ${map1} --hash-regions=4Ki,3 ${in} out mapfile ||
+	test_failed $LINENO
+"${DDRESCUE}" -q -r1 -R -H ${map2} --hash-regions=4Ki,3 ${in} out mapfile ||
+	test_failed $LINENO
+cmp ${in} out || test_failed $LINENO
+grep -e '^0x' -e '^# Image hash' mapfile.hash > hash2 || test_failed $LINENO
+cmp hash1 hash2 || test_failed $LINENO
+"${DDRESCUE}" -q -i0x1000 -s0x2000 --hash-regions=4Ki ${in} out3 mapfile3 ||
+	test_failed $LINENO
+grep -q '^# Image hash:  [0-9a-f]\{64\}$' mapfile3.hash || test_failed $LINENO
+[ "$(grep '^# Image hash' mapfile3.hash)" != "$(grep '^# Image hash' hash1)" ] ||
+	test_failed $LINENO
+rm -f out3 mapfile3 mapfile.hash mapfile3.hash hash1 hash2 || framework_failure
+
 rm -f out || framework_failure
 "${DDRESCUE}" -q -F+ -o15000 -c143 ${in} out2 mapfile || test_failed $LINENO
 "${DDRESCUE}" -q -R -S -i15000 -o0 -u -Z1Mis out2 out || test_failed $LINENO
@@ -186,6 +583,11 @@ rm -f out || framework_failure
 "${DDRESCUE}" -q -O -r1 -H - --pause-on-error=s0 ${in} out < ${map1} ||
 	test_failed $LINENO
 cmp ${in1} out || test_failed $LINENO
+rm -f out2 || framework_failure
+"${DDRESCUE}" -q -O -r1 -H - --pause-on-error=0.01 ${in} out2 < ${map1} ||
+	test_failed $LINENO
+cmp ${in1} out2 || test_failed $LINENO
+rm -f out2 || framework_failure
 "${DDRESCUE}" -q -L -K0 -c1 -H ${map2i} --pause-on-error=0 ${in2} out ||
 	test_failed $LINENO
 cmp ${in} out || test_failed $LINENO
@@ -221,6 +623,50 @@ rm -f out || framework_failure
 	test_failed $LINENO
 cmp ${in} out || test_failed $LINENO
 
+rm -f out mapfile || framework_failure
+"${DDRESCUE}" -q --mapfile-interval=0 -c1 ${in} out mapfile ||
+	test_failed $LINENO
+cmp ${in} out || test_failed $LINENO
+"${DDRESCUELOG}" -D mapfile || test_failed $LINENO
+[ ! -e mapfile.tmp ] || test_failed $LINENO
+rm -f out mapfile || framework_failure
+"${DDRESCUE}" -q --group-sync=1Ki -c1 ${in} out mapfile ||
+	test_failed $LINENO
+cmp ${in} out || test_failed $LINENO
+"${DDRESCUELOG}" -D mapfile || test_failed $LINENO
+rm -f out || framework_failure
+"${DDRESCUE}" -P --status-interval=0.01 -c1 ${in} out > /dev/null ||
+	test_failed $LINENO
+cmp ${in} out || test_failed $LINENO
+rm -f out mapfile || framework_failure
+sed -e 's,^0x00000800  0x00000800  ?,0x00000800  0x00000800  /,' ${map1} \
+	> hangmap || framework_failure
+"${DDRESCUE}" -q -O -c1 --read-timeout=0.01 -H hangmap --log-events=events \
+	${in} out mapfile || test_failed $LINENO
+grep -q 'Read timed out at position 0x00000800' events ||
+	test_failed $LINENO
+
+# a hung read does not delay saving the mapfile, stopping on timeout or
+# being interrupted
+rm -f out2 mapfile2 || framework_failure
+"${DDRESCUE}" -q -c1 --read-timeout=60 -T1 -H hangmap ${in} out2 mapfile2
+[ $? = 1 ] || test_failed $LINENO
+grep -q '^0x00000000  0x00000800  +' mapfile2 || test_failed $LINENO
+rm -f out2 mapfile2 || framework_failure
+"${DDRESCUE}" -q -c1 --read-timeout=60 --mapfile-interval=1 -H hangmap \
+	${in} out2 mapfile2 &
+pid=$!
+i=0
+while ! grep -q '^0x00000000  0x00000800  +' mapfile2 2> /dev/null &&
+      [ $i -lt 10 ] ; do sleep 1 ; i=$((i + 1)) ; done
+[ $i -lt 10 ] || test_failed $LINENO
+kill -INT $pid
+wait $pid
+[ $? = 130 ] || test_failed $LINENO
+rm -f out2 mapfile2 || framework_failure
+"${DDRESCUE}" -q -r1 ${in} out mapfile || test_failed $LINENO
+cmp ${in} out || test_failed $LINENO
+
 rm -f out || framework_failure
 cat ${map1} > mapfile || framework_failure
 "${DDRESCUE}" -q -I ${in2} out mapfile || test_failed $LINENO
@@ -356,6 +802,36 @@ printf "c 0 72776\nf\n" | "${DDRESCUE}" --command-mode ${in4} out mapfile \
 cmp ${in} out || test_failed $LINENO
 "${DDRESCUELOG}" -d mapfile || test_failed $LINENO
 
+# binary command mode: copy, status of another area, status, unknown, finish
+rm -f out mapfile || framework_failure
+awk 'function le( v, n,   i ) {
+		for( i = 0; i < n; ++i ) { printf "%c", v % 256 ; v = int( v / 256 ) } }
+	function rec( t, id, pos, size ) {
+		le( ( t == "c" || t == "s" ) ? 24 : 8, 4 )
+		printf "%s%c%c%c", t, 0, 0, 0 ; le( id, 4 )
+		if( t == "c" || t == "s" ) { le( pos, 8 ) ; le( size, 8 ) } }
+	BEGIN { rec( "c", 1, 0, 36388 ) ; rec( "s", 2, 36388, 36388 )
+		rec( "s", 3, 0, 72776 ) ; rec( "x", 4 ) ; rec( "f", 5 ) }' |
+"${DDRESCUE}" --command-mode=binary ${in} out mapfile > copy
+[ $? = 1 ] || test_failed $LINENO
+[ "`wc -c < copy`" -eq 147 ] || test_failed $LINENO
+[ "`od -An -c -j4 -N1 copy | tr -d ' '`" = s ] || test_failed $LINENO
+"${DDRESCUE}" -q --command-mode=bogus ${in} out mapfile < /dev/null
+[ $? = 1 ] || test_failed $LINENO
+"${DDRESCUE}" -q -i36388 ${in} out mapfile || test_failed $LINENO
+cmp ${in} out || test_failed $LINENO
+rm -f out2 mapfile2 || framework_failure
+awk 'function le( v, n,   i ) {
+		for( i = 0; i < n; ++i ) { printf "%c", v % 256 ; v = int( v / 256 ) } }
+	BEGIN { le( 24, 4 ) ; printf "c%c%c%c", 0, 0, 0 ; le( 7, 4 )
+		le( 0, 8 ) ; le( 4096, 8 ) ; le( 2, 4 ) ; printf "xx" }' |
+"${DDRESCUE}" -q --command-mode=binary ${in} out2 mapfile2 > copy
+[ $? = 1 ] || test_failed $LINENO
+[ "`wc -c < copy`" -eq 24 ] || test_failed $LINENO
+[ "`od -An -c -j4 -N1 copy | tr -d ' '`" = c ] || test_failed $LINENO
+grep -q "^0x00000000  0x00001000  +" mapfile2 || test_failed $LINENO
+rm -f copy out2 mapfile2 || framework_failure
+
 printf "\ntesting ddrescuelog-%s..." "$2"
 
 "${DDRESCUELOG}" -q mapfile
@@ -371,6 +847,45 @@ printf "\ntesting ddrescuelog-%s..." "$2"
 "${DDRESCUELOG}" -q --shift -i20 mapfile
 [ $? = 1 ] || test_failed $LINENO
 
+# malformed mapfiles are reported with the number of the offending line
+rm -f mapfile3 logfile || framework_failure
+printf "# bad status line\n0x100 x\n0x0 0x200 +\n" > mapfile3 ||
+	framework_failure
+"${DDRESCUELOG}" -t mapfile3 2> logfile
+[ $? = 2 ] || test_failed $LINENO
+grep -q "error in mapfile 'mapfile3', line 2\." logfile || test_failed $LINENO
+printf "# bad block\n0x100 +\n0x0 0x100 +\n0x100 0x100 -\n0x200 zz -\n" \
+	> mapfile3 || framework_failure
+"${DDRESCUELOG}" -t mapfile3 2> logfile
+[ $? = 2 ] || test_failed $LINENO
+grep -q "error in mapfile 'mapfile3', line 5\." logfile || test_failed $LINENO
+printf "# gap\n0x100 +\n0x0 0x100 +\n0x180 0x100 -\n" > mapfile3 ||
+	framework_failure
+"${DDRESCUELOG}" -t mapfile3 2> logfile
+[ $? = 2 ] || test_failed $LINENO
+grep -q "error in mapfile 'mapfile3', line 4\." logfile || test_failed $LINENO
+# A mapfile of 2.6 MB is split in 2 chunks whatever the number of
+# processors. The 2nd chunk begins at block 50001 (line 50003).
+mkmap() { awk -v gap=$1 -v bad=$2 'BEGIN { print "# big mapfile" ;
+	print "0x00000000     +" ;
+	for( i = 1 ; i <= 100000 ; ++i ) {
+		pos = ( i - 1 ) * 512 ; if( gap && i >= gap ) pos += 512
+		printf "0x%08X  0x%08X  %s\n", pos, 512, ( i == bad ) ? "z" : "+" }
+	}' > mapfile3 || framework_failure ; }
+mkmap 0 0
+"${DDRESCUELOG}" -t mapfile3 > /dev/null || test_failed $LINENO
+"${DDRESCUELOG}" -q -C mapfile3 > copy || test_failed $LINENO
+printf "0x00000000  0x030D4000  +\n" > out || framework_failure
+[ "$(tail -n 1 copy)" = "$(cat out)" ] || test_failed $LINENO
+for i in 50001,0,50003 50000,0,50002 0,50001,50003 0,80000,80002 ; do
+	mkmap ${i%%,*} $(echo $i | cut -d, -f2)
+	"${DDRESCUELOG}" -t mapfile3 2> logfile
+	[ $? = 2 ] || test_failed $LINENO $i
+	grep -q "error in mapfile 'mapfile3', line ${i##*,}\." logfile ||
+		test_failed $LINENO $i
+done
+rm -f mapfile3 logfile copy out || framework_failure
+
 "${DDRESCUELOG}" -a '?,+' -i3072 - < ${map1} > mapfile
 "${DDRESCUELOG}" -D - < mapfile
 [ $? = 1 ] || test_failed $LINENO
@@ -381,6 +896,15 @@ printf "\ntesting ddrescuelog-%s..." "$2"
 [ $? = 1 ] || test_failed $LINENO
 "${DDRESCUELOG}" -d mapfile2 || test_failed $LINENO
 
+# unsorted list whose runs overlap blocks already marked
+rm -f mapfile3 mapfile4 || framework_failure
+printf "5\n6\n7\n3\n4\n5\n6\n" |
+	"${DDRESCUELOG}" -b512 -s 8192 -c mapfile3 || test_failed $LINENO
+printf "0x00000000  0x00000600  -\n0x00000600  0x00000A00  +\n\
+0x00001000  0x00001000  -\n" > mapfile4 || framework_failure
+[ "$(grep '^0x.*  0x' mapfile3)" = "$(cat mapfile4)" ] || test_failed $LINENO
+rm -f mapfile3 mapfile4 || framework_failure
+
 "${DDRESCUELOG}" -b2048 -l+ - < ${map1} > out || test_failed $LINENO
 "${DDRESCUELOG}" -b2048 -c - < out > mapfile || test_failed $LINENO
 "${DDRESCUELOG}" -b2048 -l+ mapfile > copy || test_failed $LINENO
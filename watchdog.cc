@@ -0,0 +1,210 @@
+/*  GNU ddrescue - Data recovery tool
+    Copyright (C) 2004-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "rational.h"
+#include "block.h"
+#include "mapbook.h"
+#include "rescuebook.h"
+
+
+// State shared between a Read_watchdog and its worker thread. Once
+// abandoned, it belongs to the worker, which deletes it.
+struct Read_worker
+  {
+  pthread_mutex_t mutex;
+  pthread_cond_t cv;			// request, result, or abandon
+  uint8_t * buf_base;
+  uint8_t * buf;			// aligned for direct disc access
+  long long pos;
+  int fd;
+  int size;
+  int result;				// bytes read
+  int errno_;				// errno of the read
+  bool hang;				// simulate a read that never returns
+  bool request;				// a read has been requested
+  bool done;				// the requested read has returned
+  bool abandoned;
+  bool close_fd;			// close fd when the read returns
+
+  Read_worker( const int bufsize, const int hardbs )
+    : pos( 0 ), fd( -1 ), size( 0 ), result( 0 ), errno_( 0 ),
+      hang( false ), request( false ), done( false ), abandoned( false ),
+      close_fd( false )
+    {
+    long alignment = sysconf( _SC_PAGESIZE );
+    if( alignment < hardbs || alignment % hardbs ) alignment = hardbs;
+    if( alignment < 2 ) alignment = 0;
+    buf = buf_base = new uint8_t[ alignment + bufsize ];
+    if( alignment > 1 )
+      {
+      const int disp =
+        alignment - ( reinterpret_cast<unsigned long long> (buf) % alignment );
+      if( disp > 0 && disp < alignment ) buf += disp;
+      }
+    xinit_mutex( &mutex ); xinit_cond( &cv );
+    }
+
+  ~Read_worker()
+    { xdestroy_cond( &cv ); xdestroy_mutex( &mutex ); delete[] buf_base; }
+  };
+
+
+namespace {
+
+pthread_mutex_t hung_mutex = PTHREAD_MUTEX_INITIALIZER;
+int hung_count = 0;		// abandoned reads that have not returned yet
+
+
+extern "C" void * read_worker( void * arg )
+  {
+  Read_worker & w = *(Read_worker *)arg;
+  xlock( &w.mutex );
+  while( true )
+    {
+    while( !w.request && !w.abandoned ) xwait( &w.cv, &w.mutex );
+    if( !w.request ) break;			// abandoned while idle
+    int rd = 0, errcode = 0;
+    if( w.hang )
+      { while( !w.abandoned ) xwait( &w.cv, &w.mutex ); errcode = ETIMEDOUT; }
+    else
+      {
+      xunlock( &w.mutex );
+      rd = preadblock( w.fd, w.buf, w.size, w.pos );
+      errcode = errno;
+      xlock( &w.mutex );
+      }
+    w.request = false; w.result = rd; w.errno_ = errcode; w.done = true;
+    if( w.abandoned )				// the read hung
+      {
+      xlock( &hung_mutex ); --hung_count; xunlock( &hung_mutex );
+      break;
+      }
+    xbroadcast( &w.cv );
+    }
+  const int fd = w.close_fd ? w.fd : -1;
+  xunlock( &w.mutex );
+  if( fd >= 0 ) close( fd );
+  delete &w;
+  return 0;
+  }
+
+} // end namespace
+
+
+Read_watchdog::~Read_watchdog() { if( worker ) abandon( false ); }
+
+
+// Starts reading 'size' bytes from position 'pos' of 'fd'.
+// Returns false if a worker thread could not be created.
+//
+bool Read_watchdog::start_read( const int fd, const int size,
+                                const long long pos, const bool hang )
+  {
+  if( pending || size > bufsize_ )
+    internal_error( "bad read request in watchdog." );
+  if( !worker )
+    {
+    Read_worker * const w = new Read_worker( bufsize_, hardbs_ );
+    pthread_t worker_id;
+    const int errcode = pthread_create( &worker_id, 0, read_worker, w );
+    if( errcode ) { delete w; errno = errcode; return false; }
+    pthread_detach( worker_id );
+    worker = w;
+    }
+  Read_worker & w = *worker;
+  xlock( &w.mutex );
+  w.fd = fd; w.size = size; w.pos = pos; w.hang = hang;
+  w.request = true; w.done = false;
+  xbroadcast( &w.cv );
+  xunlock( &w.mutex );
+  pending = true;
+  return true;
+  }
+
+
+// Waits at most 'ms' milliseconds for the pending read to return.
+// Returns the number of bytes read, with errno set as by readblockp,
+// or -1 if the read has not returned yet.
+//
+int Read_watchdog::wait_read( const int ms )
+  {
+  if( !pending ) internal_error( "no pending read in watchdog." );
+  Read_worker & w = *worker;
+  struct timeval tv;
+  gettimeofday( &tv, 0 );
+  long long usec = tv.tv_usec + ms * 1000LL;
+  struct timespec deadline;
+  deadline.tv_sec = tv.tv_sec + usec / 1000000;
+  deadline.tv_nsec = ( usec % 1000000 ) * 1000;
+  xlock( &w.mutex );
+  while( !w.done && pthread_cond_timedwait( &w.cv, &w.mutex, &deadline ) == 0 )
+    {}
+  const bool done = w.done;
+  const int result = w.result, errcode = w.errno_;
+  xunlock( &w.mutex );
+  if( !done ) return -1;
+  pending = false;
+  errno = errcode;
+  return result;
+  }
+
+
+const uint8_t * Read_watchdog::buffer() const
+  { return worker ? worker->buf : 0; }
+
+
+// Leaves the worker behind. If a read is pending, it is counted as hung
+// until it returns, and then 'close_fd' tells whether to close its fd.
+//
+void Read_watchdog::abandon( const bool close_fd )
+  {
+  if( !worker ) return;
+  Read_worker & w = *worker;
+  worker = 0;
+  xlock( &w.mutex );
+  if( pending && !w.done )
+    {
+    xlock( &hung_mutex ); ++hung_count; xunlock( &hung_mutex );
+    w.close_fd = close_fd;
+    }
+  else if( close_fd && w.fd >= 0 ) close( w.fd );
+  w.abandoned = true;
+  xbroadcast( &w.cv );
+  xunlock( &w.mutex );
+  pending = false;
+  }
+
+
+int Read_watchdog::hung_reads()
+  {
+  xlock( &hung_mutex );
+  const int count = hung_count;
+  xunlock( &hung_mutex );
+  return count;
+  }